@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <string>
+#include <sstream>
+
+#include <oriutil/debug.h>
+#include <oriutil/monitor.h>
+#include <oriutil/stopwatch.h>
+#include <ori/durability.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+using namespace std;
+
+static const char *modeNames[] = { "strict", "batched", "relaxed" };
+
+Durability::Durability()
+    : mode(DURABILITY_BATCHED)
+{
+    memset(&stats, 0, sizeof(stats));
+}
+
+Durability::~Durability()
+{
+}
+
+Durability *
+Durability::getDefault()
+{
+    static Durability defaultDurability;
+
+    return &defaultDurability;
+}
+
+const char *
+Durability::modeName(DurabilityMode mode)
+{
+    return modeNames[mode];
+}
+
+bool
+Durability::parseMode(const string &name, DurabilityMode *mode)
+{
+    stringstream ss(name);
+    string n;
+
+    ss >> n;
+
+    for (int i = 0; i < 3; i++) {
+        if (n == modeNames[i]) {
+            *mode = (DurabilityMode)i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void
+Durability::setMode(DurabilityMode mode)
+{
+    this->mode = mode;
+}
+
+DurabilityMode
+Durability::getMode() const
+{
+    return mode;
+}
+
+bool
+Durability::write(int fd, const struct iovec *iov, int iovcnt)
+{
+    struct iovec cur[IOV_MAX];
+    uint64_t calls = 0, bytes = 0;
+    int first = 0, n = 0;
+
+    // Retry short writes from where they stopped
+    while (first < n || iovcnt > 0) {
+        if (first == n) {
+            n = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+            memcpy(cur, iov, n * sizeof(struct iovec));
+            iov += n;
+            iovcnt -= n;
+            first = 0;
+        }
+
+        ssize_t written = ::writev(fd, cur + first, n - first);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        calls++;
+        bytes += written;
+
+        while (first < n && (size_t)written >= cur[first].iov_len) {
+            written -= cur[first].iov_len;
+            first++;
+        }
+        if (first < n) {
+            cur[first].iov_base = (char *)cur[first].iov_base + written;
+            cur[first].iov_len -= written;
+        }
+    }
+
+    lock.lock();
+    stats.writes += calls;
+    stats.bytes += bytes;
+    lock.unlock();
+
+    return first == n && iovcnt == 0;
+}
+
+bool
+Durability::write(int fd, const void *buf, size_t len)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+
+    return write(fd, &iov, 1);
+}
+
+void
+Durability::barrier(int fd, DurabilityFile file)
+{
+    if (mode == DURABILITY_RELAXED)
+        return;
+
+    Stopwatch sw = Stopwatch();
+    sw.start();
+    if (::fsync(fd) < 0)
+        WARNING("fsync failed: %s", strerror(errno));
+    sw.stop();
+
+    uint64_t usec = sw.getElapsedTime();
+    int bucket = 0;
+    while (bucket < DURABILITY_HIST_BUCKETS - 1 && (usec >> (bucket + 1)) != 0)
+        bucket++;
+
+    lock.lock();
+    stats.syncs[file]++;
+    stats.syncUsec[file] += usec;
+    stats.hist[file][bucket]++;
+    lock.unlock();
+}
+
+void
+Durability::endGroup()
+{
+    lock.lock();
+    stats.groups++;
+    lock.unlock();
+}
+
+DurabilityStats
+Durability::getStats()
+{
+    Monitor l(lock);
+
+    return stats;
+}
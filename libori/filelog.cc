@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+
+#include "tuneables.h"
+
+#include <oriutil/debug.h>
+#include <oriutil/oriutil.h>
+#include <oriutil/stream.h>
+#include <ori/repo.h>
+#include <ori/localrepo.h>
+#include <ori/historywalk.h>
+#include <ori/filelog.h>
+
+using namespace std;
+
+FileLog::FileLog(Repo *r)
+    : repo(r), components(), memo(), commitObjs(), pending(), treesLoaded(0)
+{
+}
+
+FileLog::~FileLog()
+{
+}
+
+/*
+ * Find the object at components[ix..] below a tree.
+ */
+ObjectHash
+FileLog::resolve(const ObjectHash &tree, size_t ix)
+{
+    if (ix == components.size())
+        return tree;
+
+    pair<ObjectHash, size_t> key = make_pair(tree, ix);
+    map<pair<ObjectHash, size_t>, ObjectHash>::iterator it = memo.find(key);
+    if (it != memo.end())
+        return it->second;
+
+    ObjectHash rval;
+    Tree t = repo->getTree(tree);
+    treesLoaded++;
+
+    Tree::iterator e = t.find(components[ix]);
+    if (e != t.end()) {
+        if (ix + 1 == components.size())
+            rval = e->second.hash;
+        else if (e->second.type == TreeEntry::Tree)
+            rval = resolve(e->second.hash, ix + 1);
+    }
+
+    if (memo.size() >= FILELOG_MEMO_MAX)
+        memo.clear();
+    memo[key] = rval;
+
+    return rval;
+}
+
+bool
+FileLog::isResolved(const ObjectHash &commitId) const
+{
+    if (commitId.isEmpty() || commitId == EMPTY_COMMIT)
+        return true;
+
+    return commitObjs.find(commitId) != commitObjs.end();
+}
+
+/*
+ * Report commits in the order they were visited once the object at the path
+ * is known for all of their parents.
+ */
+void
+FileLog::flush(bytewstream *out)
+{
+    while (!pending.empty()) {
+        const Pending &p = pending.front();
+        pair<ObjectHash, ObjectHash> parents = p.commit.getParents();
+
+        if (!isResolved(parents.first) || !isResolved(parents.second))
+            return;
+
+        const ObjectHash &objId = commitObjs[p.hash];
+        bool changed;
+
+        if (parents.first == EMPTY_COMMIT) {
+            changed = !objId.isEmpty();
+        } else {
+            changed = commitObjs[parents.first] != objId;
+            if (!parents.second.isEmpty() &&
+                commitObjs[parents.second] == objId)
+                changed = false;
+        }
+
+        if (changed) {
+            out->writeUInt8(1);
+            out->writeHash(p.hash);
+            out->writeHash(objId);
+            out->writeLPStr(p.commit.getBlob());
+        }
+
+        pending.pop_front();
+    }
+}
+
+void
+FileLog::run(const ObjectHash &head, const string &path, bytewstream *out)
+{
+    HistoryWalk walk(repo);
+    ObjectHash hash;
+    Commit c;
+
+    components = Util_PathToVector(path);
+    memo.clear();
+    commitObjs.clear();
+    pending.clear();
+
+    walk.push(head);
+    while (walk.next(&hash, &c)) {
+        Pending p;
+
+        commitObjs[hash] = resolve(c.getTree(), 0);
+        p.hash = hash;
+        p.commit = c;
+        pending.push_back(p);
+        flush(out);
+    }
+    ASSERT(pending.empty());
+
+    out->writeUInt8(0);
+    out->flush();
+}
+
+bool
+FileLog::readEntry(bytestream *in, ObjectHash *commitId, ObjectHash *objId,
+                   Commit *c)
+{
+    string blob;
+
+    if (in->ended() || in->readUInt8() == 0)
+        return false;
+
+    in->readHash(*commitId);
+    in->readHash(*objId);
+    in->readLPStr(blob);
+    c->fromBlob(blob);
+
+    return !in->error();
+}
+
+/*
+ * Records are written to the connection as they are found, so the client
+ * can show them before the walk reaches the start of history.
+ */
+void
+FileLog_UDSExt(LocalRepo *repo, const string &data, bytewstream *out)
+{
+    strstream in(data);
+    ObjectHash head;
+    string path;
+
+    in.readHash(head);
+    in.readPStr(path);
+    if (in.error()) {
+        out->writeUInt8(0);
+        return;
+    }
+    if (head.isEmpty())
+        head = repo->getHead();
+
+    FileLog fl(repo);
+    fl.run(head, path, out);
+    DLOG("filelog %s: %lu trees read", path.c_str(), fl.getTreesLoaded());
+}
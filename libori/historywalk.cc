@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string>
+#include <vector>
+#include <queue>
+
+#include <oriutil/debug.h>
+#include <ori/repo.h>
+#include <ori/commit.h>
+#include <ori/historywalk.h>
+
+using namespace std;
+
+HistoryWalk::HistoryWalk(Repo *r)
+    : repo(r), queue(), seen(), pending(), last(), hasLast(false), visited(0)
+{
+}
+
+HistoryWalk::~HistoryWalk()
+{
+}
+
+void
+HistoryWalk::push(const ObjectHash &commitId)
+{
+    if (commitId.isEmpty() || commitId == EMPTY_COMMIT)
+        return;
+    if (!seen.insert(commitId).second)
+        return;
+
+    pending.push_back(commitId);
+}
+
+void
+HistoryWalk::push(const vector<ObjectHash> &commitIds)
+{
+    for (size_t i = 0; i < commitIds.size(); i++) {
+        push(commitIds[i]);
+    }
+}
+
+/*
+ * Load all queued commits in one request.
+ */
+void
+HistoryWalk::load()
+{
+    if (pending.empty())
+        return;
+
+    vector<Commit> commits = repo->getCommits(pending);
+    ASSERT(commits.size() == pending.size());
+
+    for (size_t i = 0; i < pending.size(); i++) {
+        Entry e;
+
+        e.time = commits[i].getTime();
+        e.hash = pending[i];
+        e.commit = commits[i];
+        queue.push(e);
+    }
+    pending.clear();
+}
+
+bool
+HistoryWalk::next(ObjectHash *commitId, Commit *c)
+{
+    if (hasLast) {
+        pair<ObjectHash, ObjectHash> p = last.getParents();
+        push(p.first);
+        push(p.second);
+        hasLast = false;
+    }
+
+    load();
+    if (queue.empty())
+        return false;
+
+    const Entry &e = queue.top();
+    *commitId = e.hash;
+    *c = e.commit;
+    last = e.commit;
+    hasLast = true;
+    queue.pop();
+    visited++;
+
+    return true;
+}
+
+void
+HistoryWalk::prune()
+{
+    hasLast = false;
+}
@@ -34,10 +34,12 @@
 
 #include <oriutil/debug.h>
 #include <oriutil/oriutil.h>
+#include <oriutil/zipcodec.h>
 #include <ori/object.h>
 #include <ori/httpclient.h>
 #include <ori/httprepo.h>
 #include <ori/packfile.h>
+#include <ori/filelog.h>
 
 #include "httpdefs.h"
 
@@ -127,18 +129,11 @@ HttpRepo::getObject(const ObjectHash &id)
         num = bs->readUInt32();
         ASSERT(num == 0);
 
-        switch (info.getAlgo()) {
-            case ObjectInfo::ZIPALGO_NONE:
-                payloads[info.hash] = payload;
-                break;
-            case ObjectInfo::ZIPALGO_FASTLZ:
-                payloads[info.hash] = zipstream(new strstream(payload),
-                                                DECOMPRESS,
-                                                info.payload_size).readAll();
-            case ObjectInfo::ZIPALGO_LZMA:
-            case ObjectInfo::ZIPALGO_UNKNOWN:
-                NOT_IMPLEMENTED(false);
+        bytestream::ap zs(ZipCodec_Decompress(new strstream(payload), info));
+        if (!zs.get()) {
+            NOT_IMPLEMENTED(false);
         }
+        payloads[info.hash] = zs->readAll();
         return Object::sp(new HttpObject(this, info));
     }
     return Object::sp();
@@ -284,6 +279,34 @@ HttpRepo::listCommits()
 }
 
 
+/*
+ * Server-side operations are reached through dedicated paths rather than a
+ * generic extension call.
+ */
+set<string>
+HttpRepo::listExt()
+{
+    set<string> exts;
+
+    exts.insert(FILELOG_EXT);
+
+    return exts;
+}
+
+string
+HttpRepo::callExt(const string &ext, const string &data)
+{
+    string resp;
+
+    if (ext != FILELOG_EXT)
+        return "";
+
+    if (client->postRequest(ORIHTTP_PATH_FILELOG, data, resp) != 0)
+        return "";
+
+    return resp;
+}
+
 std::string &
 HttpRepo::_payload(const ObjectHash &id)
 {
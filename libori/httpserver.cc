@@ -44,6 +44,7 @@
 #include <ori/version.h>
 #include <ori/localrepo.h>
 #include <ori/httpserver.h>
+#include <ori/filelog.h>
 
 #include "evbufstream.h"
 #include "httpdefs.h"
@@ -118,6 +119,7 @@ HTTPServer::entry(struct evhttp_request *req)
      * /getobjs
      * /objs/...
      * /objinfo/...
+     * /filelog
      */
 
 #ifdef DEBUG
@@ -139,6 +141,8 @@ HTTPServer::entry(struct evhttp_request *req)
         contains(req);
     } else if (url == ORIHTTP_PATH_GETOBJS) {
         getObjs(req);
+    } else if (url == ORIHTTP_PATH_FILELOG) {
+        fileLog(req);
     } else if (OriStr_StartsWith(url, "/objs/")) {
         evhttp_send_error(req, HTTP_NOTFOUND, "File Not Found");
         return;
@@ -322,9 +326,11 @@ HTTPServer::contains(struct evhttp_request *req)
         ObjectHash hash;
         in.readHash(hash);
 
+        bool present = repo.hasObject(hash);
+
         DLOG("httpd: contains: %d of %d %s %c", i + 1, numObjs,
-                hash.hex().c_str(), repo.hasObject(hash) ? 'P' : 'N');
-        if (repo.hasObject(hash))
+                hash.hex().c_str(), present ? 'P' : 'N');
+        if (present)
             rval += "P"; // Present
         else
             rval += "N"; // Not Present
@@ -400,6 +406,34 @@ HTTPServer::getObjInfo(struct evhttp_request *req)
     evhttp_send_reply(req, HTTP_OK, "OK", es.buf());
 }
 
+void
+HTTPServer::fileLog(struct evhttp_request *req)
+{
+    evbuffer *buf = evhttp_request_get_input_buffer(req);
+    evbufstream in(buf);
+    ObjectHash head;
+    string path;
+
+    in.readHash(head);
+    in.readPStr(path);
+    if (in.error()) {
+        evhttp_send_error(req, HTTP_BADREQUEST, "Bad Request");
+        return;
+    }
+    if (head.isEmpty())
+        head = repo.getHead();
+
+    DLOG("httpd: filelog %s", path.c_str());
+
+    evbufwstream out;
+    FileLog fl(&repo);
+    fl.run(head, path, &out);
+
+    evhttp_add_header(req->output_headers, "Content-Type",
+            "application/octet-stream");
+    evhttp_send_reply(req, HTTP_OK, "OK", out.buf());
+}
+
 // void
 // HTTPServer::pushObj(struct evhttp_request *req, void *arg)
 // {
@@ -0,0 +1,734 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+#include "tuneables.h"
+
+#include <oriutil/debug.h>
+#include <oriutil/oriutil.h>
+#include <oriutil/oricrypt.h>
+#include <oriutil/objectinfo.h>
+#include <oriutil/monitor.h>
+#include <oriutil/stopwatch.h>
+#include <oriutil/thread.h>
+#include <ori/largeblob.h>
+#include <ori/localrepo.h>
+#include <ori/packfile.h>
+#include <ori/tree.h>
+#include <ori/treebuilder.h>
+#include <ori/importer.h>
+
+using namespace std;
+
+/*
+ * A directory, symlink or file found by the scan stage.  It is freed by the
+ * pack stage once all of its pieces are packed.
+ */
+struct ImportFile {
+    enum Kind { Dir, Symlink, Small, Large };
+
+    Kind kind;
+    // Path from the import root, starting with a slash
+    string path;
+    string fullPath;
+    AttrMap attrs;
+    uint64_t size;
+
+    // Only used by the pack stage
+    uint32_t packed;
+    // Pieces, zero until the last one is packed
+    uint32_t total;
+    bool failed;
+    ObjectHash hash;
+    ObjectHash totalHash;
+    map<uint64_t, LBlobEntry> parts;
+};
+
+/*
+ * Consecutive parts of a file.  Small files and symlinks are a single part
+ * and directories none, large files are split into pieces of about
+ * IMPORT_PIECE_SIZE bytes so they move through the stages together.
+ */
+struct ImportPiece {
+    ImportPiece(ImportFile *f, uint32_t index, uint64_t offset)
+        : file(f), index(index), offset(offset), last(false), failed(false),
+          bytes(0)
+    {
+    }
+
+    ImportFile *file;
+    uint32_t index;
+    // File offset of the first part
+    uint64_t offset;
+    bool last;
+    bool failed;
+    // Set on the last piece of a large file
+    ObjectHash totalHash;
+    // Payloads, replaced by the stored payloads in the compress stage
+    vector<string> parts;
+    vector<ObjectInfo> infos;
+    // Parts this piece adds to the repository
+    vector<bool> store;
+    size_t bytes;
+};
+
+/*
+ * A queue between two stages holding at most maxItems items and maxBytes
+ * bytes, except that an item larger than that goes in alone.  Waits poll
+ * like the rest of the tree and the time spent waiting is added to the
+ * caller's counter.
+ */
+template <class T>
+class ImportQueue
+{
+public:
+    ImportQueue(size_t maxItems, size_t maxBytes)
+        : maxItems(maxItems), maxBytes(maxBytes), bytes(0), closed(false)
+    {
+    }
+    void push(T *item, size_t len, uint64_t *waitUsec)
+    {
+        Stopwatch sw = Stopwatch();
+        bool waited = false;
+
+        lock.lock();
+        while (!items.empty() &&
+               (items.size() >= maxItems || bytes + len > maxBytes)) {
+            lock.unlock();
+            if (!waited) {
+                sw.start();
+                waited = true;
+            }
+            usleep(IMPORT_WAIT_USECS);
+            lock.lock();
+        }
+        items.push_back(make_pair(item, len));
+        bytes += len;
+        lock.unlock();
+
+        if (waited) {
+            sw.stop();
+            *waitUsec += sw.getElapsedTime();
+        }
+    }
+    /// Returns false once the queue is closed and empty
+    bool pop(T **item, uint64_t *waitUsec)
+    {
+        Stopwatch sw = Stopwatch();
+        bool waited = false;
+        bool found;
+
+        lock.lock();
+        while (items.empty() && !closed) {
+            lock.unlock();
+            if (!waited) {
+                sw.start();
+                waited = true;
+            }
+            usleep(IMPORT_WAIT_USECS);
+            lock.lock();
+        }
+        found = !items.empty();
+        if (found) {
+            *item = items.front().first;
+            bytes -= items.front().second;
+            items.pop_front();
+        }
+        lock.unlock();
+
+        if (waited) {
+            sw.stop();
+            *waitUsec += sw.getElapsedTime();
+        }
+
+        return found;
+    }
+    /// Called once nothing more will be pushed
+    void close()
+    {
+        Monitor l(lock);
+
+        closed = true;
+    }
+private:
+    Mutex lock;
+    deque<pair<T *, size_t> > items;
+    size_t maxItems;
+    size_t maxBytes;
+    size_t bytes;
+    bool closed;
+};
+
+class ImportWorker : public Thread
+{
+public:
+    ImportWorker(Importer *imp, ImportStage stage)
+        : Thread("import"), imp(imp), stage(stage)
+    {
+    }
+    void run()
+    {
+        imp->runStage(stage);
+    }
+private:
+    Importer *imp;
+    ImportStage stage;
+};
+
+/*
+ * Per worker counters, added to the stage totals when the worker is done.
+ */
+struct ImportCounters {
+    uint64_t items;
+    uint64_t bytes;
+    uint64_t inputUsec;
+    uint64_t outputUsec;
+};
+
+/*
+ * State of a large file being split, the parts are gathered into pieces and
+ * handed to the hash stage as they fill up.
+ */
+struct ImportSplit {
+    ImportQueue<ImportPiece> *q;
+    ImportCounters *counters;
+    ImportPiece *piece;
+    uint64_t off;
+    OriCrypt_HashCtx *ctx;
+};
+
+static void
+ImporterSplitCB(const uint8_t *buf, uint32_t len, void *arg)
+{
+    ImportSplit *s = (ImportSplit *)arg;
+
+    OriCrypt_HashUpdate(s->ctx, buf, len);
+
+    s->piece->parts.push_back(string((const char *)buf, len));
+    s->piece->bytes += len;
+    s->off += len;
+
+    if (s->piece->bytes >= IMPORT_PIECE_SIZE) {
+        ImportPiece *next = new ImportPiece(s->piece->file,
+                                            s->piece->index + 1, s->off);
+
+        s->counters->items++;
+        s->q->push(s->piece, s->piece->bytes, &s->counters->outputUsec);
+        s->piece = next;
+    }
+}
+
+/*
+ * Attributes as the file system stores them.
+ */
+static void
+ImporterSetAttrs(AttrMap *attrs, const struct stat &sb)
+{
+    struct passwd *pw = getpwuid(sb.st_uid);
+    struct group *grp = getgrgid(sb.st_gid);
+
+    attrs->setAsStr(ATTR_USERNAME, pw != NULL ? pw->pw_name : "nobody");
+    attrs->setAsStr(ATTR_GROUPNAME, grp != NULL ? grp->gr_name : "nogroup");
+    attrs->setAs<bool>(ATTR_SYMLINK, S_ISLNK(sb.st_mode));
+    attrs->setAs<mode_t>(ATTR_PERMS, sb.st_mode & 0777);
+    attrs->setAs<size_t>(ATTR_FILESIZE, sb.st_size);
+    attrs->setAs<time_t>(ATTR_MTIME, sb.st_mtime);
+    attrs->setAs<time_t>(ATTR_CTIME, sb.st_ctime);
+}
+
+static int
+ImporterReadFile(const string &path, uint64_t size, string *out)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    size_t total = 0;
+
+    if (fd < 0)
+        return -errno;
+
+    out->resize(size);
+    while (total < size) {
+        ssize_t res = ::read(fd, &(*out)[total], size - total);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            int err = errno;
+            ::close(fd);
+            return -err;
+        }
+        if (res == 0)
+            break;
+        total += res;
+    }
+    out->resize(total);
+    ::close(fd);
+
+    return 0;
+}
+
+Importer::Importer(LocalRepo *repo)
+    : repo(repo), threads(1), root(), entries(), scanQ(NULL), chunkQ(NULL),
+      hashQ(NULL), compressQ(NULL), claimed(), error()
+{
+    memset(&stats, 0, sizeof(stats));
+    memset(&running, 0, sizeof(running));
+}
+
+Importer::~Importer()
+{
+}
+
+const char *
+Importer::stageName(ImportStage stage)
+{
+    const char *names[] = { "scan", "chunk", "hash", "compress", "pack" };
+
+    ASSERT(stage < IMPORT_STAGES);
+    return names[stage];
+}
+
+ImportStats
+Importer::getStats()
+{
+    Monitor l(lock);
+
+    return stats;
+}
+
+ObjectHash
+Importer::run(const string &dir)
+{
+    vector<Thread *> workers;
+    Stopwatch sw = Stopwatch();
+    ImportQueue<ImportFile> sq(IMPORT_QUEUE_ITEMS, IMPORT_QUEUE_BYTES);
+    ImportQueue<ImportPiece> cq(IMPORT_QUEUE_ITEMS, IMPORT_QUEUE_BYTES);
+    ImportQueue<ImportPiece> hq(IMPORT_QUEUE_ITEMS, IMPORT_QUEUE_BYTES);
+    ImportQueue<ImportPiece> zq(IMPORT_QUEUE_ITEMS, IMPORT_QUEUE_BYTES);
+    struct stat sb;
+
+    if (stat(dir.c_str(), &sb) < 0 || !S_ISDIR(sb.st_mode))
+        throw runtime_error("Cannot read directory " + dir);
+
+    root = dir;
+    scanQ = &sq;
+    chunkQ = &cq;
+    hashQ = &hq;
+    compressQ = &zq;
+    entries.clear();
+    claimed.clear();
+    error = "";
+    memset(&stats, 0, sizeof(stats));
+
+    sw.start();
+    for (int s = 0; s < IMPORT_STAGES; s++) {
+        int n = (s == IMPORT_SCAN || s == IMPORT_PACK) ? 1 : MAX(threads, 1);
+
+        stats.stages[s].threads = n;
+        running[s] = n;
+        if (s == IMPORT_PACK)
+            break;
+        for (int i = 0; i < n; i++) {
+            workers.push_back(new ImportWorker(this, (ImportStage)s));
+            workers.back()->start();
+        }
+    }
+
+    // Packing appends to the current packfile so it stays on this thread
+    runStage(IMPORT_PACK);
+
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i]->wait();
+        delete workers[i];
+    }
+
+    if (error != "")
+        throw runtime_error(error);
+
+    // Parents sort before their children so they are always there first
+    TreeBuilder tb = TreeBuilder(repo, Tree());
+    for (map<string, TreeEntry>::iterator it = entries.begin();
+         it != entries.end();
+         it++) {
+        tb.set(it->first, it->second);
+    }
+    entries.clear();
+
+    ObjectHash hash = repo->addTree(tb.commit());
+    sw.stop();
+
+    Monitor l(lock);
+    stats.objects = stats.stages[IMPORT_PACK].items;
+    stats.storedBytes = stats.stages[IMPORT_PACK].bytes;
+    stats.usec = sw.getElapsedTime();
+
+    return hash;
+}
+
+/*
+ * Runs one worker of a stage until its input runs dry, the last worker of a
+ * stage to finish closes the next queue.
+ */
+void
+Importer::runStage(ImportStage stage)
+{
+    ImportCounters c;
+    Stopwatch sw = Stopwatch();
+    ImportFile *f = NULL;
+    ImportPiece *p = NULL;
+
+    memset(&c, 0, sizeof(c));
+    sw.start();
+    switch (stage) {
+        case IMPORT_SCAN:
+            scanDir("", &c);
+            break;
+        case IMPORT_CHUNK:
+            while (scanQ->pop(&f, &c.inputUsec))
+                chunkFile(f, &c);
+            break;
+        case IMPORT_HASH:
+            while (chunkQ->pop(&p, &c.inputUsec)) {
+                hashPiece(p, &c);
+                hashQ->push(p, p->bytes, &c.outputUsec);
+            }
+            break;
+        case IMPORT_COMPRESS:
+            while (hashQ->pop(&p, &c.inputUsec)) {
+                compressPiece(p, &c);
+                compressQ->push(p, p->bytes, &c.outputUsec);
+            }
+            break;
+        case IMPORT_PACK:
+            while (compressQ->pop(&p, &c.inputUsec))
+                packPiece(p, &c);
+            break;
+        default:
+            NOT_IMPLEMENTED(false);
+    }
+    sw.stop();
+
+    Monitor l(lock);
+    ImportStageStats &s = stats.stages[stage];
+    uint64_t usec = sw.getElapsedTime();
+
+    s.items += c.items;
+    s.bytes += c.bytes;
+    s.inputUsec += c.inputUsec;
+    s.outputUsec += c.outputUsec;
+    s.busyUsec += usec - MIN(usec, c.inputUsec + c.outputUsec);
+
+    if (--running[stage] == 0) {
+        if (stage == IMPORT_SCAN)
+            scanQ->close();
+        else if (stage == IMPORT_CHUNK)
+            chunkQ->close();
+        else if (stage == IMPORT_HASH)
+            hashQ->close();
+        else if (stage == IMPORT_COMPRESS)
+            compressQ->close();
+    }
+}
+
+void
+Importer::fail(const string &msg)
+{
+    Monitor l(lock);
+
+    WARNING("%s", msg.c_str());
+    if (error == "")
+        error = msg;
+}
+
+/*
+ * Walks a directory in sorted order, each directory is queued before the
+ * files in it.  Directory symlinks are not followed.
+ */
+void
+Importer::scanDir(const string &relPath, ImportCounters *c)
+{
+    string dirPath = root + relPath;
+    vector<string> names;
+    DIR *d;
+    struct dirent *de;
+
+    d = opendir(dirPath.c_str());
+    if (d == NULL) {
+        fail("Cannot read directory " + dirPath + ": " + strerror(errno));
+        return;
+    }
+    while ((de = readdir(d)) != NULL) {
+        string name = de->d_name;
+
+        if (name == "." || name == ".." || name == ".ori")
+            continue;
+        names.push_back(name);
+    }
+    closedir(d);
+
+    sort(names.begin(), names.end());
+
+    for (size_t i = 0; i < names.size(); i++) {
+        ImportFile *f = new ImportFile();
+        struct stat sb;
+
+        f->path = relPath + "/" + names[i];
+        f->fullPath = root + f->path;
+        f->packed = 0;
+        f->total = 0;
+        f->failed = false;
+
+        if (lstat(f->fullPath.c_str(), &sb) < 0) {
+            fail("Cannot stat " + f->fullPath + ": " + strerror(errno));
+            delete f;
+            continue;
+        }
+
+        if (S_ISDIR(sb.st_mode)) {
+            f->kind = ImportFile::Dir;
+        } else if (S_ISLNK(sb.st_mode)) {
+            f->kind = ImportFile::Symlink;
+        } else if (S_ISREG(sb.st_mode)) {
+            f->kind = (uint64_t)sb.st_size > LARGEFILE_MINIMUM
+                      ? ImportFile::Large : ImportFile::Small;
+        } else {
+            WARNING("Skipping special file %s", f->fullPath.c_str());
+            delete f;
+            continue;
+        }
+        f->size = sb.st_size;
+        ImporterSetAttrs(&f->attrs, sb);
+
+        c->items++;
+        c->bytes += (f->kind == ImportFile::Dir) ? 0 : f->size;
+
+        // The pack stage may free f as soon as it is queued
+        if (f->kind == ImportFile::Dir) {
+            string path = f->path;
+
+            scanQ->push(f, 0, &c->outputUsec);
+            scanDir(path, c);
+        } else {
+            scanQ->push(f, 0, &c->outputUsec);
+        }
+    }
+}
+
+/*
+ * Reads a file into pieces.  Large files are split the same way as
+ * LargeBlob::chunkFile so the parts and the large blob come out the same.
+ */
+void
+Importer::chunkFile(ImportFile *f, ImportCounters *c)
+{
+    ImportPiece *p = new ImportPiece(f, 0, 0);
+    int status = 0;
+
+    if (f->kind == ImportFile::Symlink) {
+        vector<char> buf(MAX(f->size, (uint64_t)MAXPATHLEN) + 1);
+        ssize_t len = readlink(f->fullPath.c_str(), &buf[0], buf.size());
+
+        if (len < 0) {
+            status = -errno;
+        } else {
+            p->parts.push_back(string(&buf[0], len));
+            p->bytes = len;
+        }
+    } else if (f->kind == ImportFile::Small) {
+        p->parts.push_back("");
+        status = ImporterReadFile(f->fullPath, f->size, &p->parts.back());
+        p->bytes = p->parts.back().size();
+    } else if (f->kind == ImportFile::Large) {
+        ImportSplit s;
+
+        s.q = chunkQ;
+        s.counters = c;
+        s.piece = p;
+        s.off = 0;
+        s.ctx = OriCrypt_HashBegin();
+        status = LargeBlob::splitFile(f->fullPath, ImporterSplitCB, &s);
+        p = s.piece;
+        p->totalHash = OriCrypt_HashEnd(s.ctx);
+        c->bytes += s.off;
+    }
+
+    if (status < 0) {
+        fail("Cannot read " + f->fullPath + ": " + strerror(-status));
+        p->failed = true;
+    } else if (f->kind != ImportFile::Large) {
+        c->bytes += p->bytes;
+    }
+
+    p->last = true;
+    c->items++;
+    chunkQ->push(p, p->bytes, &c->outputUsec);
+}
+
+void
+Importer::hashPiece(ImportPiece *p, ImportCounters *c)
+{
+    p->infos.resize(p->parts.size());
+    for (size_t i = 0; i < p->parts.size(); i++) {
+        ObjectInfo &info = p->infos[i];
+
+        info.hash = OriCrypt_HashString(p->parts[i]);
+        info.type = ObjectInfo::Blob;
+        info.payload_size = p->parts[i].size();
+
+        c->items++;
+        c->bytes += p->parts[i].size();
+    }
+}
+
+/*
+ * Compresses the parts that are neither stored nor taken on by another
+ * piece.  No ZipAdvisor is consulted, it follows one file at a time.
+ */
+void
+Importer::compressPiece(ImportPiece *p, ImportCounters *c)
+{
+    const ZipPolicy &policy = repo->getZipPolicy();
+
+    p->store.resize(p->parts.size());
+    p->bytes = 0;
+    for (size_t i = 0; i < p->parts.size(); i++) {
+        ObjectInfo &info = p->infos[i];
+        string stored;
+
+        repoLock.lock();
+        p->store[i] = claimed.count(info.hash) == 0 &&
+                      !repo->isObjectStored(info.hash);
+        if (p->store[i])
+            claimed.insert(info.hash);
+        repoLock.unlock();
+
+        if (!p->store[i]) {
+            p->parts[i] = "";
+            continue;
+        }
+
+        c->items++;
+        c->bytes += p->parts[i].size();
+        if (PfTransaction::compress(&info, p->parts[i],
+                                    policy.select(info.type,
+                                                  info.payload_size),
+                                    NULL, &stored)) {
+            p->parts[i].swap(stored);
+        }
+        p->bytes += p->parts[i].size();
+    }
+}
+
+/*
+ * Stores the parts of a piece and records where they go in the file.  The
+ * file is finished once all of its pieces are in, in whatever order.
+ */
+void
+Importer::packPiece(ImportPiece *p, ImportCounters *c)
+{
+    ImportFile *f = p->file;
+    uint64_t off = p->offset;
+
+    repoLock.lock();
+    for (size_t i = 0; i < p->parts.size(); i++) {
+        if (!p->store[i])
+            continue;
+        repo->addStoredObject(p->infos[i], p->parts[i]);
+        c->items++;
+        c->bytes += p->parts[i].size();
+    }
+    repoLock.unlock();
+
+    for (size_t i = 0; i < p->infos.size(); i++) {
+        if (f->kind == ImportFile::Large) {
+            f->parts.insert(make_pair(off,
+                                      LBlobEntry(p->infos[i].hash,
+                                                 p->infos[i].payload_size)));
+        } else {
+            f->hash = p->infos[i].hash;
+        }
+        off += p->infos[i].payload_size;
+    }
+
+    f->packed++;
+    f->failed = f->failed || p->failed;
+    if (p->last) {
+        f->total = p->index + 1;
+        f->totalHash = p->totalHash;
+    }
+    delete p;
+
+    if (f->total != 0 && f->packed == f->total)
+        finishFile(f);
+}
+
+void
+Importer::finishFile(ImportFile *f)
+{
+    TreeEntry te;
+
+    if (f->failed) {
+        delete f;
+        return;
+    }
+
+    if (f->kind == ImportFile::Dir) {
+        te.type = TreeEntry::Tree;
+    } else if (f->kind == ImportFile::Large) {
+        LargeBlob lb = LargeBlob(repo);
+
+        lb.parts.swap(f->parts);
+        lb.totalHash = f->totalHash;
+
+        repoLock.lock();
+        ObjectHash hash = repo->addBlob(ObjectInfo::LargeBlob, lb.getBlob());
+        repoLock.unlock();
+
+        te = TreeEntry(hash, lb.totalHash);
+    } else {
+        te = TreeEntry(f->hash, ObjectHash());
+    }
+    te.attrs = f->attrs;
+    entries[f->path] = te;
+
+    Monitor l(lock);
+    if (f->kind == ImportFile::Dir) {
+        stats.dirs++;
+    } else {
+        stats.files++;
+        stats.bytes += f->size;
+    }
+    delete f;
+}
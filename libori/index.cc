@@ -28,11 +28,14 @@
 #include <iostream>
 #include <boost/tr1/unordered_map.hpp>
 
+#include "tuneables.h"
+
 #include <oriutil/debug.h>
 #include <oriutil/runtimeexception.h>
 #include <oriutil/systemexception.h>
 #include <oriutil/orifile.h>
 #include <oriutil/oricrypt.h>
+#include <oriutil/stream.h>
 #include <ori/object.h>
 #include <ori/index.h>
 
@@ -43,8 +46,8 @@ using namespace std::tr1;
 #define TOTAL_ENTRYSIZE (IndexEntry::SIZE + 16)
 
 Index::Index()
+    : fd(-1), durability(Durability::getDefault()), dirty(false)
 {
-    fd = -1;
 }
 
 Index::~Index()
@@ -52,6 +55,12 @@ Index::~Index()
     close();
 }
 
+void
+Index::setDurability(Durability *durability)
+{
+    this->durability = durability;
+}
+
 void
 Index::open(const string &indexFile)
 {
@@ -133,7 +142,7 @@ void
 Index::close()
 {
     if (fd != -1) {
-        ::fsync(fd);
+        sync();
         ::close(fd);
         fd = -1;
     }
@@ -142,7 +151,11 @@ Index::close()
 void
 Index::sync()
 {
-    ::fsync(fd);
+    _flush();
+    if (dirty) {
+        durability->barrier(fd, DURABILITY_INDEX);
+        dirty = false;
+    }
 }
 
 void
@@ -163,13 +176,17 @@ Index::rewrite()
     fd = fdNew;
     ::close(tmpFd);
 
-    // Write new index
-    for (unordered_map<ObjectHash, IndexEntry>::iterator it = index.begin();
+    // Write new index, which includes the pending entries
+    pending.clear();
+    for (ObjectHashMap<IndexEntry>::iterator it = index.begin();
             it != index.end();
             it++)
     {
         _writeEntry((*it).second);
+        if (pending.size() >= GROUPCOMMIT_BUFFER_MAX)
+            _flush();
     }
+    _flush();
 
     OriFile_Rename(newIndex, fileName);
 }
@@ -177,7 +194,7 @@ Index::rewrite()
 void
 Index::dump()
 {
-    unordered_map<ObjectHash, IndexEntry>::iterator it;
+    ObjectHashMap<IndexEntry>::iterator it;
 
     cout << "***** BEGIN REPOSITORY INDEX *****" << endl;
     for (it = index.begin(); it != index.end(); it++)
@@ -191,13 +208,16 @@ Index::dump()
 }
 
 void
-Index::updateEntry(const ObjectHash &objId, const IndexEntry &entry)
+Index::updateEntry(const ObjectHash &objId, const IndexEntry &entry,
+                   bool move)
 {
     ASSERT(!objId.isEmpty());
 
     _writeEntry(entry);
+    if (pending.size() >= GROUPCOMMIT_BUFFER_MAX)
+        _flush();
 
-    if (index.find(objId) != index.end()) {
+    if (!move && index.find(objId) != index.end()) {
         fprintf(stderr, "WARNING: duplicate updateEntry\n");
     }
 
@@ -205,16 +225,16 @@ Index::updateEntry(const ObjectHash &objId, const IndexEntry &entry)
     index[objId] = entry;
 }
 
-const IndexEntry &
+IndexEntry
 Index::getEntry(const ObjectHash &objId) const
 {
-    unordered_map<ObjectHash, IndexEntry>::const_iterator it = index.find(objId);
+    ObjectHashMap<IndexEntry>::const_iterator it = index.find(objId);
     ASSERT(it != index.end());
 
     return (*it).second;
 }
 
-const ObjectInfo &
+ObjectInfo
 Index::getInfo(const ObjectHash &objId) const
 {
     return getEntry(objId).info;
@@ -223,7 +243,7 @@ Index::getInfo(const ObjectHash &objId) const
 bool
 Index::hasObject(const ObjectHash &objId) const
 {
-    unordered_map<ObjectHash, IndexEntry>::const_iterator it;
+    ObjectHashMap<IndexEntry>::const_iterator it;
 
     it = index.find(objId);
 
@@ -234,7 +254,7 @@ set<ObjectInfo>
 Index::getList()
 {
     set<ObjectInfo> lst;
-    unordered_map<ObjectHash, IndexEntry>::iterator it;
+    ObjectHashMap<IndexEntry>::iterator it;
 
     for (it = index.begin(); it != index.end(); it++)
     {
@@ -245,10 +265,13 @@ Index::getList()
 }
 
 
+/*
+ * Appends the entry to the pending entries.
+ */
 void
 Index::_writeEntry(const IndexEntry &e)
 {
-    strwstream ss;
+    strwstream ss(TOTAL_ENTRYSIZE);
 
     string info_str = e.info.toString();
     ss.write(info_str.data(), info_str.size());
@@ -260,8 +283,20 @@ Index::_writeEntry(const IndexEntry &e)
     ObjectHash checksum = OriCrypt_HashString(ss.str());
     ss.write(checksum.hash, 16);
 
-    const string &final = ss.str();
-    ASSERT(final.size() == TOTAL_ENTRYSIZE);
-    write(fd, final.data(), final.size());
+    ASSERT(ss.str().size() == TOTAL_ENTRYSIZE);
+    pending += ss.str();
 }
 
+void
+Index::_flush()
+{
+    if (pending.empty())
+        return;
+
+    if (!durability->write(fd, pending.data(), pending.size())) {
+        perror("Index write");
+        throw SystemException();
+    }
+    pending.clear();
+    dirty = true;
+}
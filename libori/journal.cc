@@ -0,0 +1,388 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+
+#include <string>
+
+#include <oriutil/debug.h>
+#include <oriutil/orifile.h>
+#include <oriutil/stopwatch.h>
+#include <ori/journal.h>
+
+using namespace std;
+
+#define JOURNAL_MAGIC           "ORIJRNL1"
+#define JOURNAL_MAGIC_LEN       8
+// Time an append sleeps while it waits on the writer
+#define JOURNAL_WAIT_USECS      50
+
+/*
+ * Events in the ring start with this header and are aligned to its size.
+ * The size is set last, so the writer stops at the first event with none.
+ */
+struct Journal::RingHeader {
+    volatile uint32_t size;
+    uint32_t event;
+    uint32_t len1;
+    uint32_t len2;
+};
+
+static const char *eventNames[] = {
+    "pad", "create", "unlink", "rename", "mkdir", "rmdir", "snapshot",
+    "write", "truncate",
+};
+
+static void
+Journal_PutLength(string *out, uint32_t len)
+{
+    while (len >= 0x80) {
+        out->push_back((char)(len | 0x80));
+        len >>= 7;
+    }
+    out->push_back((char)len);
+}
+
+static bool
+Journal_GetLength(const string &buf, size_t *off, uint32_t *len)
+{
+    *len = 0;
+    for (int shift = 0; shift < 35 && *off < buf.size(); shift += 7) {
+        uint8_t b = buf[(*off)++];
+
+        *len |= (uint32_t)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+Journal::Journal()
+    : Thread("journal"), fd(-1), syncMsecs(JOURNAL_SYNC_MSECS), ring(NULL),
+      head(0), tail(0), durable(0), kicked(0), stopping(0)
+{
+    wakeFds[0] = wakeFds[1] = -1;
+    memset(&stats, 0, sizeof(stats));
+}
+
+Journal::~Journal()
+{
+    close();
+}
+
+void
+Journal::open(int fd, unsigned int syncMsecs)
+{
+    ASSERT(this->fd == -1);
+
+    if (::pipe(wakeFds) < 0) {
+        WARNING("Couldn't create the journal wakeup pipe: %s",
+                strerror(errno));
+        return;
+    }
+    fcntl(wakeFds[0], F_SETFL, O_NONBLOCK);
+    fcntl(wakeFds[1], F_SETFL, O_NONBLOCK);
+
+    if (lseek(fd, 0, SEEK_END) == 0 &&
+        ::write(fd, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) != JOURNAL_MAGIC_LEN) {
+        WARNING("Couldn't write the journal header: %s", strerror(errno));
+    }
+
+    ring = (uint8_t *)calloc(1, JOURNAL_RING_SIZE);
+    ASSERT(ring != NULL);
+    head = tail = durable = 0;
+    stopping = 0;
+    this->syncMsecs = syncMsecs;
+    this->fd = fd;
+
+    start();
+}
+
+void
+Journal::close()
+{
+    if (fd == -1)
+        return;
+
+    stopping = 1;
+    kick();
+    wait();
+
+    ::close(fd);
+    fd = -1;
+    ::close(wakeFds[0]);
+    ::close(wakeFds[1]);
+    wakeFds[0] = wakeFds[1] = -1;
+    free(ring);
+    ring = NULL;
+}
+
+/*
+ * Reserves len bytes of the ring, after padding to its end if they do not
+ * fit before it.  Returns the ring position of the event and sets end to
+ * the position after it.
+ */
+uint64_t
+Journal::reserve(size_t len, uint64_t *end)
+{
+    while (true) {
+        uint64_t h = head;
+        uint64_t off = h & (JOURNAL_RING_SIZE - 1);
+        uint64_t pad = 0;
+
+        if (off + len > JOURNAL_RING_SIZE)
+            pad = JOURNAL_RING_SIZE - off;
+
+        if (h + pad + len - tail > JOURNAL_RING_SIZE) {
+            __sync_fetch_and_add(&stats.stalls, 1);
+            kick();
+            ::usleep(JOURNAL_WAIT_USECS);
+            continue;
+        }
+        if (!__sync_bool_compare_and_swap(&head, h, h + pad + len))
+            continue;
+
+        if (pad != 0) {
+            RingHeader *hdr = (RingHeader *)(ring + off);
+
+            hdr->event = Pad;
+            __sync_synchronize();
+            hdr->size = pad;
+        }
+
+        *end = h + pad + len;
+        return h + pad;
+    }
+}
+
+void
+Journal::kick()
+{
+    if (__sync_bool_compare_and_swap(&kicked, 0, 1)) {
+        char c = 0;
+        if (::write(wakeFds[1], &c, 1) < 0 && errno != EAGAIN)
+            WARNING("Couldn't wake the journal writer: %s", strerror(errno));
+    }
+}
+
+void
+Journal::waitDurable(uint64_t pos)
+{
+    while (durable < pos)
+        ::usleep(JOURNAL_WAIT_USECS);
+}
+
+void
+Journal::append(Event ev, const string &arg1, const string &arg2, bool sync)
+{
+    if (fd == -1)
+        return;
+
+    size_t len = sizeof(RingHeader) + arg1.size() + arg2.size();
+    len = (len + sizeof(RingHeader) - 1) & ~(sizeof(RingHeader) - 1);
+    ASSERT(len <= JOURNAL_RING_SIZE / 4);
+
+    uint64_t end;
+    uint64_t pos = reserve(len, &end);
+    RingHeader *hdr = (RingHeader *)(ring + (pos & (JOURNAL_RING_SIZE - 1)));
+    uint8_t *body = (uint8_t *)(hdr + 1);
+
+    memcpy(body, arg1.data(), arg1.size());
+    memcpy(body + arg1.size(), arg2.data(), arg2.size());
+    hdr->event = ev;
+    hdr->len1 = arg1.size();
+    hdr->len2 = arg2.size();
+    __sync_synchronize();
+    hdr->size = len;
+
+    __sync_fetch_and_add(&stats.events, 1);
+
+    if (sync) {
+        kick();
+        waitDurable(end);
+    } else if (end - durable >= JOURNAL_BATCH_BYTES) {
+        kick();
+    }
+}
+
+void
+Journal::sync()
+{
+    if (fd == -1)
+        return;
+
+    uint64_t end = head;
+    kick();
+    waitDurable(end);
+}
+
+JournalStats
+Journal::getStats()
+{
+    return stats;
+}
+
+/*
+ * Encodes the published events at the tail of the ring into out and frees
+ * their space.  Returns false if there were none.
+ */
+bool
+Journal::drain(string *out)
+{
+    uint64_t pos = tail;
+
+    while (true) {
+        RingHeader *hdr = (RingHeader *)(ring + (pos & (JOURNAL_RING_SIZE - 1)));
+        uint32_t size = hdr->size;
+
+        if (size == 0)
+            break;
+        __sync_synchronize();
+
+        if (hdr->event != Pad) {
+            const char *body = (const char *)(hdr + 1);
+
+            out->push_back((char)hdr->event);
+            Journal_PutLength(out, hdr->len1);
+            Journal_PutLength(out, hdr->len2);
+            out->append(body, hdr->len1 + hdr->len2);
+        }
+
+        // Appends rely on free space being zeroed
+        memset(hdr, 0, size);
+        pos += size;
+    }
+
+    if (pos == tail)
+        return false;
+
+    __sync_synchronize();
+    tail = pos;
+    return true;
+}
+
+void
+Journal::run()
+{
+    struct pollfd pfd;
+    string out;
+
+    pfd.fd = wakeFds[0];
+    pfd.events = POLLIN;
+
+    while (true) {
+        bool stop = stopping;
+        char buf[64];
+
+        if (!stop) {
+            pfd.revents = 0;
+            ::poll(&pfd, 1, syncMsecs);
+        }
+        while (::read(wakeFds[0], buf, sizeof(buf)) > 0)
+            ;
+        kicked = 0;
+        __sync_synchronize();
+
+        out.clear();
+        if (drain(&out)) {
+            size_t off = 0;
+
+            while (off < out.size()) {
+                ssize_t n = ::write(fd, out.data() + off, out.size() - off);
+                if (n < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    WARNING("Couldn't write the journal: %s",
+                            strerror(errno));
+                    break;
+                }
+                off += n;
+                stats.writes++;
+            }
+            stats.bytes += out.size();
+        }
+
+        uint64_t pos = tail;
+        if (durable != pos) {
+            Stopwatch sw = Stopwatch();
+
+            sw.start();
+            if (::fsync(fd) < 0)
+                WARNING("Couldn't sync the journal: %s", strerror(errno));
+            sw.stop();
+            stats.syncs++;
+            stats.syncUsec += sw.getElapsedTime();
+
+            __sync_synchronize();
+            durable = pos;
+        }
+
+        if (stop && tail == head)
+            break;
+    }
+}
+
+const char *
+Journal::eventName(Event ev)
+{
+    if ((size_t)ev >= sizeof(eventNames) / sizeof(eventNames[0]))
+        return "unknown";
+    return eventNames[ev];
+}
+
+int64_t
+Journal::replay(const string &path, ReplayCb cb, void *arg)
+{
+    string buf;
+    size_t off = JOURNAL_MAGIC_LEN;
+    int64_t events = 0;
+
+    if (!OriFile_Exists(path))
+        return -1;
+
+    buf = OriFile_ReadFile(path);
+    if (buf.size() < JOURNAL_MAGIC_LEN ||
+        buf.compare(0, JOURNAL_MAGIC_LEN, JOURNAL_MAGIC) != 0)
+        return -1;
+
+    while (off < buf.size()) {
+        Event ev = (Event)(uint8_t)buf[off++];
+        uint32_t len1, len2;
+
+        if (!Journal_GetLength(buf, &off, &len1) ||
+            !Journal_GetLength(buf, &off, &len2) ||
+            (uint64_t)off + len1 + len2 > buf.size()) {
+            WARNING("Ignoring a torn event at the end of the journal");
+            break;
+        }
+
+        if (cb != NULL)
+            cb(ev, buf.substr(off, len1), buf.substr(off + len1, len2), arg);
+        off += len1 + len2;
+        events++;
+    }
+
+    return events;
+}
@@ -27,6 +27,8 @@
 #include <errno.h>
 
 #include <string>
+#include <vector>
+#include <algorithm>
 #include <sstream>
 #include <iostream>
 #include <iomanip>
@@ -51,6 +53,18 @@
 
 using namespace std;
 
+#ifdef ORI_USE_RK
+typedef RKChunker<4096, 2048, 8192> LBChunker;
+// Ranges this small are always a single chunk
+#define LARGEBLOB_MINCHUNK 2048
+#endif /* ORI_USE_RK */
+
+#ifdef ORI_USE_FIXED
+//typedef FChunker<4096> LBChunker;
+typedef FChunker<32*1024> LBChunker;
+#define LARGEBLOB_MINCHUNK (32*1024)
+#endif /* ORI_USE_FIXED */
+
 /********************************************************************
  *
  *
@@ -97,9 +111,10 @@ public:
     {
         lb = l;
         lbOff = 0;
+        srcFd = -1;
         buf = NULL;
     }
-    ~FileChunkerCB()
+    virtual ~FileChunkerCB()
     {
         if (buf)
             delete[] buf;
@@ -164,7 +179,7 @@ public:
         uint64_t toRead = MIN(bufLen - *l, fileLen - fileOff);
         int status;
 
-        status = read(srcFd, buf + *l, toRead);
+        status = fill(buf + *l, toRead);
         if (status < 0) {
             perror("Cannot read large file");
             PANIC();
@@ -178,7 +193,11 @@ public:
 
         return 1;
     }
-private:
+protected:
+    virtual ssize_t fill(uint8_t *b, uint64_t len)
+    {
+        return read(srcFd, b, len);
+    }
     // Output large blob
     LargeBlob *lb;
     uint64_t lbOff;
@@ -191,19 +210,66 @@ private:
     uint64_t bufLen;
 };
 
+/*
+ * Chunks one range of a modified file.  The bytes come from readModified and
+ * are added to the running hash of the whole file as they are matched.
+ */
+class ExtentChunkerCB : public FileChunkerCB
+{
+public:
+    ExtentChunkerCB(LargeBlob *l, OriCrypt_HashCtx *c)
+        : FileChunkerCB(l), ctx(c)
+    {
+    }
+    void open(const LargeBlob *b, int fd, const map<uint64_t, uint64_t> *d,
+              uint64_t start, uint64_t end)
+    {
+        base = b;
+        dirtyFd = fd;
+        dirty = d;
+        bufLen = MIN(8 * 1024 * 1024, end - start);
+        buf = new uint8_t[bufLen];
+        lbOff = start;
+        rangeOff = start;
+        fileLen = end - start;
+        fileOff = 0;
+    }
+    virtual void match(const uint8_t *b, uint32_t l)
+    {
+        OriCrypt_HashUpdate(ctx, b, l);
+        FileChunkerCB::match(b, l);
+    }
+protected:
+    virtual ssize_t fill(uint8_t *b, uint64_t len)
+    {
+        uint64_t total = 0;
+
+        // Unlike read(2) readModified may stop at a chunk boundary
+        while (total < len) {
+            ssize_t res = base->readModified(b + total, len - total,
+                                             rangeOff + fileOff + total,
+                                             dirtyFd, *dirty);
+            if (res <= 0)
+                return res < 0 ? res : -EIO;
+            total += res;
+        }
+
+        return total;
+    }
+private:
+    OriCrypt_HashCtx *ctx;
+    const LargeBlob *base;
+    int dirtyFd;
+    const map<uint64_t, uint64_t> *dirty;
+    uint64_t rangeOff;
+};
+
 void
 LargeBlob::chunkFile(const string &path)
 {
     int status;
     FileChunkerCB cb = FileChunkerCB(this);
-#ifdef ORI_USE_RK
-    RKChunker<4096, 2048, 8192> c = RKChunker<4096, 2048, 8192>();
-#endif /* ORI_USE_RK */
-
-#ifdef ORI_USE_FIXED
-    //FChunker<4096> c = FChunker<4096>();
-    FChunker<32*1024> c = FChunker<32*1024>();
-#endif /* ORI_USE_FIXED */
+    LBChunker c = LBChunker();
 
     status = cb.open(path);
     if (status < 0) {
@@ -217,6 +283,41 @@ LargeBlob::chunkFile(const string &path)
     c.chunk(&cb);
 }
 
+/*
+ * Hands the parts of a file to a callback instead of the repository.
+ */
+class SplitChunkerCB : public FileChunkerCB
+{
+public:
+    SplitChunkerCB(LargeBlob::ChunkCB cb, void *arg)
+        : FileChunkerCB(NULL), cb(cb), arg(arg)
+    {
+    }
+    virtual void match(const uint8_t *b, uint32_t l)
+    {
+        cb(b, l, arg);
+    }
+private:
+    LargeBlob::ChunkCB cb;
+    void *arg;
+};
+
+int
+LargeBlob::splitFile(const string &path, ChunkCB cb, void *arg)
+{
+    int status;
+    SplitChunkerCB scb = SplitChunkerCB(cb, arg);
+    LBChunker c = LBChunker();
+
+    status = scb.open(path);
+    if (status < 0)
+        return status;
+
+    c.chunk(&scb);
+
+    return 0;
+}
+
 void
 LargeBlob::extractFile(const string &path)
 {
@@ -260,22 +361,19 @@ ssize_t
 LargeBlob::read(uint8_t *buf, size_t s, off_t off) const
 {
     map<uint64_t, LBlobEntry>::const_iterator it;
-    // XXX: Using upper/lower_bound should be faster
 
-    for (it = parts.begin(); it != parts.end(); it++) {
-        if ((*it).first <= off && ((*it).first + (*it).second.length) > off)
-            break;
-    }
-
-    if (it == parts.end()) {
+    // Find the last part starting at or before off
+    it = parts.upper_bound(off);
+    if (it == parts.begin()) {
         LOG("offset %llu larger than large blob", off);
         return 0;
     }
+    it--;
 
     off_t part_off = off - (*it).first;
     if (part_off >= (*it).second.length) {
-        LOG("offset %llu larger than last blob in LB", off);
-        ASSERT(false);
+        // Past the end of the last part
+        LOG("offset %llu larger than large blob", off);
         return 0;
     }
     if (part_off < 0) {
@@ -293,12 +391,151 @@ LargeBlob::read(uint8_t *buf, size_t s, off_t off) const
 
     size_t to_read = MIN((size_t)left, s);
 
-    Object::sp o(repo->getObject((*it).second.hash));
-    ASSERT(o->getInfo().type == ObjectInfo::Blob);
-    const std::string &payload = o->getPayload();
-    memcpy(buf, payload.data()+part_off, to_read);
+    return repo->readPayload((*it).second.hash, buf, to_read, part_off);
+}
+
+ssize_t
+LargeBlob::readModified(uint8_t *buf, size_t s, off_t off, int fd,
+                        const map<uint64_t, uint64_t> &dirty) const
+{
+    map<uint64_t, uint64_t>::const_iterator next = dirty.upper_bound(off);
+    size_t len = s;
+
+    if (next != dirty.begin()) {
+        map<uint64_t, uint64_t>::const_iterator prev = next;
+
+        prev--;
+        if (prev->second > (uint64_t)off) {
+            ssize_t status;
+
+            // Written since the file was opened
+            len = MIN(len, prev->second - off);
+            status = pread(fd, buf, len, off);
+            if (status < 0)
+                return -errno;
+            return status;
+        }
+    }
+
+    if (next != dirty.end())
+        len = MIN(len, next->first - off);
+
+    return read(buf, len, off);
+}
+
+/*
+ * Returns the offset of the part containing off, or of the last part if off
+ * is past the end.
+ */
+static uint64_t
+LargeBlobPartStart(const LargeBlob &lb, uint64_t off)
+{
+    map<uint64_t, LBlobEntry>::const_iterator it = lb.parts.upper_bound(off);
+
+    if (it == lb.parts.begin())
+        return 0;
+    it--;
+
+    return it->first;
+}
+
+/*
+ * Returns the end offset of the part containing off.
+ */
+static uint64_t
+LargeBlobPartEnd(const LargeBlob &lb, uint64_t off)
+{
+    map<uint64_t, LBlobEntry>::const_iterator it = lb.parts.upper_bound(off);
 
-    return to_read;
+    if (it == lb.parts.begin())
+        return 0;
+    it--;
+
+    return it->first + it->second.length;
+}
+
+void
+LargeBlob::chunkModified(const LargeBlob &base, int fd,
+                         const map<uint64_t, uint64_t> &dirty, uint64_t size)
+{
+    uint64_t baseSize = base.totalSize();
+    vector<pair<uint64_t, uint64_t> > ranges;
+    map<uint64_t, LBlobEntry>::const_iterator p;
+    OriCrypt_HashCtx *ctx = OriCrypt_HashBegin();
+    uint64_t off = 0;
+
+    parts.clear();
+
+    /*
+     * Widen each written range to the parts around it.  Parts are cut where
+     * the content matched the chunker, so chunking from the start of the
+     * first part to the end of the last one gives the same boundaries
+     * outside of the range as chunking the whole file would.
+     */
+    for (map<uint64_t, uint64_t>::const_iterator it = dirty.begin();
+         it != dirty.end() && it->first < size;
+         it++) {
+        uint64_t start = LargeBlobPartStart(base, it->first);
+        uint64_t end = MIN(it->second, size);
+
+        if (end < baseSize)
+            end = MIN(LargeBlobPartEnd(base, end - 1), size);
+        ranges.push_back(make_pair(start, end));
+    }
+    // A truncated file ends in the middle of a part
+    if (size < baseSize && LargeBlobPartStart(base, size) != size)
+        ranges.push_back(make_pair(LargeBlobPartStart(base, size - 1), size));
+    sort(ranges.begin(), ranges.end());
+
+    p = base.parts.begin();
+    for (size_t i = 0; i <= ranges.size(); i++) {
+        uint64_t start = (i == ranges.size()) ? size : ranges[i].first;
+        uint64_t end = (i == ranges.size()) ? size : ranges[i].second;
+
+        // Merge overlapping ranges
+        while (i + 1 < ranges.size() && ranges[i + 1].first <= end) {
+            i++;
+            end = MAX(end, ranges[i].second);
+        }
+        // Reuse the unmodified parts before this range
+        for (; p != base.parts.end() && p->first < start; p++) {
+            if (p->first < off)
+                continue; // Inside the previous range
+            ASSERT(p->first == off);
+            ASSERT(p->first + p->second.length <= start);
+
+            Object::sp o(repo->getObject(p->second.hash));
+            const string &payload = o->getPayload();
+            OriCrypt_HashUpdate(ctx, (const uint8_t *)payload.data(),
+                                payload.size());
+            parts.insert(*p);
+            off += p->second.length;
+        }
+
+        if (start == end)
+            continue;
+        ASSERT(off == start);
+
+        ExtentChunkerCB cb = ExtentChunkerCB(this, ctx);
+        cb.open(&base, fd, &dirty, start, end);
+        if (end - start <= LARGEBLOB_MINCHUNK) {
+            // Too short for the chunker to split
+            uint8_t *b = NULL;
+            uint64_t l = 0, o = 0;
+
+            cb.load(&b, &l, &o);
+            ASSERT(l == end - start);
+            cb.match(b, l);
+        } else {
+            LBChunker c = LBChunker();
+
+            c.chunk(&cb);
+        }
+        off = end;
+    }
+
+    ASSERT(off == size);
+    totalHash = OriCrypt_HashEnd(ctx);
 }
 
 const string
@@ -324,7 +561,13 @@ LargeBlob::getBlob()
 void
 LargeBlob::fromBlob(const string &blob)
 {
-    strstream ss(blob);
+    fromBlob((const uint8_t *)blob.data(), blob.size());
+}
+
+void
+LargeBlob::fromBlob(const uint8_t *blob, size_t len)
+{
+    memstream ss(blob, len);
     ss.readHash(totalHash);
 
     size_t num = ss.readUInt64();
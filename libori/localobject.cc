@@ -43,6 +43,7 @@
 #include "tuneables.h"
 
 #include <oriutil/debug.h>
+#include <oriutil/zipcodec.h>
 #include <ori/object.h>
 #include <ori/localobject.h>
 
@@ -66,22 +67,13 @@ LocalObject::~LocalObject()
 {
 }
 
-// XXX: Eliminate duplicate compression code!
 bytestream *LocalObject::getPayloadStream() {
     if (packfile.get()) {
         return packfile->getPayload(entry);
     }
     if (transaction.get()) {
-        switch(info.getAlgo()) {
-            case ObjectInfo::ZIPALGO_NONE:
-                return new strstream(transaction->payloads[ix_tr]);
-            case ObjectInfo::ZIPALGO_FASTLZ:
-                return new zipstream(new strstream(transaction->payloads[ix_tr]),
-                                     DECOMPRESS, info.payload_size);
-            case ObjectInfo::ZIPALGO_LZMA:
-            case ObjectInfo::ZIPALGO_UNKNOWN:
-                NOT_IMPLEMENTED(false);
-        }
+        return ZipCodec_Decompress(
+                new strstream(transaction->payloads[ix_tr]), info);
     }
     return NULL;
 }
@@ -38,6 +38,8 @@
 #include <boost/uuid/uuid_generators.hpp>
 #include <boost/bind.hpp>
 
+#include "tuneables.h"
+
 #include <ori/version.h>
 #include <oriutil/debug.h>
 #include <oriutil/runtimeexception.h>
@@ -51,6 +53,9 @@
 #include <oriutil/zeroconf.h>
 #include <ori/largeblob.h>
 #include <ori/localrepo.h>
+#include <ori/historywalk.h>
+#include <ori/verifier.h>
+#include <ori/refcountbuilder.h>
 #include <ori/sshrepo.h>
 #include <ori/remoterepo.h>
 
@@ -224,6 +229,33 @@ LocalRepo_PeerHelper(LocalRepo *l, const string &path)
     return 0;
 }
 
+/*
+ * Marks an older repository with the current version before anything is
+ * written in a newer format, so binaries that can't read it refuse it.
+ * Called on the write paths rather than on open, so that reading does not
+ * lock older binaries out and works on read-only media.
+ */
+void
+LocalRepo::upgradeVersion()
+{
+    if (version == ORI_FS_VERSION_STR)
+        return;
+
+    string versionPath = rootPath + ORI_PATH_VERSION;
+    string tmpPath = versionPath + ".tmp";
+
+    LOG("Upgrading repository from %s to %s", version.c_str(),
+        ORI_FS_VERSION_STR);
+
+    if (!OriFile_WriteFile(ORI_FS_VERSION_STR, tmpPath) ||
+        OriFile_Rename(tmpPath, versionPath) < 0) {
+        WARNING("LocalRepo: Couldn't upgrade the file system version");
+        throw SystemException();
+    }
+    version = ORI_FS_VERSION_STR;
+    metadata.setCheckpoints(true);
+}
+
 void
 LocalRepo::open(const string &root)
 {
@@ -243,8 +275,16 @@ LocalRepo::open(const string &root)
         version = OriFile_ReadFile(rootPath + ORI_PATH_VERSION);
 
         if (version != ORI_FS_VERSION_STR) {
-            WARNING("LocalRepo::open: Unsupported file system version!");
-            throw RuntimeException(ORIEC_UNSUPPORTEDVERSION, "Unsuppported file system version!");
+            int major, minor;
+
+            if (sscanf(version.c_str(), "ORI%d.%d", &major, &minor) != 2 ||
+                major != ORI_FS_MAJOR_VERSION ||
+                minor > ORI_FS_MINOR_VERSION) {
+                WARNING("LocalRepo::open: Unsupported file system version!");
+                throw RuntimeException(ORIEC_UNSUPPORTEDVERSION, "Unsuppported file system version!");
+            }
+            // Upgraded by the first write, see upgradeVersion
+            DLOG("Opening a %s repository", version.c_str());
         }
     }
     catch (std::ios_base::failure &e)
@@ -253,6 +293,18 @@ LocalRepo::open(const string &root)
         throw SystemException();
     }
 
+    // Group commit for the append only files
+    DurabilityMode mode = DURABILITY_BATCHED;
+    string durabilityPath = rootPath + ORI_PATH_DURABILITY;
+    if (OriFile_Exists(durabilityPath) &&
+        !Durability::parseMode(OriFile_ReadFile(durabilityPath), &mode)) {
+        WARNING("Unknown durability mode in %s", durabilityPath.c_str());
+    }
+    durability.setMode(mode);
+    index.setDurability(&durability);
+    metadata.setDurability(&durability);
+    metadata.setCheckpoints(version == ORI_FS_VERSION_STR);
+
     // XXX: Check and rebuild index on error
     index.open(rootPath + ORI_PATH_INDEX); // throws SystemException or RuntimeException
 
@@ -274,6 +326,15 @@ LocalRepo::open(const string &root)
         throw e;
     }
     packfiles.reset(new PackfileManager(getRootPath() + ORI_PATH_OBJS));
+    packfiles->setDurability(&durability);
+
+    // Choose codecs for new objects
+    zipPolicy.setDefault(ZIPALGO_DEFAULT);
+    string policyPath = rootPath + ORI_PATH_ZIPPOLICY;
+    if (OriFile_Exists(policyPath)) {
+        zipPolicy.fromString(OriFile_ReadFile(policyPath));
+    }
+    zipAdvisor.open(rootPath + ORI_PATH_ZIPADVICE);
 
     // Scan for peers
     string peer_path = rootPath + ORI_PATH_REMOTES;
@@ -288,6 +349,7 @@ LocalRepo::open(const string &root)
 		    (*it).second.getUrl().c_str());
                 cacheRemoteObjects = true;
 		remoteRepo = resumeRepo.get();
+                prefetcher.reset(new Prefetcher(remoteRepo, this, true));
 		break;
 	    }
 	}
@@ -307,6 +369,7 @@ LocalRepo::close()
     currTransaction.reset();
     index.close();
     snapshots.close();
+    metadata.close();
     packfiles.reset();
     opened = false;
 }
@@ -358,6 +421,7 @@ LocalRepo::setRemote(Repo *r)
     ASSERT(remoteRepo == NULL);
     remoteRepo = r;
     cacheRemoteObjects = true;
+    prefetcher.reset(new Prefetcher(r, this, cacheRemoteObjects));
 }
 
 void
@@ -366,6 +430,7 @@ LocalRepo::clearRemote()
     Monitor lock(remoteLock);
 
     remoteRepo = NULL;
+    prefetcher.reset();
 }
 
 void
@@ -374,6 +439,8 @@ LocalRepo::setRemoteFlags(bool cacheLocally)
     Monitor lock(remoteLock);
 
     cacheRemoteObjects = cacheLocally;
+    if (prefetcher)
+        prefetcher->setStoreLocally(cacheLocally);
 }
 
 bool
@@ -384,36 +451,104 @@ LocalRepo::hasRemote()
     return (remoteRepo != NULL);
 }
 
+Prefetcher::sp
+LocalRepo::getPrefetcher()
+{
+    Monitor lock(remoteLock);
+
+    return prefetcher;
+}
+
+void
+LocalRepo::readahead(const ObjectHash &lbHash, const LargeBlob &lb,
+                     uint64_t off, size_t len)
+{
+    Prefetcher::sp p = getPrefetcher();
+
+    if (p)
+        p->readahead(lbHash, lb, off, len);
+}
+
+void
+LocalRepo::prefetchTree(const Tree &t)
+{
+    Prefetcher::sp p = getPrefetcher();
+
+    if (p)
+        p->prefetchTree(t);
+}
+
+uint64_t
+LocalRepo::hydrate(const ObjectHashVec &objs, uint64_t rate,
+                   RWLock *storeLock)
+{
+    Prefetcher::sp p = getPrefetcher();
+
+    if (!p || objs.empty())
+        return 0;
+
+    return p->pull(objs, rate, storeLock);
+}
+
+bool
+LocalRepo::getPrefetchStats(PrefetchStats *stats)
+{
+    Prefetcher::sp p = getPrefetcher();
+
+    if (!p)
+        return false;
+
+    *stats = p->getStats();
+    return true;
+}
+
+void
+LocalRepo::setPackfileLimits(size_t maxHandles, size_t maxMappedBytes)
+{
+    packfiles->setLimits(maxHandles, maxMappedBytes);
+}
+
+PackfilePoolStats
+LocalRepo::getPackfileStats()
+{
+    return packfiles->getStats();
+}
+
+void
+LocalRepo::setDurability(DurabilityMode mode)
+{
+    durability.setMode(mode);
+}
+
+DurabilityStats
+LocalRepo::getDurabilityStats()
+{
+    return durability.getStats();
+}
+
 /*
  * Object Operations
  */
 
 Object::sp LocalRepo::getObject(const ObjectHash &objId)
 {
+    Prefetcher::sp p = getPrefetcher();
+
+    if (p) {
+        Object::sp co = p->getCached(objId);
+        if (co)
+            return co;
+    }
+
     LocalObject::sp o(getLocalObject(objId));
 
     if (!o) {
         LOG("Object not found: %s", objId.hex().c_str());
-        Monitor lock(remoteLock);
 
-        if (remoteRepo != NULL) {
+        if (p) {
+            // Stored locally by the prefetcher if cacheRemoteObjects is set
             LOG("Instaclone getting object %s", objId.hex().c_str());
-            Object::sp ro = remoteRepo->getObject(objId);
-
-            if (!ro) {
-                LOG("Object not available on remote machine!");
-                return Object::sp();
-            }
-
-            if (cacheRemoteObjects) {
-                auto_ptr<bytestream> bs(ro->getPayloadStream());
-                string buf = bs->readAll();
-                addBlob(ro->getInfo().type, buf);
-
-                // XXX: Add reference counts
-            }
-
-            return ro;
+            return p->getObject(objId);
         } else {
             return Object::sp();
         }
@@ -443,7 +578,7 @@ LocalObject::sp LocalRepo::getLocalObject(const ObjectHash &objId)
     if (!index.hasObject(objId))
 	return LocalObject::sp();
 
-    const IndexEntry &ie = index.getEntry(objId);
+    IndexEntry ie = index.getEntry(objId);
     Packfile::sp packfile = packfiles->getPackfile(ie.packfile);
     return LocalObject::sp(new LocalObject(packfile, ie));
 }
@@ -470,23 +605,38 @@ LocalRepo::createObjDirs(const ObjectHash &objId)
 string
 LocalRepo::objIdToPath(const ObjectHash &objId)
 {
-    string rval = rootPath;
-    string hexId = objId.hex();
+    char hexId[ObjectHash::STR_SIZE + 1];
+    string rval;
 
     ASSERT(!objId.isEmpty());
-    ASSERT(hexId.length() == 64);
-    ASSERT(rval != "");
+    ASSERT(rootPath != "");
 
+    objId.hex(hexId);
+    rval.reserve(rootPath.size() + strlen(ORI_PATH_OBJS) +
+                 ObjectHash::STR_SIZE + 6);
+    rval += rootPath;
     rval += ORI_PATH_OBJS;
-    rval += hexId.substr(0,2);
+    rval.append(hexId, 2);
     rval += "/";
-    rval += hexId.substr(2,2);
+    rval.append(hexId + 2, 2);
     rval += "/";
-    rval += hexId;
+    rval.append(hexId, ObjectHash::STR_SIZE);
 
     return rval;
 }
 
+void
+LocalRepo::beginFile(const string &name)
+{
+    zipAdvisor.beginFile(name);
+}
+
+void
+LocalRepo::endFile()
+{
+    zipAdvisor.endFile();
+}
+
 int
 LocalRepo::addObject(ObjectType type, const ObjectHash &hash,
         const std::string &payload)
@@ -498,27 +648,15 @@ LocalRepo::addObject(ObjectType type, const ObjectHash &hash,
 
     if (isObjectStored(hash)) return 0;
 
-    if (!currPackfile.get()) {
-        currPackfile = packfiles->newPackfile();
-        currTransaction = currPackfile->begin(&index);
-    }
-
-    if (!currTransaction.get()) {
-        currTransaction = currPackfile->begin(&index);
-    }
-
-    if (currTransaction->full()) {
-        currTransaction->commit();
-        currTransaction.reset();
-        currPackfile = packfiles->newPackfile();
-        currTransaction = currPackfile->begin(&index);
-    }
+    beginTransaction();
 
     ObjectInfo info(hash);
     info.type = type;
     info.payload_size = payload.size();
 
-    currTransaction->addPayload(info, payload);
+    currTransaction->addPayload(info, payload,
+                                zipPolicy.select(type, payload.size()),
+                                &zipAdvisor);
 
 
     /*string objPath = objIdToPath(hash);
@@ -538,6 +676,53 @@ LocalRepo::addObject(ObjectType type, const ObjectHash &hash,
     return 0;
 }
 
+/*
+ * Add an object whose payload has already been compressed as described by
+ * info, as PfTransaction::compress leaves it.
+ */
+int
+LocalRepo::addStoredObject(const ObjectInfo &info, const std::string &stored)
+{
+    ASSERT(opened);
+    ASSERT(!info.hash.isEmpty());
+
+    purged.erase(info.hash);
+
+    if (isObjectStored(info.hash)) return 0;
+
+    beginTransaction();
+    currTransaction->addStored(info, stored);
+
+    return 0;
+}
+
+/*
+ * Makes sure there is a transaction with room for another object, starting
+ * a new packfile once the current one is full.
+ */
+void
+LocalRepo::beginTransaction()
+{
+    upgradeVersion();
+
+    if (!currPackfile.get()) {
+        currPackfile = packfiles->newPackfile();
+        currTransaction = currPackfile->begin(&index);
+    }
+
+    if (!currTransaction.get()) {
+        currTransaction = currPackfile->begin(&index);
+    }
+
+    if (currTransaction->full()) {
+        currTransaction->commit();
+        currTransaction.reset();
+        endGroup();
+        currPackfile = packfiles->newPackfile();
+        currTransaction = currPackfile->begin(&index);
+    }
+}
+
 /*
  * Add a tree to the repository.
  */
@@ -616,6 +801,54 @@ LocalRepo::getPayload(const ObjectHash &objId)
     return bs->readAll();
 }
 
+/*
+ * Read part of an object's payload.  Objects in sealed packfiles are read
+ * in place, which for block compressed objects only decompresses the blocks
+ * that overlap the request.  Returns bytes read or a negative errno.
+ */
+ssize_t
+LocalRepo::readPayload(const ObjectHash &objId, uint8_t *buf, size_t n,
+                       off_t off)
+{
+    ASSERT(opened);
+
+    Prefetcher::sp p = getPrefetcher();
+    if (p && p->getCached(objId))
+        return Repo::readPayload(objId, buf, n, off);
+
+    if ((!currTransaction.get() || !currTransaction->has(objId)) &&
+        index.hasObject(objId)) {
+        IndexEntry ie = index.getEntry(objId);
+        Packfile::sp packfile = packfiles->getPackfile(ie.packfile);
+        return packfile->readPayload(ie, buf, n, off);
+    }
+
+    return Repo::readPayload(objId, buf, n, off);
+}
+
+/*
+ * Point view at an object's payload in a packfile mapping, which avoids
+ * copying it.  Only uncompressed payloads in the mapped part of a packfile
+ * can be viewed.  The view stays valid for as long as it is held.
+ */
+bool
+LocalRepo::getPayloadView(const ObjectHash &objId, PayloadView *view)
+{
+    ASSERT(opened);
+
+    if (currTransaction.get() && currTransaction->has(objId))
+        return false;
+    if (!index.hasObject(objId))
+        return false;
+
+    IndexEntry ie = index.getEntry(objId);
+    if (ie.info.payload_size == 0)
+        return false;
+
+    Packfile::sp packfile = packfiles->getPackfile(ie.packfile);
+    return packfile->getPayloadView(ie, view);
+}
+
 /*
  * Get an object length.
  */
@@ -653,7 +886,10 @@ string
 LocalRepo::verifyObject(const ObjectHash &objId)
 {
     LocalObject::sp o;
-    ObjectType type;
+    ObjectInfo info;
+    vector<VerifyRef> refs;
+    string payload;
+    string error;
 
     if (!hasObject(objId))
 	return "Object not found!";
@@ -663,71 +899,27 @@ LocalRepo::verifyObject(const ObjectHash &objId)
     if (!o)
 	return "Cannot open object!";
 
-    type = o->getInfo().type;
-    if (type == ObjectInfo::Null)
-        return "Object with Null type!";
-
-    if (type != ObjectInfo::Purged) {
-        ObjectHash computedHash = OriCrypt_HashString(o->getPayload());
-        if (computedHash != objId) {
-            stringstream ss;
-            ss << "Object hash mismatch! (computed hash "
-               << computedHash.hex()
-               << ")";
-            return ss.str();
-        }
-    }
+    info = o->getInfo();
+    if (info.type != ObjectInfo::Null && info.type != ObjectInfo::Purged)
+        payload = o->getPayload();
 
-    switch(type) {
-	case ObjectInfo::Commit:
-	{
-	    // XXX: Verify tree and parents exist
-	    break;
-	}
-	case ObjectInfo::Tree:
-	{
-            Tree t;
-            t.fromBlob(o->getPayload());
-            for (map<string, TreeEntry>::iterator it = t.tree.begin();
-                    it != t.tree.end();
-                    it++) {
-                if (!(*it).second.hasBasicAttrs())
-                    return string("TreeEntry ") + (*it).first + " missing basic attrs";
-            }
+    error = Verifier::checkObject(info, payload, &refs);
+    if (error != "")
+        return error;
 
-	    // XXX: Verify subtrees and blobs exist
-	    break;
-	}
-	case ObjectInfo::Blob:
-	{
-	    break;
-	}
-        case ObjectInfo::LargeBlob:
-        {
-            LargeBlob lb(this);
-            lb.fromBlob(o->getPayload());
-            for (map<uint64_t, LBlobEntry>::iterator it = lb.parts.begin();
-                 it != lb.parts.end(); it++)
-            {
-                if (it->second.hash.isEmpty()) {
-                    return "LargeBlob contains an empty hash!";
-                }
-            }
-            // XXX: Verify fragments
-            // XXX: Verify file hash matches largeObject's file hash
-            break;
-        }
-	case ObjectInfo::Purged:
-	    break;
-	default:
-	    return "Object with unknown type!";
-    }
+    if (!index.hasObject(objId) || index.getInfo(objId).type != info.type)
+        return "Index entry does not match object";
 
-    if (!o->getInfo().hasAllFields()) {
-        return "Object info missing some fileds!";
+    for (size_t i = 0; i < refs.size(); i++) {
+        if (!hasObject(refs[i].hash))
+            return "Missing referenced object " + refs[i].hash.hex();
+        if (getObjectType(refs[i].hash) != refs[i].type)
+            return "Referenced object has the wrong type " +
+                   refs[i].hash.hex();
     }
 
-    // XXX: Check against index
+    if (info.type == ObjectInfo::LargeBlob)
+        return Verifier::checkLargeBlob(this, payload);
 
     return "";
 }
@@ -764,6 +956,19 @@ LocalRepo::listObjects()
     return index.getList();
 }
 
+/*
+ * Ends a group commit, the packfiles written in it are synced before the
+ * index entries that refer to them.
+ */
+void
+LocalRepo::endGroup()
+{
+    packfiles->sync();
+    index.sync();
+    metadata.sync();
+    durability.endGroup();
+}
+
 /*
  * This gu
  */
@@ -775,9 +980,9 @@ LocalRepo::sync()
         full = currTransaction->full();
         currTransaction->commit();
         currTransaction.reset();
-        index.sync();
-        metadata.sync();
+        zipAdvisor.save();
     }
+    endGroup();
     if (full) {
         currPackfile = packfiles->newPackfile();
         currTransaction = currPackfile->begin(&index);
@@ -881,6 +1086,118 @@ LocalRepo::listCommits()
     return rval;
 }
 
+struct CommitLoc {
+    packid_t packfile;
+    offset_t offset;
+    size_t ix;
+    bool operator<(const CommitLoc &l) const {
+        if (packfile != l.packfile)
+            return packfile < l.packfile;
+        return offset < l.offset;
+    }
+};
+
+/*
+ * Load commits in packfile order so that history walks read each packfile
+ * sequentially.
+ */
+/*
+ * Point view at a stored payload in place when it is uncompressed, and
+ * otherwise decompress it straight into buf.
+ */
+bool
+LocalRepo::getStoredPayload(const ObjectHash &objId, PayloadView *view,
+                            vector<uint8_t> *buf)
+{
+    if (getPayloadView(objId, view))
+        return true;
+    if (!index.hasObject(objId))
+        return false;
+
+    size_t len = index.getInfo(objId).payload_size;
+    size_t off = 0;
+
+    if (len == 0)
+        return false;
+    buf->resize(len);
+    while (off < len) {
+        ssize_t n = readPayload(objId, &(*buf)[off], len - off, off);
+        if (n <= 0)
+            return false;
+        off += n;
+    }
+
+    view->data = &(*buf)[0];
+    view->len = len;
+    view->map.reset();
+    return true;
+}
+
+/*
+ * Trees and large blobs are decoded from the packfile mapping when they are
+ * stored uncompressed.
+ */
+Tree
+LocalRepo::getTree(const ObjectHash &treeId)
+{
+    vector<uint8_t> buf;
+    PayloadView view;
+
+    if (!getStoredPayload(treeId, &view, &buf))
+        return Repo::getTree(treeId);
+
+    ASSERT(getObjectType(treeId) == ObjectInfo::Tree);
+
+    Tree t;
+    t.fromBlob(view.data, view.len);
+    return t;
+}
+
+LargeBlob
+LocalRepo::getLargeBlob(const ObjectHash &objId)
+{
+    vector<uint8_t> buf;
+    PayloadView view;
+
+    if (!getStoredPayload(objId, &view, &buf))
+        return Repo::getLargeBlob(objId);
+
+    ASSERT(getObjectType(objId) == ObjectInfo::LargeBlob);
+
+    LargeBlob lb(this);
+    lb.fromBlob(view.data, view.len);
+    return lb;
+}
+
+vector<Commit>
+LocalRepo::getCommits(const ObjectHashVec &commitIds)
+{
+    vector<Commit> rval(commitIds.size());
+    vector<CommitLoc> locs;
+
+    for (size_t i = 0; i < commitIds.size(); i++) {
+        if (!index.hasObject(commitIds[i])) {
+            // Possibly from the remote repository
+            rval[i] = getCommit(commitIds[i]);
+            continue;
+        }
+
+        IndexEntry ie = index.getEntry(commitIds[i]);
+        CommitLoc l;
+        l.packfile = ie.packfile;
+        l.offset = ie.offset;
+        l.ix = i;
+        locs.push_back(l);
+    }
+
+    sort(locs.begin(), locs.end());
+    for (size_t i = 0; i < locs.size(); i++) {
+        rval[locs[i].ix] = getCommit(commitIds[locs[i].ix]);
+    }
+
+    return rval;
+}
+
 map<string, ObjectHash>
 LocalRepo::listSnapshots()
 {
@@ -903,6 +1220,69 @@ LocalRepo::lookupSnapshot(const string &name)
  * High Level Operations
  */
 
+/*
+ * Populate an empty repository on this machine, as created by LocalRepo_Init,
+ * without reading any objects.  Packfiles are never appended to once the
+ * repository that wrote them moves on to a new one, and purging replaces a
+ * packfile rather than modifying it, so every packfile except the one this
+ * instance is filling can be shared by a hard link.  The rest, and the index,
+ * snapshot and metadata files, are copied.  Must be called before the new
+ * repository is opened.
+ */
+int
+LocalRepo::cloneTo(const string &oriPath)
+{
+    LocalRepoLock::sp _lock(lock());
+    string objPath = oriPath + ORI_PATH_OBJS;
+    vector<packid_t> pfIds = packfiles->getPackfileList();
+    size_t linked = 0, copied = 0;
+    int status;
+
+    for (size_t i = 0; i < pfIds.size(); i++) {
+        string srcPath = packfiles->getPackfilePath(pfIds[i]);
+        string dstPath = objPath + OriFile_Basename(srcPath);
+
+        if ((!currPackfile.get() ||
+             currPackfile->getPackfileID() != pfIds[i]) &&
+            link(srcPath.c_str(), dstPath.c_str()) == 0) {
+            linked++;
+            continue;
+        }
+
+        status = OriFile_Clone(srcPath, dstPath);
+        if (status < 0) {
+            WARNING("Failed to copy %s: %s", srcPath.c_str(),
+                    strerror(-status));
+            return status;
+        }
+        copied++;
+    }
+
+    // The new repository recomputes its free list from the packfiles
+    OriFile_Delete(objPath + PFMGR_FREELIST);
+
+    // Leave the metadata as a checkpoint and a log
+    metadata.waitCompaction();
+
+    const char *logs[] = { ORI_PATH_INDEX, ORI_PATH_SNAPSHOTS,
+                           ORI_PATH_METADATA,
+                           ORI_PATH_METADATA METADATA_BASE_SUFFIX };
+    for (size_t i = 0; i < sizeof(logs) / sizeof(logs[0]); i++) {
+        if (!OriFile_Exists(rootPath + logs[i]))
+            continue;
+
+        status = OriFile_Clone(rootPath + logs[i], oriPath + logs[i]);
+        if (status < 0) {
+            WARNING("Failed to copy %s: %s", logs[i], strerror(-status));
+            return status;
+        }
+    }
+
+    LOG("cloneTo: %lu packfiles linked, %lu copied", linked, copied);
+
+    return 0;
+}
+
 /*
  * Pull changes from the source repository.
  */
@@ -995,7 +1375,7 @@ struct MultiPullOp {
 
     // Pull queue
     deque<ObjectHash> toPull;
-    tr1::unordered_set<ObjectHash> toPullSet;
+    ObjectHashSet toPullSet;
 
     // Remotes
     std::vector<RemoteRepo::sp> remotes;
@@ -1168,31 +1548,43 @@ LocalRepo::multiPull(RemoteRepo::sp defaultRemote)
     printf("Speed-up: %lu of %lu objects\n", closerObjs, totalObjs);
 }
 
+static bool
+packOrderCompare(const IndexEntry &e1, const IndexEntry &e2)
+{
+    if (e1.packfile != e2.packfile)
+        return e1.packfile < e2.packfile;
+    return e1.offset < e2.offset;
+}
+
 void
 LocalRepo::transmit(bytewstream *bs, const ObjectHashVec &objs)
 {
-    std::tr1::unordered_set<ObjectHash> includedHashes;
+    ObjectHashSet includedHashes;
+    std::vector<IndexEntry> entries;
 
-    typedef std::vector<IndexEntry> IndexEntryVec;
-    std::map<Packfile::sp, IndexEntryVec> packs;
     for (size_t i = 0; i < objs.size(); i++) {
         if (includedHashes.find(objs[i]) == includedHashes.end()) {
-            const IndexEntry &ie = index.getEntry(objs[i]);
-            Packfile::sp pf = packfiles->getPackfile(ie.packfile);
-            packs[pf].push_back(ie);
+            entries.push_back(index.getEntry(objs[i]));
             includedHashes.insert(objs[i]);
         } else {
             DLOG("duplicate object in LocalRepo::transmit");
         }
     }
 
-    for (std::map<Packfile::sp, IndexEntryVec>::iterator it = packs.begin();
-            it != packs.end();
-            it++) {
-        const Packfile::sp &pf = (*it).first;
-        //fprintf(stderr, "Transmitting %lu objects from %p\n",
-        //        (*it).second.size(), pf.get());
-        pf->transmit(bs, (*it).second);
+    // Read each packfile once in file order with one handle
+    std::sort(entries.begin(), entries.end(), packOrderCompare);
+    size_t start = 0;
+    while (start < entries.size()) {
+        size_t end = start + 1;
+        while (end < entries.size() &&
+               entries[end].packfile == entries[start].packfile)
+            end++;
+
+        Packfile::sp pf = packfiles->getPackfile(entries[start].packfile);
+        std::vector<IndexEntry> run(entries.begin() + start,
+                                    entries.begin() + end);
+        pf->transmit(bs, run);
+        start = end;
     }
 
     /* Write (numobjs_t)0 */
@@ -1203,6 +1595,8 @@ void
 LocalRepo::receive(bytestream *bs)
 {
     bool cont = true;
+
+    upgradeVersion();
     while (cont) {
         if (!currPackfile.get() || currPackfile->full()) {
             currPackfile = packfiles->newPackfile();
@@ -1428,6 +1822,7 @@ LocalRepo::gc()
     index.rewrite();
 
     // Compact the metadata log
+    upgradeVersion();
     metadata.rewrite();
 
     // Do purges
@@ -1435,7 +1830,7 @@ LocalRepo::gc()
     for (std::set<ObjectHash>::iterator it = purged.begin();
             it != purged.end();
             it++) {
-        const IndexEntry &ie = index.getEntry((*it));
+        IndexEntry ie = index.getEntry((*it));
         purgePacks.insert(ie.packfile);
     }
 
@@ -1468,11 +1863,9 @@ LocalRepo::hasObject(const ObjectHash &objId)
     if (isObjectStored(objId))
         return true;
 
-    Monitor lock(remoteLock);
-
-    if (remoteRepo != NULL) {
-        return remoteRepo->hasObject(objId);
-    }
+    Prefetcher::sp p = getPrefetcher();
+    if (p)
+        return p->hasObject(objId);
 
     return false;
 }
@@ -1486,12 +1879,10 @@ LocalRepo::getObjectInfo(const ObjectHash &objId)
     if (index.hasObject(objId)) {
         return index.getInfo(objId);
     }
-    
-    Monitor lock(remoteLock);
 
-    if (remoteRepo != NULL) {
-        return remoteRepo->getObjectInfo(objId);
-    }
+    Prefetcher::sp p = getPrefetcher();
+    if (p)
+        return p->getObjectInfo(objId);
 
     return ObjectInfo();
 }
@@ -1513,61 +1904,18 @@ LocalRepo::getMetadata()
 RefcountMap
 LocalRepo::recomputeRefCounts()
 {
-    set<ObjectInfo> obj = listObjects();
+    RefcountBuilder builder(this);
+    RefcountBuilder::Chunk chunk;
     RefcountMap rval;
 
-    for (set<ObjectInfo>::iterator it = obj.begin();
-            it != obj.end();
-            it++) {
-        const ObjectHash &hash = (*it).hash;
-        switch ((*it).type) {
-            case ObjectInfo::Commit:
-            {
-                Commit c = getCommit(hash);
-                
-                rval[c.getTree()] += 1;
-                if (c.getParents().first != EMPTY_COMMIT) {
-                    rval[c.getParents().first] += 1;
-                }
-                if (!c.getParents().second.isEmpty()) {
-                    rval[c.getParents().second] += 1;
-                }
-                
-                break;
-            }
-            case ObjectInfo::Tree:
-            {
-                Tree t = getTree(hash);
-                map<string, TreeEntry>::iterator tt;
-
-                for  (tt = t.tree.begin(); tt != t.tree.end(); tt++) {
-                    ObjectHash h = (*tt).second.hash;
-                    rval[h] += 1;
-                }
-                break;
-            }
-            case ObjectInfo::LargeBlob:
-            {
-                LargeBlob lb(this);
-                Object::sp o(getObject(hash));
-                lb.fromBlob(o->getPayload());
-
-                for (map<uint64_t, LBlobEntry>::iterator pit = lb.parts.begin();
-                        pit != lb.parts.end();
-                        pit++) {
-                    ObjectHash h = (*pit).second.hash;
-                    rval[h] += 1;
-                }
-                break;
-            }
-            case ObjectInfo::Blob:
-	    case ObjectInfo::Purged:
-                break;
-            default:
-                printf("Unsupported object type!\n");
-                PANIC();
-                break;
-        }
+    builder.setThreads(sysconf(_SC_NPROCESSORS_ONLN));
+    if (!builder.run()) {
+        printf("Cannot read all objects!\n");
+        PANIC();
+    }
+
+    while (builder.next(&chunk)) {
+        rval.insert(chunk.begin(), chunk.end());
     }
 
     return rval;
@@ -1576,10 +1924,38 @@ LocalRepo::recomputeRefCounts()
 bool
 LocalRepo::rewriteRefCounts(const RefcountMap &refs)
 {
+    upgradeVersion();
     metadata.rewrite(&refs);
     return true;
 }
 
+/*
+ * Recompute and rewrite all reference counts without holding them all in
+ * memory at once.  The counts are streamed to the new metadata log in hash
+ * order.
+ */
+bool
+LocalRepo::rebuildRefCounts()
+{
+    RefcountBuilder builder(this);
+    RefcountBuilder::Chunk chunk;
+
+    builder.setThreads(sysconf(_SC_NPROCESSORS_ONLN));
+    if (!builder.run())
+        return false;
+    DLOG("Read %lu objects, %lu runs written", builder.getObjectsRead(),
+         builder.getRuns());
+
+    upgradeVersion();
+    metadata.beginRewrite();
+    while (builder.next(&chunk)) {
+        metadata.rewriteCounts(chunk);
+    }
+    metadata.endRewrite();
+
+    return true;
+}
+
 /*
  * Purging Operations
  */
@@ -1595,7 +1971,7 @@ LocalRepo::purgeObject(const ObjectHash &objId)
     if (currTransaction.get())
         currTransaction.reset();
 
-    /*const IndexEntry &ie = index.getEntry(objId);
+    /*IndexEntry ie = index.getEntry(objId);
     Packfile::sp packfile = packfiles->getPackfile(ie.packfile);
     packfile->purge(objId);*/
 
@@ -1688,10 +2064,12 @@ LocalRepo::purgeCommit(const ObjectHash &commitId)
 void
 LocalRepo::purgeFuseCommits()
 {
-    vector<Commit> commits = listCommits();
-    for (size_t i = 0; i < commits.size(); i++) {
-        const Commit &c = commits[i];
-        ObjectHash hash = c.hash();
+    HistoryWalk walk(this);
+    ObjectHash hash;
+    Commit c;
+
+    walk.push(listHeads());
+    while (walk.next(&hash, &c)) {
         if (metadata.getMeta(hash, "status") == "fuse") {
             bool status UNUSED = purgeCommit(hash);
             ASSERT(status);
@@ -1742,41 +2120,21 @@ LocalRepo::getSubtreeObjects(const ObjectHash &treeId)
 }
 
 /*
- * Walk the repository history.
- * XXX: Make this a template function
+ * Walk the repository history from the head, visiting each commit once.
  */
 set<ObjectHash>
 LocalRepo::walkHistory(HistoryCB &cb)
 {
     set<ObjectHash> rval;
-    set<ObjectHash> curLevel;
-    set<ObjectHash> nextLevel;
-    set<ObjectHash>::iterator it;
-
-    if (getHead() == EMPTY_COMMIT)
-        return rval;
-
-    nextLevel.insert(getHead());
-
-    while (!nextLevel.empty()) {
-	curLevel = nextLevel;
-	nextLevel.clear();
-
-	for (it = curLevel.begin(); it != curLevel.end(); it++) {
-	    Commit c = getCommit(*it);
-	    pair<ObjectHash, ObjectHash> p = c.getParents();
-            ObjectHash val;
-
-	    val = cb.cb(*it, &c);
-            if (!val.isEmpty())
-                rval.insert(val);
+    HistoryWalk walk(this);
+    ObjectHash hash;
+    Commit c;
 
-            if (p.first != EMPTY_COMMIT) {
-	        nextLevel.insert(p.first);
-	        if (!p.second.isEmpty())
-		    nextLevel.insert(p.second);
-            }
-	}
+    walk.push(getHead());
+    while (walk.next(&hash, &c)) {
+        ObjectHash val = cb.cb(hash, &c);
+        if (!val.isEmpty())
+            rval.insert(val);
     }
 
     return rval;
@@ -2062,6 +2420,32 @@ LocalRepo::listBranches()
     return rval;
 }
 
+/*
+ * Return the head commit of every branch.
+ */
+vector<ObjectHash>
+LocalRepo::listHeads()
+{
+    set<string> branches = listBranches();
+    vector<ObjectHash> rval;
+
+    for (set<string>::iterator it = branches.begin();
+         it != branches.end();
+         it++) {
+        string headPath = rootPath + ORI_PATH_HEADS + *it;
+        try {
+            rval.push_back(ObjectHash::fromHex(OriFile_ReadFile(headPath)));
+        } catch (std::ios_base::failure &e) {
+            continue;
+        }
+    }
+
+    // A detached head is not on any branch
+    rval.push_back(getHead());
+
+    return rval;
+}
+
 string
 LocalRepo::getBranch()
 {
@@ -17,20 +17,31 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#include <string.h>
+
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <arpa/inet.h>
 
 #include <string>
+#include <vector>
+#include <map>
 #include <iostream>
+#include <algorithm>
 #include <boost/tr1/memory.hpp>
 #include <boost/tr1/unordered_map.hpp>
 
+#include "tuneables.h"
+
 #include <oriutil/debug.h>
 #include <oriutil/orifile.h>
 #include <oriutil/stream.h>
+#include <oriutil/mutex.h>
+#include <oriutil/thread.h>
 #include <oriutil/systemexception.h>
 #include <ori/metadatalog.h>
 
@@ -56,7 +67,7 @@ void MdTransaction::addRef(const ObjectHash &hash)
 void MdTransaction::decRef(const ObjectHash &hash)
 {
     counts[hash] -= 1;
-    ASSERT(log->refcounts[hash] + counts[hash] >= 0);
+    ASSERT(log->getRefCount(hash) + counts[hash] >= 0);
 }
 
 void MdTransaction::setMeta(const ObjectHash &hash, const string &key,
@@ -65,64 +76,540 @@ void MdTransaction::setMeta(const ObjectHash &hash, const string &key,
     metadata[hash][key] = value;
 }
 
+/*
+ * MetadataBase
+ *
+ * A checkpoint is a header followed by the reference counts and the index of
+ * the metadata, both sorted by hash, and the serialized metadata:
+ *
+ *   magic[8] flags numCounts numMeta reserved        (UInt32s)
+ *   numCounts x (hash, Int32 count)
+ *   numMeta x (hash, UInt32 offset into the metadata)
+ *   numMeta x (UInt32 numKeys, numKeys x (PStr key, PStr value))
+ *
+ * The magic is written last, so a file with a valid header is complete.
+ */
+
+#define METADATA_MAGIC "ORIMETA1"
+#define METADATA_HDRSIZE 24
+#define METADATA_RECSIZE (ObjectHash::SIZE + 4)
+#define METADATA_OLD_SUFFIX ".old"
+#define METADATA_TMP_SUFFIX ".tmp"
+
+// The checkpoint includes every record of the log, which must be emptied
+// before the checkpoint replaces the previous one
+#define METADATA_REPLACES_LOG 1
+
+static uint32_t
+MetadataBase_Read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return ntohl(v);
+}
+
+class MetadataBase
+{
+public:
+    MetadataBase()
+        : fd(-1), map(NULL), len(0), flags(0), numCounts(0), numMeta(0),
+          counts(NULL), metaIndex(NULL), metaData(NULL)
+    {
+    }
+    ~MetadataBase()
+    {
+        if (map != NULL)
+            munmap(map, len);
+        if (fd != -1)
+            ::close(fd);
+    }
+    bool open(const string &path)
+    {
+        struct stat sb;
+
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0 || fstat(fd, &sb) < 0)
+            return false;
+        len = sb.st_size;
+        if (len < METADATA_HDRSIZE)
+            return false;
+
+        void *m = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+        if (m == MAP_FAILED)
+            return false;
+        map = (uint8_t *)m;
+
+        if (memcmp(map, METADATA_MAGIC, 8) != 0)
+            return false;
+        flags = MetadataBase_Read32(map + 8);
+        numCounts = MetadataBase_Read32(map + 12);
+        numMeta = MetadataBase_Read32(map + 16);
+        if (METADATA_HDRSIZE + ((uint64_t)numCounts + numMeta) *
+                METADATA_RECSIZE > len)
+            return false;
+
+        counts = map + METADATA_HDRSIZE;
+        metaIndex = counts + numCounts * METADATA_RECSIZE;
+        metaData = metaIndex + numMeta * METADATA_RECSIZE;
+
+        return true;
+    }
+    uint32_t getFlags() const { return flags; }
+    size_t getNumCounts() const { return numCounts; }
+    size_t getNumMeta() const { return numMeta; }
+    void countAt(size_t i, ObjectHash *hash, refcount_t *count) const
+    {
+        const uint8_t *rec = counts + i * METADATA_RECSIZE;
+
+        memcpy(hash->hash, rec, ObjectHash::SIZE);
+        *count = (refcount_t)MetadataBase_Read32(rec + ObjectHash::SIZE);
+    }
+    bool findCount(const ObjectHash &hash, refcount_t *count) const
+    {
+        ssize_t i = search(counts, numCounts, hash);
+        if (i < 0)
+            return false;
+
+        *count = (refcount_t)MetadataBase_Read32(counts +
+                i * METADATA_RECSIZE + ObjectHash::SIZE);
+        return true;
+    }
+    void metaAt(size_t i, ObjectHash *hash, ObjMetadata *md) const
+    {
+        memcpy(hash->hash, metaIndex + i * METADATA_RECSIZE,
+               ObjectHash::SIZE);
+        readMeta(i, md);
+    }
+    bool findMeta(const ObjectHash &hash, ObjMetadata *md) const
+    {
+        ssize_t i = search(metaIndex, numMeta, hash);
+        if (i < 0)
+            return false;
+
+        readMeta(i, md);
+        return true;
+    }
+private:
+    static ssize_t search(const uint8_t *recs, size_t n,
+                          const ObjectHash &hash)
+    {
+        size_t lo = 0, hi = n;
+
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            int cmp = memcmp(recs + mid * METADATA_RECSIZE, hash.hash,
+                             ObjectHash::SIZE);
+
+            if (cmp == 0)
+                return mid;
+            if (cmp < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        return -1;
+    }
+    void readMeta(size_t i, ObjMetadata *md) const
+    {
+        size_t dataLen = map + len - metaData;
+        size_t off = MetadataBase_Read32(metaIndex + i * METADATA_RECSIZE +
+                                         ObjectHash::SIZE);
+        size_t end = dataLen;
+
+        if (i + 1 < numMeta)
+            end = MetadataBase_Read32(metaIndex + (i + 1) * METADATA_RECSIZE +
+                                      ObjectHash::SIZE);
+        if (off > end || end > dataLen) {
+            WARNING("Corrupted metadata checkpoint entry!");
+            return;
+        }
+
+        strstream ss(string((const char *)metaData + off, end - off));
+        uint32_t num = ss.readUInt32();
+        for (uint32_t j = 0; j < num && !ss.error(); j++) {
+            string key, value;
+
+            ss.readPStr(key);
+            ss.readPStr(value);
+            (*md)[key] = value;
+        }
+    }
+
+    int fd;
+    uint8_t *map;
+    size_t len;
+    uint32_t flags;
+    uint32_t numCounts;
+    uint32_t numMeta;
+    const uint8_t *counts;
+    const uint8_t *metaIndex;
+    const uint8_t *metaData;
+};
+
+typedef vector<pair<ObjectHash, ObjMetadata> > MetadataList;
+
+/*
+ * Writes a checkpoint.  Counts are streamed to the file and must be added in
+ * hash order; the metadata, which is much smaller, is passed at the end.
+ * The file is removed unless finish() succeeds.
+ */
+class MetadataBaseWriter
+{
+public:
+    MetadataBaseWriter(const string &path, uint32_t flags)
+        : path(path), fd(-1), out(NULL), flags(flags), numCounts(0),
+          last(), finished(false)
+    {
+    }
+    ~MetadataBaseWriter()
+    {
+        delete out;
+        if (fd != -1)
+            ::close(fd);
+        if (!finished)
+            OriFile_Delete(path);
+    }
+    bool open()
+    {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return false;
+
+        string hdr(METADATA_HDRSIZE, '\0');
+        out = new fdbufwstream(fd);
+        out->write(hdr.data(), hdr.size());
+
+        return true;
+    }
+    void addCount(const ObjectHash &hash, refcount_t count)
+    {
+        if (count == 0)
+            return;
+        ASSERT(numCounts == 0 || last < hash);
+
+        out->writeHash(hash);
+        out->writeInt32(count);
+        last = hash;
+        numCounts++;
+    }
+    bool finish(const MetadataList &md)
+    {
+        strwstream data;
+
+        for (size_t i = 0; i < md.size(); i++) {
+            const ObjMetadata &m = md[i].second;
+
+            out->writeHash(md[i].first);
+            out->writeUInt32(data.str().size());
+
+            data.writeUInt32(m.size());
+            for (ObjMetadata::const_iterator it = m.begin();
+                 it != m.end();
+                 it++) {
+                data.writePStr(it->first);
+                data.writePStr(it->second);
+            }
+        }
+        out->write(data.str().data(), data.str().size());
+        if (out->flush() < 0 || fsync(fd) < 0)
+            return false;
+
+        strwstream hdr;
+        hdr.write(METADATA_MAGIC, 8);
+        hdr.writeUInt32(flags);
+        hdr.writeUInt32(numCounts);
+        hdr.writeUInt32(md.size());
+        hdr.writeUInt32(0);
+        if (pwrite(fd, hdr.str().data(), hdr.str().size(), 0) !=
+                (ssize_t)hdr.str().size() || fsync(fd) < 0)
+            return false;
+
+        finished = true;
+        return true;
+    }
+private:
+    string path;
+    int fd;
+    fdbufwstream *out;
+    uint32_t flags;
+    uint32_t numCounts;
+    ObjectHash last;
+    bool finished;
+};
+
+/*
+ * Add the counts of a checkpoint, overridden by newer ones, to a writer.
+ */
+static void
+MetadataLog_MergeCounts(MetadataBaseWriter *w, const MetadataBase *b,
+                        const RefcountMap &counts)
+{
+    vector<pair<ObjectHash, refcount_t> > sorted(counts.begin(),
+                                                 counts.end());
+    size_t n = b ? b->getNumCounts() : 0;
+    size_t i = 0, j = 0;
+
+    sort(sorted.begin(), sorted.end());
+    while (i < n || j < sorted.size()) {
+        ObjectHash hash;
+        refcount_t count = 0;
+
+        if (i < n)
+            b->countAt(i, &hash, &count);
+
+        if (j < sorted.size() && (i == n || !(hash < sorted[j].first))) {
+            if (i < n && hash == sorted[j].first)
+                i++;
+            w->addCount(sorted[j].first, sorted[j].second);
+            j++;
+        } else {
+            w->addCount(hash, count);
+            i++;
+        }
+    }
+}
+
+/*
+ * Returns the metadata of a checkpoint with the keys set by newer
+ * transactions applied, in hash order.
+ */
+static MetadataList
+MetadataLog_MergeMeta(const MetadataBase *b, const MetadataMap *older,
+                      const MetadataMap *newer)
+{
+    map<ObjectHash, ObjMetadata> merged;
+    const MetadataMap *overlays[2] = { older, newer };
+
+    for (size_t i = 0; b != NULL && i < b->getNumMeta(); i++) {
+        ObjectHash hash;
+        ObjMetadata md;
+
+        b->metaAt(i, &hash, &md);
+        merged[hash].swap(md);
+    }
+
+    for (size_t i = 0; i < 2; i++) {
+        if (overlays[i] == NULL)
+            continue;
+        for (MetadataMap::const_iterator it = overlays[i]->begin();
+             it != overlays[i]->end();
+             it++) {
+            ObjMetadata &md = merged[it->first];
+
+            for (ObjMetadata::const_iterator mit = it->second.begin();
+                 mit != it->second.end();
+                 mit++) {
+                md[mit->first] = mit->second;
+            }
+        }
+    }
+
+    return MetadataList(merged.begin(), merged.end());
+}
+
+/*
+ * Merges a log that was moved aside into a new checkpoint.
+ */
+class MetadataCompactor : public Thread
+{
+public:
+    MetadataCompactor(const string &path, const MetadataBase *b,
+                      const RefcountMap &counts, const MetadataMap &meta)
+        : Thread("mdcompact"), path(path), b(b), counts(counts), meta(meta),
+          lock(), done(false), ok(false)
+    {
+    }
+    void run()
+    {
+        MetadataBaseWriter w(path, 0);
+        bool status = w.open();
 
+        if (status) {
+            MetadataLog_MergeCounts(&w, b, counts);
+            status = w.finish(MetadataLog_MergeMeta(b, &meta, NULL));
+        }
+
+        lock.lock();
+        done = true;
+        ok = status;
+        lock.unlock();
+    }
+    bool isDone()
+    {
+        lock.lock();
+        bool rval = done;
+        lock.unlock();
+        return rval;
+    }
+    bool succeeded() const { return ok; }
+private:
+    string path;
+    const MetadataBase *b;
+    const RefcountMap &counts;
+    const MetadataMap &meta;
+    Mutex lock;
+    bool done;
+    bool ok;
+};
 
 /*
  * MetadataLog
  */
 
 MetadataLog::MetadataLog()
-    : fd(-1)
+    : fd(-1), filename(), tailBytes(0), base(NULL), writer(NULL),
+      refcounts(), metadata(), compactor(NULL), frozenCounts(), frozenMeta(),
+      durability(Durability::getDefault()), pending(), dirty(false),
+      checkpoints(true)
 {
 }
 
 MetadataLog::~MetadataLog()
 {
-    if (fd != -1) {
-        ::close(fd);
-    }
+    close();
+}
+
+void
+MetadataLog::setDurability(Durability *durability)
+{
+    this->durability = durability;
+}
+
+void
+MetadataLog::setCheckpoints(bool enable)
+{
+    checkpoints = enable;
 }
 
-// XXX: Handle crach detection and recovery
 void
 MetadataLog::open(const string &filename)
 {
+    string basePath = filename + METADATA_BASE_SUFFIX;
+    string tmpPath = basePath + METADATA_TMP_SUFFIX;
+    string oldPath = filename + METADATA_OLD_SUFFIX;
+
+    this->filename = filename;
+    refcounts.clear();
+    metadata.clear();
+
+    // Finish installing a checkpoint that was completely written
+    if (OriFile_Exists(tmpPath)) {
+        MetadataBase tmp;
+
+        if (tmp.open(tmpPath)) {
+            if (tmp.getFlags() & METADATA_REPLACES_LOG) {
+                truncate(filename.c_str(), 0);
+                if (OriFile_Exists(oldPath))
+                    OriFile_Delete(oldPath);
+            }
+            OriFile_Rename(tmpPath, basePath);
+        } else {
+            OriFile_Delete(tmpPath);
+        }
+    }
+
+    if (OriFile_Exists(basePath)) {
+        base = new MetadataBase();
+        if (!base->open(basePath)) {
+            WARNING("Corrupted metadata checkpoint!");
+            delete base;
+            base = NULL;
+            throw SystemException();
+        }
+    }
+
     fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
     if (fd < 0) {
         WARNING("MetadataLog open failed!");
         throw SystemException();
     }
 
-    this->filename = filename;
+    // A compaction was interrupted, carry its log over to the current one
+    if (OriFile_Exists(oldPath)) {
+        replay(oldPath);
+        replay(filename);
+        appendRecord(refcounts, metadata);
+        flush();
+        ::fsync(fd);
+        OriFile_Delete(oldPath);
+    } else {
+        replay(filename);
+    }
 
     struct stat sb;
     if (fstat(fd, &sb) < 0) {
         WARNING("MetadataLog fstat failed!");
         throw SystemException();
     }
+    tailBytes = sb.st_size;
+
+    if (checkpoints && tailBytes >= METADATA_TAIL_MAX)
+        startCompaction();
+}
+
+void
+MetadataLog::close()
+{
+    if (fd == -1)
+        return;
+
+    waitCompaction();
+    flush();
+    delete writer;
+    writer = NULL;
+    delete base;
+    base = NULL;
+
+    ::close(fd);
+    fd = -1;
+    refcounts.clear();
+    metadata.clear();
+}
+
+// XXX: Handle crach detection and recovery
+void
+MetadataLog::replay(const string &path)
+{
+    int logFd = ::open(path.c_str(), O_RDONLY);
+    if (logFd < 0) {
+        WARNING("MetadataLog open failed!");
+        throw SystemException();
+    }
+
+    struct stat sb;
+    if (fstat(logFd, &sb) < 0) {
+        WARNING("MetadataLog fstat failed!");
+        ::close(logFd);
+        throw SystemException();
+    }
 
     size_t readSoFar = 0;
     while (true) {
         uint32_t nbytes;
-        int n = read(fd, &nbytes, sizeof(uint32_t));
+        int n = read(logFd, &nbytes, sizeof(uint32_t));
         readSoFar += sizeof(uint32_t);
         if (n == 0)
             break;
         if (n < 0) {
             WARNING("MetadataLog read failed!");
+            ::close(logFd);
             throw SystemException();
         }
 
         if (readSoFar + nbytes > (size_t)sb.st_size) {
             // TODO: truncate this entry
             WARNING("Corrupted metadata log entry!");
+            ::close(logFd);
             throw SystemException();
         }
 
         string packet;
         packet.resize(nbytes);
-        if (read(fd, &packet[0], nbytes) < 0) {
+        if (read(logFd, &packet[0], nbytes) < 0) {
             WARNING("MetadataLog read failed!");
+            ::close(logFd);
             throw SystemException();
         }
         readSoFar += nbytes;
@@ -131,7 +618,6 @@ MetadataLog::open(const string &filename)
         uint32_t num_rc = ss.readUInt32();
         uint32_t num_md = ss.readUInt32();
 
-        //fprintf(stderr, "Reading %u refcount entries\n", num_rc);
         for (size_t i = 0; i < num_rc; i++) {
             ObjectHash hash;
             ss.readHash(hash);
@@ -140,7 +626,6 @@ MetadataLog::open(const string &filename)
             refcounts[hash] = refcount;
         }
 
-        //fprintf(stderr, "Reading %u metadata entries\n", num_md);
         for (size_t i = 0; i < num_md; i++) {
             ObjectHash hash;
             ss.readHash(hash);
@@ -154,43 +639,242 @@ MetadataLog::open(const string &filename)
             }
         }
     }
+
+    ::close(logFd);
 }
 
 void
 MetadataLog::sync()
 {
-    ::fsync(fd);
+    pollCompaction();
+    flush();
+    if (dirty) {
+        durability->barrier(fd, DURABILITY_METADATA);
+        dirty = false;
+    }
+}
+
+/*
+ * Writes the records appended since the last flush.
+ */
+void
+MetadataLog::flush()
+{
+    if (pending.empty())
+        return;
+
+    if (!durability->write(fd, pending.data(), pending.size())) {
+        perror("MetadataLog write");
+        throw SystemException();
+    }
+    pending.clear();
+    dirty = true;
+}
+
+/*
+ * Replace the checkpoint with the file written at basePath.tmp.  The log is
+ * emptied first when the checkpoint includes all of it.
+ */
+void
+MetadataLog::installBase(bool truncateLog)
+{
+    string basePath = filename + METADATA_BASE_SUFFIX;
+
+    if (truncateLog) {
+        // The checkpoint includes the records not yet written
+        pending.clear();
+        ftruncate(fd, 0);
+        ::fsync(fd);
+        refcounts.clear();
+        metadata.clear();
+        tailBytes = 0;
+    }
+
+    if (OriFile_Rename(basePath + METADATA_TMP_SUFFIX, basePath) < 0) {
+        perror("MetadataLog::installBase rename");
+        throw SystemException();
+    }
+
+    MetadataBase *b = new MetadataBase();
+    if (!b->open(basePath)) {
+        WARNING("Corrupted metadata checkpoint!");
+        delete b;
+        throw SystemException();
+    }
+    delete base;
+    base = b;
 }
 
 void
 MetadataLog::rewrite(const RefcountMap *refs, const MetadataMap *data)
 {
-    if (refs == NULL)
-        refs = &refcounts;
-    if (data == NULL)
-        data = &metadata;
+    waitCompaction();
 
-    string tmpFilename = filename + ".tmp";
-    int newFd = ::open(tmpFilename.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
-    if (newFd < 0) {
+    string tmpPath = filename + METADATA_BASE_SUFFIX + METADATA_TMP_SUFFIX;
+    MetadataBaseWriter w(tmpPath, METADATA_REPLACES_LOG);
+    if (!w.open()) {
         perror("MetadataLog::rewrite open");
         throw SystemException();
     }
 
-    int oldFd = fd;
+    if (refs != NULL)
+        MetadataLog_MergeCounts(&w, NULL, *refs);
+    else
+        MetadataLog_MergeCounts(&w, base, refcounts);
+
+    MetadataList md;
+    if (data != NULL)
+        md = MetadataLog_MergeMeta(NULL, data, NULL);
+    else
+        md = MetadataLog_MergeMeta(base, &metadata, NULL);
+
+    if (!w.finish(md)) {
+        perror("MetadataLog::rewrite write");
+        throw SystemException();
+    }
+
+    installBase(true);
+}
+
+/*
+ * Start writing a new checkpoint.  Until endRewrite() is called the counts
+ * passed to rewriteCounts() are written out directly, and the ones in use
+ * are left as they are.
+ */
+void
+MetadataLog::beginRewrite()
+{
+    ASSERT(writer == NULL);
+
+    waitCompaction();
+
+    string tmpPath = filename + METADATA_BASE_SUFFIX + METADATA_TMP_SUFFIX;
+    writer = new MetadataBaseWriter(tmpPath, METADATA_REPLACES_LOG);
+    if (!writer->open()) {
+        perror("MetadataLog::beginRewrite open");
+        delete writer;
+        writer = NULL;
+        throw SystemException();
+    }
+}
+
+void
+MetadataLog::rewriteCounts(const vector<pair<ObjectHash, refcount_t> > &counts)
+{
+    ASSERT(writer != NULL);
+
+    for (size_t i = 0; i < counts.size(); i++) {
+        writer->addCount(counts[i].first, counts[i].second);
+    }
+}
+
+void
+MetadataLog::endRewrite()
+{
+    ASSERT(writer != NULL);
+
+    bool ok = writer->finish(MetadataLog_MergeMeta(base, &metadata, NULL));
+    delete writer;
+    writer = NULL;
+    if (!ok) {
+        perror("MetadataLog::endRewrite write");
+        throw SystemException();
+    }
+
+    installBase(true);
+}
+
+/*
+ * Move the log aside and merge it into a new checkpoint in the background.
+ * Lookups see the moved log until the checkpoint is installed.
+ */
+void
+MetadataLog::startCompaction()
+{
+    ASSERT(compactor == NULL);
+
+    string oldPath = filename + METADATA_OLD_SUFFIX;
+
+    flush();
+    ::fsync(fd);
+    if (OriFile_Rename(filename, oldPath) < 0) {
+        WARNING("Couldn't move the metadata log aside");
+        return;
+    }
+
+    int newFd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (newFd < 0) {
+        WARNING("Couldn't create a new metadata log");
+        OriFile_Rename(oldPath, filename);
+        return;
+    }
+    ::close(fd);
     fd = newFd;
+    tailBytes = 0;
 
-    ftruncate(fd, 0);
-    lseek(fd, 0, SEEK_SET);
-    MdTransaction::sp tr = begin();
-    tr->counts = *refs;
-    tr->metadata = *data;
+    frozenCounts.swap(refcounts);
+    frozenMeta.swap(metadata);
 
-    refcounts.clear();
-    metadata.clear();
+    compactor = new MetadataCompactor(
+            filename + METADATA_BASE_SUFFIX + METADATA_TMP_SUFFIX,
+            base, frozenCounts, frozenMeta);
+    compactor->start();
+}
+
+void
+MetadataLog::finishCompaction()
+{
+    compactor->wait();
+    bool ok = compactor->succeeded();
+    delete compactor;
+    compactor = NULL;
+
+    if (ok) {
+        installBase(false);
+    } else {
+        WARNING("Metadata compaction failed, keeping the log");
+
+        // Carry the moved log over to the current one
+        for (RefcountMap::iterator it = refcounts.begin();
+             it != refcounts.end();
+             it++) {
+            frozenCounts[it->first] = it->second;
+        }
+        for (MetadataMap::iterator it = metadata.begin();
+             it != metadata.end();
+             it++) {
+            ObjMetadata &md = frozenMeta[it->first];
+
+            for (ObjMetadata::iterator mit = it->second.begin();
+                 mit != it->second.end();
+                 mit++) {
+                md[mit->first] = mit->second;
+            }
+        }
+        refcounts.swap(frozenCounts);
+        metadata.swap(frozenMeta);
+        appendRecord(refcounts, metadata);
+        flush();
+        ::fsync(fd);
+    }
+
+    OriFile_Delete(filename + METADATA_OLD_SUFFIX);
+    frozenCounts.clear();
+    frozenMeta.clear();
+}
 
-    OriFile_Rename(tmpFilename, filename);
-    ::close(oldFd);
+void
+MetadataLog::pollCompaction()
+{
+    if (compactor != NULL && compactor->isDone())
+        finishCompaction();
+}
+
+void
+MetadataLog::waitCompaction()
+{
+    if (compactor != NULL)
+        finishCompaction();
 }
 
 void
@@ -207,21 +891,42 @@ refcount_t
 MetadataLog::getRefCount(const ObjectHash &hash) const
 {
     RefcountMap::const_iterator it = refcounts.find(hash);
-    if (it == refcounts.end())
-        return 0;
-    return (*it).second;
+    if (it != refcounts.end())
+        return (*it).second;
+
+    it = frozenCounts.find(hash);
+    if (it != frozenCounts.end())
+        return (*it).second;
+
+    refcount_t count;
+    if (base != NULL && base->findCount(hash, &count))
+        return count;
+
+    return 0;
 }
 
 string
 MetadataLog::getMeta(const ObjectHash &hash, const string &key) const
 {
-    MetadataMap::const_iterator it = metadata.find(hash);
-    if (it == metadata.end())
-        return "";
-    ObjMetadata::const_iterator mit = (*it).second.find(key);
-    if (mit == (*it).second.end())
-        return "";
-    return (*mit).second;
+    const MetadataMap *maps[2] = { &metadata, &frozenMeta };
+
+    for (size_t i = 0; i < 2; i++) {
+        MetadataMap::const_iterator it = maps[i]->find(hash);
+        if (it == maps[i]->end())
+            continue;
+        ObjMetadata::const_iterator mit = (*it).second.find(key);
+        if (mit != (*it).second.end())
+            return (*mit).second;
+    }
+
+    ObjMetadata md;
+    if (base != NULL && base->findMeta(hash, &md)) {
+        ObjMetadata::const_iterator mit = md.find(key);
+        if (mit != md.end())
+            return (*mit).second;
+    }
+
+    return "";
 }
 
 MdTransaction::sp
@@ -236,27 +941,23 @@ MetadataLog::commit(MdTransaction *tr)
     uint32_t num_rc = tr->counts.size();
     uint32_t num_md = tr->metadata.size();
     if (num_rc + num_md == 0) return;
-    
-    DLOG("Committing %u refcount changes, %u metadata entries", num_rc, num_md);
 
-    //write(fd, &num, sizeof(uint32_t));
+    DLOG("Committing %u refcount changes, %u metadata entries", num_rc, num_md);
 
-    strwstream ws(36*num_rc + 8);
-    ws.writeUInt32(num_rc);
-    ws.writeUInt32(num_md);
+    pollCompaction();
 
+    // The log holds the final counts
     for (RefcountMap::iterator it = tr->counts.begin();
             it != tr->counts.end();
             it++) {
         const ObjectHash &hash = (*it).first;
         ASSERT(!hash.isEmpty());
 
-        ws.writeHash(hash);
-        refcount_t final_count = refcounts[hash] + (*it).second;
+        refcount_t final_count = getRefCount(hash) + (*it).second;
         ASSERT(final_count >= 0);
 
         refcounts[hash] = final_count;
-        ws.writeInt32(final_count);
+        (*it).second = final_count;
     }
 
     for (MetadataMap::iterator it = tr->metadata.begin();
@@ -265,15 +966,56 @@ MetadataLog::commit(MdTransaction *tr)
         const ObjectHash &hash = (*it).first;
         ASSERT(!hash.isEmpty());
 
-        ws.writeHash(hash);
+        for (ObjMetadata::iterator mit =
+                (*it).second.begin();
+                mit != (*it).second.end();
+                mit++) {
+            metadata[hash][(*mit).first] = (*mit).second;
+        }
+    }
+
+    appendRecord(tr->counts, tr->metadata);
+
+    tr->counts.clear();
+    tr->metadata.clear();
+
+    if (durability->isStrict())
+        sync();
+    else if (pending.size() >= GROUPCOMMIT_BUFFER_MAX)
+        flush();
+
+    if (checkpoints && tailBytes >= METADATA_TAIL_MAX && compactor == NULL)
+        startCompaction();
+}
+
+void
+MetadataLog::appendRecord(const RefcountMap &counts, const MetadataMap &data)
+{
+    uint32_t num_rc = counts.size();
+    uint32_t num_md = data.size();
+
+    strwstream ws(36*num_rc + 8);
+    ws.writeUInt32(num_rc);
+    ws.writeUInt32(num_md);
+
+    for (RefcountMap::const_iterator it = counts.begin();
+            it != counts.end();
+            it++) {
+        ws.writeHash((*it).first);
+        ws.writeInt32((*it).second);
+    }
+
+    for (MetadataMap::const_iterator it = data.begin();
+            it != data.end();
+            it++) {
+        ws.writeHash((*it).first);
         uint32_t num_mde = (*it).second.size();
         ws.writeUInt32(num_mde);
 
-        for (ObjMetadata::iterator mit =
+        for (ObjMetadata::const_iterator mit =
                 (*it).second.begin();
                 mit != (*it).second.end();
                 mit++) {
-            metadata[hash][(*mit).first] = (*mit).second;
             ws.writePStr((*mit).first);
             ws.writePStr((*mit).second);
         }
@@ -284,20 +1026,36 @@ MetadataLog::commit(MdTransaction *tr)
 
     const string &str = ws.str();
     uint32_t nbytes = str.size();
-    write(fd, &nbytes, sizeof(uint32_t));
-    write(fd, str.data(), str.size());
-
-    tr->counts.clear();
-    tr->metadata.clear();
+    pending.append((const char *)&nbytes, sizeof(uint32_t));
+    pending.append(str);
+    tailBytes += sizeof(uint32_t) + nbytes;
 }
 
 void
 MetadataLog::dumpRefs() const
 {
-    RefcountMap::const_iterator it;
+    map<ObjectHash, refcount_t> refs;
+    const RefcountMap *maps[2] = { &frozenCounts, &refcounts };
+
+    for (size_t i = 0; base != NULL && i < base->getNumCounts(); i++) {
+        ObjectHash hash;
+        refcount_t count;
+
+        base->countAt(i, &hash, &count);
+        refs[hash] = count;
+    }
+    for (size_t i = 0; i < 2; i++) {
+        for (RefcountMap::const_iterator it = maps[i]->begin();
+             it != maps[i]->end();
+             it++) {
+            refs[it->first] = it->second;
+        }
+    }
 
     cout << "Reference Counts:" << endl;
-    for (it = refcounts.begin(); it != refcounts.end(); it++)
+    for (map<ObjectHash, refcount_t>::iterator it = refs.begin();
+         it != refs.end();
+         it++)
     {
         cout << (*it).first.hex() << ": " << (*it).second << endl;
     }
@@ -306,10 +1064,10 @@ MetadataLog::dumpRefs() const
 void
 MetadataLog::dumpMeta() const
 {
-    MetadataMap::const_iterator it;
+    MetadataList md = MetadataLog_MergeMeta(base, &frozenMeta, &metadata);
 
     cout << "Metadata:" << endl;
-    for (it = metadata.begin(); it != metadata.end(); it++)
+    for (MetadataList::iterator it = md.begin(); it != md.end(); it++)
     {
         ObjMetadata::const_iterator mit;
 
@@ -321,4 +1079,3 @@ MetadataLog::dumpMeta() const
         }
     }
 }
-
@@ -15,14 +15,19 @@
  */
 
 
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <errno.h>
 
 #include <string>
 #include <set>
+#include <map>
 #include <list>
 #include <vector>
 #include <sstream>
@@ -36,15 +41,21 @@
 #include <oriutil/debug.h>
 #include <oriutil/oriutil.h>
 #include <oriutil/orifile.h>
+#include <oriutil/monitor.h>
 #include <oriutil/scan.h>
+#include <oriutil/stopwatch.h>
+#include <oriutil/blockzip.h>
+#include <oriutil/zipcodec.h>
 #include <oriutil/systemexception.h>
+#include <oriutil/thread.h>
 #include <ori/packfile.h>
 #include <ori/index.h>
+#include <ori/zipadvisor.h>
 
 using namespace std;
 
 PfTransaction::PfTransaction(Packfile *pf, Index *idx)
-    : totalSize(0), committed(false), pf(pf), idx(idx)
+    : totalSize(0), committed(false), moving(false), pf(pf), idx(idx)
 {
 }
 
@@ -60,14 +71,77 @@ bool PfTransaction::full() const
         totalSize >= PACKFILE_MAXSIZE;
 }
 
-float
-PfTransaction::_checkCompressionRatio(const string &payload)
+void
+PfTransaction::addPayload(ObjectInfo info, const string &payload,
+                          ObjectInfo::ZipAlgo algo, ZipAdvisor *advisor)
+{
+    string stored;
+
+    if (compress(&info, payload, algo, advisor, &stored))
+        addStored(info, stored);
+    else
+        addStored(info, payload);
+}
+
+/*
+ * Compresses a payload for storage with algo.  Returns true and sets the
+ * algorithm in info if stored holds the compressed payload, otherwise the
+ * payload should be stored as is.  This does not touch the transaction, so
+ * payloads can be compressed by other threads and added with addStored.
+ */
+bool
+PfTransaction::compress(ObjectInfo *info, const string &payload,
+                        ObjectInfo::ZipAlgo algo, ZipAdvisor *advisor,
+                        string *stored)
 {
-    return 1.5f;
+    bool compress = false;
+
+    /*
+     * Blocks are compressed independently, so the first block is a real
+     * sample of the final ratio and its output is kept.
+     */
+    if (algo != ObjectInfo::ZIPALGO_NONE &&
+        payload.size() > ZIP_MINIMUM_SIZE &&
+        (advisor == NULL ||
+         advisor->advise(info->type, payload) == ZipAdvisor::ZIPADV_TRY)) {
+        blockzipstream bs(new strstream(payload), COMPRESS, 0, algo);
+        Stopwatch sw = Stopwatch();
+
+        sw.start();
+        stored->resize(BLOCKZIP_MAXFRAME);
+        size_t compSize = bs.read((uint8_t *)&(*stored)[0], BLOCKZIP_MAXFRAME);
+        stored->resize(compSize);
+        if (bs.error()) {
+            WARNING("Cannot compress with %s: %s",
+                    ZipCodec_Name(algo), bs.error());
+        } else if ((float)compSize / (float)bs.inputConsumed()
+                       <= COMPCHECK_RATIO) {
+            strwstream ss(*stored);
+            ss.copyFrom(&bs);
+            *stored = ss.str();
+            compress = true;
+        }
+        sw.stop();
+
+        if (advisor != NULL) {
+            advisor->record(info->type,
+                            compress ? payload.size() : bs.inputConsumed(),
+                            stored->size(), compress, sw.getElapsedTime());
+        }
+    }
+
+    info->setAlgo(compress ? algo : ObjectInfo::ZIPALGO_NONE);
+    if (!compress)
+        stored->clear();
+
+    return compress;
 }
 
+/*
+ * Adds a payload as it is stored, compressed with the algorithm set in info.
+ */
 void
-PfTransaction::addPayload(ObjectInfo info, const string &payload)
+PfTransaction::addStored(const ObjectInfo &info, const string &stored)
 {
     if (committed) {
         throw runtime_error("Adding payload to already-committed transaction!");
@@ -83,51 +157,8 @@ PfTransaction::addPayload(ObjectInfo info, const string &payload)
     }
 #endif
 
-    ObjectInfo::ZipAlgo defaultAlgo = ObjectInfo::ZIPALGO_FASTLZ;
-    switch (defaultAlgo) {
-        case ObjectInfo::ZIPALGO_NONE:
-        {
-            info.setAlgo(defaultAlgo);
-            payloads.push_back(payload);
-            totalSize += payload.size();
-            break;
-        }
-        case ObjectInfo::ZIPALGO_FASTLZ:
-        {
-            zipstream ls(new strstream(payload), COMPRESS);
-            uint8_t buf[COMPCHECK_BYTES];
-            size_t compSize = 0;
-            bool compress = false;
-
-            if (payload.size() > ZIP_MINIMUM_SIZE) {
-                compSize = ls.read(buf, COMPCHECK_BYTES);
-                float ratio = (float)compSize / (float)ls.inputConsumed();
-
-                if (ratio <= COMPCHECK_RATIO) {
-                    compress = true;
-                }
-            }
-
-            if (compress) {
-                // Okay to compress
-                info.setAlgo(defaultAlgo);
-                // Reuse compression test data
-                strwstream ss(string((char*)buf, compSize));
-                ss.copyFrom(&ls);
-
-                payloads.push_back(ss.str());
-                totalSize += ss.str().size();
-            } else {
-                info.setAlgo(ObjectInfo::ZIPALGO_NONE);
-                payloads.push_back(payload);
-                totalSize += payload.size();
-            }
-            break;
-        }
-        case ObjectInfo::ZIPALGO_LZMA:
-        case ObjectInfo::ZIPALGO_UNKNOWN:
-            NOT_IMPLEMENTED(false);
-    }
+    payloads.push_back(stored);
+    totalSize += stored.size();
 
     infos.push_back(info);
     hashToIx[info.hash] = infos.size()-1;
@@ -147,13 +178,64 @@ void PfTransaction::commit()
 }
 
 
+/*
+ * PackfileMap
+ */
+
+PackfileMap::sp
+PackfileMap::map(int fd, size_t len)
+{
+    if (len == 0)
+        return sp();
+
+    void *m = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) {
+        WARNING("Couldn't map packfile: %s", strerror(errno));
+        return sp();
+    }
+
+    return sp(new PackfileMap((const uint8_t *)m, len));
+}
+
+PackfileMap::PackfileMap(const uint8_t *base, size_t len)
+    : base(base), len(len)
+{
+}
+
+PackfileMap::~PackfileMap()
+{
+    munmap((void *)base, len);
+}
+
+/*
+ * Stream over a stored payload in a mapping, which it keeps alive.
+ */
+class mapstream : public memstream
+{
+public:
+    mapstream(PackfileMap::sp map, const uint8_t *buf, size_t len)
+        : memstream(buf, len), map(map) { }
+private:
+    PackfileMap::sp map;
+};
+
+
 // stored length + offset
 #define ENTRYSIZE (ObjectInfo::SIZE + 4 + 4)
 
-Packfile::Packfile(const string &filename, packid_t id)
-    : fd(-1), filename(filename), packid(id), numObjects(0), fileSize(0)
+Packfile::Packfile(const string &filename, packid_t id, bool writable,
+                   Durability *durability)
+    : fd(-1), filename(filename), packid(id), writable(writable),
+      numObjects(0), fileSize(0), durability(durability), dirty(false),
+      pfMap(), mapTried(false)
 {
-    fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+    if (durability == NULL)
+        this->durability = Durability::getDefault();
+
+    if (writable)
+        fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+    else
+        fd = ::open(filename.c_str(), O_RDONLY);
     if (fd < 0) {
         perror("Packfile open");
         throw SystemException();
@@ -172,8 +254,39 @@ Packfile::Packfile(const string &filename, packid_t id)
 
 Packfile::~Packfile()
 {
-    if (fd > 0)
+    if (fd > 0) {
+        sync();
         close(fd);
+    }
+}
+
+packid_t
+Packfile::getPackfileID() const
+{
+    return packid;
+}
+
+bool
+Packfile::isWritable() const
+{
+    return writable;
+}
+
+void
+Packfile::sync()
+{
+    if (dirty) {
+        durability->barrier(fd, DURABILITY_PACKFILE);
+        dirty = false;
+    }
+}
+
+size_t
+Packfile::getMappedSize()
+{
+    Monitor l(mapLock);
+
+    return pfMap ? pfMap->size() : 0;
 }
 
 bool Packfile::full() const
@@ -195,6 +308,9 @@ Packfile::commit(PfTransaction *t, Index *idx)
         throw runtime_error("PfTransaction infos.size() != payloads.size())");
     }
 
+    ASSERT(writable);
+    unmap();
+
     lseek(fd, 0, SEEK_END);
     vector<offset_t> offsets;
     size_t headers_size = t->infos.size() * ENTRYSIZE;
@@ -213,11 +329,23 @@ Packfile::commit(PfTransaction *t, Index *idx)
         off += t->payloads[i].size();
     }
 
-    write(fd, headers_ss.str().data(), headers_ss.str().size());
-    fileSize += headers_ss.str().size();
+    // The headers and payloads go out in one write
+    const string &headers = headers_ss.str();
+    vector<struct iovec> iov(t->payloads.size() + 1);
+    iov[0].iov_base = (void *)headers.data();
+    iov[0].iov_len = headers.size();
+    for (size_t i = 0; i < t->payloads.size(); i++) {
+        iov[i + 1].iov_base = (void *)t->payloads[i].data();
+        iov[i + 1].iov_len = t->payloads[i].size();
+    }
+    if (!durability->write(fd, &iov[0], (int)iov.size())) {
+        perror("Packfile::commit write");
+        throw SystemException();
+    }
+    dirty = true;
+    fileSize += headers.size();
 
     for (size_t i = 0; i < t->payloads.size(); i++) {
-        write(fd, t->payloads[i].data(), t->payloads[i].size());
         fileSize += t->payloads[i].size();
         numObjects++;
 
@@ -227,33 +355,164 @@ Packfile::commit(PfTransaction *t, Index *idx)
         ie.packed_size = t->payloads[i].size();
         ie.packfile = packid;
 
-        idx->updateEntry(ie.info.hash, ie);
+        idx->updateEntry(ie.info.hash, ie, t->moving);
     }
 
-    ::fsync(fd);
+    // Otherwise the index entries are synced after this at the group's end
+    if (durability->isStrict()) {
+        sync();
+        idx->sync();
+    }
     t->committed = true;
 }
 
+/*
+ * Returns the stored bytes at [off, off + len) if they are in the mapping,
+ * which map then holds while they are used.  Handles that write are not
+ * mapped.
+ */
+const uint8_t *
+Packfile::getStored(offset_t off, size_t len, PackfileMap::sp *map)
+{
+    Monitor l(mapLock);
+
+    if (!mapTried && !writable) {
+        mapTried = true;
+        pfMap = PackfileMap::map(fd, fileSize);
+    }
+
+    if (!pfMap || (size_t)off + len > pfMap->size())
+        return NULL;
+    *map = pfMap;
+    return pfMap->data() + off;
+}
+
+void
+Packfile::unmap()
+{
+    Monitor l(mapLock);
+
+    pfMap.reset();
+    mapTried = true;
+}
+
 bytestream *Packfile::getPayload(const IndexEntry &entry)
 {
     ASSERT(entry.packfile == packid);
-    bytestream *stored = new fdstream(fd, entry.offset, entry.packed_size);
-   
-    switch (entry.info.getAlgo()) {
-        case ObjectInfo::ZIPALGO_NONE:
-            return stored;
-        case ObjectInfo::ZIPALGO_FASTLZ:
-            return new zipstream(stored, DECOMPRESS, entry.info.payload_size);
-        case ObjectInfo::ZIPALGO_LZMA:
-        case ObjectInfo::ZIPALGO_UNKNOWN:
-            NOT_IMPLEMENTED(false);
+    PackfileMap::sp map;
+    const uint8_t *buf = getStored(entry.offset, entry.packed_size, &map);
+    bytestream *stored;
+
+    if (buf != NULL)
+        stored = new mapstream(map, buf, entry.packed_size);
+    else
+        stored = new fdstream(fd, entry.offset, entry.packed_size);
+
+    bytestream *bs = ZipCodec_Decompress(stored, entry.info);
+
+    if (bs == NULL) {
+        NOT_IMPLEMENTED(false);
     }
-    return 0;
+    return bs;
+}
+
+/*
+ * Read a payload as it is stored, without decompressing it.
+ */
+string
+Packfile::getStoredPayload(const IndexEntry &entry)
+{
+    ASSERT(entry.packfile == packid);
+    PackfileMap::sp map;
+    const uint8_t *stored = getStored(entry.offset, entry.packed_size, &map);
+
+    if (stored != NULL)
+        return string((const char *)stored, entry.packed_size);
+
+    string buf;
+    buf.resize(entry.packed_size);
+    if (entry.packed_size == 0)
+        return buf;
+
+    ssize_t n = pread(fd, &buf[0], entry.packed_size, entry.offset);
+    if (n < 0 || (size_t)n != entry.packed_size) {
+        throw SystemException();
+    }
+
+    return buf;
+}
+
+/*
+ * Read part of an object's payload.  Block-framed payloads only decompress
+ * the blocks covering [off, off + n).
+ */
+ssize_t
+Packfile::readPayload(const IndexEntry &entry, uint8_t *buf, size_t n,
+                      off_t off)
+{
+    ASSERT(entry.packfile == packid);
+
+    if (off >= (off_t)entry.info.payload_size)
+        return 0;
+    n = MIN(n, entry.info.payload_size - off);
+
+    ObjectInfo::ZipAlgo algo = entry.info.getAlgo();
+    PackfileMap::sp map;
+    const uint8_t *stored = getStored(entry.offset, entry.packed_size, &map);
+
+    if (algo == ObjectInfo::ZIPALGO_NONE) {
+        if (stored != NULL) {
+            memcpy(buf, stored + off, n);
+            return n;
+        }
+        ssize_t status = pread(fd, buf, n, entry.offset + off);
+        return status < 0 ? -errno : status;
+    }
+    if (ZipCodec_Get(algo) != NULL) {
+        if (stored != NULL) {
+            return BlockZip_Read(stored, entry.packed_size, algo,
+                                 buf, n, off);
+        }
+        return BlockZip_PRead(fd, entry.offset, entry.packed_size, algo,
+                              buf, n, off);
+    }
+
+    // Legacy payloads are compressed as a single stream
+    bytestream::ap bs(getPayload(entry));
+    string payload = bs->readAll();
+    if (bs->error())
+        return -EIO;
+    memcpy(buf, payload.data() + off, n);
+    return n;
+}
+
+/*
+ * Point view at an uncompressed payload in the mapping.  The view holds the
+ * mapping, so it can outlive this packfile.
+ */
+bool
+Packfile::getPayloadView(const IndexEntry &entry, PayloadView *view)
+{
+    ASSERT(entry.packfile == packid);
+
+    if (entry.info.getAlgo() != ObjectInfo::ZIPALGO_NONE)
+        return false;
+
+    PackfileMap::sp map;
+    const uint8_t *stored = getStored(entry.offset, entry.packed_size, &map);
+    if (stored == NULL)
+        return false;
+
+    view->data = stored;
+    view->len = entry.packed_size;
+    view->map = map;
+    return true;
 }
 
 bool Packfile::purge(const set<ObjectHash> &hset, Index *idx)
 {
     PfTransaction::sp tr = begin(idx);
+    tr->moving = true;
     
     // Read the current contents
     lseek(fd, 0, SEEK_SET);
@@ -316,6 +575,11 @@ bool Packfile::purge(const set<ObjectHash> &hset, Index *idx)
 
     ::close(oldFd);
     OriFile_Rename(tmpFilename, filename);
+    writable = true;
+    unmap();
+    // The objects kept are written again from the start of the new file
+    fileSize = 0;
+    numObjects = 0;
 
     // Commit the transaction
     bool empty = tr->payloads.size() == 0;
@@ -351,6 +615,309 @@ Packfile::readEntries(ReadEntryCb cb, void *arg)
     }
 }
 
+class PackfileScanWorker : public Thread
+{
+public:
+    PackfileScanWorker(PackfileScanner *scanner, size_t first)
+        : Thread("pfscan"), scanner(scanner), first(first)
+    {
+    }
+    void run()
+    {
+        uint64_t seen = 0;
+        PackfileScanBatch *b;
+
+        while ((b = scanner->takeBatch(&seen)) != NULL) {
+            scanner->processBatch(b, first, scanner->threads);
+            scanner->doneBatch();
+        }
+    }
+private:
+    PackfileScanner *scanner;
+    size_t first;
+};
+
+PackfileScanner::PackfileScanner(size_t batchSize)
+    : threads(1), batchSize(batchSize), scans(), poolLock(), poolReady(),
+      poolIdle(), poolBatch(NULL), poolGen(0), poolBusy(0), poolStop(false)
+{
+}
+
+PackfileScanner::~PackfileScanner()
+{
+    for (size_t i = 0; i < scans.size(); i++) {
+        if (scans[i].fd >= 0)
+            ::close(scans[i].fd);
+    }
+}
+
+void
+PackfileScanner::addPackfile(packid_t id, const string &path, offset_t off,
+                             uint64_t ino)
+{
+    Scan s;
+
+    s.id = id;
+    s.path = path;
+    s.fd = -1;
+    s.ino = ino;
+    s.off = off;
+    s.end = 0;
+    scans.push_back(s);
+}
+
+bool
+PackfileScanner::wantPayload(packid_t id, const PackfileScanItem &item)
+{
+    return true;
+}
+
+void
+PackfileScanner::startBatch(PackfileScanBatch *b)
+{
+}
+
+bool
+PackfileScanner::openScan(Scan *s)
+{
+    struct stat sb;
+
+    s->fd = ::open(s->path.c_str(), O_RDONLY);
+    if (s->fd < 0 || fstat(s->fd, &sb) < 0) {
+        scanError(s->id, "Cannot open packfile");
+        if (s->fd >= 0)
+            ::close(s->fd);
+        s->fd = -1;
+        return false;
+    }
+
+    // Purge replaces the packfile, the offset is only valid for the old one
+    if ((s->ino != 0 && s->ino != (uint64_t)sb.st_ino) ||
+        s->off > (uint64_t)sb.st_size)
+        s->off = 0;
+    s->ino = sb.st_ino;
+    s->end = sb.st_size;
+
+    return true;
+}
+
+/*
+ * Read whole transactions from a packfile, starting at s->off, until the
+ * batch holds batchSize bytes of payloads.  Returns false if the rest of the
+ * packfile cannot be read, with the transactions before that in the batch.
+ */
+bool
+PackfileScanner::readBatch(Scan *s, PackfileScanBatch *b)
+{
+    const char *error = NULL;
+
+    b->packfile = s->id;
+    b->ino = s->ino;
+    b->start = s->off;
+
+    while (s->off < s->end && b->buf.size() < batchSize) {
+        uint32_t num;
+        string hdrs;
+
+        if (pread(s->fd, &num, sizeof(num), s->off) != sizeof(num)) {
+            error = "Packfile truncated";
+            break;
+        }
+
+        // Entries are written with writeUInt32
+        strstream numStream(string((const char *)&num, sizeof(num)));
+        num = numStream.readUInt32();
+
+        uint64_t payloadOff = (uint64_t)s->off + sizeof(num) +
+                              (uint64_t)num * ENTRYSIZE;
+        if (payloadOff > s->end) {
+            error = "Packfile truncated";
+            break;
+        }
+
+        hdrs.resize(num * ENTRYSIZE);
+        if (num > 0 && pread(s->fd, &hdrs[0], hdrs.size(), s->off + sizeof(num))
+                != (ssize_t)hdrs.size()) {
+            error = "Cannot read packfile";
+            break;
+        }
+
+        strstream hs(hdrs);
+        uint64_t groupEnd = payloadOff;
+        size_t base = b->buf.size();
+        size_t first = b->items.size();
+        bool all = true;
+
+        for (size_t i = 0; i < num; i++) {
+            PackfileScanItem item;
+
+            hs.readInfo(item.info);
+            item.storedSize = hs.readUInt32();
+            item.offset = hs.readUInt32();
+            item.bufOff = 0;
+
+            if (item.offset < payloadOff ||
+                (uint64_t)item.offset + item.storedSize > s->end) {
+                error = "Corrupt packfile header";
+                break;
+            }
+            groupEnd = MAX(groupEnd, (uint64_t)item.offset + item.storedSize);
+
+            if (wantPayload(s->id, item))
+                b->items.push_back(item);
+            else
+                all = false;
+        }
+        if (error != NULL) {
+            b->items.resize(first);
+            break;
+        }
+
+        // Read the whole transaction at once unless objects were left out
+        if (all) {
+            b->buf.resize(base + groupEnd - payloadOff);
+            if (groupEnd > payloadOff &&
+                pread(s->fd, &b->buf[base], groupEnd - payloadOff, payloadOff)
+                    != (ssize_t)(groupEnd - payloadOff))
+                error = "Cannot read packfile";
+            for (size_t i = first; i < b->items.size(); i++) {
+                b->items[i].bufOff = base + b->items[i].offset - payloadOff;
+            }
+        } else {
+            for (size_t i = first; i < b->items.size() && !error; i++) {
+                PackfileScanItem &item = b->items[i];
+
+                item.bufOff = b->buf.size();
+                b->buf.resize(item.bufOff + item.storedSize);
+                if (item.storedSize > 0 &&
+                    pread(s->fd, &b->buf[item.bufOff], item.storedSize,
+                          item.offset) != (ssize_t)item.storedSize)
+                    error = "Cannot read packfile";
+            }
+        }
+        if (error != NULL) {
+            b->items.resize(first);
+            b->buf.resize(base);
+            break;
+        }
+
+        s->off = groupEnd;
+    }
+
+    b->end = s->off;
+    if (error != NULL) {
+        scanError(s->id, error);
+        s->off = s->end;
+        return false;
+    }
+
+    return true;
+}
+
+PackfileScanBatch *
+PackfileScanner::nextBatch(size_t *cur)
+{
+    while (*cur < scans.size()) {
+        Scan &s = scans[*cur];
+
+        if (s.fd < 0 && !openScan(&s)) {
+            (*cur)++;
+            continue;
+        }
+
+        if (s.off < s.end) {
+            PackfileScanBatch *b = new PackfileScanBatch();
+
+            readBatch(&s, b);
+            return b;
+        }
+
+        ::close(s.fd);
+        s.fd = -1;
+        (*cur)++;
+    }
+
+    return NULL;
+}
+
+/*
+ * Waits for a batch that was not seen yet, returns NULL once the workers are
+ * to stop.
+ */
+PackfileScanBatch *
+PackfileScanner::takeBatch(uint64_t *seen)
+{
+    Monitor m(poolLock);
+
+    while (!poolStop && (poolBatch == NULL || poolGen == *seen))
+        poolReady.wait(poolLock);
+    if (poolStop)
+        return NULL;
+    *seen = poolGen;
+    return poolBatch;
+}
+
+void
+PackfileScanner::doneBatch()
+{
+    Monitor m(poolLock);
+
+    poolBusy--;
+    if (poolBusy == 0)
+        poolIdle.signal();
+}
+
+void
+PackfileScanner::scan()
+{
+    vector<PackfileScanWorker *> workers;
+    size_t cur = 0;
+
+    if (threads < 1)
+        threads = 1;
+    poolStop = false;
+    for (int i = 0; i < threads; i++) {
+        workers.push_back(new PackfileScanWorker(this, i));
+        workers.back()->start();
+    }
+
+    // Read the next batch while the workers process the current one
+    PackfileScanBatch *b = nextBatch(&cur);
+    while (b != NULL) {
+        startBatch(b);
+
+        poolLock.lock();
+        poolBatch = b;
+        poolBusy = threads;
+        poolGen++;
+        poolReady.broadcast();
+        poolLock.unlock();
+
+        PackfileScanBatch *next = nextBatch(&cur);
+
+        poolLock.lock();
+        while (poolBusy > 0)
+            poolIdle.wait(poolLock);
+        poolBatch = NULL;
+        poolLock.unlock();
+
+        finishBatch(b);
+        delete b;
+        b = next;
+    }
+
+    poolLock.lock();
+    poolStop = true;
+    poolReady.broadcast();
+    poolLock.unlock();
+
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i]->wait();
+        delete workers[i];
+    }
+    scans.clear();
+}
+
 bool
 _offsetCmp(const IndexEntry &ie1, const IndexEntry &ie2)
 {
@@ -401,7 +968,7 @@ Packfile::transmit(bytewstream *bs, vector<IndexEntry> objects)
     }
 
     // Transmit object infos
-    tr1::unordered_set<ObjectHash> includedHashes;
+    ObjectHashSet includedHashes;
     numobjs_t totalObjs = 0;
 
     strwstream infos_ss;
@@ -430,9 +997,16 @@ Packfile::transmit(bytewstream *bs, vector<IndexEntry> objects)
     for (map<offset_t, offset_t>::iterator it = blocks.begin();
             it != blocks.end();
             it++) {
-        lseek(fd, (*it).first, SEEK_SET);
 	ASSERT((*it).second >= (*it).first);
         ssize_t len = (*it).second - (*it).first;
+        PackfileMap::sp map;
+        const uint8_t *stored = getStored((*it).first, len, &map);
+        if (stored != NULL) {
+            bs->write(stored, len);
+            continue;
+        }
+
+        lseek(fd, (*it).first, SEEK_SET);
         buf.resize(len);
         ssize_t n = read(fd, &buf[0], len);
         if (n < 0 || n != len) {
@@ -454,10 +1028,14 @@ Packfile::receive(bytestream *bs, Index *idx)
     numobjs_t num = bs->readUInt32();
     if (num == 0) return false;
 
+    ASSERT(writable);
+    unmap();
+
     lseek(fd, 0, SEEK_END);
     size_t headers_size = num * ENTRYSIZE;
     offset_t off = fileSize + sizeof(numobjs_t) + headers_size;
     vector<size_t> obj_sizes;
+    vector<IndexEntry> entries;
     
     strwstream headers_ss;
     ASSERT(sizeof(offset_t) == sizeof(numobjs_t));
@@ -478,23 +1056,43 @@ Packfile::receive(bytestream *bs, Index *idx)
         headers_ss.writeUInt32(off);
 
         IndexEntry ie = {info, off, obj_size, packid};
-        idx->updateEntry(info.hash, ie);
+        entries.push_back(ie);
 
         off += obj_size;
     }
 
-    write(fd, headers_ss.str().data(), headers_ss.str().size());
-    fileSize += headers_ss.str().size();
-
-    vector<uint8_t> data;
+    // Payloads are written along with the headers in large writes
+    string buf = headers_ss.str();
+    fileSize += buf.size();
     for (size_t i = 0; i < num; i++) {
         //fprintf(stderr, "Reading %lu packed size %lu\n", i, obj_sizes[i]);
-        data.resize(obj_sizes[i]);
-        bs->readExact(&data[0], obj_sizes[i]);
-        
-        write(fd, &data[0], obj_sizes[i]);
+        size_t start = buf.size();
+        buf.resize(start + obj_sizes[i]);
+        bs->readExact((uint8_t *)&buf[start], obj_sizes[i]);
         fileSize += obj_sizes[i];
         numObjects++;
+
+        if (buf.size() >= GROUPCOMMIT_BUFFER_MAX) {
+            if (!durability->write(fd, buf.data(), buf.size())) {
+                perror("Packfile::receive write");
+                throw SystemException();
+            }
+            buf.clear();
+        }
+    }
+    if (!buf.empty() && !durability->write(fd, buf.data(), buf.size())) {
+        perror("Packfile::receive write");
+        throw SystemException();
+    }
+    dirty = true;
+
+    // Readers may look objects up while this runs, so only once written
+    for (size_t i = 0; i < num; i++)
+        idx->updateEntry(entries[i].info.hash, entries[i]);
+
+    if (durability->isStrict()) {
+        sync();
+        idx->sync();
     }
 
     return true;
@@ -508,8 +1106,12 @@ Packfile::receive(bytestream *bs, Index *idx)
  */
 
 PackfileManager::PackfileManager(const string &rootPath)
-    : rootPath(rootPath)
+    : rootPath(rootPath), maxHandles(PACKFILE_POOL_HANDLES),
+      maxMappedBytes(PACKFILE_POOL_MAPPED),
+      durability(Durability::getDefault())
 {
+    memset(&stats, 0, sizeof(stats));
+
     if (!_loadFreeList()) {
         _recomputeFreeList();
         _writeFreeList();
@@ -521,34 +1123,189 @@ PackfileManager::~PackfileManager()
     _writeFreeList();
 }
 
+/*
+ * Returns the shared handle for a packfile.  Once the handle that wrote a
+ * packfile is released it is replaced with a read-only one.
+ */
 Packfile::sp
 PackfileManager::getPackfile(packid_t id)
 {
-    if (!_packfileCache.hasKey(id)) {
-        Packfile::sp pf(new Packfile(_getPackfileName(id), id));
+    Monitor l(poolLock);
+    map<packid_t, PoolEntry>::iterator it = pool.find(id);
+
+    stats.lookups++;
+    if (it != pool.end()) {
+        PoolEntry &e = (*it).second;
 
-        _packfileCache.put(id, pf);
-        return pf;
+        if (!e.pf->isWritable() || !e.pf.unique()) {
+            stats.hits++;
+            poolLru.splice(poolLru.begin(), poolLru, e.lru);
+            return e.pf;
+        }
+
+        poolLru.erase(e.lru);
+        pool.erase(it);
     }
 
-    return _packfileCache.get(id);
+    Packfile::sp pf(new Packfile(_getPackfileName(id), id, false,
+                                 durability));
+    stats.opens++;
+    _poolInsert(id, pf);
+    _poolEvict();
+
+    return pf;
 }
 
 Packfile::sp
 PackfileManager::newPackfile()
 {
+    Monitor l(poolLock);
+
     ASSERT(freeList.size() > 0);
     packid_t id = freeList[0];
-    Packfile::sp pf(new Packfile(_getPackfileName(id), id));
+    Packfile::sp pf(new Packfile(_getPackfileName(id), id, true, durability));
     if (freeList.size() == 1) {
         freeList[0] += 1;
     }
     else {
         freeList.pop_front();
     }
+
+    stats.opens++;
+    _poolInsert(id, pf);
+    _poolEvict();
+
     return pf;
 }
 
+void
+PackfileManager::setLimits(size_t maxHandles, size_t maxMappedBytes)
+{
+    Monitor l(poolLock);
+
+    this->maxHandles = maxHandles;
+    this->maxMappedBytes = maxMappedBytes;
+    _poolEvict();
+}
+
+PackfilePoolStats
+PackfileManager::getStats()
+{
+    Monitor l(poolLock);
+    PackfilePoolStats rval = stats;
+
+    rval.handles = pool.size();
+    rval.mappedBytes = 0;
+    for (map<packid_t, PoolEntry>::iterator it = pool.begin();
+         it != pool.end();
+         it++) {
+        rval.mappedBytes += (*it).second.pf->getMappedSize();
+    }
+
+    return rval;
+}
+
+void
+PackfileManager::setDurability(Durability *durability)
+{
+    Monitor l(poolLock);
+
+    this->durability = durability;
+}
+
+/*
+ * Handles that were written to stay in the pool until they are released,
+ * and sync when they are closed.
+ */
+void
+PackfileManager::sync()
+{
+    Monitor l(poolLock);
+
+    for (map<packid_t, PoolEntry>::iterator it = pool.begin();
+         it != pool.end();
+         it++) {
+        (*it).second.pf->sync();
+    }
+}
+
+/*
+ * Called with the pool lock held.
+ */
+void
+PackfileManager::_poolInsert(packid_t id, Packfile::sp pf)
+{
+    map<packid_t, PoolEntry>::iterator it = pool.find(id);
+
+    if (it != pool.end()) {
+        poolLru.erase((*it).second.lru);
+        pool.erase(it);
+    }
+
+    poolLru.push_front(id);
+    pool[id].pf = pf;
+    pool[id].lru = poolLru.begin();
+}
+
+/*
+ * Closes the least recently used handles that are not held outside the
+ * pool until it is within its limits.  Called with the pool lock held.
+ */
+void
+PackfileManager::_poolEvict()
+{
+    size_t mapped = 0;
+
+    for (map<packid_t, PoolEntry>::iterator it = pool.begin();
+         it != pool.end();
+         it++) {
+        mapped += (*it).second.pf->getMappedSize();
+    }
+
+    list<packid_t>::iterator it = poolLru.end();
+    while (it != poolLru.begin() &&
+           (pool.size() > maxHandles || mapped > maxMappedBytes)) {
+        it--;
+
+        PoolEntry &e = pool[*it];
+        if (!e.pf.unique())
+            continue;
+
+        mapped -= e.pf->getMappedSize();
+        pool.erase(*it);
+        it = poolLru.erase(it);
+        stats.evictions++;
+    }
+}
+
+/*
+ * Deletes a packfile whose objects have all been written elsewhere, its id
+ * is reused.  Handles still held elsewhere keep reading the unlinked file.
+ */
+void
+PackfileManager::removePackfile(packid_t id)
+{
+    Monitor l(poolLock);
+    map<packid_t, PoolEntry>::iterator it = pool.find(id);
+
+    if (it != pool.end()) {
+        poolLru.erase((*it).second.lru);
+        pool.erase(it);
+    }
+
+    if (OriFile_Delete(_getPackfileName(id)) < 0) {
+        WARNING("Could not delete packfile %u", id);
+        return;
+    }
+
+    // The last entry stands for every id from it up
+    deque<packid_t>::iterator fit = lower_bound(freeList.begin(),
+                                                freeList.end(), id);
+    if (fit == freeList.end() || *fit != id)
+        freeList.insert(fit, id);
+    _writeFreeList();
+}
+
 bool
 PackfileManager::hasPackfile(packid_t id)
 {
@@ -0,0 +1,613 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/param.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <boost/tr1/memory.hpp>
+
+#include <oriutil/debug.h>
+#include <oriutil/oriutil.h>
+#include <oriutil/monitor.h>
+#include <oriutil/rwlock.h>
+#include <oriutil/zipcodec.h>
+#include <ori/backup.h>
+#include <ori/largeblob.h>
+#include <ori/localrepo.h>
+#include <ori/packfile.h>
+#include <ori/prefetcher.h>
+#include <ori/tree.h>
+
+#include "tuneables.h"
+
+using namespace std;
+
+Prefetcher::Prefetcher(Repo *remote, LocalRepo *store, bool storeLocally)
+    : remote(remote), store(store), storeLocally(storeLocally),
+      cacheBytes(0), streamClock(0)
+{
+    memset(&stats, 0, sizeof(stats));
+}
+
+Prefetcher::~Prefetcher()
+{
+}
+
+void
+Prefetcher::setStoreLocally(bool val)
+{
+    Monitor l(remoteLock);
+
+    storeLocally = val;
+}
+
+Object::sp
+Prefetcher::getCached(const ObjectHash &hash)
+{
+    Monitor l(lock);
+    ObjectHashMap<Entry>::iterator it = cache.find(hash);
+
+    if (it == cache.end())
+        return Object::sp();
+
+    Entry &e = it->second;
+    stats.requests++;
+    if (e.demand) {
+        // The read that asked for it already paid for the round trip
+        stats.misses++;
+        e.demand = false;
+    } else {
+        stats.hits++;
+    }
+    e.used = true;
+
+    return e.obj;
+}
+
+Object::sp
+Prefetcher::getObject(const ObjectHash &hash)
+{
+    bool waited = false;
+
+    lock.lock();
+    stats.requests++;
+    while (true) {
+        ObjectHashMap<Entry>::iterator it = cache.find(hash);
+        if (it != cache.end()) {
+            Object::sp o = it->second.obj;
+
+            it->second.used = true;
+            it->second.demand = false;
+            if (waited)
+                stats.waits++;
+            else
+                stats.hits++;
+            lock.unlock();
+            return o;
+        }
+
+        // A batch pulled into the packfiles skips the cache
+        if (waited && store->isObjectStored(hash)) {
+            stats.waits++;
+            lock.unlock();
+            return store->getLocalObject(hash);
+        }
+
+        ObjectHashMap<BatchRef>::iterator bit = inflight.find(hash);
+        if (bit == inflight.end() || waited)
+            break;
+
+        // Someone else asked for it, wait until their batch is in
+        BatchRef b = bit->second;
+        b->waiting.insert(hash);
+        lock.unlock();
+        b->done.lock();
+        b->done.unlock();
+        lock.lock();
+        waited = true;
+    }
+
+    stats.misses++;
+
+    ObjectHashVec hashes;
+    hashes.push_back(hash);
+    BatchRef b = startBatch(hashes);
+    lock.unlock();
+
+    return fetch(b, hashes, 1, hash);
+}
+
+bool
+Prefetcher::hasObject(const ObjectHash &hash)
+{
+    {
+        Monitor l(lock);
+
+        if (cache.count(hash) != 0 || inflight.count(hash) != 0)
+            return true;
+    }
+
+    Monitor l(remoteLock);
+    return remote->hasObject(hash);
+}
+
+ObjectInfo
+Prefetcher::getObjectInfo(const ObjectHash &hash)
+{
+    {
+        Monitor l(lock);
+        ObjectHashMap<Entry>::iterator it = cache.find(hash);
+
+        if (it != cache.end())
+            return it->second.obj->getInfo();
+    }
+
+    Monitor l(remoteLock);
+    return remote->getObjectInfo(hash);
+}
+
+void
+Prefetcher::prefetch(const ObjectHashVec &hashes)
+{
+    ObjectHashVec toFetch;
+
+    lock.lock();
+    for (size_t i = 0; i < hashes.size(); i++) {
+        if (!isPresent(hashes[i]) && toFetch.size() < PREFETCH_BATCH_MAX)
+            toFetch.push_back(hashes[i]);
+    }
+    if (toFetch.empty()) {
+        lock.unlock();
+        return;
+    }
+    BatchRef b = startBatch(toFetch);
+    lock.unlock();
+
+    fetch(b, toFetch, 0, ObjectHash());
+}
+
+/*
+ * Fetches the parts under the read along with the next window of parts.  A
+ * new batch is sent once fewer than half a window of parts are left ahead
+ * of the reader, and the window doubles each time that happens.  Reading
+ * backwards or past the parts fetched starts over with the smallest window.
+ */
+void
+Prefetcher::readahead(const ObjectHash &lbHash, const LargeBlob &lb,
+                      uint64_t off, size_t len)
+{
+    map<uint64_t, LBlobEntry>::const_iterator it;
+    uint64_t readEnd = off + len;
+    ObjectHashVec toFetch;
+    size_t numDemand = 0;
+    size_t ahead = 0;
+
+    if (lb.parts.empty() || len == 0)
+        return;
+
+    lock.lock();
+    Stream *s = getStream(lbHash);
+    if (s->window == 0 || off < s->lastOff || off > s->aheadOff) {
+        s->window = PREFETCH_WINDOW_MIN;
+        s->aheadOff = off;
+    }
+    s->lastOff = off;
+
+    // Parts already on their way past the end of this read
+    for (it = lb.parts.lower_bound(readEnd);
+         it != lb.parts.end() && it->first < s->aheadOff &&
+         ahead < s->window / 2;
+         it++)
+        ahead++;
+    if (readEnd <= s->aheadOff && ahead >= s->window / 2) {
+        lock.unlock();
+        return;
+    }
+
+    // Start from the part holding the first byte not fetched yet
+    it = lb.parts.upper_bound(MAX(off, s->aheadOff));
+    if (it != lb.parts.begin())
+        it--;
+
+    ahead = 0;
+    for (; it != lb.parts.end() && ahead < s->window &&
+           toFetch.size() < PREFETCH_BATCH_MAX; it++) {
+        const LBlobEntry &e = it->second;
+
+        if (it->first >= readEnd)
+            ahead++;
+        s->aheadOff = it->first + e.length;
+        if (isPresent(e.hash))
+            continue;
+        if (it->first < readEnd)
+            numDemand++;
+        toFetch.push_back(e.hash);
+    }
+    s->window = MIN(s->window * 2, (size_t)PREFETCH_WINDOW_MAX);
+
+    if (toFetch.empty()) {
+        lock.unlock();
+        return;
+    }
+    BatchRef b = startBatch(toFetch);
+    lock.unlock();
+
+    fetch(b, toFetch, numDemand, ObjectHash());
+}
+
+void
+Prefetcher::prefetchTree(const Tree &t)
+{
+    map<string, TreeEntry>::const_iterator it;
+    ObjectHashVec hashes;
+
+    for (it = t.tree.begin(); it != t.tree.end(); it++) {
+        const TreeEntry &te = it->second;
+
+        if (te.type == TreeEntry::Tree) {
+            hashes.push_back(te.hash);
+        } else if (te.attrs.has(ATTR_SYMLINK) &&
+                   te.attrs.getAs<bool>(ATTR_SYMLINK)) {
+            hashes.push_back(te.hash);
+        }
+    }
+
+    if (!hashes.empty())
+        prefetch(hashes);
+}
+
+/*
+ * storeLock is read locked to look for the objects already stored, and then
+ * the objects are read into memory with only the remote connection held.  The
+ * batch is finished before storeLock is write locked so that readers waiting
+ * on it while holding storeLock can go ahead, so the objects they wait for
+ * are put in the cache first.  Objects that another reader fetched and stored
+ * in the meantime are dropped.
+ */
+uint64_t
+Prefetcher::pull(const ObjectHashVec &hashes, uint64_t rate, RWLock *storeLock)
+{
+    ObjectHashVec toFetch;
+    ObjectHashSet seen;
+    vector<string> infos;
+    vector<string> payloads;
+    uint64_t bytes = 0;
+    RWKey::sp key;
+
+    if (storeLock != NULL)
+        key = storeLock->readLock();
+    lock.lock();
+    for (size_t i = 0; i < hashes.size(); i++) {
+        if (!isPresent(hashes[i]) && seen.insert(hashes[i]).second)
+            toFetch.push_back(hashes[i]);
+    }
+    if (toFetch.empty()) {
+        lock.unlock();
+        return 0;
+    }
+    BatchRef b = startBatch(toFetch);
+    lock.unlock();
+    key.reset();
+
+    try {
+        Monitor l(remoteLock);
+        bytestream::ap bs(remote->getObjects(toFetch));
+
+        if (bs.get()) {
+            ratestream rs(bs.get(), rate);
+
+            while (true) {
+                ASSERT(sizeof(numobjs_t) == sizeof(uint32_t));
+                numobjs_t num = rs.readUInt32();
+                size_t first = infos.size();
+
+                if (num == 0)
+                    break;
+
+                for (size_t i = 0; i < num; i++) {
+                    string info_str(ObjectInfo::SIZE, '\0');
+
+                    rs.readExact((uint8_t *)&info_str[0], ObjectInfo::SIZE);
+                    infos.push_back(info_str);
+                    payloads.push_back(string(rs.readUInt32(), '\0'));
+                }
+                for (size_t i = first; i < payloads.size(); i++) {
+                    if (!payloads[i].empty())
+                        rs.readExact((uint8_t *)&payloads[i][0],
+                                     payloads[i].size());
+                }
+            }
+            bytes = rs.bytesRead();
+        }
+    } catch (...) {
+        Monitor l(lock);
+
+        finishBatch(b, toFetch);
+        throw;
+    }
+
+    lock.lock();
+    stats.batches++;
+    stats.objects += toFetch.size();
+    stats.bytes += bytes;
+    for (size_t i = 0; i < infos.size(); i++) {
+        ObjectInfo info;
+
+        info.fromString(infos[i]);
+        if (b->waiting.count(info.hash) == 0)
+            continue;
+
+        bytestream::ap zs(ZipCodec_Decompress(new strstream(payloads[i]),
+                                              info));
+        if (!zs.get()) {
+            WARNING("Cannot decompress %s", info.hash.hex().c_str());
+            continue;
+        }
+        insert(Object::sp(new MemoryObject(info, zs->readAll())), false, true);
+    }
+    finishBatch(b, toFetch);
+    lock.unlock();
+
+    // Stores from demand fetches are made with the remote connection held
+    if (storeLock != NULL)
+        key = storeLock->writeLock();
+    Monitor l(remoteLock);
+    vector<size_t> keep;
+    strwstream raw;
+
+    for (size_t i = 0; i < infos.size(); i++) {
+        ObjectInfo info;
+
+        info.fromString(infos[i]);
+        if (!store->isObjectStored(info.hash))
+            keep.push_back(i);
+    }
+    if (keep.empty())
+        return bytes;
+
+    // The objects are stored as they were sent, without recompressing
+    raw.writeUInt32(keep.size());
+    for (size_t i = 0; i < keep.size(); i++) {
+        raw.write(infos[keep[i]].data(), ObjectInfo::SIZE);
+        raw.writeUInt32(payloads[keep[i]].size());
+    }
+    for (size_t i = 0; i < keep.size(); i++)
+        raw.write(payloads[keep[i]].data(), payloads[keep[i]].size());
+    raw.writeUInt32(0);
+
+    strstream ss(raw.str());
+    store->receive(&ss);
+
+    return bytes;
+}
+
+PrefetchStats
+Prefetcher::getStats()
+{
+    Monitor l(lock);
+
+    return stats;
+}
+
+/*
+ * Returns true if the object does not need to be fetched.  Called with the
+ * lock held.
+ */
+bool
+Prefetcher::isPresent(const ObjectHash &hash)
+{
+    if (cache.count(hash) != 0 || inflight.count(hash) != 0)
+        return true;
+
+    return store->isObjectStored(hash);
+}
+
+Prefetcher::Stream *
+Prefetcher::getStream(const ObjectHash &lbHash)
+{
+    map<ObjectHash, Stream>::iterator it = streams.find(lbHash);
+
+    if (it == streams.end()) {
+        if (streams.size() >= PREFETCH_STREAMS) {
+            map<ObjectHash, Stream>::iterator old = streams.begin();
+
+            for (it = streams.begin(); it != streams.end(); it++) {
+                if (it->second.lastUse < old->second.lastUse)
+                    old = it;
+            }
+            streams.erase(old);
+        }
+
+        Stream s;
+        s.lastOff = 0;
+        s.aheadOff = 0;
+        s.window = 0;
+        it = streams.insert(make_pair(lbHash, s)).first;
+    }
+
+    it->second.lastUse = ++streamClock;
+    return &it->second;
+}
+
+/*
+ * Marks the objects as on their way.  Called with the lock held and the
+ * returned batch stays locked until fetch is done with it.
+ */
+Prefetcher::BatchRef
+Prefetcher::startBatch(const ObjectHashVec &hashes)
+{
+    BatchRef b(new Batch());
+
+    b->done.lock();
+    for (size_t i = 0; i < hashes.size(); i++)
+        inflight[hashes[i]] = b;
+
+    return b;
+}
+
+/*
+ * Wakes up the requests waiting for a batch.  Called with the lock held.
+ */
+void
+Prefetcher::finishBatch(BatchRef b, const ObjectHashVec &hashes)
+{
+    for (size_t i = 0; i < hashes.size(); i++)
+        inflight.erase(hashes[i]);
+    b->done.unlock();
+}
+
+/*
+ * Sends one getObjects request and adds what comes back to the cache.  The
+ * first numDemand hashes are needed by a read in progress.  Returns the
+ * object for wanted if it is given.
+ */
+Object::sp
+Prefetcher::fetch(BatchRef b, const ObjectHashVec &hashes,
+                  size_t numDemand, const ObjectHash &wanted)
+{
+    vector<Object::sp> objs;
+    Object::sp rval;
+    uint64_t bytes = 0;
+
+    try {
+        Monitor l(remoteLock);
+        strwstream raw;
+        bytestream::ap bs(remote->getObjects(hashes));
+
+        while (bs.get()) {
+            ASSERT(sizeof(numobjs_t) == sizeof(uint32_t));
+            numobjs_t num = bs->readUInt32();
+            vector<ObjectInfo> infos;
+            vector<uint32_t> sizes;
+
+            if (num == 0)
+                break;
+
+            raw.writeUInt32(num);
+            for (size_t i = 0; i < num; i++) {
+                string info_str(ObjectInfo::SIZE, '\0');
+                ObjectInfo info;
+
+                bs->readExact((uint8_t *)&info_str[0], ObjectInfo::SIZE);
+                info.fromString(info_str);
+                infos.push_back(info);
+                sizes.push_back(bs->readUInt32());
+
+                raw.write(info_str.data(), ObjectInfo::SIZE);
+                raw.writeUInt32(sizes.back());
+            }
+
+            for (size_t i = 0; i < num; i++) {
+                string payload(sizes[i], '\0');
+
+                if (sizes[i] != 0)
+                    bs->readExact((uint8_t *)&payload[0], sizes[i]);
+                raw.write(payload.data(), payload.size());
+                bytes += sizes[i];
+
+                bytestream::ap zs(ZipCodec_Decompress(new strstream(payload),
+                                                      infos[i]));
+                if (!zs.get()) {
+                    WARNING("Cannot decompress %s",
+                            infos[i].hash.hex().c_str());
+                    continue;
+                }
+                objs.push_back(Object::sp(new MemoryObject(infos[i],
+                                                           zs->readAll())));
+            }
+        }
+
+        // The objects are stored as they were sent, without recompressing
+        if (storeLocally && !objs.empty()) {
+            raw.writeUInt32(0);
+            strstream rs(raw.str());
+            store->receive(&rs);
+        }
+    } catch (...) {
+        Monitor l(lock);
+
+        finishBatch(b, hashes);
+        throw;
+    }
+
+    lock.lock();
+    stats.batches++;
+    stats.objects += objs.size();
+    stats.bytes += bytes;
+    for (size_t i = 0; i < objs.size(); i++) {
+        const ObjectHash &hash = objs[i]->getInfo().hash;
+        bool demand = false;
+
+        if (hash == wanted) {
+            rval = objs[i];
+        } else {
+            for (size_t j = 0; j < numDemand; j++) {
+                if (hashes[j] == hash) {
+                    demand = true;
+                    break;
+                }
+            }
+            if (!demand)
+                stats.prefetched++;
+        }
+        insert(objs[i], hash == wanted, demand);
+    }
+    finishBatch(b, hashes);
+    lock.unlock();
+
+    if (!wanted.isEmpty() && !rval)
+        LOG("Object not available on remote machine!");
+
+    return rval;
+}
+
+/*
+ * Adds an object to the cache and drops the oldest ones past
+ * PREFETCH_CACHE_SIZE bytes.  Called with the lock held.
+ */
+void
+Prefetcher::insert(Object::sp obj, bool used, bool demand)
+{
+    const ObjectHash &hash = obj->getInfo().hash;
+
+    if (cache.count(hash) != 0)
+        return;
+
+    Entry e;
+    e.obj = obj;
+    e.used = used;
+    e.demand = demand;
+    cache[hash] = e;
+    cacheOrder.push_back(hash);
+    cacheBytes += obj->getInfo().payload_size;
+
+    while (cacheBytes > PREFETCH_CACHE_SIZE && cacheOrder.size() > 1) {
+        ObjectHashMap<Entry>::iterator it = cache.find(cacheOrder.front());
+
+        cacheOrder.pop_front();
+        if (it == cache.end())
+            continue;
+        if (!it->second.used)
+            stats.wasted++;
+        cacheBytes -= it->second.obj->getInfo().payload_size;
+        cache.erase(it);
+    }
+}
@@ -0,0 +1,413 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <exception>
+
+#include "tuneables.h"
+
+#include <oriutil/debug.h>
+#include <oriutil/oriutil.h>
+#include <oriutil/stream.h>
+#include <oriutil/systemexception.h>
+#include <oriutil/objectinfo.h>
+#include <oriutil/zipcodec.h>
+#include <ori/commit.h>
+#include <ori/tree.h>
+#include <ori/largeblob.h>
+#include <ori/localrepo.h>
+#include <ori/refcountbuilder.h>
+
+using namespace std;
+
+typedef pair<ObjectHash, refcount_t> RefcountEntry;
+
+/*
+ * Sorted counts read back from a run, or left in memory at the end.
+ */
+struct RefcountSource
+{
+    RefcountSource(int fd, size_t entries)
+        : in(NULL), left(entries), mem(), memIx(0), cur(), valid(false)
+    {
+        if (fd >= 0) {
+            lseek(fd, 0, SEEK_SET);
+            in = new fdbufstream(fd);
+        }
+    }
+    ~RefcountSource()
+    {
+        delete in;
+    }
+    void advance()
+    {
+        if (in != NULL) {
+            valid = left > 0;
+            if (valid) {
+                in->readHash(cur.first);
+                cur.second = in->readInt32();
+                left--;
+                if (in->error()) {
+                    WARNING("Cannot read reference count run");
+                    valid = false;
+                }
+            }
+        } else {
+            valid = memIx < mem.size();
+            if (valid)
+                cur = mem[memIx++];
+        }
+    }
+
+    fdbufstream *in;
+    size_t left;
+    vector<RefcountEntry> mem;
+    size_t memIx;
+    RefcountEntry cur;
+    bool valid;
+};
+
+static bool
+RefcountBuilder_Decode(const PackfileScanBatch *b,
+                       const PackfileScanItem &item,
+                       vector<ObjectHash> *refs)
+{
+    bytestream::ap bs(ZipCodec_Decompress(new strstream(b->getStored(item)),
+                                          item.info));
+    if (!bs.get())
+        return false;
+
+    string payload = bs->readAll();
+    if (bs->error() || payload.size() != item.info.payload_size)
+        return false;
+
+    try {
+        switch (item.info.type) {
+            case ObjectInfo::Commit:
+            {
+                Commit c;
+
+                c.fromBlob(payload);
+                refs->push_back(c.getTree());
+                if (c.getParents().first != EMPTY_COMMIT)
+                    refs->push_back(c.getParents().first);
+                if (!c.getParents().second.isEmpty())
+                    refs->push_back(c.getParents().second);
+                break;
+            }
+            case ObjectInfo::Tree:
+            {
+                Tree t;
+
+                t.fromBlob(payload);
+                for (map<string, TreeEntry>::iterator it = t.tree.begin();
+                     it != t.tree.end();
+                     it++) {
+                    refs->push_back(it->second.hash);
+                }
+                break;
+            }
+            case ObjectInfo::LargeBlob:
+            {
+                LargeBlob lb(NULL);
+
+                lb.fromBlob(payload);
+                for (map<uint64_t, LBlobEntry>::iterator it = lb.parts.begin();
+                     it != lb.parts.end();
+                     it++) {
+                    refs->push_back(it->second.hash);
+                }
+                break;
+            }
+            default:
+                return false;
+        }
+    } catch (exception &e) {
+        return false;
+    }
+
+    return true;
+}
+
+static size_t
+RefcountBuilder_Shard(const ObjectHash &hash)
+{
+    return ((size_t)hash.hash[0] * REFCOUNT_SHARDS) >> 8;
+}
+
+RefcountBuilder::RefcountBuilder(LocalRepo *r)
+    : PackfileScanner(REFCOUNT_BATCH_SIZE), repo(r),
+      maxEntries(REFCOUNT_MEM_ENTRIES), objectsRead(0), ok(true), failed(),
+      shards(), runs(), merging(false), sources()
+{
+    for (size_t i = 0; i < REFCOUNT_SHARDS; i++) {
+        shards.push_back(new Shard());
+    }
+}
+
+RefcountBuilder::~RefcountBuilder()
+{
+    for (size_t i = 0; i < sources.size(); i++) {
+        delete sources[i];
+    }
+    for (size_t i = 0; i < runs.size(); i++) {
+        ::close(runs[i].fd);
+    }
+    for (size_t i = 0; i < shards.size(); i++) {
+        delete shards[i];
+    }
+}
+
+/*
+ * Sorting the references first means each shard is locked once per call.
+ */
+void
+RefcountBuilder::addRefs(vector<ObjectHash> &refs)
+{
+    size_t i = 0;
+
+    sort(refs.begin(), refs.end());
+    while (i < refs.size()) {
+        size_t s = RefcountBuilder_Shard(refs[i]);
+        Shard *shard = shards[s];
+
+        shard->lock.lock();
+        for (; i < refs.size() && RefcountBuilder_Shard(refs[i]) == s; i++) {
+            shard->counts[refs[i]] += 1;
+        }
+        shard->lock.unlock();
+    }
+    refs.clear();
+}
+
+/*
+ * Only the commits, trees and large blobs are read.  Objects that the index
+ * locates elsewhere are stale copies and are skipped.
+ */
+bool
+RefcountBuilder::wantPayload(packid_t id, const PackfileScanItem &item)
+{
+    Index &index = repo->index;
+
+    if (item.info.type != ObjectInfo::Commit &&
+        item.info.type != ObjectInfo::Tree &&
+        item.info.type != ObjectInfo::LargeBlob)
+        return false;
+    if (!index.hasObject(item.info.hash))
+        return false;
+
+    IndexEntry e = index.getEntry(item.info.hash);
+    return e.packfile == id && e.offset == item.offset;
+}
+
+void
+RefcountBuilder::startBatch(PackfileScanBatch *b)
+{
+    failed.assign(b->items.size(), 0);
+}
+
+/*
+ * Decode a share of the batch, called by the worker threads.
+ */
+void
+RefcountBuilder::processBatch(PackfileScanBatch *b, size_t first, size_t step)
+{
+    vector<ObjectHash> refs;
+
+    for (size_t i = first; i < b->items.size(); i += step) {
+        failed[i] = !RefcountBuilder_Decode(b, b->items[i], &refs);
+    }
+    addRefs(refs);
+}
+
+void
+RefcountBuilder::finishBatch(PackfileScanBatch *b)
+{
+    for (size_t i = 0; i < b->items.size(); i++) {
+        if (failed[i]) {
+            WARNING("Cannot decode object %s",
+                    b->items[i].info.hash.hex().c_str());
+            ok = false;
+        }
+    }
+    objectsRead += b->items.size();
+
+    if (countEntries() > maxEntries)
+        spill();
+}
+
+void
+RefcountBuilder::scanError(packid_t id, const string &what)
+{
+    WARNING("%s %s", what.c_str(),
+            repo->packfiles->getPackfilePath(id).c_str());
+    ok = false;
+}
+
+size_t
+RefcountBuilder::countEntries()
+{
+    size_t n = 0;
+
+    for (size_t i = 0; i < shards.size(); i++) {
+        n += shards[i]->counts.size();
+    }
+
+    return n;
+}
+
+/*
+ * Move a shard's counts to a sorted vector, releasing the table's memory.
+ */
+void
+RefcountBuilder::sortShard(Shard *s, vector<RefcountEntry> *out)
+{
+    size_t base = out->size();
+
+    out->insert(out->end(), s->counts.begin(), s->counts.end());
+    sort(out->begin() + base, out->end());
+
+    RefcountMap empty;
+    s->counts.swap(empty);
+}
+
+/*
+ * Write the counts in memory to an unlinked temporary file.  Shards cover
+ * increasing hash ranges so sorting each of them sorts the whole run.
+ */
+void
+RefcountBuilder::spill()
+{
+    string templ = repo->getRootPath() + ORI_PATH_TMP + "refcount.XXXXXX";
+    Run r;
+
+    r.fd = mkstemp(&templ[0]);
+    if (r.fd < 0) {
+        perror("RefcountBuilder::spill mkstemp");
+        throw SystemException();
+    }
+    unlink(templ.c_str());
+    r.entries = 0;
+
+    {
+        fdbufwstream out(r.fd);
+
+        for (size_t i = 0; i < shards.size(); i++) {
+            vector<RefcountEntry> sorted;
+
+            sortShard(shards[i], &sorted);
+            for (size_t j = 0; j < sorted.size(); j++) {
+                out.writeHash(sorted[j].first);
+                out.writeInt32(sorted[j].second);
+            }
+            r.entries += sorted.size();
+        }
+
+        if (out.flush() < 0) {
+            perror("RefcountBuilder::spill write");
+            ::close(r.fd);
+            throw SystemException();
+        }
+    }
+
+    DLOG("Wrote a run of %lu reference counts", r.entries);
+    runs.push_back(r);
+}
+
+bool
+RefcountBuilder::run()
+{
+    vector<packid_t> ids = repo->packfiles->getPackfileList();
+
+    ok = true;
+    sort(ids.begin(), ids.end());
+    for (size_t i = 0; i < ids.size(); i++) {
+        addPackfile(ids[i], repo->packfiles->getPackfilePath(ids[i]));
+    }
+    scan();
+
+    return ok;
+}
+
+void
+RefcountBuilder::startMerge()
+{
+    RefcountSource *mem = new RefcountSource(-1, 0);
+
+    for (size_t i = 0; i < runs.size(); i++) {
+        sources.push_back(new RefcountSource(runs[i].fd, runs[i].entries));
+    }
+    for (size_t i = 0; i < shards.size(); i++) {
+        sortShard(shards[i], &mem->mem);
+    }
+    sources.push_back(mem);
+
+    for (size_t i = 0; i < sources.size(); i++) {
+        sources[i]->advance();
+    }
+    merging = true;
+}
+
+/*
+ * Merge the runs and the counts left in memory, a hash may appear in
+ * several of them.
+ */
+bool
+RefcountBuilder::next(Chunk *chunk)
+{
+    if (!merging)
+        startMerge();
+
+    chunk->clear();
+    while (chunk->size() < REFCOUNT_CHUNK) {
+        RefcountSource *min = NULL;
+
+        for (size_t i = 0; i < sources.size(); i++) {
+            if (sources[i]->valid &&
+                (min == NULL || sources[i]->cur.first < min->cur.first))
+                min = sources[i];
+        }
+        if (min == NULL)
+            break;
+
+        RefcountEntry e = min->cur;
+        e.second = 0;
+        for (size_t i = 0; i < sources.size(); i++) {
+            RefcountSource *s = sources[i];
+
+            if (s->valid && s->cur.first == e.first) {
+                e.second += s->cur.second;
+                s->advance();
+            }
+        }
+        chunk->push_back(e);
+    }
+
+    return !chunk->empty();
+}
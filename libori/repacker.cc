@@ -0,0 +1,377 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <algorithm>
+#include <iostream>
+
+#include "tuneables.h"
+
+#include <oriutil/debug.h>
+#include <oriutil/oriutil.h>
+#include <oriutil/objectinfo.h>
+#include <oriutil/stopwatch.h>
+#include <ori/commit.h>
+#include <ori/tree.h>
+#include <ori/largeblob.h>
+#include <ori/localrepo.h>
+#include <ori/packfile.h>
+#include <ori/repacker.h>
+
+using namespace std;
+
+RepackStats::RepackStats()
+    : packsBefore(0), packsAfter(0), hotObjects(0), coldObjects(0),
+      otherObjects(0), bytes(0), time(0)
+{
+    memset(before, 0, sizeof(before));
+    memset(after, 0, sizeof(after));
+}
+
+static bool
+Repacker_PackOrder(const IndexEntry &e1, const IndexEntry &e2)
+{
+    if (e1.packfile != e2.packfile)
+        return e1.packfile < e2.packfile;
+    return e1.offset < e2.offset;
+}
+
+Repacker::Repacker(LocalRepo *r)
+    : repo(r), dryRun(false), stats()
+{
+}
+
+Repacker::~Repacker()
+{
+}
+
+const char *
+Repacker::pullName(RepackPull pull)
+{
+    const char *names[] = { "checkout HEAD", "recent commits", "clone" };
+
+    ASSERT(pull < REPACK_PULLS);
+    return names[pull];
+}
+
+/*
+ * Returns the stored commits of the history of HEAD, newest first.
+ */
+vector<ObjectHash>
+Repacker::getHistory()
+{
+    vector<ObjectHash> history;
+    deque<ObjectHash> q;
+    ObjectHashSet visited;
+    ObjectHash head = repo->getHead();
+
+    if (!head.isEmpty())
+        q.push_back(head);
+
+    while (!q.empty()) {
+        ObjectHash hash = q.front();
+        q.pop_front();
+
+        if (visited.count(hash) != 0 || !repo->isObjectStored(hash))
+            continue;
+        visited.insert(hash);
+        history.push_back(hash);
+
+        pair<ObjectHash, ObjectHash> p = repo->getCommit(hash).getParents();
+        if (!p.first.isEmpty())
+            q.push_back(p.first);
+        if (!p.second.isEmpty())
+            q.push_back(p.second);
+    }
+
+    return history;
+}
+
+/*
+ * Appends the stored objects of a commit that are not in seen: the commit,
+ * its trees and then its files.
+ */
+void
+Repacker::collectCommit(const ObjectHash &commit, ObjectHashSet *seen,
+                        vector<ObjectHash> *out)
+{
+    vector<ObjectHash> files;
+
+    if (seen->count(commit) != 0 || !repo->isObjectStored(commit))
+        return;
+    seen->insert(commit);
+    out->push_back(commit);
+
+    collectTree(repo->getCommit(commit).getTree(), seen, out, &files);
+    out->insert(out->end(), files.begin(), files.end());
+}
+
+/*
+ * Walks a tree depth first, the files of a directory go before those of
+ * its subdirectories.  Subtrees in seen were collected with everything
+ * under them and are skipped.
+ */
+void
+Repacker::collectTree(const ObjectHash &tree, ObjectHashSet *seen,
+                      vector<ObjectHash> *trees, vector<ObjectHash> *files)
+{
+    if (seen->count(tree) != 0 || !repo->isObjectStored(tree))
+        return;
+    seen->insert(tree);
+    trees->push_back(tree);
+
+    Tree t = repo->getTree(tree);
+    for (Tree::iterator it = t.begin(); it != t.end(); it++) {
+        const TreeEntry &te = (*it).second;
+
+        if (te.type == TreeEntry::Tree || seen->count(te.hash) != 0 ||
+            !repo->isObjectStored(te.hash))
+            continue;
+        seen->insert(te.hash);
+        files->push_back(te.hash);
+
+        if (te.type != TreeEntry::LargeBlob)
+            continue;
+
+        LargeBlob lb = repo->getLargeBlob(te.hash);
+        for (map<uint64_t, LBlobEntry>::iterator pit = lb.parts.begin();
+             pit != lb.parts.end();
+             pit++) {
+            const ObjectHash &part = (*pit).second.hash;
+
+            if (seen->count(part) != 0 || !repo->isObjectStored(part))
+                continue;
+            seen->insert(part);
+            files->push_back(part);
+        }
+    }
+
+    for (Tree::iterator it = t.begin(); it != t.end(); it++) {
+        if ((*it).second.type == TreeEntry::Tree)
+            collectTree((*it).second.hash, seen, trees, files);
+    }
+}
+
+/*
+ * Adds the packfiles and contiguous runs of stored bytes the objects take,
+ * as Packfile::transmit would read them.
+ */
+void
+Repacker::addLayout(const vector<ObjectHash> &objs, RepackLayout *l)
+{
+    vector<IndexEntry> entries;
+    packid_t lastPack = 0;
+    offset_t lastEnd = 0;
+    bool first = true;
+
+    for (size_t i = 0; i < objs.size(); i++) {
+        if (repo->index.hasObject(objs[i]))
+            entries.push_back(repo->index.getEntry(objs[i]));
+    }
+    sort(entries.begin(), entries.end(), Repacker_PackOrder);
+
+    l->objects += entries.size();
+    for (size_t i = 0; i < entries.size(); i++) {
+        const IndexEntry &e = entries[i];
+
+        if (first || e.packfile != lastPack)
+            l->packs++;
+        if (e.packed_size == 0)
+            continue;
+        if (first || e.packfile != lastPack || e.offset != lastEnd)
+            l->blocks++;
+
+        first = false;
+        lastPack = e.packfile;
+        lastEnd = e.offset + e.packed_size;
+    }
+}
+
+void
+Repacker::measure(const vector<ObjectHash> &history,
+                  RepackLayout layout[REPACK_PULLS])
+{
+    vector<ObjectHash> objs;
+    ObjectHashSet seen;
+
+    memset(layout, 0, sizeof(RepackLayout) * REPACK_PULLS);
+    if (history.empty())
+        return;
+
+    collectCommit(history[0], &seen, &objs);
+    addLayout(objs, &layout[REPACK_PULL_CHECKOUT]);
+
+    for (size_t i = 0; i < history.size() && i < REPACK_RECENT_COMMITS; i++) {
+        ObjectHash parent = repo->getCommit(history[i]).getParents().first;
+        vector<ObjectHash> parentObjs;
+
+        seen.clear();
+        objs.clear();
+        if (!parent.isEmpty())
+            collectCommit(parent, &seen, &parentObjs);
+        collectCommit(history[i], &seen, &objs);
+        addLayout(objs, &layout[REPACK_PULL_RECENT]);
+    }
+
+    seen.clear();
+    objs.clear();
+    for (size_t i = 0; i < history.size(); i++)
+        collectCommit(history[i], &seen, &objs);
+    addLayout(objs, &layout[REPACK_PULL_CLONE]);
+}
+
+/*
+ * Copies the objects in order to new packfiles that hold nothing else.
+ */
+void
+Repacker::writeSection(const vector<ObjectHash> &objs)
+{
+    Packfile::sp pf;
+    PfTransaction::sp tr;
+
+    for (size_t i = 0; i < objs.size(); i++) {
+        if (!repo->index.hasObject(objs[i]))
+            continue;
+
+        IndexEntry e = repo->index.getEntry(objs[i]);
+        string stored = repo->packfiles->getPackfile(e.packfile)
+                            ->getStoredPayload(e);
+
+        if (!pf.get()) {
+            pf = repo->packfiles->newPackfile();
+            tr = pf->begin(&repo->index);
+            tr->moving = true;
+        }
+        if (tr->full()) {
+            tr->commit();
+            if (pf->full())
+                pf = repo->packfiles->newPackfile();
+            tr = pf->begin(&repo->index);
+            tr->moving = true;
+        }
+
+        tr->addStored(e.info, stored);
+        stats.bytes += stored.size();
+    }
+
+    if (tr.get())
+        tr->commit();
+}
+
+void
+Repacker::run()
+{
+    Stopwatch sw = Stopwatch();
+    vector<ObjectHash> history;
+    vector<ObjectHash> hot, cold, other;
+    ObjectHashSet seen, headObjs;
+
+    sw.start();
+    stats = RepackStats();
+
+    // Other processes must not read or append to the packfiles replaced
+    LocalRepoLock::sp _lock(repo->lock());
+
+    // Nothing may be left in or added to the packfiles being replaced
+    if (repo->currTransaction.get()) {
+        repo->currTransaction->commit();
+        repo->currTransaction.reset();
+    }
+    repo->currPackfile.reset();
+    repo->endGroup();
+
+    vector<packid_t> oldPacks = repo->packfiles->getPackfileList();
+    stats.packsBefore = oldPacks.size();
+
+    history = getHistory();
+    measure(history, stats.before);
+    if (dryRun) {
+        stats.packsAfter = stats.packsBefore;
+        memcpy(stats.after, stats.before, sizeof(stats.after));
+        sw.stop();
+        stats.time = sw.getElapsedTime();
+        return;
+    }
+
+    /*
+     * Each object is grouped with the oldest commit that reaches it, which
+     * is the one that added it, and the groups are written in history
+     * order, newest first, so a pull of a commit reads its group from each
+     * section.
+     */
+    vector<vector<ObjectHash> > added(history.size());
+    for (size_t i = history.size(); i > 0; i--)
+        collectCommit(history[i - 1], &seen, &added[i - 1]);
+
+    if (!history.empty()) {
+        vector<ObjectHash> objs;
+        collectCommit(history[0], &headObjs, &objs);
+    }
+    for (size_t i = 0; i < added.size(); i++) {
+        for (size_t j = 0; j < added[i].size(); j++) {
+            if (headObjs.count(added[i][j]) != 0)
+                hot.push_back(added[i][j]);
+            else
+                cold.push_back(added[i][j]);
+        }
+    }
+
+    /*
+     * Everything else in its current order.  Objects waiting for gc to purge
+     * them are copied too, since gc finds them through the index and the
+     * packfiles they are in now are removed.
+     */
+    set<ObjectInfo> all = repo->index.getList();
+    vector<IndexEntry> rest;
+    for (set<ObjectInfo>::iterator it = all.begin(); it != all.end(); it++) {
+        const ObjectHash &hash = (*it).hash;
+
+        if (seen.count(hash) != 0)
+            continue;
+        rest.push_back(repo->index.getEntry(hash));
+    }
+    sort(rest.begin(), rest.end(), Repacker_PackOrder);
+    for (size_t i = 0; i < rest.size(); i++)
+        other.push_back(rest[i].info.hash);
+
+    stats.hotObjects = hot.size();
+    stats.coldObjects = cold.size();
+    stats.otherObjects = other.size();
+
+    writeSection(hot);
+    writeSection(cold);
+    writeSection(other);
+
+    // The index must point at the new copies before the old ones go
+    repo->endGroup();
+    for (size_t i = 0; i < oldPacks.size(); i++)
+        repo->packfiles->removePackfile(oldPacks[i]);
+    // Drop the superseded entries from the index log
+    repo->index.rewrite();
+
+    stats.packsAfter = repo->packfiles->getPackfileList().size();
+    measure(history, stats.after);
+
+    sw.stop();
+    stats.time = sw.getElapsedTime();
+}
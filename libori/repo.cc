@@ -15,6 +15,11 @@
  */
 
 #include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/param.h>
 
 #include <string>
 #include <vector>
@@ -28,7 +33,9 @@
 #include <oriutil/oriutil.h>
 #include <oriutil/orifile.h>
 #include <oriutil/oricrypt.h>
+#include <oriutil/systemexception.h>
 #include <oriutil/dag.h>
+#include <oriutil/zipcodec.h>
 
 #include <ori/object.h>
 #include <ori/largeblob.h>
@@ -118,6 +125,29 @@ Repo::addSmallFile(const string &path)
     return addBlob(ObjectInfo::Blob, ds.readAll());
 }
 
+/*
+ * Add the contents of a small file that is held in memory rather than on
+ * disk, the name is passed to beginFile as with addFile.
+ */
+ObjectHash
+Repo::addFileContents(const string &blob, const string &name)
+{
+    ObjectHash hash;
+
+    ASSERT(blob.size() <= LARGEFILE_MINIMUM);
+
+    beginFile(name);
+    try {
+        hash = addBlob(ObjectInfo::Blob, blob);
+    } catch (...) {
+        endFile();
+        throw;
+    }
+    endFile();
+
+    return hash;
+}
+
 /*
  * Add a file to the repository. This is a low-level interface.
  */
@@ -146,22 +176,102 @@ Repo::addLargeFile(const string &path)
 
 /*
  * Add a file to the repository. This is an internal interface that pusheds the
- * work to addLargeFile or addSmallFile based on our size threshold.
+ * work to addLargeFile or addSmallFile based on our size threshold.  The name
+ * is passed to beginFile when path is a temporary copy of the real file.
  */
 pair<ObjectHash, ObjectHash>
-Repo::addFile(const string &path)
+Repo::addFile(const string &path, const string &name)
 {
     size_t sz = OriFile_GetSize(path);
+    pair<ObjectHash, ObjectHash> hashes;
+
+    beginFile(name == "" ? path : name);
+    try {
+        if (sz > LARGEFILE_MINIMUM)
+            hashes = addLargeFile(path);
+        else
+            hashes = make_pair(addSmallFile(path), ObjectHash());
+    } catch (...) {
+        endFile();
+        throw;
+    }
+    endFile();
 
-    if (sz > LARGEFILE_MINIMUM)
-        return addLargeFile(path);
-    else
-        return make_pair(addSmallFile(path), ObjectHash());
+    return hashes;
 }
 
 
 
 
+/*
+ * Add a file that was modified from the large blob base.  The ranges in
+ * dirty were written to path at their file offsets and the rest of the file
+ * is unchanged from base, so only the parts around the written ranges are
+ * read and chunked again.  See LargeBlob::chunkModified.
+ */
+pair<ObjectHash, ObjectHash>
+Repo::addModifiedFile(const string &path, const LargeBlob &base,
+                      const map<uint64_t, uint64_t> &dirty,
+                      const string &name)
+{
+    size_t sz = OriFile_GetSize(path);
+    pair<ObjectHash, ObjectHash> hashes;
+    int fd;
+
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw SystemException(errno);
+
+    beginFile(name == "" ? path : name);
+    try {
+        if (sz > LARGEFILE_MINIMUM) {
+            LargeBlob lb = LargeBlob(this);
+
+            lb.chunkModified(base, fd, dirty, sz);
+            hashes = make_pair(addBlob(ObjectInfo::LargeBlob, lb.getBlob()),
+                               lb.totalHash);
+        } else {
+            // Small enough to store as a single blob
+            string blob;
+            blob.resize(sz);
+
+            size_t off = 0;
+            while (off < sz) {
+                ssize_t res = base.readModified((uint8_t *)&blob[off],
+                                                sz - off, off, fd, dirty);
+                if (res <= 0)
+                    throw SystemException(res < 0 ? -res : EIO);
+                off += res;
+            }
+            hashes = make_pair(addBlob(ObjectInfo::Blob, blob), ObjectHash());
+        }
+    } catch (...) {
+        endFile();
+        close(fd);
+        throw;
+    }
+    endFile();
+    close(fd);
+
+    return hashes;
+}
+
+
+ssize_t
+Repo::readPayload(const ObjectHash &id, uint8_t *buf, size_t n, off_t off)
+{
+    Object::sp o(getObject(id));
+    if (!o.get())
+        return -ENOENT;
+
+    string payload = o->getPayload();
+    if (off >= (off_t)payload.size())
+        return 0;
+    n = MIN(n, payload.size() - off);
+    memcpy(buf, payload.data() + off, n);
+    return n;
+}
+
 Tree
 Repo::getTree(const ObjectHash &treeId)
 {
@@ -198,6 +308,21 @@ Repo::getCommit(const ObjectHash &commitId)
     return c;
 }
 
+/*
+ * Load several commits, in the order requested.
+ */
+vector<Commit>
+Repo::getCommits(const ObjectHashVec &commitIds)
+{
+    vector<Commit> rval;
+
+    for (size_t i = 0; i < commitIds.size(); i++) {
+        rval.push_back(getCommit(commitIds[i]));
+    }
+
+    return rval;
+}
+
 LargeBlob
 Repo::getLargeBlob(const ObjectHash &objId)
 {
@@ -273,6 +398,77 @@ Repo::transmit(bytewstream *bs, const ObjectHashVec &objs)
     NOT_IMPLEMENTED(false);
 }
 
+/*
+ * Transmit to a peer that can only decode the payload algorithms in
+ * zipAlgos (see ZIPCODEC_BIT).  Payloads in any other algorithm are sent
+ * uncompressed.  Objects are transmitted in batches of
+ * TRANSMIT_COMPAT_BATCH so that only one batch is held in memory.
+ */
+void
+Repo::transmitFor(bytewstream *bs, const ObjectHashVec &objs,
+                  uint32_t zipAlgos)
+{
+    if ((ZipCodec_Supported() & ~zipAlgos) == 0) {
+        transmit(bs, objs);
+        return;
+    }
+
+    for (size_t start = 0; start < objs.size();
+         start += TRANSMIT_COMPAT_BATCH) {
+        size_t end = MIN(start + TRANSMIT_COMPAT_BATCH, objs.size());
+        ObjectHashVec batch(objs.begin() + start, objs.begin() + end);
+        strwstream ss;
+
+        transmit(&ss, batch);
+
+        strstream in(ss.str());
+        while (true) {
+            uint32_t num = in.readUInt32();
+            if (num == 0)
+                break;
+
+            vector<ObjectInfo> infos(num);
+            vector<string> payloads(num);
+            for (uint32_t i = 0; i < num; i++) {
+                string info_str(ObjectInfo::SIZE, '\0');
+                in.readExact((uint8_t*)&info_str[0], ObjectInfo::SIZE);
+                infos[i].fromString(info_str);
+                payloads[i].resize(in.readUInt32());
+            }
+            for (uint32_t i = 0; i < num; i++) {
+                if (payloads[i].size() > 0)
+                    in.readExact((uint8_t*)&payloads[i][0], payloads[i].size());
+
+                if (zipAlgos & ZIPCODEC_BIT(infos[i].getAlgo()))
+                    continue;
+
+                bytestream::ap zs(ZipCodec_Decompress(
+                        new strstream(payloads[i]), infos[i]));
+                if (!zs.get()) {
+                    WARNING("Couldn't decompress %s for the peer",
+                            infos[i].hash.hex().c_str());
+                    continue;
+                }
+                payloads[i] = zs->readAll();
+                infos[i].setAlgo(ObjectInfo::ZIPALGO_NONE);
+            }
+
+            bs->writeUInt32(num);
+            for (uint32_t i = 0; i < num; i++) {
+                string info_str = infos[i].toString();
+                bs->write(info_str.data(), info_str.size());
+                bs->writeUInt32(payloads[i].size());
+            }
+            for (uint32_t i = 0; i < num; i++) {
+                bs->write(payloads[i].data(), payloads[i].size());
+            }
+        }
+    }
+
+    /* Write (numobjs_t)0 */
+    bs->writeUInt32(0);
+}
+
 void
 Repo::receive(bytestream *bs)
 {
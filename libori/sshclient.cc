@@ -30,6 +30,7 @@
 
 #include <oriutil/debug.h>
 #include <oriutil/oriutil.h>
+#include <oriutil/zipcodec.h>
 #include <ori/sshclient.h>
 #include <ori/sshrepo.h>
 
@@ -119,7 +120,8 @@ int SshClient::connect()
 
     fdToChild = pipe_to_child[D_WRITE];
     fdFromChild = pipe_from_child[D_READ];
-    streamToChild.reset(new fdwstream(fdToChild));
+    streamToChild.reset(new fdbufwstream(fdToChild));
+    streamFromChild.reset(new fdbufstream(fdFromChild));
 
     // SSH sets stderr to nonblock, possibly screwing up stdout (according to
     // rsync)
@@ -131,6 +133,37 @@ int SshClient::connect()
         return -1;
     }
 
+    // Older servers only send payloads that older clients can decode
+    if (announceZipAlgos() < 0) {
+        DLOG("SSH server does not take zipalgos");
+    }
+
+    return 0;
+}
+
+/*
+ * Tell the server which payload algorithms we decode, otherwise it sends
+ * everything in ZIPCODEC_LEGACY.  Servers before protocol 1.1 don't take
+ * the command and would misread its argument, so ask for the version first.
+ */
+int SshClient::announceZipAlgos()
+{
+    std::string version;
+    strwstream ss;
+
+    sendCommand("hello");
+    if (!respIsOK())
+        return -1;
+    streamFromChild->readPStr(version);
+    if (version == "1.0")
+        return -1;
+
+    ss.writeUInt32(ZipCodec_Supported());
+    sendCommand("zipalgos");
+    sendData(ss.str());
+    if (!respIsOK())
+        return -1;
+
     return 0;
 }
 
@@ -155,38 +188,31 @@ bool SshClient::connected() {
 void SshClient::sendCommand(const std::string &command) {
     ASSERT(connected());
     streamToChild->writePStr(command);
-    fsync(fdToChild);
 }
 
 void SshClient::sendData(const std::string &data) {
     ASSERT(connected());
-    size_t len = data.size();
-    size_t off = 0;
-    while (len > 0) {
-        ssize_t written = write(fdToChild, data.data()+off, len);
-        if (written < 0) {
-            perror("SshClient::sendData write");
-            exit(1);
-        }
-        len -= written;
-        off += written;
+    if (streamToChild->write(data.data(), data.size()) < 0) {
+        perror("SshClient::sendData write");
+        exit(1);
     }
-
-    fsync(fdToChild);
 }
 
 bytestream *SshClient::getStream() {
-    return new fdstream(fdFromChild, -1);
+    return new refstream(streamFromChild.get());
 }
 
 bool SshClient::respIsOK() {
     uint8_t resp = 0;
-    int status = read(fdFromChild, &resp, 1);
+    size_t status;
+
+    streamToChild->flush();
+
+    status = streamFromChild->read(&resp, 1);
     if (status == 1 && resp == 0) return true;
     else {
         std::string errStr;
-        fdstream fs(fdFromChild, -1);
-        fs.readPStr(errStr);
+        streamFromChild->readPStr(errStr);
         WARNING("SSH error (%d): %s", (int)resp, errStr.c_str());
         return false;
     }
@@ -33,6 +33,7 @@
 
 #include <oriutil/debug.h>
 #include <oriutil/oriutil.h>
+#include <oriutil/zipcodec.h>
 #include <ori/packfile.h>
 #include <ori/sshclient.h>
 #include <ori/sshrepo.h>
@@ -124,19 +125,11 @@ Object::sp SshRepo::getObject(const ObjectHash &id)
         num = bs->readUInt32();
         ASSERT(num == 0);
 
-        switch (info.getAlgo()) {
-            case ObjectInfo::ZIPALGO_NONE:
-                payloads[info.hash] = payload;
-                break;
-            case ObjectInfo::ZIPALGO_FASTLZ:
-                payloads[info.hash] = zipstream(new strstream(payload),
-                                                DECOMPRESS,
-                                                info.payload_size).readAll();
-                break;
-            case ObjectInfo::ZIPALGO_LZMA:
-            case ObjectInfo::ZIPALGO_UNKNOWN:
-                NOT_IMPLEMENTED(false);
+        bytestream::ap zs(ZipCodec_Decompress(new strstream(payload), info));
+        if (!zs.get()) {
+            NOT_IMPLEMENTED(false);
         }
+        payloads[info.hash] = zs->readAll();
         return Object::sp(new SshObject(this, info));
     }
     return Object::sp();
@@ -186,7 +179,7 @@ SshRepo::getObjectInfo(const ObjectHash &id)
 
 bool SshRepo::hasObject(const ObjectHash &id) {
     if (!containedObjs) {
-        containedObjs = new unordered_set<ObjectHash>();
+        containedObjs = new ObjectHashSet();
         std::set<ObjectInfo> objs = listObjects();
         for (std::set<ObjectInfo>::iterator it = objs.begin();
                 it != objs.end();
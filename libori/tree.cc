@@ -243,7 +243,13 @@ Tree::getBlob() const
 void
 Tree::fromBlob(const string &blob)
 {
-    strstream ss(blob);
+    fromBlob((const uint8_t *)blob.data(), blob.size());
+}
+
+void
+Tree::fromBlob(const uint8_t *blob, size_t len)
+{
+    memstream ss(blob, len);
     ss.enableTypes();
     size_t num_entries = ss.readUInt64();
     
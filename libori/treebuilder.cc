@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string>
+#include <map>
+#include <vector>
+#include <stdexcept>
+
+#include <oriutil/debug.h>
+#include <oriutil/oristr.h>
+#include <oriutil/oricrypt.h>
+#include <ori/repo.h>
+#include <ori/tree.h>
+#include <ori/treebuilder.h>
+
+using namespace std;
+
+TreeBuilder::TreeBuilder(Repo *r, const Tree &t)
+    : repo(r), root(new Node()), loaded(0), written(0)
+{
+    root->tree = t;
+}
+
+TreeBuilder::~TreeBuilder()
+{
+    freeNode(root);
+}
+
+void
+TreeBuilder::freeNode(Node *n)
+{
+    for (map<string, Node *>::iterator it = n->children.begin();
+         it != n->children.end();
+         it++) {
+        freeNode(it->second);
+    }
+    delete n;
+}
+
+void
+TreeBuilder::splitPath(const string &path, string *dir, string *name)
+{
+    size_t pos = path.rfind('/');
+
+    if (pos == string::npos) {
+        *dir = "";
+        *name = path;
+    } else {
+        *dir = path.substr(0, pos);
+        *name = path.substr(pos + 1);
+    }
+}
+
+/*
+ * Returns the loaded child directory, loading it on first use.  Returns NULL
+ * if name is missing or not a directory.
+ */
+TreeBuilder::Node *
+TreeBuilder::getChild(Node *n, const string &name, bool modify)
+{
+    Node *child;
+    map<string, Node *>::iterator cit = n->children.find(name);
+
+    if (cit != n->children.end()) {
+        child = cit->second;
+    } else {
+        Tree::iterator it = n->tree.find(name);
+        if (it == n->tree.end() || it->second.type != TreeEntry::Tree)
+            return NULL;
+
+        child = new Node();
+        child->tree = repo->getTree(it->second.hash);
+        n->children[name] = child;
+        loaded++;
+    }
+
+    if (modify)
+        child->dirty = true;
+
+    return child;
+}
+
+/*
+ * Walks to a directory.  With modify set every tree on the way is marked to
+ * be rewritten.
+ */
+TreeBuilder::Node *
+TreeBuilder::lookupDir(const string &path, bool modify)
+{
+    vector<string> components = OriStr_Split(path, '/');
+    Node *n = root;
+
+    if (modify)
+        root->dirty = true;
+
+    for (size_t i = 0; i < components.size() && n != NULL; i++) {
+        if (components[i] == "")
+            continue;
+        n = getChild(n, components[i], modify);
+    }
+
+    return n;
+}
+
+bool
+TreeBuilder::get(const string &path, TreeEntry *te)
+{
+    string dir, name;
+
+    splitPath(path, &dir, &name);
+
+    Node *d = lookupDir(dir, false);
+    if (d == NULL)
+        return false;
+
+    Tree::iterator it = d->tree.find(name);
+    if (it == d->tree.end())
+        return false;
+
+    *te = it->second;
+    return true;
+}
+
+bool
+TreeBuilder::insert(const string &path, const TreeEntry &te)
+{
+    TreeEntry old;
+
+    if (get(path, &old))
+        return false;
+
+    set(path, te);
+    return true;
+}
+
+void
+TreeBuilder::set(const string &path, const TreeEntry &te)
+{
+    string dir, name;
+
+    splitPath(path, &dir, &name);
+
+    Node *d = lookupDir(dir, true);
+    if (d == NULL) {
+        throw runtime_error("Parent directory not found");
+    }
+
+    Tree::iterator it = d->tree.find(name);
+    bool wasTree = it != d->tree.end() && it->second.type == TreeEntry::Tree;
+    map<string, Node *>::iterator cit = d->children.find(name);
+
+    if (te.type == TreeEntry::Tree) {
+        /*
+         * A directory that is not loaded stays an entry with its hash, the
+         * existing one if te has none, until something under it changes.
+         * Only a new empty directory needs a node.
+         */
+        if (cit == d->children.end()) {
+            TreeEntry entry = te;
+
+            if (entry.hash.isEmpty() && wasTree)
+                entry.hash = it->second.hash;
+            if (!entry.hash.isEmpty()) {
+                d->tree.tree[name] = entry;
+                return;
+            }
+
+            Node *child = new Node();
+            child->dirty = true;
+            d->children[name] = child;
+        }
+    } else if (cit != d->children.end()) {
+        freeNode(cit->second);
+        d->children.erase(cit);
+    }
+
+    d->tree.tree[name] = te;
+}
+
+void
+TreeBuilder::erase(const string &path)
+{
+    string dir, name;
+
+    splitPath(path, &dir, &name);
+
+    Node *d = lookupDir(dir, true);
+    if (d == NULL)
+        return;
+
+    map<string, Node *>::iterator cit = d->children.find(name);
+    if (cit != d->children.end()) {
+        freeNode(cit->second);
+        d->children.erase(cit);
+    }
+    d->tree.tree.erase(name);
+}
+
+/*
+ * Writes out the modified subtrees of n, deepest first, and then n itself.
+ */
+ObjectHash
+TreeBuilder::commitNode(Node *n)
+{
+    for (map<string, Node *>::iterator it = n->children.begin();
+         it != n->children.end();
+         it++) {
+        Node *child = it->second;
+        if (!child->dirty)
+            continue;
+
+        TreeEntry &te = n->tree.tree[it->first];
+        te.hash = commitNode(child);
+        te.type = TreeEntry::Tree;
+        ASSERT(te.hasBasicAttrs());
+    }
+
+    string blob = n->tree.getBlob();
+    ObjectHash hash = OriCrypt_HashString(blob);
+
+    repo->addObject(ObjectInfo::Tree, hash, blob);
+    n->dirty = false;
+    written++;
+
+    return hash;
+}
+
+Tree
+TreeBuilder::commit()
+{
+    if (root->dirty) {
+        commitNode(root);
+    }
+
+    return root->tree;
+}
@@ -30,6 +30,7 @@
 #include <oriutil/oricrypt.h>
 #include <oriutil/scan.h>
 #include <ori/treediff.h>
+#include <ori/treebuilder.h>
 #include <ori/largeblob.h>
 
 using namespace std;
@@ -186,6 +187,176 @@ TreeDiff::diffTwoTrees(const Tree::Flat &t1, const Tree::Flat &t2)
     return;
 }
 
+/*
+ * Structural diff
+ */
+
+typedef int (*TreeDiffWalkCB)(void *, const TreeDiffEntry &);
+
+static TreeDiffEntry
+_addedEntry(const string &path, const TreeEntry &entry)
+{
+    TreeDiffEntry diffEntry;
+
+    diffEntry.filepath = path;
+    if (entry.type == TreeEntry::Tree) {
+        diffEntry.type = TreeDiffEntry::NewDir;
+    } else {
+        diffEntry.type = TreeDiffEntry::NewFile;
+        diffEntry.hashBase = make_pair(EMPTYFILE_HASH, ObjectHash());
+    }
+    diffEntry.hashes = make_pair(entry.hash, entry.largeHash);
+    diffEntry.newAttrs = entry.attrs;
+
+    return diffEntry;
+}
+
+static TreeDiffEntry
+_deletedEntry(const string &path, const TreeEntry &entry)
+{
+    return TreeDiffEntry(path, entry.type == TreeEntry::Tree ?
+                               TreeDiffEntry::DeletedDir :
+                               TreeDiffEntry::DeletedFile);
+}
+
+/*
+ * Merge-join the entries of two directories.  Either tree may be NULL when a
+ * directory exists on one side only, in which case everything below it is
+ * reported as added or deleted.  Directories with the same hash are skipped
+ * without being loaded.
+ */
+static int
+_walkTrees(const string &prefix, const Tree *t1, const Tree *t2, Repo *r,
+           void *arg, TreeDiffWalkCB f)
+{
+    const Tree empty;
+    const Tree &a = t1 ? *t1 : empty;
+    const Tree &b = t2 ? *t2 : empty;
+    map<string, TreeEntry>::const_iterator i1 = a.tree.begin();
+    map<string, TreeEntry>::const_iterator i2 = b.tree.begin();
+    int status;
+
+    while (i1 != a.tree.end() || i2 != b.tree.end()) {
+        int cmp;
+
+        if (i1 == a.tree.end())
+            cmp = 1;
+        else if (i2 == b.tree.end())
+            cmp = -1;
+        else
+            cmp = i1->first.compare(i2->first);
+
+        if (cmp < 0) {
+            const TreeEntry &e1 = i1->second;
+            string path = prefix + i1->first;
+
+            status = f(arg, _addedEntry(path, e1));
+            if (status < 0)
+                return status;
+            if (e1.type == TreeEntry::Tree) {
+                Tree sub = r->getTree(e1.hash);
+                status = _walkTrees(path + "/", &sub, NULL, r, arg, f);
+                if (status < 0)
+                    return status;
+            }
+            i1++;
+        } else if (cmp > 0) {
+            const TreeEntry &e2 = i2->second;
+            string path = prefix + i2->first;
+
+            status = f(arg, _deletedEntry(path, e2));
+            if (status < 0)
+                return status;
+            if (e2.type == TreeEntry::Tree) {
+                Tree sub = r->getTree(e2.hash);
+                status = _walkTrees(path + "/", NULL, &sub, r, arg, f);
+                if (status < 0)
+                    return status;
+            }
+            i2++;
+        } else {
+            const TreeEntry &e1 = i1->second;
+            const TreeEntry &e2 = i2->second;
+            string path = prefix + i1->first;
+            bool dir1 = e1.type == TreeEntry::Tree;
+            bool dir2 = e2.type == TreeEntry::Tree;
+
+            status = 0;
+            if (!dir1 && dir2) {
+                // Replaced directory with file
+                Tree sub = r->getTree(e2.hash);
+
+                status = f(arg, _deletedEntry(path, e2));
+                if (status >= 0)
+                    status = f(arg, _addedEntry(path, e1));
+                if (status >= 0)
+                    status = _walkTrees(path + "/", NULL, &sub, r, arg, f);
+            } else if (dir1 && !dir2) {
+                // Replaced file with directory
+                Tree sub = r->getTree(e1.hash);
+
+                status = f(arg, _deletedEntry(path, e2));
+                if (status >= 0)
+                    status = f(arg, _addedEntry(path, e1));
+                if (status >= 0)
+                    status = _walkTrees(path + "/", &sub, NULL, r, arg, f);
+            } else if (dir1 && dir2) {
+                if (e1.hash != e2.hash) {
+                    Tree sub1 = r->getTree(e1.hash);
+                    Tree sub2 = r->getTree(e2.hash);
+
+                    status = _walkTrees(path + "/", &sub1, &sub2, r, arg, f);
+                }
+            } else if (e1.hash != e2.hash) {
+                TreeDiffEntry diffEntry(path, TreeDiffEntry::Modified);
+
+                diffEntry.hashes = make_pair(e1.hash, e1.largeHash);
+                diffEntry.hashBase = make_pair(e2.hash, e2.largeHash);
+                diffEntry.newAttrs = e1.attrs;
+                diffEntry.attrsBase = e2.attrs;
+
+                status = f(arg, diffEntry);
+            }
+            // XXX: Handle attribute only changes
+            if (status < 0)
+                return status;
+
+            i1++;
+            i2++;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Report the changes that turn t2 into t1, one entry at a time, in the same
+ * form as TreeDiff::diffTwoTrees.  Returning a negative value from f stops
+ * the walk and is passed back to the caller.
+ */
+int
+TreeDiff_Walk(const Tree &t1, const Tree &t2, Repo *r,
+              void *arg, int (*f)(void *, const TreeDiffEntry &))
+{
+    return _walkTrees("/", &t1, &t2, r, arg, f);
+}
+
+static int
+_diffTwoTreesCB(void *arg, const TreeDiffEntry &e)
+{
+    ((TreeDiff *)arg)->append(e);
+    return 0;
+}
+
+/*
+ * Diff two committed trees without flattening them.
+ */
+void
+TreeDiff::diffTwoTrees(const Tree &t1, const Tree &t2, Repo *r)
+{
+    TreeDiff_Walk(t1, t2, r, this, _diffTwoTreesCB);
+}
+
 struct _scanHelperData {
     set<string> *wd_paths;
     map<string, TreeEntry> *flattened_tree;
@@ -747,17 +918,21 @@ TreeDiff::applyTo(Tree::Flat *flat) const
     }
 }
 
+/*
+ * Applies the diff on top of a committed tree.  Only the trees along changed
+ * paths are loaded and rewritten.
+ */
 Tree
-TreeDiff::applyTo(Tree::Flat flat, Repo *dest_repo)
+TreeDiff::applyTo(const Tree &tree, Repo *dest_repo)
 {
+    TreeBuilder tb(dest_repo, tree);
+
     for (size_t i = 0; i < entries.size(); i++) {
         const TreeDiffEntry &tde = entries[i];
         if (tde.type == TreeDiffEntry::Noop) continue;
 
         DLOG("Applying %c   %s (%s)", tde.type, tde.filepath.c_str(),
             tde.newFilename.c_str());
-        //if (i % 80 == 0 && i > 0) putc('\n', stdout);
-        //putc(tde.type, stdout);
         if (tde.type == TreeDiffEntry::NewFile) {
             pair<ObjectHash, ObjectHash> hashes;
             if (tde.newFilename == "") {
@@ -768,37 +943,34 @@ TreeDiff::applyTo(Tree::Flat flat, Repo *dest_repo)
             TreeEntry te(hashes.first, hashes.second);
             te.attrs.mergeFrom(tde.newAttrs);
             ASSERT(te.hasBasicAttrs());
-            flat.insert(make_pair(tde.filepath, te));
+            tb.insert(tde.filepath, te);
         }
         else if (tde.type == TreeDiffEntry::NewDir) {
             TreeEntry te;
             te.type = TreeEntry::Tree;
             te.attrs.mergeFrom(tde.newAttrs);
             ASSERT(te.hasBasicAttrs());
-            flat.insert(make_pair(tde.filepath, te));
+            tb.insert(tde.filepath, te);
         }
         else if (tde.type == TreeDiffEntry::DeletedDir) {
-            ASSERT(flat[tde.filepath].type == TreeEntry::Tree);
-            flat.erase(tde.filepath);
 #ifdef DEBUG
-            // Check that no files still exist in this directory
-            for (Tree::Flat::iterator it = flat.begin();
-                    it != flat.end();
-                    it++) {
-                if (strncmp(tde.filepath.c_str(), (*it).first.c_str(),
-                            tde.filepath.size()) == 0) {
-                    ASSERT((*it).first[tde.filepath.size()] != '/');
-                }
-            }
+            TreeEntry te;
+            ASSERT(tb.get(tde.filepath, &te) && te.type == TreeEntry::Tree);
 #endif
+            tb.erase(tde.filepath);
         }
         else if (tde.type == TreeDiffEntry::DeletedFile) {
-            ASSERT(flat[tde.filepath].type == TreeEntry::Blob ||
-                   flat[tde.filepath].type == TreeEntry::LargeBlob);
-            flat.erase(tde.filepath);
+#ifdef DEBUG
+            TreeEntry te;
+            ASSERT(tb.get(tde.filepath, &te) &&
+                   (te.type == TreeEntry::Blob ||
+                    te.type == TreeEntry::LargeBlob));
+#endif
+            tb.erase(tde.filepath);
         }
         else if (tde.type == TreeDiffEntry::Modified) {
-            TreeEntry te = flat[tde.filepath];
+            TreeEntry te;
+            tb.get(tde.filepath, &te);
             if (tde.newFilename != "") {
                 pair<ObjectHash, ObjectHash> hashes = dest_repo->addFile(tde.newFilename);
                 te.hash = hashes.first;
@@ -818,32 +990,27 @@ TreeDiff::applyTo(Tree::Flat flat, Repo *dest_repo)
             te.attrs.mergeFrom(tde.newAttrs);
             ASSERT(te.hasBasicAttrs());
 
-            flat[tde.filepath] = te;
+            tb.set(tde.filepath, te);
         }
         else if (tde.type == TreeDiffEntry::Renamed) {
-            ASSERT(flat.find(tde.filepath) != flat.end());
-            ASSERT(flat.find(tde.newFilename) == flat.end());
+            TreeEntry te;
+            bool found UNUSED = tb.get(tde.filepath, &te);
+            ASSERT(found);
 
-            TreeEntry te = flat[tde.filepath];
-            flat.erase(tde.filepath);
+            tb.erase(tde.filepath);
             te.attrs.mergeFrom(tde.newAttrs);
-            flat[tde.newFilename] = te;
             ASSERT(te.hasBasicAttrs());
+            bool added UNUSED = tb.insert(tde.newFilename, te);
+            ASSERT(added);
         }
         else {
             NOT_IMPLEMENTED(false);
         }
     }
 
-    /*for (Tree::Flat::iterator it = flat.begin();
-            it != flat.end();
-            it++) {
-        printf("%s %s\n", (*it).first.c_str(), (*it).second.hash.c_str());
-    }*/
-    //putc('\n', stdout);
-
-    Tree rval = Tree::unflatten(flat, dest_repo);
-    //dest_repo->addBlob(Object::Tree, rval.getBlob());
+    Tree rval = tb.commit();
+    DLOG("applyTo: loaded %lu trees, wrote %lu", tb.getLoaded(),
+         tb.getWritten());
     return rval;
 }
 
@@ -23,10 +23,71 @@
 
 // Minimum compressable object (FastLZ requires 66 bytes)
 #define ZIP_MINIMUM_SIZE 512
-// How much of a payload to check for compressibility
-#define COMPCHECK_BYTES 1024
 // Maximum compression ratio (0.8 means compressed file is 80% size of original)
 #define COMPCHECK_RATIO 0.95
+// Payloads with a sampled byte entropy above this (bits/byte) are stored raw
+#define ZIPADV_ENTROPY_MAX 7.5
+// Incompressible chunks in a row before the rest of a file is stored raw
+#define ZIPADV_FILE_STRIKES 2
+// Samples and fraction of them incompressible to stop compressing an extension
+#define ZIPADV_EXT_SAMPLES 8
+#define ZIPADV_EXT_RATIO 0.9
+// Retry one in this many payloads of an extension that is skipped
+#define ZIPADV_EXT_REPROBE 64
+// Maximum number of extensions remembered
+#define ZIPADV_EXT_MAX 4096
+
+// Metadata log size at which it is merged into a new checkpoint
+#define METADATA_TAIL_MAX (1024*1024)
+
+// Path lookups remembered by the filelog before the cache is reset
+#define FILELOG_MEMO_MAX 65536
+
+// Packfile data read per batch by the verifier
+#define VERIFY_BATCH_SIZE (8*1024*1024)
+
+// Start of a packfile hashed to tell it from a new one with the same inode
+#define VERIFY_HEAD_SIZE 4096
+
+// Reference count rebuild: number of lock shards, count entries kept in
+// memory before a sorted run is written out, payload bytes read per batch
+// and counts handed back per chunk
+#define REFCOUNT_SHARDS 16
+#define REFCOUNT_MEM_ENTRIES (2*1024*1024)
+#define REFCOUNT_BATCH_SIZE (8*1024*1024)
+#define REFCOUNT_CHUNK (64*1024)
+
+// Instaclone prefetching: large blob parts fetched ahead of a sequential
+// reader (the window doubles up to the maximum), objects per request,
+// prefetched bytes kept in memory and large blobs tracked for readahead
+#define PREFETCH_WINDOW_MIN 8
+#define PREFETCH_WINDOW_MAX 256
+#define PREFETCH_BATCH_MAX 1024
+#define PREFETCH_CACHE_SIZE (32*1024*1024)
+#define PREFETCH_STREAMS 64
+
+// Objects per transmit batch when payloads are decompressed for a peer
+// that can't decode them
+#define TRANSMIT_COMPAT_BATCH 256
+
+// Index entries and metadata records buffered before they are written,
+// within a group commit
+#define GROUPCOMMIT_BUFFER_MAX (1024*1024)
+
+// Packfile handles kept open and the bytes they may map, handles in use
+// are not closed to stay within them
+#define PACKFILE_POOL_HANDLES 96
+#define PACKFILE_POOL_MAPPED (1024*1024*1024)
+
+// Bulk import: bounds of each queue between stages, file bytes a chunk
+// worker hands on at once and how long an idle worker sleeps
+#define IMPORT_QUEUE_ITEMS 4096
+#define IMPORT_QUEUE_BYTES (32*1024*1024)
+#define IMPORT_PIECE_SIZE (4*1024*1024)
+#define IMPORT_WAIT_USECS 100
+
+// Commits whose pulls are measured by the repacker
+#define REPACK_RECENT_COMMITS 8
 
 // These are soft maximums ("heuristics")
 // 64 MB
@@ -40,12 +101,29 @@
 #error "Please select one hash algorithm."
 #endif
 
-// Choose the compression algorithm (choose one)
+// Choose the default compression codec (choose one)
 //#define ORI_USE_LZMA
 //#define ORI_USE_FASTLZ
+//#define ORI_USE_SNAPPY
+//#define ORI_USE_LZ4
+//#define ORI_USE_ZSTD
 #if defined(ORI_USE_COMPRESISON) && !defined(ORI_USE_LZMA) && !defined(ORI_USE_FASTLZ)
 #error "Please select one compression algorithm."
 #endif
 
+// Codec for new objects when the repository has no compression policy.  LZMA
+// is only used to read old objects so those builds default to FastLZ.
+#if defined(ORI_USE_SNAPPY)
+#define ZIPALGO_DEFAULT ObjectInfo::ZIPALGO_SNAPPY
+#elif defined(ORI_USE_LZ4)
+#define ZIPALGO_DEFAULT ObjectInfo::ZIPALGO_LZ4
+#elif defined(ORI_USE_ZSTD)
+#define ZIPALGO_DEFAULT ObjectInfo::ZIPALGO_ZSTD
+#elif defined(ORI_USE_FASTLZ) || defined(ORI_USE_LZMA)
+#define ZIPALGO_DEFAULT ObjectInfo::ZIPALGO_FASTLZBLK
+#else
+#define ZIPALGO_DEFAULT ObjectInfo::ZIPALGO_NONE
+#endif
+
 #endif /* __TUNEABLES_H__ */
 
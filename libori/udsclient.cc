@@ -28,10 +28,13 @@
 #include <sys/un.h>
 
 #include <string>
+#include <deque>
 
 #include <oriutil/debug.h>
 #include <oriutil/oriutil.h>
 #include <oriutil/systemexception.h>
+#include <oriutil/stopwatch.h>
+#include <oriutil/zipcodec.h>
 #include <ori/localrepo.h> // ORI_PATH_UDSSOCK
 #include <ori/udsclient.h>
 #include <ori/udsrepo.h>
@@ -46,11 +49,12 @@ using namespace std;
  */
 
 UDSClient::UDSClient()
+    : fd(-1), havePendingReq(false), nextReqId(1)
 {
 }
 
 UDSClient::UDSClient(const string &repoPath)
-    : fd(-1)
+    : fd(-1), havePendingReq(false), nextReqId(1)
 {
     udsPath = repoPath + ORI_PATH_UDSSOCK;
 }
@@ -79,7 +83,8 @@ int UDSClient::connect()
         throw SystemException();
 
     fd = sock;
-    streamToChild.reset(new fdwstream(fd));
+    streamToChild.reset(new fdbufwstream(fd));
+    streamFromChild.reset(new fdbufstream(fd));
 
     // Sync by waiting for message from server
     if (!respIsOK()) {
@@ -87,11 +92,26 @@ int UDSClient::connect()
         return -1;
     }
 
+    // Older servers reject the framed command; stay unframed in that case.
+    // Those servers only send payloads that older clients can decode.
+    if (enableFraming() < 0) {
+        DLOG("UDS server does not support framing");
+    } else if (announceZipAlgos() < 0) {
+        DLOG("UDS server does not take zipalgos");
+    }
+
     return 0;
 }
 
 void UDSClient::disconnect()
 {
+    response.reset();
+    streamToChild.reset();
+    streamFromChild.reset();
+    frameReader.reset();
+    frameWriter.reset();
+    havePendingReq = false;
+
     close(fd);
 
     fd = -1;
@@ -101,41 +121,188 @@ bool UDSClient::connected() {
     return fd != -1;
 }
 
+/*
+ * Servers that predate framing answer "Unknown command", which only means
+ * staying unframed and is not worth a warning.
+ */
+int UDSClient::enableFraming() {
+    string errStr;
+
+    sendCommand("framed");
+    if (!readStatus(&errStr)) {
+        if (errStr != "Unknown command")
+            WARNING("UDS error: %s", errStr.c_str());
+        return -1;
+    }
+
+    frameReader.reset(new UDSFrameReader(fd));
+    frameWriter.reset(new UDSFrameWriter(fd));
+
+    return 0;
+}
+
+/*
+ * Tell the server which payload algorithms we decode, otherwise it sends
+ * everything in ZIPCODEC_LEGACY.  Every server that supports framing also
+ * takes this command.
+ */
+int UDSClient::announceZipAlgos() {
+    strwstream ss;
+
+    ss.writeUInt32(ZipCodec_Supported());
+    bytestream::ap bs(getResponse(queueRequest("zipalgos", ss.str())));
+    if (!bs.get())
+        return -1;
+
+    return 0;
+}
+
+bool UDSClient::isFramed() {
+    return frameWriter.get() != NULL;
+}
+
 void UDSClient::sendCommand(const string &command) {
     ASSERT(connected());
+    if (isFramed()) {
+        strwstream ss;
+        ss.writePStr(command);
+        pendingReq = ss.str();
+        havePendingReq = true;
+        return;
+    }
     streamToChild->writePStr(command);
 }
 
 void UDSClient::sendData(const string &data) {
     ASSERT(connected());
-    size_t len = data.size();
-    size_t off = 0;
-    while (len > 0) {
-        ssize_t written = write(fd, data.data()+off, len);
-        if (written < 0) {
-            perror("UDSClient::sendData write");
-            exit(1);
-        }
-        len -= written;
-        off += written;
+    if (isFramed()) {
+        ASSERT(havePendingReq);
+        pendingReq.append(data);
+        return;
+    }
+    if (streamToChild->write(data.data(), data.size()) < 0) {
+        perror("UDSClient::sendData write");
+        exit(1);
     }
 }
 
 bytestream *UDSClient::getStream() {
-    return new fdstream(fd, -1);
+    if (isFramed()) {
+        ASSERT(response.get() != NULL);
+        return response.release();
+    }
+    return new refstream(streamFromChild.get());
 }
 
 bool UDSClient::respIsOK() {
+    if (isFramed()) {
+        uint32_t reqId;
+
+        ASSERT(havePendingReq);
+        reqId = nextReqId++;
+        frameWriter->queue(reqId, 0, pendingReq.data(), pendingReq.size());
+        pendingReq.clear();
+        havePendingReq = false;
+
+        return readResponse(reqId);
+    }
+
+    string errStr;
+
+    if (!readStatus(&errStr)) {
+        WARNING("UDS error: %s", errStr.c_str());
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Read the status of an unframed reply, and the error message if it failed.
+ */
+bool UDSClient::readStatus(string *errStr) {
     uint8_t resp = 0;
-    int status = read(fd, &resp, 1);
-    if (status == 1 && resp == 0) return true;
-    else {
-        string errStr;
-        fdstream fs(fd, -1);
-        fs.readPStr(errStr);
-        WARNING("UDS error (%d): %s", (int)resp, errStr.c_str());
+    size_t status;
+
+    streamToChild->flush();
+
+    status = streamFromChild->read(&resp, 1);
+    if (status == 1 && resp == 0)
+        return true;
+    if (status == 1)
+        streamFromChild->readPStr(*errStr);
+    else
+        *errStr = "Connection closed";
+    return false;
+}
+
+uint32_t UDSClient::queueRequest(const string &command, const string &data)
+{
+    uint32_t reqId = nextReqId++;
+    strwstream ss(command.size() + data.size() + 1);
+
+    ASSERT(isFramed());
+
+    ss.writePStr(command);
+    ss.write(data.data(), data.size());
+    frameWriter->queue(reqId, 0, ss.str().data(), ss.str().size());
+
+    return reqId;
+}
+
+bytestream *UDSClient::getResponse(uint32_t reqId)
+{
+    ASSERT(isFramed());
+
+    if (!readResponse(reqId))
+        return NULL;
+
+    return response.release();
+}
+
+/*
+ * Read frames up to the start of the reply to reqId and consume its status
+ * byte.  Leftovers of earlier replies that the caller did not read in full
+ * are discarded.
+ */
+bool UDSClient::readResponse(uint32_t reqId)
+{
+    uint32_t id;
+    uint8_t flags;
+    string payload;
+
+    if (frameWriter->flush() < 0) {
+        WARNING("UDS write failed");
         return false;
     }
+
+    if (response.get()) {
+        response->drain();
+        response.reset();
+    }
+
+    while (true) {
+        if (!frameReader->readFrame(&id, &flags, &payload)) {
+            WARNING("UDS connection closed");
+            return false;
+        }
+        if (id == reqId)
+            break;
+        if (id > reqId) {
+            WARNING("UDS response for unknown request %u", id);
+            return false;
+        }
+    }
+
+    response.reset(new udsframestream(frameReader.get(), id, flags, payload));
+
+    uint8_t resp = response->readUInt8();
+    if (resp == 0)
+        return true;
+
+    string errStr;
+    response->readPStr(errStr);
+    WARNING("UDS error (%d): %s", (int)resp, errStr.c_str());
+    return false;
 }
 
 
@@ -196,3 +363,101 @@ int cmd_udsclient(int argc, char * const argv[]) {
 
     return 0;
 }
+
+/*
+ * cmd_udsbench
+ */
+#define UDSBENCH_WINDOW 64
+
+static void
+udsbench_report(const char *name, size_t ops, Stopwatch &sw)
+{
+    uint64_t usec = sw.getElapsedTime();
+    double secs = usec / 1000000.0;
+
+    printf("%-24s %8lu ops %10.3f s %12.1f ops/s\n",
+           name, ops, secs, secs > 0 ? ops / secs : 0.0);
+}
+
+int cmd_udsbench(int argc, char * const argv[]) {
+    if (argc < 2) {
+        printf("Usage: ori udsbench REPOPATH [COUNT]\n");
+        exit(1);
+    }
+
+    size_t count = 10000;
+    if (argc > 2)
+        count = strtoul(argv[2], NULL, 10);
+
+    UDSClient client(argv[1]);
+    if (client.connect() < 0) {
+        printf("Error connecting to %s\n", argv[1]);
+        exit(1);
+    }
+
+    UDSRepo repo(&client);
+    set<ObjectInfo> objs = repo.listObjects();
+    ObjectHashVec hashes;
+    for (set<ObjectInfo>::iterator it = objs.begin(); it != objs.end(); it++) {
+        hashes.push_back((*it).hash);
+    }
+    if (hashes.size() == 0) {
+        printf("Repository has no objects\n");
+        return 1;
+    }
+
+    printf("Framed protocol: %s\n", client.isFramed() ? "yes" : "no");
+
+    // Synchronous getobjinfo
+    Stopwatch sw = Stopwatch();
+    sw.start();
+    for (size_t i = 0; i < count; i++) {
+        repo.getObjectInfo(hashes[i % hashes.size()]);
+    }
+    sw.stop();
+    udsbench_report("getobjinfo", count, sw);
+
+    // Batched getobjinfos
+    ObjectHashVec batch;
+    for (size_t i = 0; i < count; i++) {
+        batch.push_back(hashes[i % hashes.size()]);
+    }
+    sw.reset();
+    sw.start();
+    repo.getObjectInfos(batch);
+    sw.stop();
+    udsbench_report("getobjinfos (batched)", count, sw);
+
+    if (!client.isFramed())
+        return 0;
+
+    // Pipelined getobjinfo and readobjs
+    const char *cmds[] = { "getobjinfo", "readobjs" };
+    for (int c = 0; c < 2; c++) {
+        deque<uint32_t> inflight;
+
+        sw.reset();
+        sw.start();
+        for (size_t i = 0; i < count || !inflight.empty(); i++) {
+            if (i < count) {
+                strwstream ss;
+                if (c == 1)
+                    ss.writeUInt32(1);
+                ss.writeHash(hashes[i % hashes.size()]);
+                inflight.push_back(client.queueRequest(cmds[c], ss.str()));
+            }
+
+            if (inflight.size() >= UDSBENCH_WINDOW || i >= count) {
+                bytestream::ap bs(client.getResponse(inflight.front()));
+                inflight.pop_front();
+                if (bs.get())
+                    bs->readAll();
+            }
+        }
+        sw.stop();
+        udsbench_report(c == 0 ? "getobjinfo (pipelined)"
+                               : "readobjs (pipelined)", count, sw);
+    }
+
+    return 0;
+}
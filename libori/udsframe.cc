@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <cstring>
+#include <stdint.h>
+
+#include <unistd.h>
+#include <sys/param.h>
+#include <errno.h>
+
+#include <string>
+
+#include <oriutil/debug.h>
+#include <oriutil/oriutil.h>
+#include <oriutil/stream.h>
+#include <ori/udsframe.h>
+
+using namespace std;
+
+/*
+ * UDSFrameReader
+ */
+
+UDSFrameReader::UDSFrameReader(int fd)
+    : fd(fd), buf(), off(0), readCalls(0)
+{
+}
+
+UDSFrameReader::~UDSFrameReader()
+{
+}
+
+bool
+UDSFrameReader::pending() const
+{
+    size_t avail = buf.size() - off;
+
+    if (avail < UDSFRAME_HDRSIZE)
+        return false;
+
+    strstream ss(buf.substr(off, 4));
+    uint32_t len = ss.readUInt32();
+
+    return avail >= UDSFRAME_HDRSIZE + len;
+}
+
+/*
+ * Read as much as the socket has available in a single call.
+ */
+bool
+UDSFrameReader::fill()
+{
+    size_t oldSize;
+    ssize_t status;
+
+    if (off > 0) {
+        buf.erase(0, off);
+        off = 0;
+    }
+
+    oldSize = buf.size();
+    buf.resize(oldSize + UDSFRAME_READBUF);
+retry:
+    status = ::read(fd, &buf[oldSize], UDSFRAME_READBUF);
+    if (status < 0 && errno == EINTR)
+        goto retry;
+    readCalls++;
+    if (status <= 0) {
+        buf.resize(oldSize);
+        return false;
+    }
+    buf.resize(oldSize + status);
+
+    return true;
+}
+
+bool
+UDSFrameReader::readFrame(uint32_t *reqId, uint8_t *flags, string *payload)
+{
+    uint32_t len;
+
+    while (buf.size() - off < UDSFRAME_HDRSIZE) {
+        if (!fill())
+            return false;
+    }
+
+    strstream hdr(buf.substr(off, UDSFRAME_HDRSIZE));
+    len = hdr.readUInt32();
+    *reqId = hdr.readUInt32();
+    *flags = hdr.readUInt8();
+
+    if (len > UDSFRAME_MAXREQUEST) {
+        WARNING("UDS frame too large (%u bytes)", len);
+        return false;
+    }
+
+    while (buf.size() - off < UDSFRAME_HDRSIZE + len) {
+        if (!fill())
+            return false;
+    }
+
+    payload->assign(buf, off + UDSFRAME_HDRSIZE, len);
+    off += UDSFRAME_HDRSIZE + len;
+
+    return true;
+}
+
+/*
+ * UDSFrameWriter
+ */
+
+UDSFrameWriter::UDSFrameWriter(int fd)
+    : fd(fd), buf(), writeCalls(0)
+{
+}
+
+UDSFrameWriter::~UDSFrameWriter()
+{
+}
+
+int
+UDSFrameWriter::queue(uint32_t reqId, uint8_t flags,
+                      const void *payload, size_t len)
+{
+    strwstream hdr(UDSFRAME_HDRSIZE);
+
+    ASSERT(len <= UDSFRAME_MAXREQUEST);
+
+    hdr.writeUInt32(len);
+    hdr.writeUInt32(reqId);
+    hdr.writeUInt8(flags);
+
+    buf.append(hdr.str());
+    buf.append((const char *)payload, len);
+
+    if (buf.size() >= UDSFRAME_MAXPAYLOAD)
+        return flush();
+
+    return 0;
+}
+
+int
+UDSFrameWriter::flush()
+{
+    size_t total = 0;
+
+    while (total < buf.size()) {
+        ssize_t status = ::write(fd, buf.data() + total, buf.size() - total);
+        if (status < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        writeCalls++;
+        total += status;
+    }
+
+    buf.clear();
+
+    return 0;
+}
+
+/*
+ * udsframewstream
+ */
+
+udsframewstream::udsframewstream(UDSFrameWriter *out, uint32_t reqId)
+    : out(out), reqId(reqId), buf(), finished(false)
+{
+}
+
+ssize_t
+udsframewstream::write(const void *bytes, size_t n)
+{
+    const uint8_t *p = (const uint8_t *)bytes;
+    size_t left = n;
+
+    ASSERT(!finished);
+
+    while (left > 0) {
+        size_t len = MIN(left, UDSFRAME_MAXPAYLOAD - buf.size());
+
+        buf.append((const char *)p, len);
+        p += len;
+        left -= len;
+
+        if (buf.size() == UDSFRAME_MAXPAYLOAD) {
+            if (out->queue(reqId, UDSFRAME_MORE, buf.data(), buf.size()) < 0) {
+                setErrno("write");
+                return -errno;
+            }
+            buf.clear();
+        }
+    }
+
+    return n;
+}
+
+int
+udsframewstream::finish()
+{
+    ASSERT(!finished);
+
+    finished = true;
+    return out->queue(reqId, 0, buf.data(), buf.size());
+}
+
+/*
+ * udsframestream
+ */
+
+udsframestream::udsframestream(UDSFrameReader *in, uint32_t reqId,
+                               uint8_t flags, const string &payload)
+    : in(in), reqId(reqId), flags(flags), buf(payload), off(0)
+{
+}
+
+bool
+udsframestream::ended()
+{
+    return off == buf.size() && !(flags & UDSFRAME_MORE);
+}
+
+size_t
+udsframestream::read(uint8_t *out, size_t n)
+{
+    while (off == buf.size() && (flags & UDSFRAME_MORE)) {
+        uint32_t id;
+
+        if (!in->readFrame(&id, &flags, &buf)) {
+            flags = 0;
+            buf.clear();
+            off = 0;
+            return 0;
+        }
+        ASSERT(id == reqId);
+        off = 0;
+    }
+
+    size_t len = MIN(n, buf.size() - off);
+    memcpy(out, buf.data() + off, len);
+    off += len;
+
+    return len;
+}
+
+size_t
+udsframestream::sizeHint() const
+{
+    return 0;
+}
+
+void
+udsframestream::drain()
+{
+    uint8_t tmp[4096];
+
+    while (!ended()) {
+        off = buf.size();
+        if (read(tmp, sizeof(tmp)) == 0 && !ended())
+            break;
+    }
+}
@@ -29,6 +29,7 @@
 
 #include <oriutil/debug.h>
 #include <oriutil/oriutil.h>
+#include <oriutil/zipcodec.h>
 #include <ori/packfile.h>
 #include <ori/udsclient.h>
 #include <ori/udsrepo.h>
@@ -138,19 +139,11 @@ Object::sp UDSRepo::getObject(const ObjectHash &id)
         num = bs->readUInt32();
         ASSERT(num == 0);
 
-        switch (info.getAlgo()) {
-            case ObjectInfo::ZIPALGO_NONE:
-                payloads[info.hash] = payload;
-                break;
-            case ObjectInfo::ZIPALGO_FASTLZ:
-                payloads[info.hash] = zipstream(new strstream(payload),
-                                                DECOMPRESS,
-                                                info.payload_size).readAll();
-                break;
-            case ObjectInfo::ZIPALGO_LZMA:
-            case ObjectInfo::ZIPALGO_UNKNOWN:
-                NOT_IMPLEMENTED(false);
+        bytestream::ap zs(ZipCodec_Decompress(new strstream(payload), info));
+        if (!zs.get()) {
+            NOT_IMPLEMENTED(false);
         }
+        payloads[info.hash] = zs->readAll();
         return Object::sp(new UDSObject(this, info));
     }
     return Object::sp();
@@ -198,9 +191,44 @@ UDSRepo::getObjectInfo(const ObjectHash &id)
     return info;
 }
 
+/*
+ * Fetch the info of many objects in one round trip.  Missing objects are
+ * returned as a Null ObjectInfo.
+ */
+vector<ObjectInfo>
+UDSRepo::getObjectInfos(const ObjectHashVec &objs)
+{
+    vector<ObjectInfo> infos;
+
+    client->sendCommand("getobjinfos");
+
+    strwstream ss(4 + objs.size() * ObjectHash::SIZE);
+    ss.writeUInt32(objs.size());
+    for (size_t i = 0; i < objs.size(); i++) {
+        ss.writeHash(objs[i]);
+    }
+    client->sendData(ss.str());
+
+    bool ok = client->respIsOK();
+    bytestream::ap bs(client->getStream());
+    if (!ok) {
+        return infos;
+    }
+
+    uint32_t num = bs->readUInt32();
+    ASSERT(num == objs.size());
+    infos.resize(num);
+    for (uint32_t i = 0; i < num; i++) {
+        if (bs->readUInt8())
+            bs->readInfo(infos[i]);
+    }
+
+    return infos;
+}
+
 bool UDSRepo::hasObject(const ObjectHash &id) {
     if (!containedObjs) {
-        containedObjs = new unordered_set<ObjectHash>();
+        containedObjs = new ObjectHashSet();
         std::set<ObjectInfo> objs = listObjects();
         for (std::set<ObjectInfo>::iterator it = objs.begin();
                 it != objs.end();
@@ -342,6 +370,24 @@ UDSRepo::callExt(const string &ext, const string &data)
     return "";
 }
 
+bytestream *
+UDSRepo::streamExt(const string &ext, const string &data)
+{
+    client->sendCommand("ext stream");
+
+    strwstream ss;
+    ss.writePStr(ext);
+    ss.writeLPStr(data);
+    client->sendData(ss.str());
+
+    bool ok = client->respIsOK();
+    bytestream::ap bs(client->getStream());
+    if (ok) {
+        return bs.release();
+    }
+    return NULL;
+}
+
 std::string &UDSRepo::_payload(const ObjectHash &id)
 {
     return payloads[id];
@@ -31,9 +31,12 @@
 #include <oriutil/debug.h>
 #include <oriutil/oriutil.h>
 #include <oriutil/systemexception.h>
+#include <oriutil/zipcodec.h>
 #include <ori/repostore.h>
 #include <ori/localrepo.h>
+#include <ori/udsframe.h>
 #include <ori/udsserver.h>
+#include <ori/filelog.h>
 
 using namespace std;
 
@@ -67,6 +70,9 @@ UDSServer::UDSServer(LocalRepo *repo)
         throw SystemException();
 
     listenFd = sock;
+
+    // Built-in extensions
+    registerStreamExt(FILELOG_EXT, FileLog_UDSExt);
 }
 
 UDSServer::~UDSServer()
@@ -160,6 +166,11 @@ UDSServer::listExt()
     {
         exts.insert(it->first);
     }
+    map<string, UDSStreamExtCB>::iterator sit;
+    for (sit = streamExtensions.begin(); sit != streamExtensions.end(); sit++)
+    {
+        exts.insert(sit->first);
+    }
 
     return exts;
 }
@@ -184,8 +195,29 @@ UDSServer::registerExt(const string &ext, UDSExtCB cb)
     extensions[ext] = cb;
 }
 
+bool
+UDSServer::hasStreamExt(const string &ext)
+{
+    map<string, UDSStreamExtCB>::iterator it = streamExtensions.find(ext);
+
+    return it != streamExtensions.end();
+}
+
+void
+UDSServer::callStreamExt(const string &ext, const string &data,
+                         bytewstream *out)
+{
+    streamExtensions[ext](repo, data, out);
+}
+
+void
+UDSServer::registerStreamExt(const string &ext, UDSStreamExtCB cb)
+{
+    streamExtensions[ext] = cb;
+}
+
 UDSSession::UDSSession(UDSServer *uds, int fd, LocalRepo *repo)
-    : uds(uds), fd(fd), repo(repo)
+    : uds(uds), fd(fd), repo(repo), zipAlgos(ZIPCODEC_LEGACY)
 {
 }
 
@@ -212,24 +244,74 @@ UDSSession::forceExit()
     interrupt();
 }
 
+
 #define OK 0
 #define ERROR 1
 
 void
-UDSSession::printError(const std::string &what)
+UDSSession::printError(bytewstream *out, const std::string &what)
 {
-    fdwstream fs(fd);
+    out->writeUInt8(ERROR);
+    out->writePStr(what);
+}
 
-    fs.writeUInt8(ERROR);
-    fs.writePStr(what);
+bool
+UDSSession::dispatch(const std::string &command,
+                     bytestream *in, bytewstream *out)
+{
+    if (command == "hello") {
+        cmd_hello(in, out);
+    }
+    else if (command == "zipalgos") {
+        cmd_zipAlgos(in, out);
+    }
+    else if (command == "list objs") {
+        cmd_listObjs(in, out);
+    }
+    else if (command == "list commits") {
+        cmd_listCommits(in, out);
+    }
+    else if (command == "readobjs") {
+        cmd_readObjs(in, out);
+    }
+    else if (command == "getobjinfo") {
+        cmd_getObjInfo(in, out);
+    }
+    else if (command == "getobjinfos") {
+        cmd_getObjInfos(in, out);
+    }
+    else if (command == "get head") {
+        cmd_getHead(in, out);
+    }
+    else if (command == "get fsid") {
+        cmd_getFSID(in, out);
+    }
+    else if (command == "get version") {
+        cmd_getVersion(in, out);
+    }
+    else if (command == "ext list") {
+        cmd_listExt(in, out);
+    }
+    else if (command == "ext call") {
+        cmd_callExt(in, out);
+    }
+    else if (command == "ext stream") {
+        cmd_streamExt(in, out);
+    }
+    else {
+        return false;
+    }
+
+    return true;
 }
 
 void
 UDSSession::serve() {
-    fdstream fs(fd, -1);
+    fdbufstream fs(fd);
+    fdbufwstream ws(fd);
 
-    uint8_t respOK = OK;
-    write(fd, &respOK, 1);
+    ws.writeUInt8(OK);
+    ws.flush();
 
     // XXX: Catch exception when exit is forced
     while (true) {
@@ -243,178 +325,260 @@ UDSSession::serve() {
         if (fs.readPStr(command) == 0)
             break;
 
-        if (command == "hello") {
-            cmd_hello();
-        }
-        else if (command == "list objs") {
-            cmd_listObjs();
-        }
-        else if (command == "list commits") {
-            cmd_listCommits();
-        }
-        else if (command == "readobjs") {
-            cmd_readObjs();
-        }
-        else if (command == "getobjinfo") {
-            cmd_getObjInfo();
-        }
-        else if (command == "get head") {
-            cmd_getHead();
-        }
-        else if (command == "get fsid") {
-            cmd_getFSID();
-        }
-        else if (command == "get version") {
-            cmd_getVersion();
-        }
-        else if (command == "ext list") {
-            cmd_listExt();
+        /*
+         * Clients wait for the reply before sending frames, so fs cannot
+         * have read ahead past this command.
+         */
+        if (command == "framed") {
+            DLOG("framed");
+            ws.writeUInt8(OK);
+            ws.flush();
+            serveFramed();
+            return;
         }
-        else if (command == "ext call") {
-            cmd_callExt();
+
+        if (!dispatch(command, &fs, &ws)) {
+            printError(&ws, "Unknown command");
         }
-        else {
-            printError("Unknown command");
+        ws.flush();
+    }
+}
+
+/*
+ * Serve framed requests.  Replies are accumulated in the frame writer and
+ * only flushed once no complete request is left in the read buffer, so a
+ * client pipelining requests gets its replies back in a few large writes.
+ */
+void
+UDSSession::serveFramed()
+{
+    UDSFrameReader reader(fd);
+    UDSFrameWriter writer(fd);
+
+    while (true) {
+        uint32_t reqId;
+        uint8_t flags;
+        string payload;
+        string command;
+
+        if (interruptionRequested())
+            break;
+
+        if (!reader.pending() && writer.flush() < 0)
+            break;
+
+        if (!reader.readFrame(&reqId, &flags, &payload))
+            break;
+
+        strstream in(payload);
+        udsframewstream out(&writer, reqId);
+
+        if (in.readPStr(command) == 0) {
+            printError(&out, "Malformed request");
+        } else if (!dispatch(command, &in, &out)) {
+            printError(&out, "Unknown command");
         }
+
+        if (out.finish() < 0)
+            break;
     }
+
+    writer.flush();
+    DLOG("UDSSession: %llu reads, %llu writes",
+         (unsigned long long)reader.getReadCalls(),
+         (unsigned long long)writer.getWriteCalls());
 }
 
-void UDSSession::cmd_hello()
+void UDSSession::cmd_hello(bytestream *in, bytewstream *out)
 {
     DLOG("hello");
 
-    fdwstream fs(fd);
-    fs.writeUInt8(OK);
-    fs.writePStr(ORI_UDS_PROTO_VERSION);
+    out->writeUInt8(OK);
+    out->writePStr(ORI_UDS_PROTO_VERSION);
 }
 
-void UDSSession::cmd_listObjs()
+/*
+ * The client announces the payload algorithms it can decode.  Clients that
+ * never do are older binaries, and get their payloads in ZIPCODEC_LEGACY.
+ */
+void UDSSession::cmd_zipAlgos(bytestream *in, bytewstream *out)
+{
+    zipAlgos = in->readUInt32();
+    DLOG("zipAlgos: %08x", zipAlgos);
+
+    out->writeUInt8(OK);
+}
+
+void UDSSession::cmd_listObjs(bytestream *in, bytewstream *out)
 {
     DLOG("listObjs");
-    fdwstream fs(fd);
 
-    fs.writeUInt8(OK);
+    out->writeUInt8(OK);
 
     std::set<ObjectInfo> objects = repo->listObjects();
-    fs.writeUInt64(objects.size());
+    out->writeUInt64(objects.size());
     for (std::set<ObjectInfo>::iterator it = objects.begin();
             it != objects.end();
             it++) {
-        fs.writeInfo(*it);
+        out->writeInfo(*it);
     }
 }
 
-void UDSSession::cmd_listCommits()
+void UDSSession::cmd_listCommits(bytestream *in, bytewstream *out)
 {
     DLOG("listCommits");
-    fdwstream fs(fd);
 
-    fs.writeUInt8(OK);
+    out->writeUInt8(OK);
 
     const std::vector<Commit> &commits = repo->listCommits();
-    fs.writeUInt32(commits.size());
+    out->writeUInt32(commits.size());
     for (size_t i = 0; i < commits.size(); i++) {
         std::string blob = commits[i].getBlob();
-        fs.writePStr(blob);
+        out->writePStr(blob);
     }
 }
 
-void UDSSession::cmd_readObjs()
+void UDSSession::cmd_readObjs(bytestream *in, bytewstream *out)
 {
     // Read object ids
-    fdstream in(fd, -1);
-    uint32_t numObjs = in.readUInt32();
+    uint32_t numObjs = in->readUInt32();
     DLOG("readObjs: Transmitting %u objects", numObjs);
 
     std::vector<ObjectHash> objs;
     for (uint32_t i = 0; i < numObjs; i++) {
         ObjectHash hash;
-        in.readHash(hash);
+        in->readHash(hash);
         objs.push_back(hash);
         DLOG("readObjs: %d of %d - %s", i + 1, numObjs, hash.hex().c_str());
     }
 
-    fdwstream fs(fd);
-    fs.writeUInt8(OK);
-    repo->transmit(&fs, objs);
+    out->writeUInt8(OK);
+    repo->transmitFor(out, objs, zipAlgos);
 }
 
-void UDSSession::cmd_getObjInfo()
+void UDSSession::cmd_getObjInfo(bytestream *in, bytewstream *out)
 {
-    fdstream in(fd, -1);
     ObjectHash hash;
     ObjectInfo info;
 
-    in.readHash(hash);
+    in->readHash(hash);
 
-    fdwstream fs(fd);
     info = repo->getObjectInfo(hash);
     if (info.type == ObjectInfo::Null) {
-        fs.writeUInt8(ERROR);
+        printError(out, "Object not found");
         return;
     }
-    fs.writeUInt8(OK);
-    fs.writeInfo(info);
+    out->writeUInt8(OK);
+    out->writeInfo(info);
 }
 
-void UDSSession::cmd_getHead()
+/*
+ * Batched getobjinfo: replies with a present flag per requested object
+ * followed by its ObjectInfo if present.
+ */
+void UDSSession::cmd_getObjInfos(bytestream *in, bytewstream *out)
+{
+    uint32_t numObjs = in->readUInt32();
+    std::vector<ObjectHash> objs;
+
+    DLOG("getObjInfos: %u objects", numObjs);
+
+    // The count comes from the peer, only trust the hashes actually sent
+    for (uint32_t i = 0; i < numObjs; i++) {
+        ObjectHash hash;
+
+        if (in->ended()) {
+            printError(out, "Malformed request");
+            return;
+        }
+        in->readHash(hash);
+        objs.push_back(hash);
+    }
+
+    out->writeUInt8(OK);
+    out->writeUInt32(numObjs);
+    for (uint32_t i = 0; i < numObjs; i++) {
+        ObjectInfo info = repo->getObjectInfo(objs[i]);
+
+        if (info.type == ObjectInfo::Null) {
+            out->writeUInt8(0);
+        } else {
+            out->writeUInt8(1);
+            out->writeInfo(info);
+        }
+    }
+}
+
+void UDSSession::cmd_getHead(bytestream *in, bytewstream *out)
 {
     DLOG("getHead");
-    fdwstream fs(fd);
 
-    fs.writeUInt8(OK);
-    fs.writeHash(repo->getHead());
+    out->writeUInt8(OK);
+    out->writeHash(repo->getHead());
 }
 
-void UDSSession::cmd_getFSID()
+void UDSSession::cmd_getFSID(bytestream *in, bytewstream *out)
 {
     DLOG("getFSID");
-    fdwstream fs(fd);
 
-    fs.writeUInt8(OK);
-    fs.writePStr(repo->getUUID());
+    out->writeUInt8(OK);
+    out->writePStr(repo->getUUID());
 }
 
-void UDSSession::cmd_getVersion()
+void UDSSession::cmd_getVersion(bytestream *in, bytewstream *out)
 {
     DLOG("getVersion");
 
-    fdwstream fs(fd);
-    fs.writeUInt8(OK);
-    fs.writePStr(repo->getVersion());
+    out->writeUInt8(OK);
+    out->writePStr(repo->getVersion());
 }
 
-void UDSSession::cmd_listExt()
+void UDSSession::cmd_listExt(bytestream *in, bytewstream *out)
 {
     set<string> exts = uds->listExt();
     set<string>::iterator it;
     DLOG("listExt");
-    fdwstream fs(fd);
 
-    fs.writeUInt8(OK);
-    fs.writeUInt8(exts.size());
+    out->writeUInt8(OK);
+    out->writeUInt8(exts.size());
     for (it = exts.begin(); it != exts.end(); it++) {
-        fs.writePStr(*it);
+        out->writePStr(*it);
     }
 }
 
-void UDSSession::cmd_callExt()
+void UDSSession::cmd_callExt(bytestream *in, bytewstream *out)
 {
-    fdstream in(fd, -1);
     string ext;
     string data;
 
-    in.readPStr(ext);
-    in.readLPStr(data);
+    in->readPStr(ext);
+    in->readLPStr(data);
 
     DLOG("callExt %s", ext.c_str());
-    fdwstream fs(fd);
     if (!uds->hasExt(ext)) {
-        fs.writeUInt8(ERROR);
+        printError(out, "Unknown extension");
+        return;
     }
 
     string result = uds->callExt(ext, data);
-    fs.writeUInt8(OK);
-    fs.writeLPStr(result);
+    out->writeUInt8(OK);
+    out->writeLPStr(result);
 }
 
+void UDSSession::cmd_streamExt(bytestream *in, bytewstream *out)
+{
+    string ext;
+    string data;
+
+    in->readPStr(ext);
+    in->readLPStr(data);
+
+    DLOG("streamExt %s", ext.c_str());
+    if (!uds->hasStreamExt(ext)) {
+        printError(out, "Unknown extension");
+        return;
+    }
+
+    out->writeUInt8(OK);
+    uds->callStreamExt(ext, data, out);
+}
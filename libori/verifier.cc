@@ -0,0 +1,609 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <sstream>
+#include <algorithm>
+#include <exception>
+
+#include "tuneables.h"
+
+#include <oriutil/debug.h>
+#include <oriutil/oriutil.h>
+#include <oriutil/orifile.h>
+#include <oriutil/oristr.h>
+#include <oriutil/oricrypt.h>
+#include <oriutil/stream.h>
+#include <oriutil/objectinfo.h>
+#include <oriutil/stopwatch.h>
+#include <oriutil/zipcodec.h>
+#include <ori/commit.h>
+#include <ori/tree.h>
+#include <ori/largeblob.h>
+#include <ori/localrepo.h>
+#include <ori/verifier.h>
+
+using namespace std;
+
+VerifyStats::VerifyStats()
+    : packsScanned(0), packsSkipped(0), objects(0), storedBytes(0),
+      payloadBytes(0), largeBlobs(0), reachable(0), unreachable(0), time(0)
+{
+}
+
+Verifier::Verifier(LocalRepo *r)
+    : PackfileScanner(VERIFY_BATCH_SIZE), repo(r), incremental(true),
+      checkpoints(), done(), errors(), stats(), results(), refs(),
+      largeBlobs(), edges(), packErrors()
+{
+}
+
+Verifier::~Verifier()
+{
+}
+
+/*
+ * Checks an object's payload against its info and collects the objects it
+ * references.
+ */
+string
+Verifier::checkObject(const ObjectInfo &info, const string &payload,
+                      vector<VerifyRef> *refs)
+{
+    if (info.type == ObjectInfo::Null)
+        return "Object with Null type";
+    if (!info.hasAllFields())
+        return "Object info missing some fields";
+    if (info.type == ObjectInfo::Purged)
+        return "";
+
+    if (payload.size() != info.payload_size)
+        return "Object size mismatch";
+    if (OriCrypt_HashString(payload) != info.hash)
+        return "Object hash mismatch";
+
+    try {
+        switch (info.type) {
+            case ObjectInfo::Commit:
+            {
+                Commit c;
+                VerifyRef r;
+
+                c.fromBlob(payload);
+                r.hash = c.getTree();
+                r.type = ObjectInfo::Tree;
+                r.size = (uint32_t)-1;
+                refs->push_back(r);
+
+                pair<ObjectHash, ObjectHash> p = c.getParents();
+                r.type = ObjectInfo::Commit;
+                if (!p.first.isEmpty() && p.first != EMPTY_COMMIT) {
+                    r.hash = p.first;
+                    refs->push_back(r);
+                }
+                if (!p.second.isEmpty() && p.second != EMPTY_COMMIT) {
+                    r.hash = p.second;
+                    refs->push_back(r);
+                }
+                break;
+            }
+            case ObjectInfo::Tree:
+            {
+                Tree t;
+
+                t.fromBlob(payload);
+                for (map<string, TreeEntry>::iterator it = t.tree.begin();
+                     it != t.tree.end();
+                     it++) {
+                    VerifyRef r;
+
+                    if (!it->second.hasBasicAttrs())
+                        return "TreeEntry missing basic attrs";
+
+                    r.hash = it->second.hash;
+                    r.size = (uint32_t)-1;
+                    switch (it->second.type) {
+                        case TreeEntry::Blob:
+                            r.type = ObjectInfo::Blob;
+                            break;
+                        case TreeEntry::LargeBlob:
+                            r.type = ObjectInfo::LargeBlob;
+                            break;
+                        case TreeEntry::Tree:
+                            r.type = ObjectInfo::Tree;
+                            break;
+                        default:
+                            return "TreeEntry with unknown type";
+                    }
+                    refs->push_back(r);
+                }
+                break;
+            }
+            case ObjectInfo::Blob:
+                break;
+            case ObjectInfo::LargeBlob:
+            {
+                LargeBlob lb(NULL);
+                uint64_t off = 0;
+
+                lb.fromBlob(payload);
+                for (map<uint64_t, LBlobEntry>::iterator it = lb.parts.begin();
+                     it != lb.parts.end();
+                     it++) {
+                    VerifyRef r;
+
+                    if (it->second.hash.isEmpty())
+                        return "LargeBlob contains an empty hash";
+                    if (it->first != off)
+                        return "LargeBlob fragments are not contiguous";
+                    off += it->second.length;
+
+                    r.hash = it->second.hash;
+                    r.type = ObjectInfo::Blob;
+                    r.size = it->second.length;
+                    refs->push_back(r);
+                }
+                break;
+            }
+            default:
+                return "Object with unknown type";
+        }
+    } catch (exception &e) {
+        return "Cannot parse object";
+    }
+
+    return "";
+}
+
+/*
+ * Hashes the file described by a large blob.  All fragments must exist.
+ */
+string
+Verifier::checkLargeBlob(LocalRepo *r, const string &payload)
+{
+    LargeBlob lb(r);
+
+    lb.fromBlob(payload);
+
+    OriCrypt_HashCtx *ctx = OriCrypt_HashBegin();
+    for (map<uint64_t, LBlobEntry>::iterator it = lb.parts.begin();
+         it != lb.parts.end();
+         it++) {
+        string part = r->getPayload(it->second.hash);
+
+        OriCrypt_HashUpdate(ctx, (const uint8_t *)part.data(), part.size());
+    }
+
+    if (OriCrypt_HashEnd(ctx) != lb.totalHash)
+        return "LargeBlob file hash mismatch";
+
+    return "";
+}
+
+void
+Verifier::addError(const ObjectHash &hash, const string &kind,
+                   const string &detail)
+{
+    VerifyError e;
+
+    e.hash = hash;
+    e.kind = kind;
+    e.detail = detail;
+    errors.push_back(e);
+}
+
+/*
+ * Hash the start of a packfile, up to end, which stays the same as long as
+ * the packfile is only appended to.
+ */
+static ObjectHash
+hashPackHead(const string &path, offset_t end)
+{
+    size_t len = end < VERIFY_HEAD_SIZE ? end : VERIFY_HEAD_SIZE;
+    string buf(len, '\0');
+    ssize_t n = 0;
+    int fd;
+
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return ObjectHash();
+    if (len > 0)
+        n = pread(fd, &buf[0], len, 0);
+    close(fd);
+
+    if (n != (ssize_t)len)
+        return ObjectHash();
+    return OriCrypt_HashString(buf);
+}
+
+void
+Verifier::loadCheckpoints()
+{
+    string path = repo->getRootPath() + ORI_PATH_VERIFIED;
+
+    checkpoints.clear();
+    if (!OriFile_Exists(path))
+        return;
+
+    vector<string> lines = OriStr_Split(OriFile_ReadFile(path), '\n');
+    for (size_t i = 0; i < lines.size(); i++) {
+        stringstream ss(lines[i]);
+        string kind;
+        string head;
+        packid_t id;
+        Checkpoint cp;
+
+        // Checkpoints without a head hash are dropped
+        ss >> kind;
+        if (kind == "pack" && (ss >> id >> cp.ino >> cp.offset >> head) &&
+            head.size() == ObjectHash::STR_SIZE &&
+            ObjectHash::fromHex(head.c_str(), &cp.head))
+            checkpoints[id] = cp;
+    }
+}
+
+void
+Verifier::saveCheckpoints()
+{
+    string path = repo->getRootPath() + ORI_PATH_VERIFIED;
+    stringstream ss;
+
+    for (map<packid_t, Checkpoint>::iterator it = checkpoints.begin();
+         it != checkpoints.end();
+         it++) {
+        ss << "pack " << it->first << " " << it->second.ino << " "
+           << it->second.offset << " " << it->second.head.hex() << "\n";
+    }
+
+    if (checkpoints.empty()) {
+        if (OriFile_Exists(path))
+            OriFile_Delete(path);
+        return;
+    }
+
+    if (!OriFile_WriteFile(ss.str(), path)) {
+        WARNING("Couldn't save verification checkpoints to %s", path.c_str());
+    }
+}
+
+void
+Verifier::scanError(packid_t id, const string &what)
+{
+    addError(ObjectHash(), what, repo->packfiles->getPackfilePath(id));
+    packErrors[id]++;
+}
+
+void
+Verifier::startBatch(PackfileScanBatch *b)
+{
+    results.clear();
+    results.resize(b->items.size());
+}
+
+/*
+ * Decompress and check a share of the batch, called by the worker threads.
+ */
+void
+Verifier::processBatch(PackfileScanBatch *b, size_t first, size_t step)
+{
+    for (size_t i = first; i < b->items.size(); i += step) {
+        const PackfileScanItem &item = b->items[i];
+        Result &r = results[i];
+
+        if (item.info.type == ObjectInfo::Purged) {
+            r.error = checkObject(item.info, "", &r.refs);
+            continue;
+        }
+
+        bytestream::ap bs(ZipCodec_Decompress(
+                    new strstream(b->getStored(item)), item.info));
+        if (!bs.get()) {
+            r.error = "Unsupported compression codec";
+            continue;
+        }
+
+        string payload = bs->readAll();
+        if (bs->error()) {
+            r.error = "Cannot decompress object";
+            continue;
+        }
+
+        r.error = checkObject(item.info, payload, &r.refs);
+        if (r.error == "" && item.info.type == ObjectInfo::LargeBlob)
+            r.largeBlob = payload;
+    }
+}
+
+void
+Verifier::finishBatch(PackfileScanBatch *b)
+{
+    Index &index = repo->index;
+
+    stats.storedBytes += b->end - b->start;
+    for (size_t i = 0; i < b->items.size(); i++) {
+        const PackfileScanItem &item = b->items[i];
+        Result &r = results[i];
+        const ObjectHash &hash = item.info.hash;
+
+        stats.objects++;
+        stats.payloadBytes += item.info.payload_size;
+
+        if (r.error != "") {
+            addError(hash, r.error);
+            packErrors[b->packfile]++;
+            continue;
+        }
+
+        // The index may point to another copy of the object
+        if (!index.hasObject(hash)) {
+            addError(hash, "Object missing from index");
+            packErrors[b->packfile]++;
+            continue;
+        }
+        ObjectInfo info = index.getInfo(hash);
+        if (info.type != item.info.type ||
+            (info.type != ObjectInfo::Purged &&
+             info.payload_size != item.info.payload_size)) {
+            addError(hash, "Index entry does not match object");
+            packErrors[b->packfile]++;
+            continue;
+        }
+
+        if (!incremental)
+            edges[hash] = make_pair(refs.size(), refs.size() + r.refs.size());
+        for (size_t j = 0; j < r.refs.size(); j++) {
+            PendingRef pr;
+
+            pr.from = hash;
+            pr.packfile = b->packfile;
+            pr.ref = r.refs[j];
+            refs.push_back(pr);
+        }
+        if (r.largeBlob != "") {
+            PendingBlob lb;
+
+            lb.hash = hash;
+            lb.packfile = b->packfile;
+            lb.payload.swap(r.largeBlob);
+            largeBlobs.push_back(lb);
+        }
+    }
+    results.clear();
+
+    if (packErrors[b->packfile] == 0) {
+        Checkpoint cp;
+
+        cp.ino = b->ino;
+        cp.offset = b->end;
+        done[b->packfile] = cp;
+    }
+}
+
+/*
+ * Walk the references of the objects read from the heads and snapshots and
+ * count the objects reached.  Missing objects are reported by checkRefs and
+ * checkRoots.
+ */
+void
+Verifier::checkReachable()
+{
+    vector<ObjectHash> stack = repo->listHeads();
+    map<string, ObjectHash> snaps = repo->listSnapshots();
+    ObjectHashSet seen;
+
+    for (map<string, ObjectHash>::iterator it = snaps.begin();
+         it != snaps.end();
+         it++) {
+        stack.push_back(it->second);
+    }
+
+    while (!stack.empty()) {
+        ObjectHash hash = stack.back();
+
+        stack.pop_back();
+        if (!seen.insert(hash).second)
+            continue;
+
+        ObjectHashMap<pair<size_t, size_t> >::iterator it = edges.find(hash);
+        if (it == edges.end())
+            continue;
+        stats.reachable++;
+        for (size_t i = it->second.first; i < it->second.second; i++)
+            stack.push_back(refs[i].ref.hash);
+    }
+
+    stats.unreachable = edges.size() - stats.reachable;
+    edges.clear();
+}
+
+/*
+ * Check that the objects referenced by the objects read exist.  Repositories
+ * that are still being instacloned fetch missing objects on demand.
+ */
+void
+Verifier::checkRefs()
+{
+    Index &index = repo->index;
+    bool remote = repo->hasRemote();
+    set<ObjectHash> incomplete;
+
+    for (size_t i = 0; i < refs.size(); i++) {
+        const ObjectHash &hash = refs[i].from;
+        const VerifyRef &r = refs[i].ref;
+        const char *error = NULL;
+
+        if (!index.hasObject(r.hash)) {
+            incomplete.insert(hash);
+            if (!remote)
+                error = "Missing referenced object";
+        } else {
+            ObjectInfo info = index.getInfo(r.hash);
+
+            if (info.type == ObjectInfo::Purged) {
+                // Nothing to compare against
+            } else if (info.type != r.type) {
+                error = "Referenced object has the wrong type";
+            } else if (r.size != (uint32_t)-1 &&
+                       info.payload_size != r.size) {
+                error = "LargeBlob fragment has the wrong size";
+            }
+        }
+
+        if (error) {
+            addError(hash, error, r.hash.hex());
+            packErrors[refs[i].packfile]++;
+            incomplete.insert(hash);
+        }
+    }
+    refs.clear();
+
+    for (size_t i = 0; i < largeBlobs.size(); i++) {
+        const ObjectHash &hash = largeBlobs[i].hash;
+
+        if (incomplete.find(hash) != incomplete.end())
+            continue;
+
+        stats.largeBlobs++;
+        string error = checkLargeBlob(repo, largeBlobs[i].payload);
+        if (error != "") {
+            addError(hash, error);
+            packErrors[largeBlobs[i].packfile]++;
+        }
+    }
+    largeBlobs.clear();
+}
+
+/*
+ * Check that branch heads and snapshots point to commits.
+ */
+void
+Verifier::checkRoots()
+{
+    vector<ObjectHash> roots = repo->listHeads();
+    map<string, ObjectHash> snaps = repo->listSnapshots();
+
+    for (map<string, ObjectHash>::iterator it = snaps.begin();
+         it != snaps.end();
+         it++) {
+        roots.push_back(it->second);
+    }
+
+    for (size_t i = 0; i < roots.size(); i++) {
+        if (roots[i].isEmpty() || roots[i] == EMPTY_COMMIT)
+            continue;
+        if (!repo->hasObject(roots[i])) {
+            addError(roots[i], "Missing head or snapshot");
+        } else if (repo->getObjectType(roots[i]) != ObjectInfo::Commit) {
+            addError(roots[i], "Head or snapshot is not a commit");
+        }
+    }
+}
+
+size_t
+Verifier::run()
+{
+    Stopwatch sw = Stopwatch();
+    vector<packid_t> ids = repo->packfiles->getPackfileList();
+
+    sw.start();
+    errors.clear();
+    packErrors.clear();
+    done.clear();
+    stats = VerifyStats();
+    if (incremental)
+        loadCheckpoints();
+
+    sort(ids.begin(), ids.end());
+    for (size_t i = 0; i < ids.size(); i++) {
+        string path = repo->packfiles->getPackfilePath(ids[i]);
+        struct stat sb;
+        offset_t off = 0;
+        uint64_t ino = 0;
+
+        if (stat(path.c_str(), &sb) < 0) {
+            addError(ObjectHash(), "Cannot open packfile", path);
+            continue;
+        }
+
+        map<packid_t, Checkpoint>::iterator it = checkpoints.find(ids[i]);
+        if (incremental && it != checkpoints.end() &&
+            it->second.ino == (uint64_t)sb.st_ino &&
+            it->second.offset <= (uint64_t)sb.st_size &&
+            hashPackHead(path, it->second.offset) == it->second.head) {
+            off = it->second.offset;
+            ino = sb.st_ino;
+            done[ids[i]] = it->second;
+        }
+
+        if (off == (uint64_t)sb.st_size) {
+            stats.packsSkipped++;
+            continue;
+        }
+        stats.packsScanned++;
+        addPackfile(ids[i], path, off, ino);
+    }
+
+    map<packid_t, Checkpoint> prior = done;
+    scan();
+
+    if (!incremental)
+        checkReachable();
+    checkRefs();
+    checkRoots();
+
+    // Objects with bad references are checked again by the next run
+    for (map<packid_t, size_t>::iterator it = packErrors.begin();
+         it != packErrors.end();
+         it++) {
+        if (it->second == 0)
+            continue;
+        if (prior.find(it->first) != prior.end())
+            done[it->first] = prior[it->first];
+        else
+            done.erase(it->first);
+    }
+
+    for (map<packid_t, Checkpoint>::iterator it = done.begin();
+         it != done.end();
+         it++) {
+        if (it->second.head.isEmpty()) {
+            string path = repo->packfiles->getPackfilePath(it->first);
+            it->second.head = hashPackHead(path, it->second.offset);
+        }
+    }
+
+    // Packfiles that no longer exist are dropped
+    checkpoints = done;
+    saveCheckpoints();
+
+    sw.stop();
+    stats.time = sw.getElapsedTime();
+
+    return errors.size();
+}
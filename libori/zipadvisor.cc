@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <ctype.h>
+
+#include <string>
+#include <map>
+#include <sstream>
+
+#include "tuneables.h"
+
+#include <oriutil/debug.h>
+#include <oriutil/orifile.h>
+#include <oriutil/oristr.h>
+#include <oriutil/zipcodec.h>
+#include <ori/zipadvisor.h>
+
+using namespace std;
+
+/*
+ * ZipStats
+ */
+
+ZipStats::ZipStats()
+    : objects(0), compressed(0), rejected(0),
+      skipEntropy(0), skipFile(0), skipExt(0),
+      triedBytes(0), skippedBytes(0), savedBytes(0),
+      compressUsec(0), wastedUsec(0)
+{
+}
+
+string
+ZipStats::toString() const
+{
+    stringstream ss;
+
+    ss << objects << " " << compressed << " " << rejected << " "
+       << skipEntropy << " " << skipFile << " " << skipExt << " "
+       << triedBytes << " " << skippedBytes << " " << savedBytes << " "
+       << compressUsec << " " << wastedUsec;
+
+    return ss.str();
+}
+
+void
+ZipStats::fromString(const string &str)
+{
+    stringstream ss(str);
+
+    ss >> objects >> compressed >> rejected
+       >> skipEntropy >> skipFile >> skipExt
+       >> triedBytes >> skippedBytes >> savedBytes
+       >> compressUsec >> wastedUsec;
+}
+
+uint64_t
+ZipStats::savedUsec() const
+{
+    if (triedBytes == 0)
+        return 0;
+
+    return (uint64_t)((double)skippedBytes * compressUsec / triedBytes);
+}
+
+/*
+ * ZipAdvisor
+ */
+
+ZipAdvisor::ZipAdvisor()
+    : path(), inFile(false), fileExt(), strikes(0), exts(), stats()
+{
+}
+
+ZipAdvisor::~ZipAdvisor()
+{
+}
+
+/*
+ * Load learned state.  The file holds a "stats" line followed by one
+ * "ext NAME SAMPLES INCOMPRESSIBLE" line per extension.
+ */
+void
+ZipAdvisor::open(const string &advicePath)
+{
+    path = advicePath;
+    exts.clear();
+    stats = ZipStats();
+
+    if (!OriFile_Exists(path))
+        return;
+
+    vector<string> lines = OriStr_Split(OriFile_ReadFile(path), '\n');
+    for (size_t i = 0; i < lines.size(); i++) {
+        stringstream ss(lines[i]);
+        string kind;
+
+        ss >> kind;
+        if (kind == "stats") {
+            string rest;
+            getline(ss, rest);
+            stats.fromString(rest);
+        } else if (kind == "ext") {
+            string name;
+            ExtStats e;
+
+            e.skipped = 0;
+            if (ss >> name >> e.samples >> e.incompressible)
+                exts[name] = e;
+        }
+    }
+}
+
+void
+ZipAdvisor::save()
+{
+    stringstream ss;
+
+    if (path == "")
+        return;
+
+    ss << "stats " << stats.toString() << "\n";
+    for (map<string, ExtStats>::iterator it = exts.begin();
+         it != exts.end();
+         it++) {
+        ss << "ext " << it->first << " " << it->second.samples << " "
+           << it->second.incompressible << "\n";
+    }
+
+    if (!OriFile_WriteFile(ss.str(), path)) {
+        WARNING("Couldn't save compression advice to %s", path.c_str());
+    }
+}
+
+void
+ZipAdvisor::beginFile(const string &name)
+{
+    string base = OriFile_Basename(name);
+    size_t dot = base.rfind('.');
+
+    inFile = true;
+    strikes = 0;
+    fileExt = "";
+    if (dot != string::npos && dot != 0 && dot + 1 < base.size()) {
+        fileExt = base.substr(dot + 1);
+        for (size_t i = 0; i < fileExt.size(); i++) {
+            fileExt[i] = tolower(fileExt[i]);
+        }
+    }
+}
+
+void
+ZipAdvisor::endFile()
+{
+    inFile = false;
+    strikes = 0;
+    fileExt = "";
+}
+
+bool
+ZipAdvisor::isIncompressible(const ExtStats &e) const
+{
+    return e.samples >= ZIPADV_EXT_SAMPLES &&
+           e.incompressible >= ZIPADV_EXT_RATIO * e.samples;
+}
+
+ZipAdvisor::Advice
+ZipAdvisor::advise(ObjectInfo::Type type, const string &payload)
+{
+    stats.objects++;
+
+    // Learned hints only apply to file contents
+    if (inFile && type == ObjectInfo::Blob) {
+        if (strikes >= ZIPADV_FILE_STRIKES) {
+            stats.skipFile++;
+            stats.skippedBytes += payload.size();
+            return ZIPADV_SKIP_FILE;
+        }
+
+        map<string, ExtStats>::iterator it = exts.find(fileExt);
+        if (fileExt != "" && it != exts.end() &&
+            isIncompressible(it->second)) {
+            // Occasionally retry in case the content changed character
+            if (++it->second.skipped % ZIPADV_EXT_REPROBE != 0) {
+                stats.skipExt++;
+                stats.skippedBytes += payload.size();
+                return ZIPADV_SKIP_EXT;
+            }
+        }
+    }
+
+    float entropy = ZipCodec_Entropy((const uint8_t *)payload.data(),
+                                     payload.size());
+    if (entropy > ZIPADV_ENTROPY_MAX) {
+        stats.skipEntropy++;
+        stats.skippedBytes += payload.size();
+        learn(type, false);
+        return ZIPADV_SKIP_ENTROPY;
+    }
+
+    return ZIPADV_TRY;
+}
+
+void
+ZipAdvisor::record(ObjectInfo::Type type, size_t rawSize, size_t storedSize,
+                   bool kept, uint64_t usec)
+{
+    stats.triedBytes += rawSize;
+    stats.compressUsec += usec;
+    if (kept) {
+        stats.compressed++;
+        stats.savedBytes += rawSize - storedSize;
+    } else {
+        stats.rejected++;
+        stats.wastedUsec += usec;
+    }
+
+    learn(type, kept);
+}
+
+void
+ZipAdvisor::learn(ObjectInfo::Type type, bool compressible)
+{
+    if (!inFile || type != ObjectInfo::Blob)
+        return;
+
+    strikes = compressible ? 0 : strikes + 1;
+
+    if (fileExt == "")
+        return;
+
+    map<string, ExtStats>::iterator it = exts.find(fileExt);
+    if (it == exts.end()) {
+        if (exts.size() >= ZIPADV_EXT_MAX)
+            return;
+        ExtStats e;
+        e.samples = e.incompressible = e.skipped = 0;
+        it = exts.insert(make_pair(fileExt, e)).first;
+    }
+
+    it->second.samples++;
+    if (!compressible)
+        it->second.incompressible++;
+}
+
+const ZipStats &
+ZipAdvisor::getStats() const
+{
+    return stats;
+}
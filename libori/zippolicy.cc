@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <string>
+#include <vector>
+#include <sstream>
+
+#include <oriutil/debug.h>
+#include <oriutil/oristr.h>
+#include <oriutil/zipcodec.h>
+#include <ori/zippolicy.h>
+
+using namespace std;
+
+static const struct {
+    const char *name;
+    ObjectInfo::Type type;
+} policyTypes[] = {
+    { "commit", ObjectInfo::Commit },
+    { "tree", ObjectInfo::Tree },
+    { "blob", ObjectInfo::Blob },
+    { "largeblob", ObjectInfo::LargeBlob },
+    { NULL, ObjectInfo::Null },
+};
+
+ZipPolicy::ZipPolicy()
+    : defaultAlgo(ObjectInfo::ZIPALGO_NONE), rules()
+{
+}
+
+ZipPolicy::~ZipPolicy()
+{
+}
+
+void
+ZipPolicy::setDefault(ObjectInfo::ZipAlgo algo)
+{
+    defaultAlgo = algo;
+}
+
+bool
+ZipPolicy::fromString(const string &policy)
+{
+    vector<string> lines = OriStr_Split(policy, '\n');
+    bool ok = true;
+
+    rules.clear();
+
+    for (size_t i = 0; i < lines.size(); i++) {
+        stringstream ss(lines[i]);
+        string typeStr, sizeStr, codecStr, extra;
+        Rule r;
+
+        if (!(ss >> typeStr) || typeStr[0] == '#')
+            continue;
+
+        if (!(ss >> sizeStr >> codecStr) || (ss >> extra)) {
+            WARNING("zippolicy line %zu: expected TYPE MINSIZE CODEC", i + 1);
+            ok = false;
+            continue;
+        }
+
+        r.anyType = (typeStr == "*");
+        r.type = ObjectInfo::Null;
+        for (int t = 0; policyTypes[t].name != NULL; t++) {
+            if (typeStr == policyTypes[t].name)
+                r.type = policyTypes[t].type;
+        }
+        if (!r.anyType && r.type == ObjectInfo::Null) {
+            WARNING("zippolicy line %zu: unknown type '%s'",
+                    i + 1, typeStr.c_str());
+            ok = false;
+            continue;
+        }
+
+        char *end;
+        r.minSize = strtoul(sizeStr.c_str(), &end, 10);
+        if (*end != '\0') {
+            WARNING("zippolicy line %zu: bad size '%s'",
+                    i + 1, sizeStr.c_str());
+            ok = false;
+            continue;
+        }
+
+        r.algo = ZipCodec_Lookup(codecStr);
+        if (r.algo == ObjectInfo::ZIPALGO_UNKNOWN ||
+            (r.algo != ObjectInfo::ZIPALGO_NONE && !ZipCodec_Get(r.algo))) {
+            WARNING("zippolicy line %zu: codec '%s' is not available",
+                    i + 1, codecStr.c_str());
+            ok = false;
+            continue;
+        }
+
+        rules.push_back(r);
+    }
+
+    return ok;
+}
+
+string
+ZipPolicy::toString() const
+{
+    stringstream ss;
+
+    for (size_t i = 0; i < rules.size(); i++) {
+        const Rule &r = rules[i];
+        const char *typeStr = "*";
+
+        for (int t = 0; !r.anyType && policyTypes[t].name != NULL; t++) {
+            if (r.type == policyTypes[t].type)
+                typeStr = policyTypes[t].name;
+        }
+        ss << typeStr << " " << r.minSize << " "
+           << ZipCodec_Name(r.algo) << "\n";
+    }
+
+    return ss.str();
+}
+
+ObjectInfo::ZipAlgo
+ZipPolicy::select(ObjectInfo::Type type, size_t size) const
+{
+    const Rule *best = NULL;
+
+    for (size_t i = 0; i < rules.size(); i++) {
+        const Rule &r = rules[i];
+
+        if (!r.anyType && r.type != type)
+            continue;
+        if (r.minSize > size)
+            continue;
+        // Prefer the tightest size bound, then a specific type over '*'
+        if (best == NULL || r.minSize > best->minSize ||
+            (r.minSize == best->minSize && best->anyType && !r.anyType))
+            best = &r;
+    }
+
+    return best ? best->algo : defaultAlgo;
+}
@@ -0,0 +1,555 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/param.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "byteswap.h"
+
+#include <oriutil/debug.h>
+#include <oriutil/oriutil.h>
+#include <oriutil/stream.h>
+#include <oriutil/zipcodec.h>
+#include <oriutil/blockzip.h>
+
+using namespace std;
+
+static inline void
+putU32(uint8_t *p, uint32_t v)
+{
+    v = htobe32(v);
+    memcpy(p, &v, 4);
+}
+
+static inline uint32_t
+getU32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return be32toh(v);
+}
+
+blockzipstream::blockzipstream(bytestream *source, bool compress,
+                               size_t size_hint, ObjectInfo::ZipAlgo algo)
+    : source(source), codec(ZipCodec_Get(algo)), compress(compress),
+      size_hint(size_hint), consumed(0), produced(0),
+      inBuf(BLOCKZIP_BLOCKSIZE), outBuf(), outOff(0), outLen(0),
+      outputEnded(false), table(), rawSize(0)
+{
+    assert(source != NULL);
+
+    if (codec == NULL) {
+        last_error = "Unsupported compression codec";
+        outputEnded = true;
+        return;
+    }
+
+    if (compress) {
+        outBuf.resize(4 + codec->maxCompressedSize(BLOCKZIP_BLOCKSIZE));
+    } else {
+        outBuf.resize(BLOCKZIP_BLOCKSIZE);
+    }
+}
+
+blockzipstream::~blockzipstream()
+{
+    delete source;
+}
+
+bool
+blockzipstream::ended()
+{
+    if (outOff < outLen)
+        return false;
+    if (!compress && size_hint > 0 && produced == size_hint)
+        return true;
+    return outputEnded || error();
+}
+
+size_t
+blockzipstream::read(uint8_t *buf, size_t n)
+{
+    size_t total = 0;
+
+    while (total < n) {
+        if (outOff == outLen) {
+            // Return what we have before blocking on the next block
+            if (total > 0 || outputEnded)
+                break;
+            if (!(compress ? fillCompress() : fillDecompress()))
+                break;
+            continue;
+        }
+
+        size_t len = MIN(n - total, outLen - outOff);
+        memcpy(buf + total, &outBuf[outOff], len);
+        outOff += len;
+        total += len;
+    }
+
+    if (!compress)
+        produced += total;
+    return total;
+}
+
+size_t
+blockzipstream::sizeHint() const
+{
+    return size_hint;
+}
+
+size_t
+blockzipstream::inputConsumed() const
+{
+    return consumed;
+}
+
+size_t
+blockzipstream::readSource(uint8_t *buf, size_t n)
+{
+    size_t total = 0;
+
+    while (total < n && !source->ended()) {
+        size_t len = source->read(buf + total, n - total);
+        if (source->error()) {
+            inheritError(source);
+            return total;
+        }
+        if (len == 0)
+            break;
+        total += len;
+    }
+
+    consumed += total;
+    return total;
+}
+
+/*
+ * Compress the next block into outBuf, or emit the end marker, offset table
+ * and trailer once the source is exhausted.
+ */
+bool
+blockzipstream::fillCompress()
+{
+    size_t len = readSource(&inBuf[0], BLOCKZIP_BLOCKSIZE);
+
+    if (error())
+        return false;
+
+    outOff = 0;
+
+    if (len == 0) {
+        size_t trailerLen = 4 + 4 * table.size() + BLOCKZIP_TRAILERSIZE;
+
+        outBuf.resize(MAX(outBuf.size(), trailerLen));
+        putU32(&outBuf[0], 0);
+        for (size_t i = 0; i < table.size(); i++) {
+            putU32(&outBuf[4 + 4 * i], table[i]);
+        }
+        uint8_t *trailer = &outBuf[4 + 4 * table.size()];
+        putU32(trailer, table.size());
+        putU32(trailer + 4, BLOCKZIP_BLOCKSIZE);
+        putU32(trailer + 8, rawSize);
+        putU32(trailer + 12, BLOCKZIP_MAGIC);
+
+        outLen = trailerLen;
+        outputEnded = true;
+        return true;
+    }
+
+    // In compress mode produced tracks the payload offset for the table
+    table.push_back(produced);
+
+    size_t clen = codec->compress(&inBuf[0], len,
+                                  &outBuf[4], outBuf.size() - 4);
+
+    // Blocks that don't shrink are stored so frames never exceed MAXFRAME
+    if (clen > 0 && clen < len) {
+        putU32(&outBuf[0], clen);
+        outLen = 4 + clen;
+    } else {
+        putU32(&outBuf[0], len | BLOCKZIP_STORED);
+        memcpy(&outBuf[4], &inBuf[0], len);
+        outLen = 4 + len;
+    }
+
+    rawSize += len;
+    produced += outLen;
+
+    return true;
+}
+
+bool
+blockzipstream::fillDecompress()
+{
+    uint8_t hdr[4];
+
+    outOff = 0;
+    outLen = 0;
+
+    if (readSource(hdr, 4) != 4) {
+        outputEnded = true;
+        return false;
+    }
+
+    uint32_t clen = getU32(hdr);
+    if (clen == 0) {
+        // Offset table and trailer are only used for random access
+        outputEnded = true;
+        return false;
+    }
+
+    if (clen & BLOCKZIP_STORED) {
+        clen &= ~BLOCKZIP_STORED;
+        if (clen > BLOCKZIP_BLOCKSIZE || readSource(&outBuf[0], clen) != clen) {
+            last_error = "Truncated or corrupt block";
+            return false;
+        }
+        outLen = clen;
+        return true;
+    }
+
+    if (clen >= BLOCKZIP_BLOCKSIZE) {
+        last_error = "Corrupt block length";
+        return false;
+    }
+    if (readSource(&inBuf[0], clen) != clen) {
+        last_error = "Truncated block";
+        return false;
+    }
+
+    size_t len = codec->decompress(&inBuf[0], clen, &outBuf[0], outBuf.size());
+    if (len == 0) {
+        last_error = "Couldn't decompress block";
+        return false;
+    }
+    outLen = len;
+
+    return true;
+}
+
+static ssize_t
+BlockZip_PReadFull(int fd, void *buf, size_t n, off_t off)
+{
+    size_t total = 0;
+
+    while (total < n) {
+        ssize_t len = pread(fd, (uint8_t *)buf + total, n - total, off + total);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        if (len == 0)
+            return -EIO;
+        total += len;
+    }
+
+    return total;
+}
+
+/*
+ * Copy the part of a block frame starting at blockOff into buf.  A whole
+ * block that fits is decompressed straight into buf, otherwise it goes
+ * through block, which is allocated on first use.  Returns bytes copied or
+ * a negative errno.
+ */
+static ssize_t
+BlockZip_CopyFrame(const ZipCodec *codec, const uint8_t *frame,
+                   size_t frameLen, uint32_t blockSize, vector<uint8_t> &block,
+                   size_t blockOff, uint8_t *buf, size_t n)
+{
+    uint32_t clen = getU32(frame);
+    const uint8_t *data;
+    size_t dataLen;
+
+    if ((clen & ~BLOCKZIP_STORED) > frameLen - 4)
+        return -EINVAL;
+
+    if (clen & BLOCKZIP_STORED) {
+        data = frame + 4;
+        dataLen = clen & ~BLOCKZIP_STORED;
+    } else if (blockOff == 0 && n >= blockSize) {
+        size_t dlen = codec->decompress(frame + 4, clen, buf, n);
+        if (dlen == 0)
+            return -EIO;
+        return dlen;
+    } else {
+        block.resize(blockSize);
+        size_t dlen = codec->decompress(frame + 4, clen,
+                                        &block[0], block.size());
+        if (dlen == 0)
+            return -EIO;
+        data = &block[0];
+        dataLen = dlen;
+    }
+
+    if (blockOff >= dataLen)
+        return 0;
+    size_t copyLen = MIN(n, dataLen - blockOff);
+    memcpy(buf, data + blockOff, copyLen);
+    return copyLen;
+}
+
+/*
+ * Decode the trailer of a block-framed payload of len bytes.  Returns false
+ * if it is corrupt.
+ */
+static bool
+BlockZip_ParseTrailer(const uint8_t *trailer, size_t len, uint32_t *numBlocks,
+                      uint32_t *blockSize, uint32_t *rawSize)
+{
+    *numBlocks = getU32(trailer);
+    *blockSize = getU32(trailer + 4);
+    *rawSize = getU32(trailer + 8);
+
+    return getU32(trailer + 12) == BLOCKZIP_MAGIC &&
+           *blockSize != 0 && *blockSize <= BLOCKZIP_BLOCKSIZE &&
+           4 * (size_t)*numBlocks + 4 + BLOCKZIP_TRAILERSIZE <= len;
+}
+
+ssize_t
+BlockZip_PRead(int fd, off_t base, size_t len, ObjectInfo::ZipAlgo algo,
+               uint8_t *buf, size_t n, off_t off)
+{
+    const ZipCodec *codec = ZipCodec_Get(algo);
+    uint8_t trailer[BLOCKZIP_TRAILERSIZE];
+    uint32_t numBlocks, blockSize, rawSize;
+    ssize_t status;
+
+    if (codec == NULL || len < 4 + BLOCKZIP_TRAILERSIZE)
+        return -EINVAL;
+
+    status = BlockZip_PReadFull(fd, trailer, BLOCKZIP_TRAILERSIZE,
+                                base + len - BLOCKZIP_TRAILERSIZE);
+    if (status < 0)
+        return status;
+    if (!BlockZip_ParseTrailer(trailer, len, &numBlocks, &blockSize, &rawSize))
+        return -EINVAL;
+
+    if (off >= (off_t)rawSize)
+        return 0;
+    n = MIN(n, rawSize - (size_t)off);
+
+    // Load the offset table plus the end of blocks offset
+    size_t tableOff = len - BLOCKZIP_TRAILERSIZE - 4 * numBlocks;
+    vector<uint8_t> rawTable(4 * numBlocks);
+    status = BlockZip_PReadFull(fd, &rawTable[0], rawTable.size(),
+                                base + tableOff);
+    if (status < 0)
+        return status;
+
+    vector<uint8_t> frame(BLOCKZIP_MAXFRAME);
+    vector<uint8_t> block;
+    size_t total = 0;
+
+    for (uint32_t b = off / blockSize; total < n && b < numBlocks; b++) {
+        uint32_t start = getU32(&rawTable[4 * b]);
+        // The end of blocks marker follows the last block
+        uint32_t end = (b + 1 < numBlocks) ? getU32(&rawTable[4 * (b + 1)])
+                                           : tableOff - 4;
+        // Frames lie before the end of blocks marker and the offset table
+        if (end > tableOff - 4 || end <= start + 4 ||
+            end - start > frame.size())
+            return -EINVAL;
+
+        status = BlockZip_PReadFull(fd, &frame[0], end - start, base + start);
+        if (status < 0)
+            return status;
+
+        size_t blockOff = (b == off / blockSize) ? off % blockSize : 0;
+        status = BlockZip_CopyFrame(codec, &frame[0], end - start, blockSize,
+                                    block, blockOff, buf + total, n - total);
+        if (status < 0)
+            return status;
+        if (status == 0)
+            break;
+        total += status;
+    }
+
+    return total;
+}
+
+ssize_t
+BlockZip_Read(const uint8_t *stored, size_t len, ObjectInfo::ZipAlgo algo,
+              uint8_t *buf, size_t n, off_t off)
+{
+    const ZipCodec *codec = ZipCodec_Get(algo);
+    uint32_t numBlocks, blockSize, rawSize;
+
+    if (codec == NULL || len < 4 + BLOCKZIP_TRAILERSIZE)
+        return -EINVAL;
+    if (!BlockZip_ParseTrailer(stored + len - BLOCKZIP_TRAILERSIZE, len,
+                               &numBlocks, &blockSize, &rawSize))
+        return -EINVAL;
+
+    if (off >= (off_t)rawSize)
+        return 0;
+    n = MIN(n, rawSize - (size_t)off);
+
+    size_t tableOff = len - BLOCKZIP_TRAILERSIZE - 4 * numBlocks;
+    const uint8_t *table = stored + tableOff;
+    vector<uint8_t> block;
+    size_t total = 0;
+
+    for (uint32_t b = off / blockSize; total < n && b < numBlocks; b++) {
+        uint32_t start = getU32(&table[4 * b]);
+        uint32_t end = (b + 1 < numBlocks) ? getU32(&table[4 * (b + 1)])
+                                           : tableOff - 4;
+        if (end > tableOff - 4 || end <= start + 4 ||
+            end - start > BLOCKZIP_MAXFRAME)
+            return -EINVAL;
+
+        size_t blockOff = (b == off / blockSize) ? off % blockSize : 0;
+        ssize_t status = BlockZip_CopyFrame(codec, stored + start, end - start,
+                                            blockSize, block, blockOff,
+                                            buf + total, n - total);
+        if (status < 0)
+            return status;
+        if (status == 0)
+            break;
+        total += status;
+    }
+
+    return total;
+}
+
+#define BLOCKZIPTEST_SIZE   (BLOCKZIP_BLOCKSIZE * 5 / 2)
+#define BLOCKZIPTEST_FILE   "test.blockzip"
+
+int
+BlockZip_selfTest(void)
+{
+    string input;
+    string packed;
+    string output;
+
+    cout << "Testing BlockZip ..." << endl;
+
+    // Compressible text followed by an incompressible tail
+    input.reserve(BLOCKZIPTEST_SIZE);
+    for (size_t i = 0; input.size() < 2 * BLOCKZIP_BLOCKSIZE; i++) {
+        input += "block framed payload line ";
+        input += (char)('a' + i % 26);
+        input += "\n";
+    }
+    srand(1);
+    while (input.size() < BLOCKZIPTEST_SIZE) {
+        input += (char)rand();
+    }
+
+    {
+        blockzipstream bz(new strstream(input), COMPRESS);
+        packed = bz.readAll();
+        ASSERT(bz.inputConsumed() == input.size());
+    }
+    ASSERT(packed.size() < input.size());
+
+    {
+        blockzipstream bz(new strstream(packed), DECOMPRESS, input.size());
+        output = bz.readAll();
+    }
+    ASSERT(output == input);
+
+    // Empty payload
+    {
+        blockzipstream bz(new strstream(""), COMPRESS);
+        string empty = bz.readAll();
+        blockzipstream bz2(new strstream(empty), DECOMPRESS);
+        ASSERT(bz2.readAll() == "");
+    }
+
+    // Random access
+    int fd = open(BLOCKZIPTEST_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ASSERT(fd >= 0);
+    string pad = "prefix";
+    ssize_t status UNUSED = write(fd, (pad + packed).data(),
+                                  pad.size() + packed.size());
+    ASSERT(status == (ssize_t)(pad.size() + packed.size()));
+
+    off_t offsets[] = { 0, 100, BLOCKZIP_BLOCKSIZE - 10,
+                        2 * BLOCKZIP_BLOCKSIZE + 7, BLOCKZIPTEST_SIZE - 5 };
+    for (size_t i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+        uint8_t buf[100];
+        ssize_t len UNUSED = BlockZip_PRead(fd, pad.size(), packed.size(),
+                                            ObjectInfo::ZIPALGO_FASTLZBLK,
+                                            buf, sizeof(buf), offsets[i]);
+        size_t expected UNUSED = MIN(sizeof(buf),
+                                     input.size() - offsets[i]);
+        ASSERT(len == (ssize_t)expected);
+        ASSERT(memcmp(buf, input.data() + offsets[i], expected) == 0);
+
+        len = BlockZip_Read((const uint8_t *)packed.data(), packed.size(),
+                            ObjectInfo::ZIPALGO_FASTLZBLK,
+                            buf, sizeof(buf), offsets[i]);
+        ASSERT(len == (ssize_t)expected);
+        ASSERT(memcmp(buf, input.data() + offsets[i], expected) == 0);
+    }
+
+    // Whole blocks are decompressed into the caller's buffer
+    {
+        string whole(input.size(), '\0');
+        ssize_t len UNUSED = BlockZip_Read((const uint8_t *)packed.data(),
+                                           packed.size(),
+                                           ObjectInfo::ZIPALGO_FASTLZBLK,
+                                           (uint8_t *)&whole[0], whole.size(),
+                                           0);
+        ASSERT(len == (ssize_t)input.size() && whole == input);
+
+        len = BlockZip_PRead(fd, pad.size(), packed.size(),
+                             ObjectInfo::ZIPALGO_FASTLZBLK,
+                             (uint8_t *)&whole[0], whole.size(), 0);
+        ASSERT(len == (ssize_t)input.size() && whole == input);
+    }
+
+    // A block offset past the end of the blocks is rejected
+    {
+        string bad = packed;
+        uint8_t *trailer = (uint8_t *)&bad[bad.size() - BLOCKZIP_TRAILERSIZE];
+        size_t tableOff = bad.size() - BLOCKZIP_TRAILERSIZE -
+                          4 * getU32(trailer);
+        uint8_t buf[100];
+
+        putU32((uint8_t *)&bad[tableOff + 4], tableOff + 4);
+        ssize_t len UNUSED = BlockZip_Read((const uint8_t *)bad.data(),
+                                           bad.size(),
+                                           ObjectInfo::ZIPALGO_FASTLZBLK,
+                                           buf, sizeof(buf), 0);
+        ASSERT(len == -EINVAL);
+
+        status = pwrite(fd, bad.data(), bad.size(), pad.size());
+        ASSERT(status == (ssize_t)bad.size());
+        len = BlockZip_PRead(fd, pad.size(), bad.size(),
+                             ObjectInfo::ZIPALGO_FASTLZBLK,
+                             buf, sizeof(buf), 0);
+        ASSERT(len == -EINVAL);
+    }
+
+    close(fd);
+    unlink(BLOCKZIPTEST_FILE);
+
+    return 0;
+}
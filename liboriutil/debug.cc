@@ -59,6 +59,12 @@ using namespace std;
 static fstream logStream;
 static Mutex lock_log;
 
+/*
+ * Messages above LEVEL_MSG only go to the log file, and only DEBUG builds
+ * write them, so they are enabled once a DEBUG build opens its log.
+ */
+int ori_log_level = LEVEL_MSG;
+
 #ifndef _WIN32
 void
 get_timespec(struct timespec *ts)
@@ -91,10 +97,8 @@ ori_log(int level, const char *fmt, ...)
     char buf[MAX_LOG];
     size_t off;
 
-#if !defined(DEBUG)
-    if (level > LEVEL_MSG)
+    if (level > ori_log_level)
         return;
-#endif /* DEBUG */
 
 #ifndef _WIN32
     struct timespec ts;
@@ -238,6 +242,10 @@ int ori_open_log(const string &logPath) {
         return -1;
     }
 
+#ifdef DEBUG
+    ori_log_level = LEVEL_VRB;
+#endif /* DEBUG */
+
     return 0;
 }
 
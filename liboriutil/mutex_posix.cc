@@ -46,3 +46,28 @@ bool Mutex::tryLock()
     return (pthread_mutex_trylock(&lockHandle) == 0);
 }
 
+CondVar::CondVar()
+{
+    pthread_cond_init(&condHandle, NULL);
+}
+
+CondVar::~CondVar()
+{
+    pthread_cond_destroy(&condHandle);
+}
+
+void CondVar::wait(Mutex &m)
+{
+    pthread_cond_wait(&condHandle, &m.lockHandle);
+}
+
+void CondVar::signal()
+{
+    pthread_cond_signal(&condHandle);
+}
+
+void CondVar::broadcast()
+{
+    pthread_cond_broadcast(&condHandle);
+}
+
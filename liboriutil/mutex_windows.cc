@@ -48,3 +48,27 @@ bool Mutex::tryLock()
     return (TryEnterCriticalSection(&lockHandle) != 0);
 }
 
+CondVar::CondVar()
+{
+    InitializeConditionVariable(&condHandle);
+}
+
+CondVar::~CondVar()
+{
+}
+
+void CondVar::wait(Mutex &m)
+{
+    SleepConditionVariableCS(&condHandle, &m.lockHandle, INFINITE);
+}
+
+void CondVar::signal()
+{
+    WakeConditionVariable(&condHandle);
+}
+
+void CondVar::broadcast()
+{
+    WakeAllConditionVariable(&condHandle);
+}
+
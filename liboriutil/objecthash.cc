@@ -18,9 +18,6 @@
 #include <string.h>
 
 #include <string>
-#include <sstream>
-#include <iomanip>
-#include <algorithm>
 
 #include <oriutil/debug.h>
 #include <oriutil/oriutil.h>
@@ -37,28 +34,73 @@ ObjectHash::ObjectHash(const char *source)
     memcpy(hash, source, SIZE);
 }
 
-static uint8_t hexdigit(char c)
-{
-    ASSERT(isdigit(c) || (c >= 'a' && c <= 'f'));
-    if (isdigit(c))
-        return c - '0';
-    return c - 'a' + 10;
-}
+static const char hexChars[] = "0123456789abcdef";
+
+/*
+ * Maps each character to its hex value, or 0xFF if it is not a hex digit.
+ * Upper case digits are accepted as well.  This is a constant table so that
+ * static initializers in other files can parse hashes.
+ */
+static const uint8_t hexValue[256] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+};
 
 ObjectHash ObjectHash::fromHex(std::string hex)
 {
-    ASSERT(hex.size() == STR_SIZE);
+    ObjectHash rval;
+    bool valid = hex.size() == STR_SIZE && fromHex(hex.c_str(), &rval);
+
+    ASSERT(valid);
+    if (!valid)
+        rval.clear();
 
-    std::transform(hex.begin(), hex.end(), hex.begin(), ::tolower);
+    return rval;
+}
+
+bool ObjectHash::fromHex(const char *hex, ObjectHash *out)
+{
+    uint8_t bad = 0;
 
-    char hash[SIZE];
     for (size_t i = 0; i < SIZE; i++) {
-        hash[i] = hexdigit(hex[i*2]) * 16 + hexdigit(hex[i*2+1]);
+        uint8_t hi = hexValue[(uint8_t)hex[i*2]];
+        uint8_t lo = hexValue[(uint8_t)hex[i*2+1]];
+        bad |= hi | lo;
+        out->hash[i] = (hi << 4) | (lo & 0x0F);
     }
 
-    ObjectHash rval(hash);
-    ASSERT(rval.hex() == hex);
-    return rval;
+    // Valid digits are below 16, so any high bit marks a bad digit
+    return (bad & 0xF0) == 0;
 }
 
 /*bool ObjectHash::operator <(const ObjectHash &other) const
@@ -87,15 +129,20 @@ bool ObjectHash::isEmpty() const
 
 std::string ObjectHash::hex() const
 {
-    std::stringstream rval;
+    char buf[STR_SIZE + 1];
 
-    // Convert into string.
-    for (size_t i = 0; i < SIZE; i++)
-    {
-	rval << std::hex << std::setw(2) << std::setfill('0') << (int)hash[i];
+    return std::string(hex(buf), STR_SIZE);
+}
+
+const char *ObjectHash::hex(char *buf) const
+{
+    for (size_t i = 0; i < SIZE; i++) {
+        buf[i*2] = hexChars[hash[i] >> 4];
+        buf[i*2+1] = hexChars[hash[i] & 0x0F];
     }
+    buf[STR_SIZE] = '\0';
 
-    return rval.str();
+    return buf;
 }
 
 std::string ObjectHash::bin() const
@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2012 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdint.h>
+#include <string.h>
+
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include <oriutil/debug.h>
+#include <oriutil/oriutil.h>
+#include <oriutil/objecthash.h>
+#include <oriutil/objecthashmap.h>
+
+using namespace std;
+
+/*
+ * Builds a hash from two numbers.  The first eight bytes pick the slot and
+ * the tag, so hashes with the same prefix collide and probe the same chain.
+ */
+static ObjectHash
+ObjectHashMapTest_Hash(uint64_t prefix, uint64_t suffix)
+{
+    ObjectHash h;
+
+    memset(h.hash, 0, ObjectHash::SIZE);
+    memcpy(h.hash, &prefix, sizeof(prefix));
+    memcpy(h.hash + sizeof(prefix), &suffix, sizeof(suffix));
+    return h;
+}
+
+// Spreads a counter over the slot and tag bits
+static uint64_t
+ObjectHashMapTest_Mix(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+static size_t
+ObjectHashMapTest_Capacity(const ObjectHashMap<int> &m)
+{
+    return m.memoryUsage() / (sizeof(ObjectHashMap<int>::value_type) + 1);
+}
+
+static bool
+ObjectHashMapTest_Same(const ObjectHashMap<int> &m,
+                       const map<ObjectHash, int> &ref)
+{
+    map<ObjectHash, int> seen;
+
+    if (m.size() != ref.size())
+        return false;
+    for (ObjectHashMap<int>::const_iterator it = m.begin();
+         it != m.end();
+         it++) {
+        if (!seen.insert(make_pair(it->first, it->second)).second)
+            return false;
+    }
+    if (seen != ref)
+        return false;
+    for (map<ObjectHash, int>::const_iterator it = ref.begin();
+         it != ref.end();
+         it++) {
+        ObjectHashMap<int>::const_iterator f = m.find(it->first);
+        if (f == m.end() || f->second != it->second)
+            return false;
+    }
+    return true;
+}
+
+int
+ObjectHashMap_selfTest(void)
+{
+    cout << "Testing ObjectHashMap ..." << endl;
+
+    // Insert and overwrite
+    {
+        ObjectHashMap<int> m;
+        ObjectHash k = ObjectHashMapTest_Hash(1, 1);
+
+        ASSERT(m.empty() && m.find(k) == m.end() && m.count(k) == 0);
+        m[k] = 1;
+        ASSERT(!m.insert(make_pair(k, 2)).second);
+        ASSERT(m[k] == 1);
+        m[k] = 3;
+        ASSERT(m.size() == 1 && m.find(k)->second == 3);
+        ASSERT(m.insert(make_pair(ObjectHashMapTest_Hash(2, 0), 4)).second);
+        ASSERT(m.size() == 2 && m.erase(k) == 1 && m.erase(k) == 0);
+        ASSERT(m.size() == 1 && m.count(k) == 0);
+    }
+
+    // Erasing from the middle of a probe chain leaves a tombstone that
+    // lookups step over and inserts reuse
+    {
+        ObjectHashMap<int> m;
+        vector<ObjectHash> chain;
+
+        for (uint64_t i = 0; i < 6; i++) {
+            chain.push_back(ObjectHashMapTest_Hash(7, i));
+            m[chain.back()] = (int)i;
+        }
+        size_t cap UNUSED = ObjectHashMapTest_Capacity(m);
+
+        ASSERT(m.erase(chain[1]) == 1 && m.erase(chain[3]) == 1);
+        ASSERT(m.count(chain[1]) == 0 && m.count(chain[3]) == 0);
+        for (size_t i = 0; i < chain.size(); i += 2) {
+            ASSERT(m.count(chain[i]) == 1 && m[chain[i]] == (int)i);
+        }
+        // The end of the chain is emptied rather than left as a tombstone
+        ASSERT(m.erase(chain[5]) == 1 && m.count(chain[4]) == 1);
+
+        m[chain[3]] = 33;
+        m[chain[1]] = 11;
+        m[chain[5]] = 55;
+        ASSERT(m.size() == 6 && ObjectHashMapTest_Capacity(m) == cap);
+        ASSERT(m[chain[1]] == 11 && m[chain[3]] == 33 && m[chain[5]] == 55);
+    }
+
+    // Growth at 7/8 of the capacity
+    {
+        ObjectHashMap<int> m;
+        map<ObjectHash, int> ref;
+
+        for (int i = 0; i < 14; i++) {
+            ObjectHash k = ObjectHashMapTest_Hash(ObjectHashMapTest_Mix(i), 0);
+            m[k] = i;
+            ref[k] = i;
+        }
+        ASSERT(ObjectHashMapTest_Capacity(m) == 16);
+        ObjectHash k = ObjectHashMapTest_Hash(ObjectHashMapTest_Mix(14), 0);
+        m[k] = 14;
+        ref[k] = 14;
+        ASSERT(ObjectHashMapTest_Capacity(m) == 32);
+        ASSERT(ObjectHashMapTest_Same(m, ref));
+
+        for (int i = 15; i < 10000; i++) {
+            k = ObjectHashMapTest_Hash(ObjectHashMapTest_Mix(i), 0);
+            m[k] = i;
+            ref[k] = i;
+            size_t cap UNUSED = ObjectHashMapTest_Capacity(m);
+            ASSERT(m.size() <= cap - cap / 8);
+        }
+        ASSERT(ObjectHashMapTest_Same(m, ref));
+    }
+
+    // Tombstones are dropped by a rehash at the same capacity when the
+    // table is mostly empty, so churn doesn't grow it
+    {
+        ObjectHashMap<int> m;
+        map<ObjectHash, int> ref;
+        vector<ObjectHash> live;
+
+        for (int i = 0; i < 20000; i++) {
+            // Few prefixes so erased slots are followed by used ones
+            ObjectHash k = ObjectHashMapTest_Hash(i % 5, i);
+
+            m[k] = i;
+            ref[k] = i;
+            live.push_back(k);
+            if (live.size() > 8) {
+                ObjectHash old = live[live.size() - 9];
+                ASSERT(m.erase(old) == 1);
+                ref.erase(old);
+            }
+            ASSERT(ObjectHashMapTest_Capacity(m) <= 32);
+        }
+        ASSERT(ObjectHashMapTest_Same(m, ref));
+    }
+
+    // Iteration after erasing, through keys and iterators
+    {
+        ObjectHashMap<int> m;
+        map<ObjectHash, int> ref;
+
+        // Prefixes repeat so the chains are long
+        for (int i = 0; i < 5000; i++) {
+            uint64_t prefix = ObjectHashMapTest_Mix(i) & 0xFFF;
+            ObjectHash k = ObjectHashMapTest_Hash(prefix, i);
+            m[k] = i;
+            ref[k] = i;
+        }
+        for (int i = 0; i < 5000; i += 3) {
+            uint64_t prefix = ObjectHashMapTest_Mix(i) & 0xFFF;
+            ObjectHash k = ObjectHashMapTest_Hash(prefix, i);
+            ASSERT(m.erase(k) == 1);
+            ref.erase(k);
+        }
+        ASSERT(ObjectHashMapTest_Same(m, ref));
+
+        ObjectHashMap<int>::iterator it = m.begin();
+        while (it != m.end()) {
+            ObjectHashMap<int>::iterator cur = it++;
+            if (cur->second % 2 == 0) {
+                ref.erase(cur->first);
+                m.erase(cur);
+            }
+        }
+        ASSERT(ObjectHashMapTest_Same(m, ref));
+
+        ObjectHashMap<int> copy(m);
+        m.clear();
+        ASSERT(m.empty() && m.begin() == m.end());
+        ASSERT(ObjectHashMapTest_Same(copy, ref));
+    }
+
+    // Growing swaps the values into place instead of copying them
+    {
+        ObjectHashMap<vector<int> > m;
+        ObjectHash first = ObjectHashMapTest_Hash(ObjectHashMapTest_Mix(0), 0);
+        const int *data UNUSED;
+
+        m[first].assign(1000, 7);
+        data = &m[first][0];
+        for (int i = 1; i < 1000; i++) {
+            ObjectHash k = ObjectHashMapTest_Hash(ObjectHashMapTest_Mix(i), 0);
+            m[k].push_back(i);
+        }
+        ASSERT(m.size() == 1000);
+        ASSERT(m[first].size() == 1000 && &m[first][0] == data);
+    }
+
+    // Reserving room avoids growing
+    {
+        ObjectHashMap<int> m;
+
+        m.reserve(1000);
+        size_t cap UNUSED = ObjectHashMapTest_Capacity(m);
+        for (int i = 0; i < 1000; i++) {
+            m[ObjectHashMapTest_Hash(ObjectHashMapTest_Mix(i), 0)] = i;
+        }
+        ASSERT(ObjectHashMapTest_Capacity(m) == cap);
+    }
+
+    // Sets share the table
+    {
+        ObjectHashSet s;
+        ObjectHash k UNUSED = ObjectHashMapTest_Hash(3, 3);
+
+        ASSERT(s.insert(k).second && !s.insert(k).second);
+        ASSERT(s.size() == 1 && s.count(k) == 1 && *s.begin() == k);
+        ASSERT(s.erase(k) == 1 && s.empty());
+    }
+
+    return 0;
+}
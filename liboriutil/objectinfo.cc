@@ -101,7 +101,7 @@ ObjectInfo::hasAllFields() const
 
 bool
 ObjectInfo::isCompressed() const {
-    return (flags & ORI_FLAG_ZIPMASK) == ORI_FLAG_UNCOMPRESSED;
+    return (flags & ORI_FLAG_ZIPMASK) != ORI_FLAG_UNCOMPRESSED;
 }
 
 ObjectInfo::ZipAlgo
@@ -113,6 +113,14 @@ ObjectInfo::getAlgo() const {
             return ZIPALGO_FASTLZ;
         case ORI_FLAG_LZMA:
             return ZIPALGO_LZMA;
+        case ORI_FLAG_FASTLZBLK:
+            return ZIPALGO_FASTLZBLK;
+        case ORI_FLAG_SNAPPY:
+            return ZIPALGO_SNAPPY;
+        case ORI_FLAG_LZ4:
+            return ZIPALGO_LZ4;
+        case ORI_FLAG_ZSTD:
+            return ZIPALGO_ZSTD;
         default:
             return ZIPALGO_UNKNOWN;
     }
@@ -121,6 +129,8 @@ ObjectInfo::getAlgo() const {
 void
 ObjectInfo::setAlgo(ObjectInfo::ZipAlgo algo)
 {
+    flags &= ~ORI_FLAG_ZIPMASK;
+
     switch (algo) {
         case ZIPALGO_NONE:
             flags |= ORI_FLAG_UNCOMPRESSED;
@@ -131,6 +141,18 @@ ObjectInfo::setAlgo(ObjectInfo::ZipAlgo algo)
         case ZIPALGO_LZMA:
             flags |= ORI_FLAG_LZMA;
             break;
+        case ZIPALGO_FASTLZBLK:
+            flags |= ORI_FLAG_FASTLZBLK;
+            break;
+        case ZIPALGO_SNAPPY:
+            flags |= ORI_FLAG_SNAPPY;
+            break;
+        case ZIPALGO_LZ4:
+            flags |= ORI_FLAG_LZ4;
+            break;
+        case ZIPALGO_ZSTD:
+            flags |= ORI_FLAG_ZSTD;
+            break;
         case ZIPALGO_UNKNOWN:
         default:
             NOT_IMPLEMENTED(false);
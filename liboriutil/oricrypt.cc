@@ -140,6 +140,41 @@ OriCrypt_HashFile(const string &path)
     return hash;
 }
 
+struct OriCrypt_HashCtx {
+    SHA256_CTX state;
+};
+
+OriCrypt_HashCtx *
+OriCrypt_HashBegin()
+{
+    OriCrypt_HashCtx *ctx = new OriCrypt_HashCtx();
+
+    SHA256_Init(&ctx->state);
+
+    return ctx;
+}
+
+void
+OriCrypt_HashUpdate(OriCrypt_HashCtx *ctx, const uint8_t *data, size_t len)
+{
+    SHA256_Update(&ctx->state, data, len);
+}
+
+/*
+ * Returns the hash of all data passed to OriCrypt_HashUpdate and frees the
+ * context.
+ */
+ObjectHash
+OriCrypt_HashEnd(OriCrypt_HashCtx *ctx)
+{
+    ObjectHash hash;
+
+    SHA256_Final(hash.hash, &ctx->state);
+    delete ctx;
+
+    return hash;
+}
+
 #endif
 
 
@@ -256,6 +291,17 @@ OriCrypt_selfTest()
         i++;
     }
 
+    OriCrypt_HashCtx *ctx = OriCrypt_HashBegin();
+    for (i = 0; tests[i] != ""; i++) {
+        OriCrypt_HashUpdate(ctx, (const uint8_t *)tests[i].data(),
+                            tests[i].size());
+    }
+    if (OriCrypt_HashEnd(ctx) != OriCrypt_HashString(tests[0] + tests[1] +
+                                                     tests[2])) {
+        cout << "Error incremental hash does not match!" << endl;
+        return -1;
+    }
+
     return 0;
 }
 
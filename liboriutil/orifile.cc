@@ -32,6 +32,12 @@
 #include <errno.h>
 #include <pwd.h>
 
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#endif /* __linux__ */
+
 #include <iostream>
 #include <iomanip>
 #include <sstream>
@@ -303,6 +309,69 @@ error:
     return -errno;
 }
 
+/*
+ * Copy a file, replacing newPath, letting the kernel share or copy the data
+ * where possible: a reflink on file systems that support it, otherwise an
+ * in-kernel copy_file_range, otherwise OriFile_Copy.
+ */
+int
+OriFile_Clone(const string &origPath, const string &newPath)
+{
+#if defined(__linux__)
+    int srcFd, dstFd;
+    struct stat sb;
+
+    srcFd = open(origPath.c_str(), O_RDONLY);
+    if (srcFd < 0)
+        return -errno;
+
+    if (fstat(srcFd, &sb) < 0) {
+        close(srcFd);
+        return -errno;
+    }
+
+    dstFd = open(newPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                 S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (dstFd < 0) {
+        close(srcFd);
+        return -errno;
+    }
+
+#ifdef FICLONE
+    if (ioctl(dstFd, FICLONE, srcFd) == 0) {
+        close(srcFd);
+        close(dstFd);
+        return 0;
+    }
+#endif /* FICLONE */
+
+#ifdef SYS_copy_file_range
+    off_t bytesLeft = sb.st_size;
+    while (bytesLeft > 0) {
+        ssize_t n = syscall(SYS_copy_file_range, srcFd, NULL, dstFd, NULL,
+                            (size_t)bytesLeft, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        bytesLeft -= n;
+    }
+    if (bytesLeft == 0) {
+        close(srcFd);
+        close(dstFd);
+        return 0;
+    }
+#endif /* SYS_copy_file_range */
+
+    close(srcFd);
+    close(dstFd);
+    unlink(newPath.c_str());
+#endif /* __linux__ */
+
+    int status = OriFile_Copy(origPath, newPath);
+    return (status < 0) ? status : 0;
+}
+
 /*
  * Safely move a file possibly between file systems.
  */
@@ -427,6 +496,17 @@ OriFile_selfTest(void)
         ASSERT(false);
     }
 
+    status = OriFile_Clone("test.orig", "test.d");
+    if (status < 0) {
+        printf("OriFile_Clone: %s\n", strerror(-status));
+        ASSERT(false);
+    }
+    if (OriCrypt_HashFile("test.d") != origHash) {
+        printf("Hash mismatch!\n");
+        ASSERT(false);
+    }
+    ASSERT(OriFile_Delete("test.d") == 0);
+
     // Tests for stream classes
     int test_fd = open("test.a", O_RDWR | O_CREAT, 0644);
     write(test_fd, "hello, world!", 13);
@@ -22,14 +22,16 @@
 #include <sys/stat.h>
 #include <sys/param.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
 #endif
 
-#ifdef ORI_USE_FASTLZ
+#ifndef ORI_USE_LZMA
 #include "fastlz.h"
-#endif /* ORI_USE_FASTLZ */
+#endif /* !ORI_USE_LZMA */
 
 #include <string>
 
@@ -436,16 +438,44 @@ size_t strstream::sizeHint() const
     return len;
 }
 
+/*
+ * memstream
+ */
+
+memstream::memstream(const uint8_t *buf, size_t len)
+    : buf(buf), off(0), len(len)
+{
+}
+
+bool memstream::ended() {
+    return off >= len;
+}
+
+size_t memstream::read(uint8_t *out, size_t n)
+{
+    size_t to_read = MIN(n, len - off);
+    memcpy(out, buf + off, to_read);
+    off += to_read;
+    return to_read;
+}
+
+size_t memstream::sizeHint() const
+{
+    return len;
+}
+
 /*
  * fdstream
  */
 
+/*
+ * With an offset the stream reads with pread, so it does not move the file
+ * position and streams on a descriptor shared between threads do not get in
+ * each other's way.
+ */
 fdstream::fdstream(int fd, off_t offset, size_t length)
     : fd(fd), offset(offset), length(length), left(length)
 {
-    if (offset >= 0 && lseek(fd, offset, SEEK_SET) != offset) {
-        setErrno("lseek");
-    }
 }
 
 bool fdstream::ended() {
@@ -454,8 +484,12 @@ bool fdstream::ended() {
 
 size_t fdstream::read(uint8_t *buf, size_t n) {
     size_t final_size = MIN(n, left);
+    ssize_t read_bytes;
 retry_read:
-    ssize_t read_bytes = ::read(fd, buf, final_size);
+    if (offset >= 0)
+        read_bytes = ::pread(fd, buf, final_size, offset);
+    else
+        read_bytes = ::read(fd, buf, final_size);
     if (read_bytes < 0) {
         if (errno == EINTR)
             goto retry_read;
@@ -467,6 +501,8 @@ retry_read:
         return 0;
     }
     left -= read_bytes;
+    if (offset >= 0)
+        offset += read_bytes;
 
     /*LOG("Readd %lu bytes (actually %ld) (%d)\n", n, read_bytes, fd);
     if (n < 100) {
@@ -483,6 +519,134 @@ size_t fdstream::sizeHint() const {
     return 0;
 }
 
+/*
+ * fdbufstream
+ */
+
+fdbufstream::fdbufstream(int fd)
+    : fd(fd), buf(STREAM_BUFSZ), off(0), len(0), eof(false)
+{
+}
+
+bool fdbufstream::ended() {
+    return (off == len && eof) || error();
+}
+
+size_t fdbufstream::read(uint8_t *out, size_t n) {
+    if (off == len) {
+        uint8_t *dst;
+        size_t dstLen;
+
+        if (eof)
+            return 0;
+
+        // Large reads go directly into the caller's buffer
+        if (n >= buf.size()) {
+            dst = out;
+            dstLen = n;
+        } else {
+            dst = &buf[0];
+            dstLen = buf.size();
+        }
+
+retry_read:
+        ssize_t read_bytes = ::read(fd, dst, dstLen);
+        if (read_bytes < 0) {
+            if (errno == EINTR)
+                goto retry_read;
+            setErrno("read");
+            return 0;
+        } else if (read_bytes == 0) {
+            eof = true;
+            return 0;
+        }
+
+        if (dst == out)
+            return read_bytes;
+
+        off = 0;
+        len = read_bytes;
+    }
+
+    size_t to_read = MIN(n, len - off);
+    memcpy(out, &buf[off], to_read);
+    off += to_read;
+
+    return to_read;
+}
+
+size_t fdbufstream::sizeHint() const {
+    return 0;
+}
+
+/*
+ * refstream
+ */
+
+refstream::refstream(bytestream *source)
+    : source(source)
+{
+    typedStream = source->isTyped();
+}
+
+bool refstream::ended() {
+    return source->ended();
+}
+
+size_t refstream::read(uint8_t *buf, size_t n) {
+    size_t read_bytes = source->read(buf, n);
+    inheritError(source);
+    return read_bytes;
+}
+
+size_t refstream::sizeHint() const {
+    return source->sizeHint();
+}
+
+/*
+ * ratestream
+ */
+
+static uint64_t
+ratestream_now()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+ratestream::ratestream(bytestream *source, uint64_t rate)
+    : source(source), rate(rate), total(0), startTime(ratestream_now())
+{
+    typedStream = source->isTyped();
+}
+
+bool ratestream::ended() {
+    return source->ended();
+}
+
+size_t ratestream::read(uint8_t *buf, size_t n) {
+    if (rate != 0) {
+        uint64_t elapsed = ratestream_now() - startTime;
+        uint64_t due = total * 1000000ULL / rate;
+
+        // Read in slices of a tenth of a second to keep the rate smooth
+        n = MIN(n, (size_t)MAX(rate / 10, (uint64_t)4096));
+        if (due > elapsed)
+            ::usleep(due - elapsed);
+    }
+
+    size_t read_bytes = source->read(buf, n);
+    inheritError(source);
+    total += read_bytes;
+    return read_bytes;
+}
+
+size_t ratestream::sizeHint() const {
+    return source->sizeHint();
+}
+
 /*
  * diskstream
  */
@@ -634,7 +798,7 @@ void zipstream::setLzmaErr(const char *msg, lzma_ret ret)
 
 #endif /* ORI_USE_LZMA */
 
-#ifdef ORI_USE_FASTLZ
+#ifndef ORI_USE_LZMA
 
 /*
  * FastLZ zipstream
@@ -712,7 +876,7 @@ size_t zipstream::inputConsumed() const {
     return (size_t)((offset / (float)output.size()) * input.size());
 }
 
-#endif /* ORI_USE_FASTLZ */
+#endif /* !ORI_USE_LZMA */
 
 /*
  * bytewstream
@@ -972,3 +1136,244 @@ retryWrite:
     assert(totalWritten == n);
     return totalWritten;
 }
+
+/*
+ * fdbufwstream
+ */
+fdbufwstream::fdbufwstream(int fd)
+    : fd(fd), buf(STREAM_BUFSZ), len(0)
+{
+    assert(fd >= 0);
+}
+
+fdbufwstream::~fdbufwstream()
+{
+    flush();
+}
+
+ssize_t fdbufwstream::write(const void *bytes, size_t n)
+{
+    int status;
+
+    // Zero-copy passthrough for large writes
+    if (n >= buf.size()) {
+        status = writev(bytes, n);
+        if (status < 0)
+            return status;
+        return n;
+    }
+
+    if (len + n > buf.size()) {
+        status = flush();
+        if (status < 0)
+            return status;
+    }
+
+    memcpy(&buf[len], bytes, n);
+    len += n;
+
+    return n;
+}
+
+int fdbufwstream::flush()
+{
+    return writev(NULL, 0);
+}
+
+/*
+ * Write the buffered data followed by extra in as few syscalls as possible.
+ */
+int fdbufwstream::writev(const void *extra, size_t extraLen)
+{
+    struct iovec iov[2];
+    int iovcnt = 0;
+
+    if (len > 0) {
+        iov[iovcnt].iov_base = &buf[0];
+        iov[iovcnt].iov_len = len;
+        iovcnt++;
+    }
+    if (extraLen > 0) {
+        iov[iovcnt].iov_base = (void *)extra;
+        iov[iovcnt].iov_len = extraLen;
+        iovcnt++;
+    }
+
+    struct iovec *cur = iov;
+    while (iovcnt > 0) {
+        ssize_t bytesWritten = ::writev(fd, cur, iovcnt);
+        if (bytesWritten < 0) {
+            if (errno == EINTR)
+                continue;
+            setErrno("writev");
+            return -errno;
+        }
+
+        while (iovcnt > 0 && (size_t)bytesWritten >= cur->iov_len) {
+            bytesWritten -= cur->iov_len;
+            cur++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            cur->iov_base = (uint8_t *)cur->iov_base + bytesWritten;
+            cur->iov_len -= bytesWritten;
+        }
+    }
+
+    len = 0;
+
+    return 0;
+}
+
+/*
+ * Returns the number of read and write syscalls made by this process so far,
+ * or -1 where the kernel does not report it.
+ */
+static int
+Stream_SyscallCount(uint64_t *syscr, uint64_t *syscw)
+{
+#if defined(__linux__)
+    FILE *f = fopen("/proc/self/io", "r");
+    char line[128];
+    int found = 0;
+
+    if (f == NULL)
+        return -1;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        unsigned long long val;
+        if (sscanf(line, "syscr: %llu", &val) == 1) {
+            *syscr = val;
+            found++;
+        } else if (sscanf(line, "syscw: %llu", &val) == 1) {
+            *syscw = val;
+            found++;
+        }
+    }
+    fclose(f);
+
+    return found == 2 ? 0 : -1;
+#else
+    return -1;
+#endif
+}
+
+#define STREAMTEST_FILE     "test.stream"
+#define STREAMTEST_RECORDS  10000
+
+static void
+Stream_writeRecords(bytewstream *out)
+{
+    ObjectHash hash;
+
+    for (int i = 0; i < STREAMTEST_RECORDS; i++) {
+        hash.hash[i % ObjectHash::SIZE] = (uint8_t)i;
+        out->writeUInt8(i & 0xFF);
+        out->writeUInt32(i);
+        out->writeHash(hash);
+        out->writePStr("record");
+    }
+    // One write larger than the buffer to exercise passthrough
+    std::string big(3 * STREAM_BUFSZ / 2, 'x');
+    out->write(big.data(), big.size());
+    out->writeUInt64(0x0123456789ABCDEFULL);
+    out->flush();
+}
+
+static void
+Stream_readRecords(bytestream *in)
+{
+    ObjectHash hash;
+    ObjectHash check;
+    std::string str;
+    uint8_t u8 UNUSED;
+    uint32_t u32 UNUSED;
+    uint64_t u64 UNUSED;
+
+    for (int i = 0; i < STREAMTEST_RECORDS; i++) {
+        check.hash[i % ObjectHash::SIZE] = (uint8_t)i;
+        u8 = in->readUInt8();
+        ASSERT(u8 == (i & 0xFF));
+        u32 = in->readUInt32();
+        ASSERT(u32 == (uint32_t)i);
+        in->readHash(hash);
+        ASSERT(hash == check);
+        in->readPStr(str);
+        ASSERT(str == "record");
+    }
+    std::string big(3 * STREAM_BUFSZ / 2, '\0');
+    in->readExact((uint8_t *)&big[0], big.size());
+    ASSERT(big == std::string(big.size(), 'x'));
+    u64 = in->readUInt64();
+    ASSERT(u64 == 0x0123456789ABCDEFULL);
+}
+
+static void
+Stream_report(const char *name, uint64_t r0, uint64_t w0, bool counted)
+{
+    uint64_t r1 = 0, w1 = 0;
+
+    if (!counted || Stream_SyscallCount(&r1, &w1) < 0) {
+        cout << "  " << name << ": syscall counts unavailable" << endl;
+        return;
+    }
+
+    // Four fields per record
+    double ops = STREAMTEST_RECORDS * 4;
+    printf("  %-14s %6llu syscalls %9.5f/op\n", name,
+           (unsigned long long)(r1 - r0 + w1 - w0), (r1 - r0 + w1 - w0) / ops);
+}
+
+int
+Stream_selfTest(void)
+{
+    uint64_t r0 = 0, w0 = 0;
+    bool counted;
+    int fd;
+
+    cout << "Testing Stream ..." << endl;
+
+    // Unbuffered
+    fd = open(STREAMTEST_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ASSERT(fd >= 0);
+    counted = Stream_SyscallCount(&r0, &w0) == 0;
+    {
+        fdwstream out(fd);
+        Stream_writeRecords(&out);
+    }
+    Stream_report("fdwstream", r0, w0, counted);
+    counted = Stream_SyscallCount(&r0, &w0) == 0;
+    {
+        fdstream in(fd, 0);
+        Stream_readRecords(&in);
+    }
+    Stream_report("fdstream", r0, w0, counted);
+    close(fd);
+
+    // Buffered
+    fd = open(STREAMTEST_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ASSERT(fd >= 0);
+    counted = Stream_SyscallCount(&r0, &w0) == 0;
+    {
+        fdbufwstream out(fd);
+        Stream_writeRecords(&out);
+    }
+    Stream_report("fdbufwstream", r0, w0, counted);
+    lseek(fd, 0, SEEK_SET);
+    counted = Stream_SyscallCount(&r0, &w0) == 0;
+    {
+        fdbufstream in(fd);
+        refstream ref(&in);
+        uint8_t tail;
+        size_t tailLen UNUSED;
+        Stream_readRecords(&ref);
+        tailLen = in.read(&tail, 1);
+        ASSERT(tailLen == 0 && in.ended());
+    }
+    Stream_report("fdbufstream", r0, w0, counted);
+    close(fd);
+
+    unlink(STREAMTEST_FILE);
+
+    return 0;
+}
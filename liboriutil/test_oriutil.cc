@@ -24,6 +24,10 @@ int OriFile_selfTest(void);
 int LRUCache_selfTest(void);
 int KVSerializer_selfTest(void);
 int OriCrypt_selfTest(void);
+int Stream_selfTest(void);
+int BlockZip_selfTest(void);
+int ZipCodec_selfTest(void);
+int ObjectHashMap_selfTest(void);
 int Key_selfTest(void);
 
 int
@@ -36,6 +40,10 @@ main(int argc, const char *argv[])
     result += LRUCache_selfTest();
     result += KVSerializer_selfTest();
     result += OriCrypt_selfTest();
+    result += Stream_selfTest();
+    result += BlockZip_selfTest();
+    result += ZipCodec_selfTest();
+    result += ObjectHashMap_selfTest();
     //result += Key_selfTest();
 
     if (result == 0) {
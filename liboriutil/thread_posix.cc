@@ -27,6 +27,7 @@
 #include <unistd.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <sched.h>
 
 #include <string>
@@ -35,6 +36,13 @@
 
 using namespace std;
 
+#if defined(__linux__)
+#define IOPRIO_WHO_PROCESS      1
+#define IOPRIO_CLASS_BE         2
+#define IOPRIO_CLASS_IDLE       3
+#define IOPRIO_CLASS_SHIFT      13
+#endif /* __linux__ */
+
 // Add support for using Thread::Thread() to get the current thread or the static GetThread().
 
 void EntryWrapper(Thread *t);
@@ -43,6 +51,7 @@ Thread::Thread()
 {
     interrupted = false;
     cstate = Running;
+    prio = InheritPriority;
     tname = "";
     tid = pthread_self(); // How do i fix this for the current thread
     attr = NULL;
@@ -52,6 +61,7 @@ Thread::Thread(const string &name)
 {
     interrupted = false;
     cstate = Running;
+    prio = InheritPriority;
     tname = name;
     tid = pthread_self();
     attr = NULL;
@@ -73,12 +83,38 @@ void Thread::setName(const string &name)
 
 ThreadPriority Thread::getPriority()
 {
-    return NormalPriority;
+    return prio;
 }
 
 void Thread::setPriority(ThreadPriority p)
 {
-    //pthread_setschedprio(tid,p);
+    prio = p;
+}
+
+/*
+ * Lowers the CPU and I/O priority of the calling thread.  Linux applies
+ * both to single threads, elsewhere they would affect the whole process so
+ * the priority is left alone.
+ */
+static void
+Thread_ApplyPriority(ThreadPriority p)
+{
+#if defined(__linux__)
+    pid_t tid = ::syscall(SYS_gettid);
+    int ioprio;
+
+    if (p == IdlePriority) {
+        setpriority(PRIO_PROCESS, tid, 19);
+        ioprio = IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+    } else if (p == LowPriority) {
+        setpriority(PRIO_PROCESS, tid, 10);
+        ioprio = (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | 7;
+    } else {
+        return;
+    }
+
+    ::syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, ioprio);
+#endif /* __linux__ */
 }
 
 int Thread::terminate()
@@ -119,8 +155,11 @@ void Thread::start()
 
 bool Thread::wait(unsigned long time)
 {
-    // pthread_join
-    return false;
+    // XXX: Timed waits are not supported
+    if (time != 0xFFFFFFFF)
+        return false;
+
+    return pthread_join(tid, NULL) == 0;
 }
 
 void Thread::yield()
@@ -130,6 +169,7 @@ void Thread::yield()
 
 void EntryWrapper(Thread *t)
 {
+    Thread_ApplyPriority(t->getPriority());
     t->run();
 }
 
@@ -20,6 +20,7 @@
 #define COPYFILE_BUFSZ	(256 * 1024)
 #define HASHFILE_BUFSZ	(256 * 1024)
 #define COMPFILE_BUFSZ  (16 * 1024)
+#define STREAM_BUFSZ    (64 * 1024)
 
 // Choose the hash algorithm (choose one)
 //#define ORI_USE_SHA256
@@ -28,12 +29,22 @@
 #error "Please select one hash algorithm."
 #endif
 
-// Choose the compression algorithm (choose one)
+// Choose the default compression codec (choose one)
 //#define ORI_USE_LZMA
 //#define ORI_USE_FASTLZ
+//#define ORI_USE_SNAPPY
+//#define ORI_USE_LZ4
+//#define ORI_USE_ZSTD
 #if defined(ORI_USE_COMPRESISON) && !defined(ORI_USE_LZMA) && !defined(ORI_USE_FASTLZ)
 #error "Please select one compression algorithm."
 #endif
 
+// Zstandard level used for block compression
+#define ZSTD_LEVEL      9
+
+// Entropy estimates sample this many bytes in ENTROPY_CHUNK sized pieces
+#define ENTROPY_SAMPLE  4096
+#define ENTROPY_CHUNK   256
+
 #endif /* __TUNEABLES_H__ */
 
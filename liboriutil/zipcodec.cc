@@ -0,0 +1,398 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <sys/param.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "fastlz.h"
+#include "snappy.h"
+#ifdef ORI_HAVE_LZ4
+#include <lz4.h>
+#endif /* ORI_HAVE_LZ4 */
+#ifdef ORI_HAVE_ZSTD
+#include <zstd.h>
+#endif /* ORI_HAVE_ZSTD */
+
+#include "tuneables.h"
+
+#include <oriutil/debug.h>
+#include <oriutil/stream.h>
+#include <oriutil/zipcodec.h>
+#include <oriutil/blockzip.h>
+
+using namespace std;
+
+/*
+ * FastLZ
+ */
+
+class FastLZCodec : public ZipCodec
+{
+public:
+    ObjectInfo::ZipAlgo getAlgo() const { return ObjectInfo::ZIPALGO_FASTLZBLK; }
+    const char *getName() const { return "fastlz"; }
+    size_t maxCompressedSize(size_t len) const {
+        // FastLZ needs 5% of slack and at least 66 bytes of output space
+        return len + len / 16 + 66;
+    }
+    size_t compress(const uint8_t *in, size_t len,
+                    uint8_t *out, size_t outLen) const {
+        ASSERT(outLen >= maxCompressedSize(len));
+        if (len < 16)
+            return 0;
+        return fastlz_compress(in, len, out);
+    }
+    size_t decompress(const uint8_t *in, size_t len,
+                      uint8_t *out, size_t outLen) const {
+        return fastlz_decompress(in, len, out, outLen);
+    }
+};
+
+/*
+ * Snappy
+ */
+
+class SnappyCodec : public ZipCodec
+{
+public:
+    ObjectInfo::ZipAlgo getAlgo() const { return ObjectInfo::ZIPALGO_SNAPPY; }
+    const char *getName() const { return "snappy"; }
+    size_t maxCompressedSize(size_t len) const {
+        return snappy::MaxCompressedLength(len);
+    }
+    size_t compress(const uint8_t *in, size_t len,
+                    uint8_t *out, size_t outLen) const {
+        size_t clen;
+        ASSERT(outLen >= maxCompressedSize(len));
+        snappy::RawCompress((const char *)in, len, (char *)out, &clen);
+        return clen;
+    }
+    size_t decompress(const uint8_t *in, size_t len,
+                      uint8_t *out, size_t outLen) const {
+        size_t rawLen;
+        if (!snappy::GetUncompressedLength((const char *)in, len, &rawLen) ||
+            rawLen > outLen)
+            return 0;
+        if (!snappy::RawUncompress((const char *)in, len, (char *)out))
+            return 0;
+        return rawLen;
+    }
+};
+
+/*
+ * LZ4
+ */
+
+#ifdef ORI_HAVE_LZ4
+class LZ4Codec : public ZipCodec
+{
+public:
+    ObjectInfo::ZipAlgo getAlgo() const { return ObjectInfo::ZIPALGO_LZ4; }
+    const char *getName() const { return "lz4"; }
+    size_t maxCompressedSize(size_t len) const {
+        return LZ4_compressBound(len);
+    }
+    size_t compress(const uint8_t *in, size_t len,
+                    uint8_t *out, size_t outLen) const {
+        int status = LZ4_compress_default((const char *)in, (char *)out,
+                                          len, outLen);
+        return status > 0 ? status : 0;
+    }
+    size_t decompress(const uint8_t *in, size_t len,
+                      uint8_t *out, size_t outLen) const {
+        int status = LZ4_decompress_safe((const char *)in, (char *)out,
+                                         len, outLen);
+        return status > 0 ? status : 0;
+    }
+};
+#endif /* ORI_HAVE_LZ4 */
+
+/*
+ * Zstandard
+ */
+
+#ifdef ORI_HAVE_ZSTD
+class ZstdCodec : public ZipCodec
+{
+public:
+    ObjectInfo::ZipAlgo getAlgo() const { return ObjectInfo::ZIPALGO_ZSTD; }
+    const char *getName() const { return "zstd"; }
+    size_t maxCompressedSize(size_t len) const {
+        return ZSTD_compressBound(len);
+    }
+    size_t compress(const uint8_t *in, size_t len,
+                    uint8_t *out, size_t outLen) const {
+        size_t status = ZSTD_compress(out, outLen, in, len, ZSTD_LEVEL);
+        return ZSTD_isError(status) ? 0 : status;
+    }
+    size_t decompress(const uint8_t *in, size_t len,
+                      uint8_t *out, size_t outLen) const {
+        size_t status = ZSTD_decompress(out, outLen, in, len);
+        return ZSTD_isError(status) ? 0 : status;
+    }
+};
+#endif /* ORI_HAVE_ZSTD */
+
+/*
+ * Registry
+ */
+
+static FastLZCodec fastlzCodec;
+static SnappyCodec snappyCodec;
+#ifdef ORI_HAVE_LZ4
+static LZ4Codec lz4Codec;
+#endif /* ORI_HAVE_LZ4 */
+#ifdef ORI_HAVE_ZSTD
+static ZstdCodec zstdCodec;
+#endif /* ORI_HAVE_ZSTD */
+
+static const ZipCodec *codecs[] = {
+    &fastlzCodec,
+    &snappyCodec,
+#ifdef ORI_HAVE_LZ4
+    &lz4Codec,
+#endif /* ORI_HAVE_LZ4 */
+#ifdef ORI_HAVE_ZSTD
+    &zstdCodec,
+#endif /* ORI_HAVE_ZSTD */
+    NULL,
+};
+
+const ZipCodec *
+ZipCodec_Get(ObjectInfo::ZipAlgo algo)
+{
+    for (int i = 0; codecs[i] != NULL; i++) {
+        if (codecs[i]->getAlgo() == algo)
+            return codecs[i];
+    }
+
+    return NULL;
+}
+
+vector<const ZipCodec *>
+ZipCodec_List()
+{
+    vector<const ZipCodec *> rval;
+
+    for (int i = 0; codecs[i] != NULL; i++) {
+        rval.push_back(codecs[i]);
+    }
+
+    return rval;
+}
+
+ObjectInfo::ZipAlgo
+ZipCodec_Lookup(const string &name)
+{
+    if (name == "none")
+        return ObjectInfo::ZIPALGO_NONE;
+
+    // Known codecs that were not built in still resolve so that callers can
+    // report them as unavailable rather than unknown
+    if (name == "fastlz")
+        return ObjectInfo::ZIPALGO_FASTLZBLK;
+    if (name == "snappy")
+        return ObjectInfo::ZIPALGO_SNAPPY;
+    if (name == "lz4")
+        return ObjectInfo::ZIPALGO_LZ4;
+    if (name == "zstd")
+        return ObjectInfo::ZIPALGO_ZSTD;
+
+    return ObjectInfo::ZIPALGO_UNKNOWN;
+}
+
+const char *
+ZipCodec_Name(ObjectInfo::ZipAlgo algo)
+{
+    switch (algo) {
+        case ObjectInfo::ZIPALGO_NONE:
+            return "none";
+        case ObjectInfo::ZIPALGO_FASTLZ:
+            return "fastlz (legacy)";
+        case ObjectInfo::ZIPALGO_LZMA:
+            return "lzma";
+        case ObjectInfo::ZIPALGO_FASTLZBLK:
+            return "fastlz";
+        case ObjectInfo::ZIPALGO_SNAPPY:
+            return "snappy";
+        case ObjectInfo::ZIPALGO_LZ4:
+            return "lz4";
+        case ObjectInfo::ZIPALGO_ZSTD:
+            return "zstd";
+        case ObjectInfo::ZIPALGO_UNKNOWN:
+        default:
+            return "unknown";
+    }
+}
+
+/*
+ * Byte histogram entropy of up to ENTROPY_SAMPLE bytes spread evenly over
+ * the buffer.  Four interleaved histograms avoid serializing on repeated
+ * bytes and let the compiler unroll the counting loop.  Byte entropy misses
+ * long range redundancy, so only values close to 8 prove incompressibility.
+ */
+float
+ZipCodec_Entropy(const uint8_t *buf, size_t len)
+{
+    uint32_t hist[4][256];
+    size_t sampled = 0;
+
+    if (len == 0)
+        return 0.0f;
+
+    memset(hist, 0, sizeof(hist));
+
+    size_t chunks = MIN(len, (size_t)ENTROPY_SAMPLE) / ENTROPY_CHUNK;
+    if (chunks == 0) {
+        chunks = 1;
+    }
+    size_t chunkLen = MIN(len / chunks, (size_t)ENTROPY_CHUNK);
+    size_t stride = len / chunks;
+
+    for (size_t c = 0; c < chunks; c++) {
+        const uint8_t *p = buf + c * stride;
+        size_t i = 0;
+
+        for (; i + 4 <= chunkLen; i += 4) {
+            hist[0][p[i]]++;
+            hist[1][p[i + 1]]++;
+            hist[2][p[i + 2]]++;
+            hist[3][p[i + 3]]++;
+        }
+        for (; i < chunkLen; i++) {
+            hist[0][p[i]]++;
+        }
+        sampled += chunkLen;
+    }
+
+    float entropy = 0.0f;
+    for (int b = 0; b < 256; b++) {
+        uint32_t n = hist[0][b] + hist[1][b] + hist[2][b] + hist[3][b];
+        if (n == 0)
+            continue;
+        float p = (float)n / (float)sampled;
+        entropy -= p * log2f(p);
+    }
+
+    return entropy;
+}
+
+uint32_t
+ZipCodec_Supported()
+{
+    uint32_t algos = ZIPCODEC_BIT(ObjectInfo::ZIPALGO_NONE);
+
+#ifdef ORI_USE_LZMA
+    algos |= ZIPCODEC_BIT(ObjectInfo::ZIPALGO_LZMA);
+#else
+    algos |= ZIPCODEC_BIT(ObjectInfo::ZIPALGO_FASTLZ);
+#endif
+    for (int i = 0; codecs[i] != NULL; i++) {
+        algos |= ZIPCODEC_BIT(codecs[i]->getAlgo());
+    }
+
+    return algos;
+}
+
+bytestream *
+ZipCodec_Decompress(bytestream *stored, const ObjectInfo &info)
+{
+    ObjectInfo::ZipAlgo algo = info.getAlgo();
+
+    switch (algo) {
+        case ObjectInfo::ZIPALGO_NONE:
+            return stored;
+#ifdef ORI_USE_LZMA
+        case ObjectInfo::ZIPALGO_LZMA:
+#else
+        case ObjectInfo::ZIPALGO_FASTLZ:
+#endif
+            // Whole-payload streams written by older versions
+            return new zipstream(stored, DECOMPRESS, info.payload_size);
+        default:
+            break;
+    }
+
+    if (ZipCodec_Get(algo) == NULL) {
+        WARNING("Unsupported compression codec %s", ZipCodec_Name(algo));
+        delete stored;
+        return NULL;
+    }
+
+    return new blockzipstream(stored, DECOMPRESS, info.payload_size, algo);
+}
+
+int
+ZipCodec_selfTest(void)
+{
+    string input;
+
+    cout << "Testing ZipCodec ..." << endl;
+
+    for (size_t i = 0; input.size() < 3 * BLOCKZIP_BLOCKSIZE / 2; i++) {
+        input += "codec test record ";
+        input += (char)('a' + i % 26);
+        input += (char)rand();
+        input += "\n";
+    }
+
+    string zeros(8192, '\0');
+    string noise;
+    for (int i = 0; i < 8192; i++) {
+        noise += (char)rand();
+    }
+    ASSERT(ZipCodec_Entropy((const uint8_t *)zeros.data(), zeros.size()) == 0.0f);
+    ASSERT(ZipCodec_Entropy((const uint8_t *)input.data(), input.size()) < 6.0f);
+    ASSERT(ZipCodec_Entropy((const uint8_t *)noise.data(), noise.size()) > 7.5f);
+    ASSERT(ZipCodec_Entropy((const uint8_t *)"abc", 3) > 1.5f);
+
+    ASSERT(ZipCodec_Get(ObjectInfo::ZIPALGO_NONE) == NULL);
+    ASSERT(ZipCodec_Lookup("none") == ObjectInfo::ZIPALGO_NONE);
+    ASSERT(ZipCodec_Lookup("bogus") == ObjectInfo::ZIPALGO_UNKNOWN);
+
+    vector<const ZipCodec *> all = ZipCodec_List();
+    for (size_t i = 0; i < all.size(); i++) {
+        ObjectInfo::ZipAlgo algo = all[i]->getAlgo();
+        string packed;
+        string output;
+
+        ASSERT(ZipCodec_Get(algo) == all[i]);
+        ASSERT(ZipCodec_Lookup(all[i]->getName()) == algo);
+
+        {
+            blockzipstream bz(new strstream(input), COMPRESS, 0, algo);
+            packed = bz.readAll();
+        }
+        ASSERT(packed.size() < input.size());
+
+        ObjectInfo info;
+        info.payload_size = input.size();
+        info.setAlgo(algo);
+        bytestream::ap bs(ZipCodec_Decompress(new strstream(packed), info));
+        output = bs->readAll();
+        ASSERT(output == input);
+    }
+
+    return 0;
+}
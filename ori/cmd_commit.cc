@@ -60,8 +60,7 @@ cmd_commit(int argc, char * const argv[])
         return 0;
     }
 
-    Tree new_tree = diff.applyTo(tip_tree.flattened(&repository),
-            &repository);
+    Tree new_tree = diff.applyTo(tip_tree, &repository);
 
     Commit newCommit;
     if (argc == 2) {
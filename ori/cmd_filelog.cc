@@ -20,7 +20,9 @@
 #include <iostream>
 #include <iomanip>
 
+#include <oriutil/stream.h>
 #include <ori/udsrepo.h>
+#include <ori/filelog.h>
 
 using namespace std;
 
@@ -29,55 +31,48 @@ extern UDSRepo repository;
 int
 cmd_filelog(int argc, char * const argv[])
 {
-    ObjectHash commit = repository.getHead();
-    list<pair<Commit, ObjectHash> > revs;
-    Commit lastCommit;
-    ObjectHash lastCommitHash;
-    ObjectHash lastHash;
-
     if (argc != 2) {
 	cout << "Wrong number of arguments!" << endl;
 	return 1;
     }
 
-    while (commit != EMPTY_COMMIT) {
-	Commit c = repository.getCommit(commit);
-	ObjectHash objId;
+    strwstream req;
+    bytestream::ap resp;
 
-	objId = repository.lookup(c, argv[1]);
+    req.writeHash(repository.getHead());
+    req.writePStr(argv[1]);
 
-	if (lastHash != objId && !lastHash.isEmpty()) {
-	    revs.push_back(make_pair(lastCommit, lastCommitHash));
-	}
-	lastCommit = c;
-	lastCommitHash = commit;
-	lastHash = objId;
+    if (repository.hasExt(FILELOG_EXT))
+	resp.reset(repository.streamExt(FILELOG_EXT, req.str()));
 
-	commit = c.getParents().first;
-	// XXX: Handle merge cases
-    }
+    // Older servers: walk the history through the repository interface
+    if (!resp.get()) {
+	strwstream out;
+	FileLog fl(&repository);
 
-    if (!lastHash.isEmpty()) {
-	revs.push_back(make_pair(lastCommit, lastCommitHash));
+	fl.run(repository.getHead(), argv[1], &out);
+	resp.reset(new strstream(out.str()));
     }
 
-    for (list<pair<Commit, ObjectHash> >::iterator it = revs.begin();
-            it != revs.end();
-            it++) {
-	Commit c = (*it).first;
+    ObjectHash commitId, objId;
+    Commit c;
+
+    while (FileLog::readEntry(resp.get(), &commitId, &objId, &c)) {
+	pair<ObjectHash, ObjectHash> parents = c.getParents();
 	time_t timeVal = c.getTime();
 	char timeStr[26];
 
 	ctime_r(&timeVal, timeStr);
 
-	cout << "Commit:  " << (*it).second.hex() << endl;
-	cout << "Parents: " << c.getParents().first.hex() << endl;
+	cout << "Commit:  " << commitId.hex() << endl;
+	cout << "Parents: " << parents.first.hex();
+	if (!parents.second.isEmpty())
+	    cout << " " << parents.second.hex();
+	cout << endl;
 	cout << "Author:  " << c.getUser() << endl;
-	// XXX: print file id?
 	cout << "Date:    " << timeStr << endl;
 	cout << c.getMessage() << endl << endl;
     }
 
     return 0;
 }
-
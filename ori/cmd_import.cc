@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <getopt.h>
+
+#include <string>
+#include <iostream>
+#include <exception>
+
+#include <oriutil/debug.h>
+#include <oriutil/oriutil.h>
+#include <oriutil/orifile.h>
+#include <ori/commit.h>
+#include <ori/importer.h>
+#include <ori/localrepo.h>
+#include <ori/repostore.h>
+
+using namespace std;
+
+void
+usage_import()
+{
+    cout << "ori import [OPTIONS] FSNAME DIRECTORY" << endl;
+    cout << endl;
+    cout << "Commit the contents of a directory as the new contents of a" << endl;
+    cout << "file system that is not mounted." << endl;
+    cout << endl;
+    cout << "Files are read, chunked, hashed, compressed and written to" << endl;
+    cout << "the packfiles by a pipeline of stages and the time each stage" << endl;
+    cout << "spent working and waiting is shown at the end." << endl;
+    cout << endl;
+    cout << "Options:" << endl;
+    cout << "    -j threads     Workers in each of the chunk, hash and" << endl;
+    cout << "                   compress stages (default: one per CPU)" << endl;
+    cout << "    -m message     Commit message" << endl;
+}
+
+static void
+import_printStage(ImportStage stage, const ImportStageStats &s, uint64_t usec)
+{
+    double avail = (double)usec * (double)s.threads;
+
+    if (avail == 0.0)
+        avail = 1.0;
+
+    printf("%-10s %7llu %10llu %10.1f %6.1f%% %6.1f%% %6.1f%%\n",
+           Importer::stageName(stage),
+           (unsigned long long)s.threads,
+           (unsigned long long)s.items,
+           (double)s.bytes / (1024.0 * 1024.0),
+           100.0 * (double)s.busyUsec / avail,
+           100.0 * (double)s.inputUsec / avail,
+           100.0 * (double)s.outputUsec / avail);
+}
+
+int
+cmd_import(int argc, char * const argv[])
+{
+    int ch;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    string msg;
+    string fsName;
+    string rootPath;
+    string dirPath;
+
+    struct option longopts[] = {
+        { "threads",    required_argument,  NULL,   'j' },
+        { "message",    required_argument,  NULL,   'm' },
+        { NULL,         0,                  NULL,   0   }
+    };
+
+    while ((ch = getopt_long(argc, argv, "j:m:", longopts, NULL)) != -1) {
+        switch (ch) {
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            case 'm':
+                msg = optarg;
+                break;
+            default:
+                printf("Usage: ori import [OPTIONS] FSNAME DIRECTORY\n");
+                return 1;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc != 2) {
+        printf("Wrong number of arguments.\n");
+        printf("Usage: ori import [OPTIONS] FSNAME DIRECTORY\n");
+        return 1;
+    }
+    if (threads < 1) {
+        printf("The number of threads must be at least one.\n");
+        return 1;
+    }
+
+    fsName = argv[0];
+    if (!Util_IsValidName(fsName)) {
+        printf("Name contains invalid charecters!\n");
+        return 1;
+    }
+
+    rootPath = RepoStore_GetRepoPath(fsName);
+    if (!OriFile_Exists(rootPath)) {
+        printf("File system does not exist!\n");
+        return 1;
+    }
+    if (OriFile_Exists(rootPath + ORI_PATH_UDSSOCK)) {
+        printf("File system is mounted, run 'ori cleanup' if it is not.\n");
+        return 1;
+    }
+
+    dirPath = OriFile_RealPath(argv[1]);
+    if (dirPath == "" || !OriFile_IsDirectory(dirPath)) {
+        printf("%s is not a directory!\n", argv[1]);
+        return 1;
+    }
+
+    LocalRepo repo;
+    repo.open(rootPath);
+
+    Importer importer = Importer(&repo);
+    ObjectHash treeHash;
+
+    importer.setThreads(threads);
+    try {
+        treeHash = importer.run(dirPath);
+    } catch (exception &e) {
+        printf("Import failed: %s\n", e.what());
+        return 1;
+    }
+
+    Commit c;
+    if (msg == "")
+        msg = "Imported " + dirPath;
+    c.setMessage(msg);
+    ObjectHash commitHash = repo.commitFromTree(treeHash, c);
+    repo.sync();
+
+    ImportStats stats = importer.getStats();
+    double secs = (double)stats.usec / 1000000.0;
+
+    printf("Committed %s\n", commitHash.hex().c_str());
+    printf("%llu files, %llu directories, %.1f MB in %.2f s (%.1f MB/s)\n",
+           (unsigned long long)stats.files, (unsigned long long)stats.dirs,
+           (double)stats.bytes / (1024.0 * 1024.0), secs,
+           secs > 0 ? (double)stats.bytes / (1024.0 * 1024.0) / secs : 0.0);
+    printf("%llu new objects, %.1f MB stored\n",
+           (unsigned long long)stats.objects,
+           (double)stats.storedBytes / (1024.0 * 1024.0));
+
+    printf("\n%-10s %7s %10s %10s %7s %7s %7s\n",
+           "Stage", "Threads", "Items", "MB", "Busy", "Starved", "Blocked");
+    for (int s = 0; s < IMPORT_STAGES; s++)
+        import_printStage((ImportStage)s, stats.stages[s], stats.usec);
+
+    return 0;
+}
@@ -36,8 +36,7 @@ cmd_rebuildrefs(int argc, char * const argv[])
         cout << "Usage: ori rebuildrefs" << endl;
     }
 
-    RefcountMap refs = repository.recomputeRefCounts();
-    if (!repository.rewriteRefCounts(refs))
+    if (!repository.rebuildRefCounts())
         return 1;
 
     return 0;
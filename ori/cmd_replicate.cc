@@ -128,6 +128,12 @@ cmd_replicate(int argc, char * const argv[])
     RemoteRepo srcRepo;
     srcRepo.connect(srcRoot);
 
+    // A repository on this machine that is not being served can be cloned
+    // by sharing its packfiles instead of pulling every object
+    LocalRepo *localSrc = NULL;
+    if (clone_mode != 2)
+        localSrc = dynamic_cast<LocalRepo *>(srcRepo.get());
+
     if (!OriFile_Exists(newRoot)) {
         mkdir(newRoot.c_str(), 0755);
     }
@@ -137,6 +143,14 @@ cmd_replicate(int argc, char * const argv[])
         return 1;
     }
 
+    if (localSrc) {
+        string oriPath = bareRepo ? newRoot : newRoot + ORI_PATH_DIR;
+        if (localSrc->cloneTo(oriPath) != 0) {
+            printf("Failed to copy the repository!\n");
+            return 1;
+        }
+    }
+
     LocalRepo dstRepo;
     dstRepo.open(newRoot);
 
@@ -152,16 +166,18 @@ cmd_replicate(int argc, char * const argv[])
 
     ObjectHash head = srcRepo->getHead();
 
-    if (clone_mode != 2) {
+    if (clone_mode != 2 && !localSrc) {
         dstRepo.pull(srcRepo.get());
     }
 
     if (!head.isEmpty())
         dstRepo.updateHead(head);
 
-    RefcountMap refs = dstRepo.recomputeRefCounts();
-    if (!dstRepo.rewriteRefCounts(refs))
-        return 1;
+    // The metadata log was copied along with the packfiles
+    if (!localSrc) {
+        if (!dstRepo.rebuildRefCounts())
+            return 1;
+    }
 
     return 0;
 }
@@ -47,6 +47,54 @@ cmd_show(int argc, char * const argv[])
     //printf("Peers:\n");
     // for
     // printf("    %s\n", hostname);
+
+    strwstream req;
+    req.writePStr("prefetch");
+
+    strstream resp = repository.callExt("FUSE", req.str());
+    if (!resp.ended() && resp.readUInt8() == 1) {
+        uint64_t requests = resp.readUInt64();
+        uint64_t hits = resp.readUInt64();
+        uint64_t waits = resp.readUInt64();
+        uint64_t misses = resp.readUInt64();
+        uint64_t prefetched = resp.readUInt64();
+        uint64_t wasted = resp.readUInt64();
+        uint64_t batches = resp.readUInt64();
+        uint64_t objects = resp.readUInt64();
+        uint64_t bytes = resp.readUInt64();
+
+        printf("--- Prefetch ---\n");
+        printf("Requests: %llu (%llu hits, %llu waits, %llu misses)\n",
+               (unsigned long long)requests, (unsigned long long)hits,
+               (unsigned long long)waits, (unsigned long long)misses);
+        printf("Hit Rate: %.1f%%\n",
+               requests ? 100.0 * (hits + waits) / requests : 0.0);
+        printf("Prefetched: %llu (%llu unused)\n",
+               (unsigned long long)prefetched, (unsigned long long)wasted);
+        printf("Batches: %llu (%llu objects, %llu bytes)\n",
+               (unsigned long long)batches, (unsigned long long)objects,
+               (unsigned long long)bytes);
+    }
+
+    strwstream hreq;
+    hreq.writePStr("hydrate");
+
+    strstream hresp = repository.callExt("FUSE", hreq.str());
+    if (!hresp.ended() && hresp.readUInt8() == 1) {
+        uint64_t trees = hresp.readUInt64();
+        uint64_t objects = hresp.readUInt64();
+        uint64_t bytes = hresp.readUInt64();
+        uint64_t pending = hresp.readUInt64();
+        bool done = hresp.readUInt8() != 0;
+
+        printf("--- Hydration ---\n");
+        printf("Status: %s\n", done ? "complete" : "in progress");
+        printf("Trees: %llu walked, %llu left\n",
+               (unsigned long long)trees, (unsigned long long)pending);
+        printf("Fetched: %llu objects, %llu bytes\n",
+               (unsigned long long)objects, (unsigned long long)bytes);
+    }
+
     return 0;
 }
 
@@ -75,6 +75,8 @@ int cmd_findheads(int argc, char * const argv[]);
 int cmd_gc(int argc, char * const argv[]);
 void usage_graft(void);
 int cmd_graft(int argc, char * const argv[]);
+void usage_import();
+int cmd_import(int argc, char * const argv[]);
 void usage_list();
 int cmd_list(int argc, char * const argv[]);
 int cmd_listkeys(int argc, char * const argv[]);
@@ -185,6 +187,13 @@ static Cmd commands[] = {
         NULL,
         0,
     },
+    {
+        "import",
+        "Commit a directory to a file system (not mounted)",
+        cmd_import,
+        usage_import,
+        0,
+    },
     {
         "list",
         "List local file systems",
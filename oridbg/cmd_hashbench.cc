@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <oriutil/debug.h>
+#include <oriutil/oriutil.h>
+#include <oriutil/oritr1.h>
+#include <oriutil/stopwatch.h>
+#include <oriutil/objecthash.h>
+#include <oriutil/objecthashmap.h>
+#include <ori/localrepo.h>
+
+using namespace std;
+
+#define HASHBENCH_DEFAULT_N     10000000
+
+/*
+ * Allocator that tallies the bytes held by a node based container.
+ */
+static size_t hashbench_allocated;
+
+template <class T>
+class CountingAllocator : public std::allocator<T>
+{
+public:
+    typedef size_t size_type;
+    typedef T *pointer;
+    template <class U> struct rebind { typedef CountingAllocator<U> other; };
+
+    CountingAllocator() { }
+    CountingAllocator(const CountingAllocator &a) : std::allocator<T>(a) { }
+    template <class U>
+    CountingAllocator(const CountingAllocator<U> &a) : std::allocator<T>(a) { }
+
+    pointer allocate(size_type n, const void *hint = 0)
+    {
+        hashbench_allocated += n * sizeof(T);
+        return std::allocator<T>::allocate(n);
+    }
+    void deallocate(pointer p, size_type n)
+    {
+        hashbench_allocated -= n * sizeof(T);
+        std::allocator<T>::deallocate(p, n);
+    }
+};
+
+typedef std::tr1::unordered_map<ObjectHash, refcount_t,
+        std::tr1::hash<ObjectHash>, std::equal_to<ObjectHash>,
+        CountingAllocator<std::pair<const ObjectHash, refcount_t> > >
+        NodeRefcountMap;
+
+/*
+ * Fills the hash from a splitmix64 sequence, cheaper than SHA-256 and just
+ * as uniform for our purposes.
+ */
+static void
+hashbench_key(uint64_t seed, ObjectHash *h)
+{
+    for (size_t i = 0; i < ObjectHash::SIZE; i += 8) {
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        z = z ^ (z >> 31);
+        memcpy(h->hash + i, &z, 8);
+    }
+}
+
+static double
+hashbench_mops(size_t ops, Stopwatch &sw)
+{
+    uint64_t usec = sw.getElapsedTime();
+
+    return usec > 0 ? (double)ops / (double)usec : 0.0;
+}
+
+template <class Map>
+static void
+hashbench_run(const char *name, Map &m, size_t n, size_t (*usage)(Map &))
+{
+    Stopwatch insSw = Stopwatch();
+    Stopwatch hitSw = Stopwatch();
+    Stopwatch missSw = Stopwatch();
+    ObjectHash h;
+    size_t found = 0;
+
+    insSw.start();
+    for (size_t i = 0; i < n; i++) {
+        hashbench_key(2 * i, &h);
+        m[h] = (refcount_t)i;
+    }
+    insSw.stop();
+
+    hitSw.start();
+    for (size_t i = 0; i < n; i++) {
+        hashbench_key(2 * i, &h);
+        found += m.count(h);
+    }
+    hitSw.stop();
+
+    missSw.start();
+    for (size_t i = 0; i < n; i++) {
+        hashbench_key(2 * i + 1, &h);
+        found += m.count(h);
+    }
+    missSw.stop();
+
+    if (found != n)
+        printf("%s: found %lu of %lu keys!\n", name, found, n);
+
+    printf("%-14s %12.2f %12.2f %12.2f %12.1f\n", name,
+           hashbench_mops(n, insSw),
+           hashbench_mops(n, hitSw),
+           hashbench_mops(n, missSw),
+           (double)usage(m) / (double)n);
+}
+
+static size_t
+hashbench_flatusage(RefcountMap &m)
+{
+    return m.memoryUsage();
+}
+
+static size_t
+hashbench_nodeusage(NodeRefcountMap &m)
+{
+    return hashbench_allocated;
+}
+
+/*
+ * Compare the flat object hash table against the node based unordered_map
+ * with a refcount sized value.
+ */
+int
+cmd_hashbench(int argc, char * const argv[])
+{
+    size_t n = HASHBENCH_DEFAULT_N;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "n:")) != -1) {
+        switch (ch) {
+            case 'n':
+                n = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                printf("Usage: oridbg hashbench [-n ENTRIES]\n");
+                return 1;
+        }
+    }
+
+    if (n == 0) {
+        printf("Need at least one entry\n");
+        return 1;
+    }
+
+    printf("%lu entries, %lu byte keys\n", n, ObjectHash::SIZE);
+    printf("\n%-14s %12s %12s %12s %12s\n",
+           "Table", "Insert Mop/s", "Hit Mop/s", "Miss Mop/s", "Bytes/entry");
+
+    {
+        RefcountMap m;
+        hashbench_run<RefcountMap>("ObjectHashMap", m, n,
+                                   hashbench_flatusage);
+    }
+    {
+        hashbench_allocated = 0;
+        NodeRefcountMap m;
+        hashbench_run<NodeRefcountMap>("unordered_map", m, n,
+                                       hashbench_nodeusage);
+    }
+
+    return 0;
+}
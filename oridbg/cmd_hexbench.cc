@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <iomanip>
+
+#include <oriutil/debug.h>
+#include <oriutil/oriutil.h>
+#include <oriutil/stopwatch.h>
+#include <oriutil/objecthash.h>
+
+using namespace std;
+
+#define HEXBENCH_DEFAULT_N      1000000
+
+/*
+ * The stringstream conversion ObjectHash::hex() used to do.
+ */
+static string
+hexbench_oldhex(const ObjectHash &h)
+{
+    stringstream rval;
+
+    for (size_t i = 0; i < ObjectHash::SIZE; i++)
+        rval << hex << setw(2) << setfill('0') << (int)h.hash[i];
+
+    return rval.str();
+}
+
+/*
+ * What a disabled DLOG cost before the level check moved into the macro:
+ * the arguments were evaluated and ori_log formatted the whole message.
+ */
+static size_t
+hexbench_oldlog(uint32_t i, uint32_t n, const ObjectHash &h)
+{
+    char buf[512];
+
+    return snprintf(buf, sizeof(buf), "httpd: getObjs %d of %d %s\n",
+                    i + 1, n, hexbench_oldhex(h).c_str());
+}
+
+static double
+hexbench_nsper(size_t ops, Stopwatch &sw)
+{
+    return ops > 0 ? (double)sw.getElapsedTime() * 1000.0 / (double)ops : 0.0;
+}
+
+/*
+ * Measure the per-object cost of hash formatting and disabled logging on
+ * the server request paths.
+ */
+int
+cmd_hexbench(int argc, char * const argv[])
+{
+    size_t n = HEXBENCH_DEFAULT_N;
+    vector<ObjectHash> hashes;
+    char buf[ObjectHash::STR_SIZE + 1];
+    size_t sink = 0;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "n:")) != -1) {
+        switch (ch) {
+            case 'n':
+                n = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                printf("Usage: oridbg hexbench [-n OBJECTS]\n");
+                return 1;
+        }
+    }
+
+    if (n == 0) {
+        printf("Need at least one object\n");
+        return 1;
+    }
+
+    hashes.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        uint64_t z = i * 0x9E3779B97F4A7C15ULL;
+        for (size_t j = 0; j < ObjectHash::SIZE; j++) {
+            z = z * 6364136223846793005ULL + 1442695040888963407ULL;
+            hashes[i].hash[j] = z >> 56;
+        }
+    }
+
+    // Sanity check the conversions against each other
+    for (size_t i = 0; i < n && i < 1000; i++) {
+        ObjectHash h;
+        string legacy = hexbench_oldhex(hashes[i]);
+        if (legacy != hashes[i].hex() ||
+            legacy != hashes[i].hex(buf) ||
+            !ObjectHash::fromHex(buf, &h) || h != hashes[i]) {
+            printf("Conversion mismatch for %s!\n", legacy.c_str());
+            return 1;
+        }
+    }
+
+    printf("%lu objects, log level %d\n\n", n, ori_log_level);
+    printf("%-28s %10s\n", "Operation", "ns/object");
+
+    Stopwatch sw = Stopwatch();
+
+    sw.start();
+    for (size_t i = 0; i < n; i++)
+        sink += hexbench_oldhex(hashes[i]).size();
+    sw.stop();
+    printf("%-28s %10.1f\n", "hex (stringstream)", hexbench_nsper(n, sw));
+
+    sw.reset();
+    sw.start();
+    for (size_t i = 0; i < n; i++)
+        sink += hashes[i].hex().size();
+    sw.stop();
+    printf("%-28s %10.1f\n", "hex (string)", hexbench_nsper(n, sw));
+
+    sw.reset();
+    sw.start();
+    for (size_t i = 0; i < n; i++)
+        sink += hashes[i].hex(buf)[i % ObjectHash::STR_SIZE];
+    sw.stop();
+    printf("%-28s %10.1f\n", "hex (buffer)", hexbench_nsper(n, sw));
+
+    sw.reset();
+    sw.start();
+    for (size_t i = 0; i < n; i++) {
+        ObjectHash h;
+        hashes[i].hex(buf);
+        sink += ObjectHash::fromHex(buf, &h);
+    }
+    sw.stop();
+    printf("%-28s %10.1f\n", "hex + fromHex (buffer)", hexbench_nsper(n, sw));
+
+    sw.reset();
+    sw.start();
+    for (size_t i = 0; i < n; i++)
+        sink += hexbench_oldlog(i, n, hashes[i]);
+    sw.stop();
+    printf("%-28s %10.1f\n", "server DLOG (before)", hexbench_nsper(n, sw));
+
+    sw.reset();
+    sw.start();
+    for (size_t i = 0; i < n; i++) {
+        DLOG("httpd: getObjs %lu of %lu %s", i + 1, n,
+             hashes[i].hex().c_str());
+        sink++;
+    }
+    sw.stop();
+    printf("%-28s %10.1f\n", "server DLOG (after)", hexbench_nsper(n, sw));
+
+    DLOG("hexbench: %lu", sink);
+
+    return 0;
+}
@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <string>
+#include <vector>
+
+#include <oriutil/debug.h>
+#include <oriutil/oriutil.h>
+#include <oriutil/orifile.h>
+#include <oriutil/stopwatch.h>
+#include <oriutil/thread.h>
+#include <ori/journal.h>
+
+using namespace std;
+
+#define JOURNALBENCH_DEFAULT_N          100000
+#define JOURNALBENCH_DEFAULT_SYNC_N     2000
+#define JOURNALBENCH_DEFAULT_THREADS    4
+
+/*
+ * Appends events the way orifs does, either to a Journal or with a text
+ * line and a write (and an fsync if sync is set) per event as it did
+ * before the journal had a writer thread.
+ */
+class JournalBenchThread : public Thread
+{
+public:
+    JournalBenchThread(Journal *j, int fd, bool sync, size_t id, size_t n)
+        : Thread("journalbench"), j(j), fd(fd), sync(sync), id(id), n(n)
+    {
+    }
+    void run()
+    {
+        char path[64], tmp[64];
+
+        for (size_t i = 0; i < n; i++) {
+            snprintf(path, sizeof(path), "/dir%lu/file%lu", id, i);
+            snprintf(tmp, sizeof(tmp), "/.ori/tmp/fuse/obj.%06lu", i);
+
+            if (j != NULL) {
+                j->append(Journal::Create, path, tmp, sync);
+                continue;
+            }
+
+            string buf = string("create:") + path + ":" + tmp + "\n";
+            if (write(fd, buf.data(), buf.size()) != (ssize_t)buf.size())
+                PANIC();
+            if (sync)
+                fsync(fd);
+        }
+    }
+private:
+    Journal *j;
+    int fd;
+    bool sync;
+    size_t id;
+    size_t n;
+};
+
+static int
+journalbench_open(const string &path)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0) {
+        perror("open");
+        exit(1);
+    }
+    return fd;
+}
+
+static void
+journalbench_run(const char *name, const string &path, bool useJournal,
+                 bool sync, size_t threads, size_t n, unsigned int msecs)
+{
+    vector<JournalBenchThread *> t;
+    Journal j;
+    int fd = journalbench_open(path);
+    Stopwatch sw = Stopwatch();
+    JournalStats js;
+
+    sw.start();
+    if (useJournal)
+        j.open(fd, msecs);
+    for (size_t i = 0; i < threads; i++) {
+        t.push_back(new JournalBenchThread(useJournal ? &j : NULL, fd, sync,
+                                           i, n / threads));
+        t.back()->start();
+    }
+    for (size_t i = 0; i < threads; i++) {
+        t[i]->wait();
+        delete t[i];
+    }
+    if (useJournal) {
+        j.sync();
+        js = j.getStats();
+        j.close();
+    } else {
+        fsync(fd);
+        close(fd);
+        memset(&js, 0, sizeof(js));
+        js.events = (n / threads) * threads;
+        js.writes = js.events;
+        js.syncs = sync ? js.events + 1 : 1;
+    }
+    sw.stop();
+
+    uint64_t usec = sw.getElapsedTime();
+    printf("%-20s %10llu %12.0f %8llu %8llu %10llu\n", name,
+           (unsigned long long)js.events,
+           usec ? (double)js.events * 1000000.0 / (double)usec : 0.0,
+           (unsigned long long)js.writes, (unsigned long long)js.syncs,
+           (unsigned long long)OriFile_GetSize(path));
+}
+
+static void
+journalbench_count(Journal::Event ev, const string &arg1, const string &arg2,
+                   void *arg)
+{
+    *(uint64_t *)arg += arg1.size() + arg2.size();
+}
+
+/*
+ * Compare the cost of journaling namespace operations with the writer
+ * thread against a write per event, and time replaying the journal.
+ */
+int
+cmd_journalbench(int argc, char * const argv[])
+{
+    size_t n = JOURNALBENCH_DEFAULT_N;
+    size_t syncN = JOURNALBENCH_DEFAULT_SYNC_N;
+    size_t threads = JOURNALBENCH_DEFAULT_THREADS;
+    unsigned int msecs = JOURNAL_SYNC_MSECS;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "n:s:t:i:")) != -1) {
+        switch (ch) {
+            case 'n':
+                n = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                syncN = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                threads = strtoul(optarg, NULL, 10);
+                break;
+            case 'i':
+                msecs = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                printf("Usage: oridbg journalbench [-n EVENTS] "
+                       "[-s SYNCEVENTS] [-t THREADS] [-i MSECS]\n");
+                return 1;
+        }
+    }
+
+    if (threads == 0 || n < threads || syncN < threads) {
+        printf("Need at least one event per thread\n");
+        return 1;
+    }
+
+    char tmpl[] = "/tmp/journalbench.XXXXXX";
+    int tmpFd = mkstemp(tmpl);
+    if (tmpFd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(tmpFd);
+    string path = tmpl;
+
+    printf("%lu threads, group sync every %u ms\n\n", threads, msecs);
+    printf("%-20s %10s %12s %8s %8s %10s\n",
+           "Method", "Events", "Events/s", "Writes", "Syncs", "Bytes");
+
+    journalbench_run("write per event", path, false, false, threads, n, msecs);
+    journalbench_run("journal", path, true, false, threads, n, msecs);
+    journalbench_run("fsync per event", path, false, true, threads, syncN,
+                     msecs);
+    journalbench_run("journal (sync)", path, true, true, threads, syncN,
+                     msecs);
+
+    // Replay a full size journal
+    journalbench_run("journal", path, true, false, threads, n, msecs);
+
+    Stopwatch sw = Stopwatch();
+    uint64_t bytes = 0;
+
+    sw.start();
+    int64_t events = Journal::replay(path, journalbench_count, &bytes);
+    sw.stop();
+
+    uint64_t usec = sw.getElapsedTime();
+    printf("\nReplayed %lld events (%llu bytes of paths) in %llu us, "
+           "%.0f events/s\n", (long long)events, (unsigned long long)bytes,
+           (unsigned long long)usec,
+           usec ? (double)events * 1000000.0 / (double)usec : 0.0);
+
+    OriFile_Delete(path);
+
+    return events == (int64_t)((n / threads) * threads) ? 0 : 1;
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2012 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <getopt.h>
+
+#include <string>
+#include <iostream>
+
+#include <ori/localrepo.h>
+#include <ori/repacker.h>
+
+using namespace std;
+
+extern LocalRepo repository;
+
+/*
+ * Rewrite the packfiles in locality order and compare the contiguous
+ * blocks typical pulls read before and after.
+ */
+int
+cmd_repack(int argc, char * const argv[])
+{
+    int ch;
+    bool dryRun = false;
+
+    struct option longopts[] = {
+        { "dry-run",    no_argument,            NULL,   'n' },
+        { NULL,         0,                      NULL,   0   }
+    };
+
+    while ((ch = getopt_long(argc, argv, "n", longopts, NULL)) != -1) {
+        switch (ch) {
+            case 'n':
+                dryRun = true;
+                break;
+            default:
+                printf("Usage: oridbg repack [--dry-run]\n");
+                return 1;
+        }
+    }
+
+    Repacker r(&repository);
+    r.setDryRun(dryRun);
+    r.run();
+
+    const RepackStats &s = r.getStats();
+    double secs = s.time / 1000000.0;
+
+    if (!dryRun) {
+        printf("Rewrote %lu packfiles as %lu: %lu objects from HEAD, "
+               "%lu from history, %lu others\n",
+               s.packsBefore, s.packsAfter, s.hotObjects, s.coldObjects,
+               s.otherObjects);
+        printf("Copied %.1f MB in %.2f s\n",
+               s.bytes / (1024.0 * 1024.0), secs);
+    }
+
+    printf("\n%-16s %8s %14s %16s\n",
+           "Pull", "Objects", "Packs", "Blocks");
+    for (int i = 0; i < REPACK_PULLS; i++) {
+        const RepackLayout &b = s.before[i];
+        const RepackLayout &a = s.after[i];
+
+        if (dryRun) {
+            printf("%-16s %8lu %14lu %16lu\n",
+                   Repacker::pullName((RepackPull)i),
+                   b.objects, b.packs, b.blocks);
+        } else {
+            printf("%-16s %8lu %6lu -> %-5lu %7lu -> %-6lu\n",
+                   Repacker::pullName((RepackPull)i),
+                   a.objects, b.packs, a.packs, b.blocks, a.blocks);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <string>
+#include <vector>
+
+#include <oriutil/debug.h>
+#include <oriutil/oriutil.h>
+#include <oriutil/orifile.h>
+#include <oriutil/scan.h>
+#include <oriutil/stopwatch.h>
+#include <oriutil/stream.h>
+#include <ori/journal.h>
+#include <ori/localrepo.h>
+
+using namespace std;
+
+#define SMALLFILEBENCH_DEFAULT_N        20000
+#define SMALLFILEBENCH_DEFAULT_SYNC_N   1000
+#define SMALLFILEBENCH_DEFAULT_SIZE     4096
+
+enum SmallFileBenchMethod {
+    SMALLFILEBENCH_TEMPFILE,
+    SMALLFILEBENCH_MEMORY,
+    SMALLFILEBENCH_MEMORY_SYNC,
+};
+
+/*
+ * Fills buf with bytes that differ for every file and run, so no object is
+ * deduplicated against an earlier one.
+ */
+static void
+smallfilebench_fill(string *buf, int run, size_t i)
+{
+    uint64_t x = ((uint64_t)run << 32) ^ (i * 0x9E3779B97F4A7C15ULL) ^ 1;
+
+    for (size_t j = 0; j < buf->size(); j++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        (*buf)[j] = (char)x;
+    }
+}
+
+/*
+ * Creates n files the way orifs does and adds them to the repository as a
+ * snapshot would, either through a temporary file each or held in memory
+ * with their writes in the recovery journal.
+ */
+static void
+smallfilebench_run(const char *name, LocalRepo *repo, const string &root,
+                   int method, size_t n, size_t size, int run)
+{
+    string tmpDir = root + ORI_PATH_TMP;
+    string journalPath = root + "/journal";
+    vector<string> temps;
+    vector<string> datas;
+    string buf(size, '\0');
+    Journal j;
+    Stopwatch createSw = Stopwatch();
+    Stopwatch snapshotSw = Stopwatch();
+
+    int fd = open(journalPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open");
+        exit(1);
+    }
+    j.open(fd);
+
+    createSw.start();
+    for (size_t i = 0; i < n; i++) {
+        char path[64];
+
+        snprintf(path, sizeof(path), "/dir%d/file%lu", run, i);
+        smallfilebench_fill(&buf, run, i);
+
+        if (method == SMALLFILEBENCH_TEMPFILE) {
+            string tmpl = tmpDir + "obj.XXXXXX";
+            vector<char> tmpPath(tmpl.begin(), tmpl.end());
+            tmpPath.push_back('\0');
+
+            int fd = mkstemp(&tmpPath[0]);
+            if (fd < 0) {
+                perror("mkstemp");
+                exit(1);
+            }
+            j.append(Journal::Create, path, &tmpPath[0]);
+            if (pwrite(fd, buf.data(), buf.size(), 0) != (ssize_t)buf.size())
+                PANIC();
+            close(fd);
+            temps.push_back(&tmpPath[0]);
+        } else {
+            strwstream ss(sizeof(uint64_t) + buf.size());
+
+            j.append(Journal::Create, path, "");
+            ss.writeUInt64(0);
+            ss.write(buf.data(), buf.size());
+            j.append(Journal::Write, path, ss.str(),
+                     method == SMALLFILEBENCH_MEMORY_SYNC);
+            datas.push_back(buf);
+        }
+    }
+    createSw.stop();
+
+    snapshotSw.start();
+    for (size_t i = 0; i < n; i++) {
+        char path[64];
+
+        snprintf(path, sizeof(path), "/dir%d/file%lu", run, i);
+        if (method == SMALLFILEBENCH_TEMPFILE)
+            repo->addFile(temps[i], path);
+        else
+            repo->addFileContents(datas[i], path);
+    }
+    repo->sync();
+    j.append(Journal::Snapshot, "");
+    j.sync();
+    snapshotSw.stop();
+
+    j.close();
+    OriFile_Delete(journalPath);
+    // orifs only deletes temporary files on unmount
+    for (size_t i = 0; i < temps.size(); i++)
+        OriFile_Delete(temps[i]);
+
+    uint64_t createUsec = createSw.getElapsedTime();
+    uint64_t snapshotUsec = snapshotSw.getElapsedTime();
+    uint64_t usec = createUsec + snapshotUsec;
+    printf("%-24s %8lu %12.0f %12.1f %12.1f\n", name, n,
+           usec ? (double)n * 1000000.0 / (double)usec : 0.0,
+           n ? (double)createUsec / (double)n : 0.0,
+           n ? (double)snapshotUsec / (double)n : 0.0);
+}
+
+static int
+smallfilebench_remove(int unused, const string &path)
+{
+    if (OriFile_IsDirectory(path))
+        OriFile_RmDir(path);
+    else
+        OriFile_Delete(path);
+
+    return 0;
+}
+
+/*
+ * Compare creating small files in orifs through temporary files against
+ * holding them in memory with journaled writes, in a scratch repository.
+ */
+int
+cmd_smallfilebench(int argc, char * const argv[])
+{
+    size_t n = SMALLFILEBENCH_DEFAULT_N;
+    size_t syncN = SMALLFILEBENCH_DEFAULT_SYNC_N;
+    size_t size = SMALLFILEBENCH_DEFAULT_SIZE;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "n:s:b:")) != -1) {
+        switch (ch) {
+            case 'n':
+                n = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                syncN = strtoul(optarg, NULL, 10);
+                break;
+            case 'b':
+                size = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                printf("Usage: oridbg smallfilebench [-n FILES] "
+                       "[-s SYNCFILES] [-b BYTES]\n");
+                return 1;
+        }
+    }
+
+    if (size == 0 || size > 1024 * 1024) {
+        printf("File size must be between 1 byte and 1 MB\n");
+        return 1;
+    }
+
+    char tmpl[] = "/tmp/smallfilebench.XXXXXX";
+    if (mkdtemp(tmpl) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    string root = tmpl;
+    if (LocalRepo_Init(root, true, "") != 0)
+        return 1;
+
+    LocalRepo repo;
+    repo.open(root);
+
+    printf("%lu byte files\n\n", size);
+    printf("%-24s %8s %12s %12s %12s\n",
+           "Method", "Files", "Files/s", "Create us", "Snapshot us");
+
+    smallfilebench_run("temporary file", &repo, root,
+                       SMALLFILEBENCH_TEMPFILE, n, size, 0);
+    smallfilebench_run("memory", &repo, root,
+                       SMALLFILEBENCH_MEMORY, n, size, 1);
+    smallfilebench_run("memory (sync journal)", &repo, root,
+                       SMALLFILEBENCH_MEMORY_SYNC, syncN, size, 2);
+
+    repo.close();
+
+    DirRTraverse(root, 0, smallfilebench_remove);
+    OriFile_RmDir(root);
+
+    return 0;
+}
@@ -19,6 +19,7 @@
 #include <string>
 #include <iostream>
 #include <iomanip>
+#include <sstream>
 
 #include <oriutil/debug.h>
 #include <oriutil/oriutil.h>
@@ -98,6 +99,52 @@ cmd_stats(int argc, char * const argv[])
     cout << left << setw(40) << "Large Blobs" << largeBlobs << endl;
     cout << left << setw(40) << "Purged Blobs" << purgedBlobs << endl;
 
+    const ZipStats &zs = repository.getZipStats();
+    cout << left << setw(40) << "Compression Candidates" << zs.objects << endl;
+    cout << left << setw(40) << "  Compressed" << zs.compressed << endl;
+    cout << left << setw(40) << "  Rejected" << zs.rejected << endl;
+    cout << left << setw(40) << "  Skipped (entropy)" << zs.skipEntropy << endl;
+    cout << left << setw(40) << "  Skipped (file)" << zs.skipFile << endl;
+    cout << left << setw(40) << "  Skipped (extension)" << zs.skipExt << endl;
+    cout << left << setw(40) << "  Bytes Saved" << zs.savedBytes << endl;
+    cout << left << setw(40) << "  Bytes Not Compressed" << zs.skippedBytes
+         << endl;
+    cout << left << setw(40) << "  Compression Time (ms)"
+         << zs.compressUsec / 1000 << endl;
+    cout << left << setw(40) << "  Wasted Time (ms)"
+         << zs.wastedUsec / 1000 << endl;
+    cout << left << setw(40) << "  Estimated Time Saved (ms)"
+         << zs.savedUsec() / 1000 << endl;
+
+    PackfilePoolStats ps = repository.getPackfileStats();
+    cout << left << setw(40) << "Packfile Lookups" << ps.lookups << endl;
+    cout << left << setw(40) << "  Open Handle Hits" << ps.hits << endl;
+    cout << left << setw(40) << "  Opened" << ps.opens << endl;
+    cout << left << setw(40) << "  Evicted" << ps.evictions << endl;
+    cout << left << setw(40) << "  Handles Open" << ps.handles << endl;
+    cout << left << setw(40) << "  Bytes Mapped" << ps.mappedBytes << endl;
+
+    DurabilityStats ds = repository.getDurabilityStats();
+    const char *files[] = { "Packfile", "Index", "Metadata" };
+    cout << left << setw(40) << "Group Commits" << ds.groups << endl;
+    cout << left << setw(40) << "  Writes" << ds.writes << endl;
+    cout << left << setw(40) << "  Bytes Written" << ds.bytes << endl;
+    for (int f = 0; f < DURABILITY_FILES; f++) {
+        string name = string("  ") + files[f] + " Syncs";
+        cout << left << setw(40) << name << ds.syncs[f] << endl;
+        if (ds.syncs[f] == 0)
+            continue;
+        cout << left << setw(40) << "    Average (us)"
+             << ds.syncUsec[f] / ds.syncs[f] << endl;
+        for (int b = 0; b < DURABILITY_HIST_BUCKETS; b++) {
+            if (ds.hist[f][b] == 0)
+                continue;
+            stringstream ss;
+            ss << "    " << (b ? 1ULL << b : 0) << "-" << (2ULL << b) - 1 << " us";
+            cout << left << setw(40) << ss.str() << ds.hist[f][b] << endl;
+        }
+    }
+
     return 0;
 }
 
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+#include <oriutil/debug.h>
+#include <oriutil/oriutil.h>
+#include <oriutil/stopwatch.h>
+#include <ori/localrepo.h>
+
+using namespace std;
+
+extern LocalRepo repository;
+
+static vector<pair<char, string> >
+treediffbench_sorted(const TreeDiff &td)
+{
+    vector<pair<char, string> > rval;
+
+    for (size_t i = 0; i < td.entries.size(); i++) {
+        rval.push_back(make_pair((char)td.entries[i].type,
+                                 td.entries[i].filepath));
+    }
+    sort(rval.begin(), rval.end());
+
+    return rval;
+}
+
+/*
+ * Compare the flattened and structural tree diffs between two commits,
+ * by default HEAD and its parent.
+ */
+int
+cmd_treediffbench(int argc, char * const argv[])
+{
+    ObjectHash h1, h2;
+
+    if (argc == 3) {
+        h1 = ObjectHash::fromHex(argv[1]);
+        h2 = ObjectHash::fromHex(argv[2]);
+    } else if (argc == 1) {
+        h1 = repository.getHead();
+        if (h1 == EMPTY_COMMIT) {
+            printf("Repository has no commits\n");
+            return 1;
+        }
+        h2 = repository.getCommit(h1).getParents().first;
+    } else {
+        printf("Usage: oridbg treediffbench [<commit 1> <commit 2>]\n");
+        return 1;
+    }
+
+    Tree t1, t2;
+    if (h1 != EMPTY_COMMIT)
+        t1 = repository.getTree(repository.getCommit(h1).getTree());
+    if (h2 != EMPTY_COMMIT)
+        t2 = repository.getTree(repository.getCommit(h2).getTree());
+
+    TreeDiff flatDiff, structDiff;
+    Stopwatch flatSw = Stopwatch();
+    Stopwatch structSw = Stopwatch();
+    size_t paths;
+
+    flatSw.start();
+    {
+        Tree::Flat f1 = t1.flattened(&repository);
+        Tree::Flat f2 = t2.flattened(&repository);
+        paths = f1.size();
+        flatDiff.diffTwoTrees(f1, f2);
+    }
+    flatSw.stop();
+
+    structSw.start();
+    structDiff.diffTwoTrees(t1, t2, &repository);
+    structSw.stop();
+
+    printf("%lu paths, %lu changes\n", paths, structDiff.entries.size());
+    printf("%-12s %14s\n", "Diff", "Time (us)");
+    printf("%-12s %14lu\n", "flattened", flatSw.getElapsedTime());
+    printf("%-12s %14lu\n", "structural", structSw.getElapsedTime());
+
+    if (treediffbench_sorted(flatDiff) != treediffbench_sorted(structDiff)) {
+        printf("Diffs do not match!\n");
+        return 1;
+    }
+
+    return 0;
+}
@@ -15,11 +15,19 @@
  */
 
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <getopt.h>
 
 #include <string>
+#include <vector>
+#include <map>
 #include <iostream>
 
 #include <ori/localrepo.h>
+#include <ori/verifier.h>
 
 using namespace std;
 
@@ -31,21 +39,72 @@ extern LocalRepo repository;
 int
 cmd_verify(int argc, char * const argv[])
 {
-    int status = 0;
-    string error;
-    set<ObjectInfo> objects = repository.listObjects();
-    set<ObjectInfo>::iterator it;
-
-    for (it = objects.begin(); it != objects.end(); it++)
-    {
-	error = repository.verifyObject((*it).hash);
-	if (error != "") {
-	    cout << "Object " << (*it).hash.hex() << endl;
-	    cout << error << endl;
-	    status = 1;
-	}
+    int ch;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    bool incremental = true;
+
+    struct option longopts[] = {
+        { "full",       no_argument,            NULL,   'f' },
+        { "threads",    required_argument,      NULL,   'j' },
+        { NULL,         0,                      NULL,   0   }
+    };
+
+    while ((ch = getopt_long(argc, argv, "fj:", longopts, NULL)) != -1) {
+        switch (ch) {
+            case 'f':
+                incremental = false;
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            default:
+                printf("Usage: oridbg verify [--full] [-j THREADS]\n");
+                return 1;
+        }
     }
 
-    return status;
-}
+    Verifier v(&repository);
+    v.setThreads(threads);
+    v.setIncremental(incremental);
+    v.run();
+
+    const vector<VerifyError> &errors = v.getErrors();
+    map<string, size_t> kinds;
+    for (size_t i = 0; i < errors.size(); i++) {
+        if (errors[i].hash.isEmpty())
+            cout << "Packfile " << errors[i].detail << endl;
+        else
+            cout << "Object " << errors[i].hash.hex() << endl;
+        cout << errors[i].kind;
+        if (!errors[i].hash.isEmpty() && errors[i].detail != "")
+            cout << " " << errors[i].detail;
+        cout << endl;
+        kinds[errors[i].kind]++;
+    }
 
+    const VerifyStats &s = v.getStats();
+    double secs = s.time / 1000000.0;
+    double mb = s.storedBytes / (1024.0 * 1024.0);
+
+    printf("Verified %lu objects, %lu large files, in %lu packfiles "
+           "(%lu unchanged)\n",
+           s.objects, s.largeBlobs, s.packsScanned, s.packsSkipped);
+    printf("Read %.1f MB (%.1f MB uncompressed) in %.2f s, %.1f MB/s\n",
+           mb, s.payloadBytes / (1024.0 * 1024.0), secs,
+           secs > 0 ? mb / secs : 0.0);
+    if (!incremental)
+        printf("%lu objects reachable from heads and snapshots, "
+               "%lu unreachable\n", s.reachable, s.unreachable);
+
+    if (errors.size() == 0)
+        return 0;
+
+    printf("%lu errors\n", errors.size());
+    for (map<string, size_t>::iterator it = kinds.begin();
+         it != kinds.end();
+         it++) {
+        printf("%8lu  %s\n", it->second, it->first.c_str());
+    }
+
+    return 1;
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include <oriutil/debug.h>
+#include <oriutil/oriutil.h>
+#include <oriutil/stopwatch.h>
+#include <oriutil/zipcodec.h>
+#include <oriutil/blockzip.h>
+#include <ori/localrepo.h>
+
+using namespace std;
+
+extern LocalRepo repository;
+
+#define ZIPBENCH_DEFAULT_MB     64
+
+static double
+zipbench_mbps(uint64_t bytes, Stopwatch &sw)
+{
+    uint64_t usec = sw.getElapsedTime();
+
+    return usec > 0 ? (double)bytes / (double)usec : 0.0;
+}
+
+/*
+ * Compare the available codecs on objects from this repository.
+ */
+int
+cmd_zipbench(int argc, char * const argv[])
+{
+    size_t maxBytes = ZIPBENCH_DEFAULT_MB * 1024 * 1024;
+    vector<string> payloads;
+    uint64_t rawBytes = 0;
+
+    if (argc > 2) {
+        printf("Usage: oridbg zipbench [MAXMB]\n");
+        return 1;
+    }
+    if (argc == 2)
+        maxBytes = strtoul(argv[1], NULL, 10) * 1024 * 1024;
+
+    // Sample objects as stored in the packfiles
+    set<ObjectInfo> objs = repository.listObjects();
+    for (set<ObjectInfo>::iterator it = objs.begin();
+         it != objs.end() && rawBytes < maxBytes;
+         it++) {
+        if ((*it).type == ObjectInfo::Purged)
+            continue;
+
+        LocalObject::sp o = repository.getLocalObject((*it).hash);
+        if (!o)
+            continue;
+        payloads.push_back(o->getPayload());
+        rawBytes += payloads.back().size();
+    }
+
+    if (rawBytes == 0) {
+        printf("Repository has no objects\n");
+        return 1;
+    }
+
+    printf("%lu objects, %lu bytes\n", payloads.size(), rawBytes);
+    string policy = repository.getZipPolicy().toString();
+    if (policy != "")
+        printf("Repository policy:\n%s", policy.c_str());
+    printf("\n%-10s %8s %14s %14s\n",
+           "Codec", "Ratio", "Comp MB/s", "Decomp MB/s");
+
+    vector<const ZipCodec *> codecs = ZipCodec_List();
+    for (size_t c = 0; c < codecs.size(); c++) {
+        ObjectInfo::ZipAlgo algo = codecs[c]->getAlgo();
+        vector<string> packed(payloads.size());
+        uint64_t packedBytes = 0;
+        Stopwatch compSw = Stopwatch();
+        Stopwatch decompSw = Stopwatch();
+
+        compSw.start();
+        for (size_t i = 0; i < payloads.size(); i++) {
+            blockzipstream bs(new strstream(payloads[i]), COMPRESS, 0, algo);
+            packed[i] = bs.readAll();
+            packedBytes += packed[i].size();
+        }
+        compSw.stop();
+
+        decompSw.start();
+        for (size_t i = 0; i < payloads.size(); i++) {
+            blockzipstream bs(new strstream(packed[i]), DECOMPRESS,
+                              payloads[i].size(), algo);
+            if (bs.readAll() != payloads[i]) {
+                printf("%s: round trip mismatch!\n", codecs[c]->getName());
+                return 1;
+            }
+        }
+        decompSw.stop();
+
+        printf("%-10s %8.3f %14.1f %14.1f\n",
+               codecs[c]->getName(),
+               (double)packedBytes / (double)rawBytes,
+               zipbench_mbps(rawBytes, compSw),
+               zipbench_mbps(rawBytes, decompSw));
+    }
+
+    return 0;
+}
@@ -68,6 +68,7 @@ int cmd_rebuildindex(int argc, char * const argv[]);
 int cmd_rebuildrefs(int argc, char * const argv[]);
 int cmd_remote(int argc, char * const argv[]);
 int cmd_removekey(int argc, char * const argv[]);
+int cmd_repack(int argc, char * const argv[]);
 int cmd_setkey(int argc, char * const argv[]);
 int cmd_show(int argc, char * const argv[]);
 int cmd_snapshots(int argc, char * const argv[]);
@@ -81,16 +82,23 @@ int cmd_dumpmeta(int argc, char * const argv[]); // Debug
 int cmd_dumpobj(int argc, char * const argv[]); // Debug
 int cmd_dumppackfile(int argc, char * const argv[]); // Debug
 int cmd_dumprefs(int argc, char * const argv[]); // Debug
+int cmd_hashbench(int argc, char * const argv[]); // Debug
+int cmd_hexbench(int argc, char * const argv[]); // Debug
+int cmd_journalbench(int argc, char * const argv[]); // Debug
 int cmd_listobj(int argc, char * const argv[]); // Debug
 int cmd_refcount(int argc, char * const argv[]); // Debug
 int cmd_stats(int argc, char * const argv[]); // Debug
 int cmd_purgeobj(int argc, char * const argv[]); // Debug
 int cmd_purgesnapshot(int argc, char * const argv[]);
+int cmd_smallfilebench(int argc, char * const argv[]); // Debug
 int cmd_stripmetadata(int argc, char * const argv[]); // Debug
 int cmd_sshclient(int argc, char * const argv[]); // Debug
 int cmd_treediff(int argc, char * const argv[]);
+int cmd_treediffbench(int argc, char * const argv[]); // Debug
+int cmd_udsbench(int argc, char * const argv[]); // Debug
 int cmd_udsclient(int argc, char * const argv[]); // Debug
 int cmd_udsserver(int argc, char * const argv[]); // Debug
+int cmd_zipbench(int argc, char * const argv[]); // Debug
 #if !defined(WITHOUT_MDNS)
 int cmd_mdnsserver(int argc, char * const argv[]); // Debug
 #endif
@@ -176,6 +184,13 @@ static Cmd commands[] = {
         NULL,
         CMD_NEED_REPO,
     },
+    {
+        "repack",
+        "Rewrite packfiles so objects read together are stored together",
+        cmd_repack,
+        NULL,
+        CMD_NEED_REPO,
+    },
     {
         "setkey",
         "Set the repository private key for signing commits",
@@ -310,6 +325,20 @@ static Cmd commands[] = {
         CMD_NEED_REPO,
     },
     /* Debugging */
+    {
+        "hashbench",
+        "Benchmark the object hash table against unordered_map",
+        cmd_hashbench,
+        NULL,
+        0,
+    },
+    {
+        "hexbench",
+        "Benchmark per-object hash formatting and logging",
+        cmd_hexbench,
+        NULL,
+        0,
+    },
     {
         "httpclient",
         "Connect to a server via HTTP",
@@ -317,6 +346,20 @@ static Cmd commands[] = {
         NULL,
         0,
     },
+    {
+        "journalbench",
+        "Benchmark the orifs recovery journal and its replay",
+        cmd_journalbench,
+        NULL,
+        0,
+    },
+    {
+        "smallfilebench",
+        "Benchmark orifs small file creation in memory and temporary files",
+        cmd_smallfilebench,
+        NULL,
+        0,
+    },
     {
         "sshclient",
         "Connect to a server via SSH",
@@ -324,6 +367,20 @@ static Cmd commands[] = {
         NULL,
         0,
     },
+    {
+        "treediffbench",
+        "Benchmark flattened and structural tree diffs",
+        cmd_treediffbench,
+        NULL,
+        CMD_NEED_REPO,
+    },
+    {
+        "udsbench",
+        "Benchmark requests over UDS",
+        cmd_udsbench,
+        NULL,
+        0,
+    },
     {
         "udsclient",
         "Connect to a server via UDS",
@@ -338,6 +395,13 @@ static Cmd commands[] = {
         NULL,
         CMD_NEED_REPO,
     },
+    {
+        "zipbench",
+        "Benchmark compression codecs on repository objects",
+        cmd_zipbench,
+        NULL,
+        CMD_NEED_REPO,
+    },
     {
         "version",
         "Show version information",
@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <new>
+#include <string>
+#include <vector>
+
+#include <oriutil/debug.h>
+#include <oriutil/oriutil.h>
+#include <oriutil/stopwatch.h>
+#include <ori/localrepo.h>
+#include <ori/packfile.h>
+#include <ori/tree.h>
+
+using namespace std;
+
+LocalRepo repository;
+
+#define READBENCH_DEFAULT_MB    64
+#define READBENCH_READSIZE      4096
+
+/*
+ * Every copy of a payload on the read paths lands in a freshly allocated
+ * string or vector, so the heap bytes allocated per read are counted as
+ * the bytes copied.  Only allocations made while a path runs are counted,
+ * including those of other threads.  This is why readbench is a program of
+ * its own rather than an oridbg command.
+ */
+static bool readbench_counting;
+static uint64_t readbench_allocated;
+
+void *
+operator new(size_t n)
+{
+    void *p;
+
+    if (readbench_counting)
+        __sync_fetch_and_add(&readbench_allocated, n);
+    p = malloc(n ? n : 1);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void
+operator delete(void *p) throw()
+{
+    free(p);
+}
+
+struct ReadBenchResult {
+    uint64_t reads;
+    uint64_t bytes;
+    uint64_t copied;
+    uint64_t usec;
+    // Checksum so the reads cannot be optimized out
+    uint64_t sum;
+};
+
+static void
+readbench_print(const char *name, const ReadBenchResult &r)
+{
+    printf("%-20s %8llu %10.1f %12.1f %8.2f %10.1f\n",
+           name, (unsigned long long)r.reads,
+           (double)r.bytes / (1024.0 * 1024.0),
+           r.reads ? (double)r.copied / (double)r.reads : 0.0,
+           r.bytes ? (double)r.copied / (double)r.bytes : 0.0,
+           r.usec ? (double)r.bytes / (double)r.usec : 0.0);
+}
+
+static uint64_t
+readbench_sum(const uint8_t *buf, size_t len)
+{
+    uint64_t sum = 0;
+
+    for (size_t i = 0; i < len; i += 512)
+        sum += buf[i];
+    return sum;
+}
+
+/*
+ * Runs one access path over the objects and tallies the bytes it copies.
+ */
+static ReadBenchResult
+readbench_run(const vector<ObjectInfo> &objs, int path)
+{
+    ReadBenchResult r = { 0, 0, 0, 0, 0 };
+    vector<uint8_t> buf(READBENCH_READSIZE);
+    Stopwatch sw = Stopwatch();
+
+    readbench_allocated = 0;
+    readbench_counting = true;
+    sw.start();
+    for (size_t i = 0; i < objs.size(); i++) {
+        const ObjectHash &hash = objs[i].hash;
+
+        if (path == 0) {
+            // Whole payload as a string
+            Object::sp o(repository.getObject(hash));
+            string payload = o->getPayload();
+            r.sum += readbench_sum((const uint8_t *)payload.data(),
+                                   payload.size());
+            r.bytes += payload.size();
+            r.reads++;
+        } else if (path == 1) {
+            // FUSE reads into the caller's buffer
+            off_t off = 0;
+            ssize_t n;
+            while ((n = repository.readPayload(hash, &buf[0], buf.size(),
+                                               off)) > 0) {
+                r.sum += readbench_sum(&buf[0], n);
+                r.bytes += n;
+                r.reads++;
+                off += n;
+            }
+        } else if (path == 2) {
+            // In place, uncompressed payloads only
+            PayloadView view;
+            if (!repository.getPayloadView(hash, &view))
+                continue;
+            r.sum += readbench_sum(view.data, view.len);
+            r.bytes += view.len;
+            r.reads++;
+        } else if (objs[i].type == ObjectInfo::Tree) {
+            // Tree decoding, copied or in place
+            Tree t = (path == 3) ? repository.Repo::getTree(hash)
+                                 : repository.getTree(hash);
+            r.sum += t.tree.size();
+            r.bytes += objs[i].payload_size;
+            r.reads++;
+        }
+    }
+    sw.stop();
+    readbench_counting = false;
+
+    r.copied = readbench_allocated;
+    r.usec = sw.getElapsedTime();
+    return r;
+}
+
+/*
+ * Compare the bytes copied per read by the payload access paths on objects
+ * from the repository in the current directory.
+ */
+int
+main(int argc, char *argv[])
+{
+    size_t maxBytes = READBENCH_DEFAULT_MB * 1024 * 1024;
+    vector<ObjectInfo> objs;
+    uint64_t rawBytes = 0;
+
+    if (argc > 2) {
+        printf("Usage: orireadbench [MAXMB]\n");
+        return 1;
+    }
+    if (argc == 2)
+        maxBytes = strtoul(argv[1], NULL, 10) * 1024 * 1024;
+
+    try {
+        repository.open();
+    } catch (std::exception &e) {
+        printf("No repository found!\n");
+        return 1;
+    }
+
+    set<ObjectInfo> all = repository.listObjects();
+    for (set<ObjectInfo>::iterator it = all.begin();
+         it != all.end() && rawBytes < maxBytes;
+         it++) {
+        if ((*it).type != ObjectInfo::Blob && (*it).type != ObjectInfo::Tree)
+            continue;
+        if (!repository.isObjectStored((*it).hash))
+            continue;
+        objs.push_back(*it);
+        rawBytes += (*it).payload_size;
+    }
+
+    if (objs.empty()) {
+        printf("Repository has no objects\n");
+        return 1;
+    }
+
+    printf("%lu objects, %llu bytes\n", objs.size(),
+           (unsigned long long)rawBytes);
+    printf("\n%-20s %8s %10s %12s %8s %10s\n",
+           "Path", "Reads", "MB", "Copied/read", "Copies", "MB/s");
+
+    const char *names[] = { "getPayload", "readPayload 4K", "payload view",
+                            "tree (copied)", "tree (in place)" };
+    for (int path = 0; path < 5; path++) {
+        ReadBenchResult r = readbench_run(objs, path);
+        readbench_print(names[path], r);
+    }
+
+    return 0;
+}
@@ -27,6 +27,7 @@
 #include <oriutil/debug.h>
 #include <oriutil/oriutil.h>
 #include <oriutil/systemexception.h>
+#include <oriutil/zipcodec.h>
 #include <ori/repostore.h>
 #include <ori/localrepo.h>
 #include <ori/udsclient.h>
@@ -37,6 +38,7 @@
 using namespace std;
 
 SshServer::SshServer()
+    : zipAlgos(ZIPCODEC_LEGACY)
 {
 }
 
@@ -104,13 +106,11 @@ SshServer::close()
 
 void
 SshServer::serve() {
-    fdstream fs(STDIN_FILENO, -1);
-
-    uint8_t respOK = OK;
-    write(STDOUT_FILENO, &respOK, 1);
-    fsync(STDOUT_FILENO);
-    fflush(stdout);
+    fdbufstream fs(STDIN_FILENO);
+    fdbufwstream out(STDOUT_FILENO);
 
+    out.writeUInt8(OK);
+    out.flush();
 
     while (true) {
         // Get command
@@ -119,32 +119,35 @@ SshServer::serve() {
             break;
 
         if (command == "hello") {
-            cmd_hello();
+            cmd_hello(&fs, &out);
+        }
+        else if (command == "zipalgos") {
+            cmd_zipAlgos(&fs, &out);
         }
         else if (command == "list objs") {
-            cmd_listObjs();
+            cmd_listObjs(&fs, &out);
         }
         else if (command == "list commits") {
-            cmd_listCommits();
+            cmd_listCommits(&fs, &out);
         }
         else if (command == "readobjs") {
-            cmd_readObjs();
+            cmd_readObjs(&fs, &out);
         }
         else if (command == "getobjinfo") {
-            cmd_getObjInfo();
+            cmd_getObjInfo(&fs, &out);
         }
         else if (command == "get head") {
-            cmd_getHead();
+            cmd_getHead(&fs, &out);
         }
         else if (command == "get fsid") {
-            cmd_getFSID();
+            cmd_getFSID(&fs, &out);
         }
         else {
-            printError("Unknown command");
+            out.writeUInt8(ERROR);
+            out.writePStr("Unknown command");
         }
 
-        fflush(stdout);
-        fsync(STDOUT_FILENO);
+        out.flush();
     }
 
     fflush(stdout);
@@ -152,99 +155,103 @@ SshServer::serve() {
 }
 
 void
-SshServer::cmd_hello()
+SshServer::cmd_hello(bytestream *in, bytewstream *out)
 {
     DLOG("hello");
-    fdwstream fs(STDOUT_FILENO);
-    fs.writeUInt8(OK);
-    fs.writePStr(ORI_PROTO_VERSION);
+    out->writeUInt8(OK);
+    out->writePStr(ORI_PROTO_VERSION);
 }
 
+/*
+ * The client announces the payload algorithms it can decode.  Clients that
+ * never do are older binaries, and get their payloads in ZIPCODEC_LEGACY.
+ */
 void
-SshServer::cmd_listObjs()
+SshServer::cmd_zipAlgos(bytestream *in, bytewstream *out)
+{
+    zipAlgos = in->readUInt32();
+    DLOG("zipAlgos: %08x", zipAlgos);
+    out->writeUInt8(OK);
+}
+
+void
+SshServer::cmd_listObjs(bytestream *in, bytewstream *out)
 {
     DLOG("listObjs");
-    fdwstream fs(STDOUT_FILENO);
-    fs.writeUInt8(OK);
+    out->writeUInt8(OK);
 
     std::set<ObjectInfo> objects = repo->listObjects();
-    fs.writeUInt64(objects.size());
+    out->writeUInt64(objects.size());
     for (std::set<ObjectInfo>::iterator it = objects.begin();
             it != objects.end();
             it++) {
-        fs.writeInfo(*it);
+        out->writeInfo(*it);
     }
 }
 
 void
-SshServer::cmd_listCommits()
+SshServer::cmd_listCommits(bytestream *in, bytewstream *out)
 {
     DLOG("listCommits");
-    fdwstream fs(STDOUT_FILENO);
-    fs.writeUInt8(OK);
+    out->writeUInt8(OK);
 
     const std::vector<Commit> &commits = repo->listCommits();
-    fs.writeUInt32(commits.size());
+    out->writeUInt32(commits.size());
     for (size_t i = 0; i < commits.size(); i++) {
         std::string blob = commits[i].getBlob();
-        fs.writePStr(blob);
+        out->writePStr(blob);
     }
 }
 
 void
-SshServer::cmd_readObjs()
+SshServer::cmd_readObjs(bytestream *in, bytewstream *out)
 {
     // Read object ids
-    fdstream in(STDIN_FILENO, -1);
-    uint32_t numObjs = in.readUInt32();
+    uint32_t numObjs = in->readUInt32();
     DLOG("readObjs: Transmitting %u objects", numObjs);
     std::vector<ObjectHash> objs;
     for (uint32_t i = 0; i < numObjs; i++) {
         ObjectHash hash;
-        in.readHash(hash);
+        in->readHash(hash);
         objs.push_back(hash);
         DLOG("readObjs: %d of %d - %s", i + 1, numObjs, hash.hex().c_str());
     }
 
-    fdwstream fs(STDOUT_FILENO);
-    fs.writeUInt8(OK);
-    repo->transmit(&fs, objs);
+    out->writeUInt8(OK);
+    repo->transmitFor(out, objs, zipAlgos);
 }
 
 void
-SshServer::cmd_getObjInfo()
+SshServer::cmd_getObjInfo(bytestream *in, bytewstream *out)
 {
-    fdstream in(STDIN_FILENO, -1);
     ObjectHash hash;
     ObjectInfo info;
 
-    in.readHash(hash);
-    fdwstream fs(STDOUT_FILENO);
+    in->readHash(hash);
     info = repo->getObjectInfo(hash);
     if (info.type == ObjectInfo::Null) {
-        fs.writeUInt8(ERROR);
+        out->writeUInt8(ERROR);
+        out->writePStr("Object not found");
         return;
     }
-    fs.writeUInt8(OK);
-    fs.writeInfo(info);
+    out->writeUInt8(OK);
+    out->writeInfo(info);
 }
 
 void
-SshServer::cmd_getHead()
+SshServer::cmd_getHead(bytestream *in, bytewstream *out)
 {
     DLOG("getHead");
-    fdwstream fs(STDOUT_FILENO);
-    fs.writeUInt8(OK);
-    fs.writeHash(repo->getHead());
+    out->writeUInt8(OK);
+    out->writeHash(repo->getHead());
 }
 
 void
-SshServer::cmd_getFSID()
+SshServer::cmd_getFSID(bytestream *in, bytewstream *out)
 {
     DLOG("getFSID");
-    fdwstream fs(STDOUT_FILENO);
-    fs.writeUInt8(OK);
-    fs.writePStr(repo->getUUID());
+    out->writeUInt8(OK);
+    out->writePStr(repo->getUUID());
 }
 
 void
@@ -1,7 +1,8 @@
 #ifndef __SERVER_H__
 #define __SERVER_H__
 
-#define ORI_PROTO_VERSION "1.0"
+// 1.1 adds zipalgos, before which payloads are sent in ZIPCODEC_LEGACY
+#define ORI_PROTO_VERSION "1.1"
 
 class SshServer
 {
@@ -14,16 +15,19 @@ public:
 
     void serve();
     
-    void cmd_hello();
-    void cmd_listObjs();
-    void cmd_listCommits();
-    void cmd_readObjs();
-    void cmd_getObjInfo();
-    void cmd_getHead();
-    void cmd_getFSID();
+    void cmd_hello(bytestream *in, bytewstream *out);
+    void cmd_zipAlgos(bytestream *in, bytewstream *out);
+    void cmd_listObjs(bytestream *in, bytewstream *out);
+    void cmd_listCommits(bytestream *in, bytewstream *out);
+    void cmd_readObjs(bytestream *in, bytewstream *out);
+    void cmd_getObjInfo(bytestream *in, bytewstream *out);
+    void cmd_getHead(bytestream *in, bytewstream *out);
+    void cmd_getFSID(bytestream *in, bytewstream *out);
 private:
     UDSClient *udsClient;
     Repo *repo;
+    // Payload algorithms the client can decode (see ZIPCODEC_BIT)
+    uint32_t zipAlgos;
 };
 
 #endif
@@ -40,6 +40,7 @@
 
 #include "logging.h"
 #include "oricmd.h"
+#include "orihydrate.h"
 #include "oripriv.h"
 
 using namespace std;
@@ -88,6 +89,10 @@ OriCommand::process(const string &data)
         return cmd_branch(str);
     if (cmd == "version")
         return cmd_version(str);
+    if (cmd == "prefetch")
+        return cmd_prefetch(str);
+    if (cmd == "hydrate")
+        return cmd_hydrate(str);
 
     // Makes debugging easier when a bad request comes in
     return "UNSUPPORTED REQUEST";
@@ -529,3 +534,54 @@ OriCommand::cmd_version(strstream &str)
     return resp.str();
 }
 
+string
+OriCommand::cmd_prefetch(strstream &str)
+{
+    FUSE_LOG("Command: prefetch");
+
+    PrefetchStats stats;
+    strwstream resp;
+
+    if (!priv->repo->getPrefetchStats(&stats)) {
+        resp.writeUInt8(0);
+        return resp.str();
+    }
+
+    resp.writeUInt8(1);
+    resp.writeUInt64(stats.requests);
+    resp.writeUInt64(stats.hits);
+    resp.writeUInt64(stats.waits);
+    resp.writeUInt64(stats.misses);
+    resp.writeUInt64(stats.prefetched);
+    resp.writeUInt64(stats.wasted);
+    resp.writeUInt64(stats.batches);
+    resp.writeUInt64(stats.objects);
+    resp.writeUInt64(stats.bytes);
+
+    return resp.str();
+}
+
+string
+OriCommand::cmd_hydrate(strstream &str)
+{
+    FUSE_LOG("Command: hydrate");
+
+    OriHydrateStats stats;
+    strwstream resp;
+
+    if (priv->hydrator == NULL) {
+        resp.writeUInt8(0);
+        return resp.str();
+    }
+
+    stats = priv->hydrator->getStats();
+
+    resp.writeUInt8(1);
+    resp.writeUInt64(stats.trees);
+    resp.writeUInt64(stats.objects);
+    resp.writeUInt64(stats.bytes);
+    resp.writeUInt64(stats.pending);
+    resp.writeUInt8(stats.done ? 1 : 0);
+
+    return resp.str();
+}
@@ -37,6 +37,8 @@ private:
     std::string cmd_remote(strstream &str);
     std::string cmd_branch(strstream &str);
     std::string cmd_version(strstream &str);
+    std::string cmd_prefetch(strstream &str);
+    std::string cmd_hydrate(strstream &str);
     OriPriv *priv;
 };
 
@@ -144,7 +144,7 @@ ori_unlink(const char *path)
         return -e.getErrno();
     }
 
-    priv->journal("unlink", path);
+    priv->journal(Journal::Unlink, path);
 
     return 0;
 }
@@ -274,10 +274,7 @@ ori_rename(const char *from_path, const char *to_path)
         return -e.getErrno();
     }
 
-    string journalArg = from_path;
-    journalArg += ":";
-    journalArg += to_path;
-    priv->journal("rename", journalArg);
+    priv->journal(Journal::Rename, from_path, to_path);
 
     return 0;
 }
@@ -320,9 +317,7 @@ ori_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 
     parentDir->add(OriFile_Basename(path), info.first->id);
 
-    string journalArg = path;
-    journalArg += ":" + info.first->path;
-    priv->journal("create", journalArg);
+    priv->journal(Journal::Create, path, info.first->path);
 
     // Set fh
     fi->fh = info.second;
@@ -441,7 +436,15 @@ ori_read(const char *path, char *buf, size_t size, off_t offset,
         return -EISDIR;
     }
 
-    if (info->fd != -1) {
+    if (info->data != NULL) {
+        // Small file held in memory
+        status = priv->readData(info, buf, size, offset);
+        if (status < 0)
+            return -errno;
+    } else if (info->fd != -1 && info->extents != NULL) {
+        // Written ranges in temporary directory, the rest in repository
+        return info->extents->read(info->fd, buf, size, offset);
+    } else if (info->fd != -1) {
         // File in temporary directory
         status = pread(info->fd, buf, size, offset);
         if (status < 0)
@@ -482,9 +485,18 @@ ori_write(const char *path, const char *buf, size_t size, off_t offset,
     }
 
     info->type = FILETYPE_DIRTY;
-    status = pwrite(info->fd, buf, size, offset);
-    if (status < 0)
-        return -errno;
+    if (info->data != NULL) {
+        // Small file held in memory, moves to a temporary file as it grows
+        status = priv->writeData(path, info, buf, size, offset);
+        if (status < 0)
+            return -errno;
+    } else {
+        status = pwrite(info->fd, buf, size, offset);
+        if (status < 0)
+            return -errno;
+        if (info->extents != NULL)
+            info->extents->write(offset, status);
+    }
 
     // Update size
     if (info->statInfo.st_size < (off_t)size + offset) {
@@ -516,9 +528,14 @@ ori_truncate(const char *path, off_t length)
     if (info->type == FILETYPE_DIRTY) {
         int status;
 
-        status = truncate(info->path.c_str(), length);
+        if (info->data != NULL)
+            status = priv->truncateData(path, info, length);
+        else
+            status = truncate(info->path.c_str(), length);
         if (status < 0)
             return -errno;
+        if (info->extents != NULL)
+            info->extents->truncate(length);
 
         // Update size
         info->statInfo.st_size = length;
@@ -554,9 +571,14 @@ ori_ftruncate(const char *path, off_t length, struct fuse_file_info *fi)
     if (info->type == FILETYPE_DIRTY) {
         int status;
 
-        status = ftruncate(info->fd, length);
+        if (info->data != NULL)
+            status = priv->truncateData(path, info, length);
+        else
+            status = ftruncate(info->fd, length);
         if (status < 0)
             return -errno;
+        if (info->extents != NULL)
+            info->extents->truncate(length);
 
         // Update size
         info->statInfo.st_size = length;
@@ -617,7 +639,7 @@ ori_mkdir(const char *path, mode_t mode)
         return -e.getErrno();
     }
 
-    priv->journal("mkdir", path);
+    priv->journal(Journal::Mkdir, path);
 
     return 0;
 }
@@ -661,7 +683,7 @@ ori_rmdir(const char *path)
         return -e.getErrno();
     }
 
-    priv->journal("rmdir", path);
+    priv->journal(Journal::Rmdir, path);
 
     return 0;
 }
@@ -985,6 +1007,11 @@ ori_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
     RWKey::sp lock = priv->nsLock.readLock();
     try {
         info = priv->getFileInfo(fi->fh);
+        if (info->data != NULL) {
+            // Writes to small files are durable once journaled
+            priv->syncData();
+            return 0;
+        }
         if (info->fd == -1)
             return 0; // XXX: File is closed ignore
 
@@ -1045,8 +1072,11 @@ usage()
     printf("    --clone=[REMOTE PATH]           Clone remote repository\n");
     printf("    --shallow                       Force caching shallow clone\n");
     printf("    --nocache                       Force no caching clone\n");
+    printf("    --hydrate[=KB/S]                Fetch the rest of a shallow clone in the\n"
+           "                                    background, optionally capped in KB/s\n");
     printf("    --journal-none                  Disable recovery journal\n");
-    printf("    --journal-async                 Asynchronous recovery journal\n");
+    printf("    --journal-async[=MSECS]         Asynchronous recovery journal, synced\n"
+           "                                    every MSECS (default 100)\n");
     printf("    --journal-sync                  Synchronous recovery journal\n");
     printf("    --no-threads                    Disable threading (DEBUG)\n");
     printf("    --debug                         Enable FUSE debug mode (DEBUG)\n");
@@ -1066,7 +1096,10 @@ main(int argc, char *argv[])
 
     config.shallow = 0;
     config.nocache = 0;
+    config.hydrate = 0;
+    config.hydrateRate = 0;
     config.journal = 0;
+    config.journalMsecs = JOURNAL_SYNC_MSECS;
     config.single = 0;
     config.debug = 0;
     config.repoPath = "";
@@ -1078,8 +1111,9 @@ main(int argc, char *argv[])
         { "clone",          required_argument,  NULL,   'c' },
         { "shallow",        no_argument,        NULL,   's' },
         { "nocache",        no_argument,        NULL,   'n' },
+        { "hydrate",        optional_argument,  NULL,   'b' },
         { "journal-none",   no_argument,        NULL,   'x' },
-        { "journal-async",  no_argument,        NULL,   'y' },
+        { "journal-async",  optional_argument,  NULL,   'y' },
         { "journal-sync",   no_argument,        NULL,   'z' },
         { "no-threads",     no_argument,        NULL,   't' },
         { "debug",          no_argument,        NULL,   'd' },
@@ -1088,7 +1122,7 @@ main(int argc, char *argv[])
         { NULL,             0,                  NULL,   0   }
     };
 
-    while ((ch = getopt_long(argc, argv, "r:c:snxyzdh", longopts, NULL)) != -1)
+    while ((ch = getopt_long(argc, argv, "r:c:snb::xy::zdh", longopts, NULL)) != -1)
     {
         switch (ch) {
             case 'r':
@@ -1104,11 +1138,18 @@ main(int argc, char *argv[])
             case 'n':
                 config.nocache = 1;
                 break;
+            case 'b':
+                config.hydrate = 1;
+                if (optarg != NULL)
+                    config.hydrateRate = strtoull(optarg, NULL, 10) * 1024;
+                break;
             case 'x':
                 config.journal = 1;
                 break;
             case 'y':
                 config.journal = 2;
+                if (optarg != NULL)
+                    config.journalMsecs = strtoul(optarg, NULL, 10);
                 break;
             case 'z':
                 config.journal = 3;
@@ -1253,7 +1294,8 @@ main(int argc, char *argv[])
         priv->setJournalMode(OriJournalMode::NoJournal);
     } else if (config.journal == 2 || config.journal == 0) {
         // XXX: default
-        priv->setJournalMode(OriJournalMode::AsyncJournal);
+        priv->setJournalMode(OriJournalMode::AsyncJournal,
+                             config.journalMsecs);
     } else if (config.journal == 3) {
         priv->setJournalMode(OriJournalMode::SyncJournal);
     } else {
@@ -0,0 +1,383 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <boost/tr1/memory.hpp>
+#include <oriutil/oritr1.h>
+
+#include <oriutil/debug.h>
+#include <oriutil/monitor.h>
+#include <oriutil/orifile.h>
+#include <oriutil/oristr.h>
+#include <oriutil/rwlock.h>
+#include <ori/commit.h>
+#include <ori/largeblob.h>
+#include <ori/localrepo.h>
+#include <ori/tree.h>
+
+#include "logging.h"
+#include "oripriv.h"
+#include "orihydrate.h"
+
+using namespace std;
+
+// Objects per batch with no rate limit, and the bounds otherwise
+#define HYDRATE_BATCH_MAX       1024
+#define HYDRATE_BATCH_MIN       16
+// Batches are sized to take about this long at the rate limit, since reads
+// of an object in a batch wait for all of it to arrive
+#define HYDRATE_BATCH_USECS     250000
+// Object size assumed until a batch has been pulled, and for objects that
+// the tree entries give no size for
+#define HYDRATE_OBJSIZE_GUESS   8192
+// Expected bytes per batch, which is held in memory until it is stored
+#define HYDRATE_BATCH_BYTES     (32 * 1024 * 1024)
+// Batches between progress saves
+#define HYDRATE_SAVE_BATCHES    16
+// Recently opened directories remembered
+#define HYDRATE_RECENT_MAX      64
+
+OriHydrator::OriHydrator(OriPriv *priv, uint64_t rate)
+    : Thread("hydrate"), priv(priv), repo(priv->getRepo()), rate(rate),
+      statePath(), batchSize(HYDRATE_BATCH_MAX), batches(0)
+{
+    statePath = repo->getRootPath() + ORI_PATH_HYDRATE;
+    memset(&stats, 0, sizeof(stats));
+
+    if (rate != 0) {
+        batchSize = rate * HYDRATE_BATCH_USECS / 1000000 /
+                    HYDRATE_OBJSIZE_GUESS;
+        batchSize = MAX(MIN(batchSize, HYDRATE_BATCH_MAX), HYDRATE_BATCH_MIN);
+    }
+
+    setPriority(IdlePriority);
+}
+
+OriHydrator::~OriHydrator()
+{
+}
+
+void
+OriHydrator::touch(const ObjectHash &tree)
+{
+    Monitor l(lock);
+
+    if (stats.done)
+        return;
+
+    recent.push_front(tree);
+    if (recent.size() > HYDRATE_RECENT_MAX)
+        recent.pop_back();
+}
+
+void
+OriHydrator::run()
+{
+    ObjectHash missing;
+
+    LOG("hydrate: starting at %llu bytes/s", (unsigned long long)rate);
+
+    load();
+    {
+        Monitor l(lock);
+        if (stats.done) {
+            LOG("hydrate: already complete");
+            return;
+        }
+    }
+
+    while (!interruptionRequested()) {
+        ObjectHash tree;
+
+        if (want.size() >= batchSize) {
+            pullBatch();
+            continue;
+        }
+
+        if (!nextTree(&tree)) {
+            if (!want.empty() || !largeBlobs.empty()) {
+                pullBatch();
+                continue;
+            }
+
+            lock.lock();
+            stats.done = true;
+            lock.unlock();
+            save();
+            LOG("hydrate: complete");
+            return;
+        }
+
+        RWKey::sp key = priv->nsLock.writeLock();
+        if (!repo->isObjectStored(tree)) {
+            key.reset();
+            if (tree == missing) {
+                WARNING("hydrate: tree %s not available", tree.hex().c_str());
+                walked.insert(tree);
+                continue;
+            }
+
+            // Pull the tree with the next batch and walk it after that
+            missing = tree;
+            addWanted(tree, HYDRATE_OBJSIZE_GUESS, true);
+            pending.push_front(tree);
+            pullBatch();
+            continue;
+        }
+        walkTree(tree);
+    }
+
+    LOG("hydrate: stopped with %lu trees left", pending.size());
+}
+
+void
+OriHydrator::stop()
+{
+    interrupt();
+    wait();
+}
+
+OriHydrateStats
+OriHydrator::getStats()
+{
+    Monitor l(lock);
+
+    return stats;
+}
+
+/*
+ * Returns the next tree to walk, recently opened directories first.
+ */
+bool
+OriHydrator::nextTree(ObjectHash *tree)
+{
+    lock.lock();
+    while (!recent.empty()) {
+        *tree = recent.front();
+        recent.pop_front();
+        if (walked.count(*tree) == 0) {
+            lock.unlock();
+            return true;
+        }
+    }
+    lock.unlock();
+
+    while (!pending.empty()) {
+        *tree = pending.front();
+        pending.pop_front();
+        if (walked.count(*tree) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Queues the missing objects of a stored tree and its subtrees for walking.
+ * Called with the namespace lock held.
+ */
+void
+OriHydrator::walkTree(const ObjectHash &hash)
+{
+    Tree t = repo->getTree(hash);
+
+    for (Tree::iterator it = t.begin(); it != t.end(); it++) {
+        const TreeEntry &te = it->second;
+
+        if (te.type == TreeEntry::Tree) {
+            if (walked.count(te.hash) == 0)
+                pending.push_back(te.hash);
+            if (!repo->isObjectStored(te.hash))
+                addWanted(te.hash, HYDRATE_OBJSIZE_GUESS);
+        } else if (te.type == TreeEntry::LargeBlob) {
+            if (repo->isObjectStored(te.hash)) {
+                expandLargeBlob(te.hash);
+            } else {
+                addWanted(te.hash, HYDRATE_OBJSIZE_GUESS);
+                largeBlobs.push_back(te.hash);
+            }
+        } else if (!repo->isObjectStored(te.hash)) {
+            uint64_t size = HYDRATE_OBJSIZE_GUESS;
+
+            if (te.attrs.has(ATTR_FILESIZE))
+                size = te.attrs.getAs<size_t>(ATTR_FILESIZE);
+            addWanted(te.hash, size);
+        }
+    }
+
+    walked.insert(hash);
+
+    Monitor l(lock);
+    stats.trees++;
+    stats.pending = pending.size();
+}
+
+void
+OriHydrator::expandLargeBlob(const ObjectHash &hash)
+{
+    LargeBlob lb = LargeBlob(repo);
+    map<uint64_t, LBlobEntry>::iterator it;
+
+    lb.fromBlob(repo->getPayload(hash));
+    for (it = lb.parts.begin(); it != lb.parts.end(); it++) {
+        if (!repo->isObjectStored(it->second.hash))
+            addWanted(it->second.hash, it->second.length);
+    }
+}
+
+void
+OriHydrator::addWanted(const ObjectHash &hash, uint64_t size, bool front)
+{
+    Wanted w;
+
+    w.hash = hash;
+    w.size = size;
+    if (front)
+        want.push_front(w);
+    else
+        want.push_back(w);
+}
+
+/*
+ * Pulls the next batch of wanted objects.  Once all of them are in the parts
+ * of the large blobs that came with them are wanted, and when none are left
+ * every tree walked so far is complete and the progress can be saved.  The
+ * namespace lock is only taken to store the batch, not for the transfer.
+ */
+void
+OriHydrator::pullBatch()
+{
+    ObjectHashVec batch;
+    uint64_t expected = 0;
+    uint64_t bytes;
+
+    // The first object goes even if it is larger than a batch
+    while (!want.empty() && batch.size() < batchSize &&
+           (batch.empty() ||
+            expected + want.front().size <= HYDRATE_BATCH_BYTES)) {
+        batch.push_back(want.front().hash);
+        expected += want.front().size;
+        want.pop_front();
+    }
+
+    bytes = repo->hydrate(batch, rate, &priv->nsLock);
+    batches++;
+
+    if (rate != 0 && bytes != 0) {
+        size_t perObj = MAX(bytes / batch.size(), (uint64_t)1);
+
+        batchSize = rate * HYDRATE_BATCH_USECS / 1000000 / perObj;
+        batchSize = MAX(MIN(batchSize, HYDRATE_BATCH_MAX), HYDRATE_BATCH_MIN);
+    }
+
+    if (want.empty() && !largeBlobs.empty()) {
+        RWKey::sp key = priv->nsLock.writeLock();
+
+        while (!largeBlobs.empty()) {
+            if (repo->isObjectStored(largeBlobs.front()))
+                expandLargeBlob(largeBlobs.front());
+            largeBlobs.pop_front();
+        }
+    }
+
+    lock.lock();
+    stats.objects += batch.size();
+    stats.bytes += bytes;
+    stats.pending = pending.size();
+    lock.unlock();
+
+    if (want.empty() && batches % HYDRATE_SAVE_BATCHES == 0)
+        save();
+}
+
+void
+OriHydrator::load()
+{
+    RWKey::sp key = priv->nsLock.writeLock();
+    ObjectHash head = repo->getHead();
+    ObjectHash savedRoot;
+    bool done = false;
+
+    if (head.isEmpty()) {
+        lock.lock();
+        stats.done = true;
+        lock.unlock();
+        return;
+    }
+    root = repo->getCommit(head).getTree();
+
+    if (OriFile_Exists(statePath)) {
+        vector<string> lines = OriStr_Split(OriFile_ReadFile(statePath), '\n');
+
+        for (size_t i = 0; i < lines.size(); i++) {
+            stringstream ss(lines[i]);
+            string kind, hex;
+
+            ss >> kind >> hex;
+            if (kind == "root") {
+                savedRoot = ObjectHash::fromHex(hex);
+            } else if (kind == "done") {
+                done = true;
+            } else if (kind == "tree" && savedRoot == root) {
+                pending.push_back(ObjectHash::fromHex(hex));
+            }
+        }
+    }
+
+    if (savedRoot != root) {
+        // HEAD moved, objects already stored are skipped as the tree is walked
+        pending.clear();
+        pending.push_back(root);
+        done = false;
+    } else if (pending.empty() && !done) {
+        pending.push_back(root);
+    }
+
+    lock.lock();
+    stats.done = done;
+    stats.pending = pending.size();
+    lock.unlock();
+
+    LOG("hydrate: %lu trees left to walk", pending.size());
+}
+
+void
+OriHydrator::save()
+{
+    string tmpPath = statePath + ".tmp";
+    stringstream ss;
+
+    ss << "root " << root.hex() << "\n";
+    if (stats.done)
+        ss << "done\n";
+    for (size_t i = 0; i < pending.size(); i++)
+        ss << "tree " << pending[i].hex() << "\n";
+
+    if (!OriFile_WriteFile(ss.str(), tmpPath) ||
+        OriFile_Rename(tmpPath, statePath) < 0) {
+        WARNING("Couldn't save hydration progress to %s", statePath.c_str());
+    }
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __ORIHYDRATE_H__
+#define __ORIHYDRATE_H__
+
+#include <stdint.h>
+
+#include <deque>
+#include <string>
+
+#include <oriutil/mutex.h>
+#include <oriutil/thread.h>
+#include <oriutil/objecthash.h>
+#include <oriutil/objecthashmap.h>
+
+class OriPriv;
+class LocalRepo;
+
+struct OriHydrateStats {
+    uint64_t trees;
+    uint64_t objects;
+    uint64_t bytes;
+    uint64_t pending;
+    bool done;
+};
+
+/*
+ * Fetches the objects of an instaclone's HEAD that are not stored locally
+ * in the background.  Trees are walked breadth first except that recently
+ * opened directories go next, and the missing objects are pulled in batches
+ * no faster than the given rate.  The trees left to walk are saved in
+ * .ori/hydrate so the next mount continues from there.
+ */
+class OriHydrator : public Thread
+{
+public:
+    /// rate is in bytes per second, zero for no limit
+    OriHydrator(OriPriv *priv, uint64_t rate);
+    ~OriHydrator();
+    /// Called when a directory is loaded to walk its tree next
+    void touch(const ObjectHash &tree);
+    void run();
+    /// Stops the thread, progress since the last save is walked again
+    void stop();
+    OriHydrateStats getStats();
+private:
+    bool nextTree(ObjectHash *tree);
+    void walkTree(const ObjectHash &tree);
+    void expandLargeBlob(const ObjectHash &hash);
+    void addWanted(const ObjectHash &hash, uint64_t size, bool front = false);
+    void pullBatch();
+    void load();
+    void save();
+
+    OriPriv *priv;
+    LocalRepo *repo;
+    uint64_t rate;
+    std::string statePath;
+    size_t batchSize;
+    uint64_t batches;
+
+    // Only used by the hydration thread
+    ObjectHash root;
+    std::deque<ObjectHash> pending;
+    ObjectHashSet walked;
+    struct Wanted {
+        ObjectHash hash;
+        // Expected size, from the tree entry when it has one
+        uint64_t size;
+    };
+    std::deque<Wanted> want;
+    std::deque<ObjectHash> largeBlobs;
+
+    // Protects recent and stats
+    Mutex lock;
+    std::deque<ObjectHash> recent;
+    OriHydrateStats stats;
+};
+
+#endif /* __ORIHYDRATE_H__ */
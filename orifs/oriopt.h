@@ -17,12 +17,17 @@
 #ifndef __ORIOPT_H__
 #define __ORIOPT_H__
 
+#include <stdint.h>
+
 #include <string>
 
 struct mount_ori_config {
     int shallow;
     int nocache;
+    int hydrate;
+    uint64_t hydrateRate;
     int journal;
+    unsigned int journalMsecs;
     int single;
     int debug;
     std::string repoPath;
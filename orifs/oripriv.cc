@@ -36,16 +36,20 @@
 
 #include <oriutil/debug.h>
 #include <oriutil/orifile.h>
+#include <oriutil/monitor.h>
 #include <oriutil/scan.h>
+#include <oriutil/stream.h>
 #include <oriutil/systemexception.h>
 #include <oriutil/rwlock.h>
 #include <oriutil/objecthash.h>
 #include <ori/commit.h>
+#include <ori/largeblob.h>
 #include <ori/localrepo.h>
 #include <ori/treediff.h>
 
 #include "logging.h"
 #include "oricmd.h"
+#include "orihydrate.h"
 #include "oripriv.h"
 #include "oriopt.h"
 #include "server.h"
@@ -120,11 +124,146 @@ OriFileInfo::storeAttr(AttrMap *attrs) const
     attrs->setAs<time_t>(ATTR_CTIME, statInfo.st_ctime);
 }
 
+// Bytes held by all small files, updated without the namespace write lock
+static volatile uint64_t dataBytes = 0;
+
+void
+OriFileInfo::resizeData(size_t len)
+{
+    if (data == NULL)
+        data = new string();
+
+    if (len > data->size())
+        __sync_fetch_and_add(&dataBytes, len - data->size());
+    else
+        __sync_fetch_and_sub(&dataBytes, data->size() - len);
+    data->resize(len);
+}
+
+void
+OriFileInfo::freeData()
+{
+    if (data == NULL)
+        return;
+
+    __sync_fetch_and_sub(&dataBytes, data->size());
+    delete data;
+    data = NULL;
+}
+
+uint64_t
+OriFileInfo::getDataBytes()
+{
+    return dataBytes;
+}
+
+// The end of the last range, the file is never this large
+#define EXTENT_EOF ((uint64_t)-1)
+
+OriFileExtents::OriFileExtents(LargeBlob *lb)
+    : base(lb)
+{
+    // Anything past the end of the original was written or is a hole
+    dirty[lb->totalSize()] = EXTENT_EOF;
+}
+
+OriFileExtents::~OriFileExtents()
+{
+    delete base;
+}
+
+void
+OriFileExtents::add(uint64_t start, uint64_t end)
+{
+    map<uint64_t, uint64_t>::iterator it = dirty.upper_bound(start);
+
+    // Merge with the ranges that overlap or touch this one
+    if (it != dirty.begin()) {
+        map<uint64_t, uint64_t>::iterator prev = it;
+
+        prev--;
+        if (prev->second >= start) {
+            start = prev->first;
+            it = prev;
+        }
+    }
+    while (it != dirty.end() && it->first <= end) {
+        end = max(end, it->second);
+        dirty.erase(it++);
+    }
+
+    dirty[start] = end;
+}
+
+void
+OriFileExtents::write(uint64_t off, uint64_t len)
+{
+    lock.lock();
+    add(off, off + len);
+    lock.unlock();
+}
+
+void
+OriFileExtents::truncate(uint64_t length)
+{
+    // The temporary file was truncated too so it holds zeros past the end
+    lock.lock();
+    add(length, EXTENT_EOF);
+    lock.unlock();
+}
+
+ssize_t
+OriFileExtents::read(int fd, char *buf, size_t size, off_t offset)
+{
+    map<uint64_t, uint64_t> ranges;
+    map<uint64_t, uint64_t>::iterator it;
+    size_t total = 0;
+
+    // Copy the ranges we need to avoid holding the lock during I/O
+    lock.lock();
+    it = dirty.upper_bound(offset);
+    if (it != dirty.begin())
+        it--;
+    for (; it != dirty.end() && it->first < offset + size; it++)
+        ranges.insert(*it);
+    lock.unlock();
+
+    while (total < size) {
+        ssize_t res = base->readModified((uint8_t *)buf + total,
+                                         size - total,
+                                         offset + total,
+                                         fd,
+                                         ranges);
+        if (res < 0)
+            return res;
+        if (res == 0)
+            break;
+        total += res;
+    }
+
+    return total;
+}
+
+map<uint64_t, uint64_t>
+OriFileExtents::getDirty()
+{
+    map<uint64_t, uint64_t> rval;
+
+    lock.lock();
+    rval = dirty;
+    lock.unlock();
+
+    return rval;
+}
+
 OriPriv::OriPriv(const std::string &repoPath,
                  const string &origin,
                  Repo *remoteRepo)
 {
     repo = new LocalRepo(repoPath);
+    hydrator = NULL;
+    journalMode = OriJournalMode::AsyncJournal;
+    journalMsecs = JOURNAL_SYNC_MSECS;
     nextId = ORIPRIVID_INVALID + 1;
     nextFH = 1;
 
@@ -142,10 +281,10 @@ OriPriv::OriPriv(const std::string &repoPath,
         ASSERT(origin != "");
         repo->addPeer("origin", origin);
         repo->setInstaClone("origin", true);
+        repo->setRemote(remoteRepo);
         if (config.nocache == 1) {
             repo->setRemoteFlags(false);
         }
-        repo->setRemote(remoteRepo);
         ObjectHash head = remoteRepo->getHead();
         if (!head.isEmpty())
             repo->updateHead(head);
@@ -205,6 +344,10 @@ OriPriv::reset()
     if (OriFile_Exists(journalFile) && (OriFile_GetSize(journalFile) == 0))
         OriFile_Delete(journalFile);
 
+    // Small files were only held in memory, rebuild them from the journal
+    if (OriFile_Exists(journalFile))
+        recoverJournal();
+
     // Attempt to delete the temporary directory if it exists
     if (OriFile_Exists(tmpDir) && OriFile_RmDir(tmpDir) != 0) {
         printf("\nAn error has occurred!\n");
@@ -213,7 +356,8 @@ OriPriv::reset()
     "Check the .ori/tmp/fuse directory for any files that may not have been\n"
     "saved to the file systems store.  You can copy or move these files to\n"
     "another location. Then delete the .ori/tmp/fuse directory and all\n"
-    "remaining files.\n\n");
+    "remaining files.  Small files that were not snapshotted are recovered\n"
+    "from the journal into .ori/tmp/fuse/recovered.\n\n");
         printf("Notes: This is a known bug and will be fixed in the future.\n");
         exit(1);
     }
@@ -230,6 +374,14 @@ void
 OriPriv::init()
 {
     UDSServerStart(repo);
+
+    if (journalMode != OriJournalMode::NoJournal)
+        journalLog.open(journalFd, journalMsecs);
+
+    if (config.hydrate && repo->hasRemote() && config.nocache == 0) {
+        hydrator = new OriHydrator(this, config.hydrateRate);
+        hydrator->start();
+    }
 }
 
 int
@@ -245,11 +397,19 @@ OriPriv::cleanup()
 {
     tmpDir = repo->getRootPath() + ORI_PATH_TMP + "fuse";
 
+    journalLog.close();
+
     // XXX: Delete all files on exit, but need support to delete only closed 
     // and committed files.  This would allow us to reclaim temporary space 
     // after a commit.
     DirIterate(tmpDir, this, cleanupHelper);
 
+    if (hydrator) {
+        hydrator->stop();
+        delete hydrator;
+        hydrator = NULL;
+    }
+
     UDSServerStop();
 }
 
@@ -352,6 +512,11 @@ OriPriv::closeFH(uint64_t fh)
         status = close(handles[fh]->fd);
         handles[fh]->fd = -1;
     }
+    if (handles[fh]->openCount == 0 &&
+        handles[fh]->type == FILETYPE_COMMITTED) {
+        // Contents are in the repository since the last snapshot
+        handles[fh]->freeData();
+    }
 
     // Manage reference count
     handles[fh]->release();
@@ -398,14 +563,19 @@ pair<OriFileInfo *, uint64_t>
 OriPriv::addFile(const string &path)
 {
     OriFileInfo *info = createInfo();
-    pair<string, int> file = getTemp();
     uint64_t handle = generateFH();
 
     info->statInfo.st_mode = S_IFREG;
     // XXX: Adjust size properly
     info->statInfo.st_size = 0;
-    info->path = file.first; // XXX: Change to relative
-    info->fd = file.second;
+    if (useData()) {
+        // Held in memory until it grows past ORIFS_SMALLFILE_MAX
+        info->resizeData(0);
+    } else {
+        pair<string, int> file = getTemp();
+        info->path = file.first; // XXX: Change to relative
+        info->fd = file.second;
+    }
 
     // Delete any old temporary files
     map<string, OriFileInfo*>::iterator it = paths.find(path);
@@ -442,7 +612,10 @@ OriPriv::openFile(const string &path, bool writing, bool trunc)
     }
 
     // Open temporary file if necessary
-    if (info->type == FILETYPE_DIRTY && info->path != "") {
+    if (info->data != NULL) {
+        // Contents are held in memory
+        return make_pair(info, handle);
+    } else if (info->type == FILETYPE_DIRTY && info->path != "") {
         if (info->fd != -1) {
             // File is already open just return a new handle
             return make_pair(info, handle);
@@ -459,15 +632,47 @@ OriPriv::openFile(const string &path, bool writing, bool trunc)
         if (!writing) {
             // Read-only
             info->fd = -1;
+        } else if (writing && trunc && useData()) {
+            // Held in memory, the journal only has the writes that follow
+            journal(Journal::Truncate, path, "0");
+
+            delete info->extents;
+            info->extents = NULL;
+            info->statInfo.st_size = 0;
+            info->statInfo.st_blocks = 0;
+            info->type = FILETYPE_DIRTY;
+            info->resizeData(0);
         } else if (writing && trunc) {
             // Generate temporary file
             pair<string, int> temp = getTemp();
 
+            delete info->extents;
+            info->extents = NULL;
             info->statInfo.st_size = 0;
             info->statInfo.st_blocks = 0;
             info->type = FILETYPE_DIRTY;
             info->path = temp.first;
             info->fd = temp.second;
+        } else if (writing &&
+                   repo->getObjectType(info->hash) == ObjectInfo::LargeBlob) {
+            // Only the written ranges are stored in the temporary file
+            pair<string, int> temp = getTemp();
+            LargeBlob *lb = new LargeBlob(repo);
+
+            lb->fromBlob(repo->getPayload(info->hash));
+            if (ftruncate(temp.second, lb->totalSize()) < 0) {
+                int err = errno;
+                delete lb;
+                close(temp.second);
+                ASSERT(false); // XXX: Need to release the handle
+                throw SystemException(err);
+            }
+
+            delete info->extents;
+            info->extents = new OriFileExtents(lb);
+            info->type = FILETYPE_DIRTY;
+            info->path = temp.first;
+            info->fd = temp.second;
         } else if (writing) {
             // Copy file
             int status;
@@ -485,6 +690,8 @@ OriPriv::openFile(const string &path, bool writing, bool trunc)
                 throw SystemException(errno);
             }
 
+            delete info->extents;
+            info->extents = NULL;
             info->type = FILETYPE_DIRTY;
             info->path = temp.first;
             info->fd = status;
@@ -506,21 +713,12 @@ OriPriv::readFile(OriFileInfo *info, char *buf, size_t size, off_t offset)
 
     ObjectType type = repo->getObjectType(info->hash);
     if (type == ObjectInfo::Blob) {
-        string payload = repo->getPayload(info->hash);
-        // XXX: Cache
-
-        size_t left = payload.size() - offset;
-        if (left > payload.size())
-            left = 0;
-        size_t real_read = min(size, left);
-
-        memcpy(buf, payload.data() + offset, real_read);
-
-        return real_read;
+        // Only the blocks covering this range are decompressed
+        return repo->readPayload(info->hash, (uint8_t *)buf, size, offset);
     } else if (type == ObjectInfo::LargeBlob) {
-        LargeBlob lb = LargeBlob(repo);
-        lb.fromBlob(repo->getPayload(info->hash));
+        LargeBlob lb = repo->getLargeBlob(info->hash);
         // XXX: Cache
+        repo->readahead(info->hash, lb, offset, size);
 
         ssize_t total = 0;
         while (total < size) {
@@ -540,6 +738,258 @@ OriPriv::readFile(OriFileInfo *info, char *buf, size_t size, off_t offset)
     return -EIO;
 }
 
+/*
+ * Journal Write events hold the offset followed by the data.
+ */
+static string
+OriPrivWriteRecord(uint64_t offset, const char *buf, size_t size)
+{
+    strwstream ss(sizeof(uint64_t) + size);
+
+    ss.writeUInt64(offset);
+    ss.write(buf, size);
+
+    return ss.str();
+}
+
+/*
+ * Small files are held in memory instead of a temporary file while the
+ * recovery journal is enabled.  Every write is journaled with its data
+ * before it is applied, so a file can be rebuilt from the journal after a
+ * crash, and at the next snapshot the contents go to the current packfile
+ * transaction without touching the disk again.  A file that grows past
+ * ORIFS_SMALLFILE_MAX moves to a temporary file.
+ */
+bool
+OriPriv::useData()
+{
+    return journalMode != OriJournalMode::NoJournal &&
+           OriFileInfo::getDataBytes() < ORIFS_SMALLFILE_MEMORY;
+}
+
+ssize_t
+OriPriv::readData(OriFileInfo *info, char *buf, size_t size, off_t offset)
+{
+    Monitor l(dataLock);
+
+    if (info->data == NULL) {
+        // Moved to a temporary file by another write
+        return pread(info->fd, buf, size, offset);
+    }
+
+    if ((size_t)offset >= info->data->size())
+        return 0;
+
+    size = MIN(size, info->data->size() - offset);
+    memcpy(buf, info->data->data() + offset, size);
+
+    return size;
+}
+
+ssize_t
+OriPriv::writeData(const string &path, OriFileInfo *info, const char *buf,
+                   size_t size, off_t offset)
+{
+    Monitor l(dataLock);
+
+    // Past the size limit, or the memory limit as files grew after creation
+    if (info->data != NULL &&
+        ((uint64_t)offset + size > ORIFS_SMALLFILE_MAX ||
+         OriFileInfo::getDataBytes() > ORIFS_SMALLFILE_MEMORY)) {
+        if (spillData(path, info) < 0)
+            return -1;
+    }
+
+    if (info->data == NULL)
+        return pwrite(info->fd, buf, size, offset);
+
+    journal(Journal::Write, path, OriPrivWriteRecord(offset, buf, size));
+
+    if (info->data->size() < offset + size)
+        info->resizeData(offset + size);
+    memcpy(&(*info->data)[offset], buf, size);
+
+    return size;
+}
+
+/*
+ * Called with the namespace write lock held.
+ */
+int
+OriPriv::truncateData(const string &path, OriFileInfo *info, off_t length)
+{
+    if (info->data != NULL && (uint64_t)length > ORIFS_SMALLFILE_MAX) {
+        if (spillData(path, info) < 0)
+            return -1;
+    }
+
+    if (info->data == NULL)
+        return ::truncate(info->path.c_str(), length);
+
+    char len[32];
+    snprintf(len, sizeof(len), "%llu", (unsigned long long)length);
+    journal(Journal::Truncate, path, len);
+    info->resizeData(length);
+
+    return 0;
+}
+
+/*
+ * Makes the writes to small files durable, they are only in the journal.
+ */
+void
+OriPriv::syncData()
+{
+    journalLog.sync();
+}
+
+/*
+ * Moves a small file to a temporary file.  Called with dataLock or the
+ * namespace write lock held.
+ */
+int
+OriPriv::spillData(const string &path, OriFileInfo *info)
+{
+    pair<string, int> temp = getTemp();
+    const string &data = *info->data;
+
+    if (!data.empty() &&
+        pwrite(temp.second, data.data(), data.size(), 0) !=
+            (ssize_t)data.size()) {
+        int err = errno;
+
+        close(temp.second);
+        OriFile_Delete(temp.first);
+        errno = err;
+        return -1;
+    }
+
+    info->path = temp.first;
+    info->fd = temp.second;
+    info->freeData();
+
+    if (info->openCount == 0) {
+        close(info->fd);
+        info->fd = -1;
+    }
+
+    // Replay takes the contents from the temporary file from here on
+    journal(Journal::Create, path, info->path);
+
+    return 0;
+}
+
+struct OriRecovery {
+    std::map<string, string> files;
+    size_t events;
+};
+
+static void
+OriPrivRecoverEvent(Journal::Event ev, const string &arg1, const string &arg2,
+                    void *arg)
+{
+    OriRecovery *r = (OriRecovery *)arg;
+    std::map<string, string> &files = r->files;
+    std::map<string, string>::iterator it;
+
+    r->events++;
+
+    switch (ev) {
+        case Journal::Create:
+            // Files created with a temporary file are in the tmp directory
+            if (arg2 == "")
+                files[arg1] = "";
+            else
+                files.erase(arg1);
+            break;
+        case Journal::Write: {
+            if (arg2.size() < sizeof(uint64_t))
+                break;
+
+            strstream ss(arg2);
+            uint64_t off = ss.readUInt64();
+            size_t len = arg2.size() - sizeof(uint64_t);
+            string &data = files[arg1];
+
+            if (data.size() < off + len)
+                data.resize(off + len);
+            data.replace(off, len, arg2, sizeof(uint64_t), len);
+            break;
+        }
+        case Journal::Truncate:
+            files[arg1].resize(strtoull(arg2.c_str(), NULL, 10));
+            break;
+        case Journal::Unlink:
+            files.erase(arg1);
+            break;
+        case Journal::Rename: {
+            std::map<string, string> moved;
+
+            // The file itself, or everything under a directory
+            files.erase(arg2);
+            for (it = files.begin(); it != files.end();) {
+                if (it->first == arg1 ||
+                    it->first.compare(0, arg1.size() + 1, arg1 + "/") == 0) {
+                    moved[arg2 + it->first.substr(arg1.size())] = it->second;
+                    files.erase(it++);
+                } else {
+                    it++;
+                }
+            }
+            files.insert(moved.begin(), moved.end());
+            break;
+        }
+        case Journal::Snapshot:
+            // Everything before is in the repository
+            files.clear();
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * Writes the small files that were held in memory when orifs last exited
+ * uncleanly to the recovered directory in the tmp directory.
+ */
+void
+OriPriv::recoverJournal()
+{
+    string recoverDir = tmpDir + "/recovered";
+    OriRecovery r;
+
+    if (OriFile_Exists(recoverDir))
+        return;
+
+    r.events = 0;
+    if (Journal::replay(journalFile, OriPrivRecoverEvent, &r) < 0) {
+        WARNING("Couldn't replay the journal %s", journalFile.c_str());
+        return;
+    }
+    if (r.files.empty())
+        return;
+
+    LOG("Recovering %lu files from %lu journal events",
+        r.files.size(), r.events);
+
+    ::mkdir(recoverDir.c_str(), 0700);
+    for (std::map<string, string>::iterator it = r.files.begin();
+         it != r.files.end();
+         it++) {
+        string filePath = recoverDir + it->first;
+
+        // Create the parent directories
+        for (size_t pos = recoverDir.size() + 1;
+             (pos = filePath.find('/', pos)) != string::npos;
+             pos++) {
+            ::mkdir(filePath.substr(0, pos).c_str(), 0700);
+        }
+
+        if (!OriFile_WriteFile(it->second, filePath))
+            WARNING("Couldn't recover %s", filePath.c_str());
+    }
+}
+
 void
 OriPriv::unlink(const string &path)
 {
@@ -728,6 +1178,11 @@ loadDir:
         OriFileInfo *dirInfo;
         OriDir *dir = new OriDir();
 
+        // Fetches subdirectories and symlinks in one go on an instaclone
+        repo->prefetchTree(t);
+        if (hydrator)
+            hydrator->touch(hash);
+
         dirInfo = getFileInfo(path);
 
         for (it = t.begin(); it != t.end(); it++) {
@@ -853,9 +1308,21 @@ OriPriv::commitTreeHelper(const string &path)
 
                 e = TreeEntry(hash, ObjectHash());
             } else {
-                if (info->path != "") {
+                if (info->data != NULL) {
+                    // Straight to the packfile transaction from memory
+                    info->hash = repo->addFileContents(*info->data, objPath);
+                    info->largeHash = ObjectHash();
+                    if (info->openCount == 0)
+                        info->freeData();
+                } else if (info->path != "") {
                     pair<ObjectHash, ObjectHash> hashes;
-                    hashes = repo->addFile(info->path);
+                    if (info->extents != NULL)
+                        hashes = repo->addModifiedFile(info->path,
+                                                       *info->extents->base,
+                                                       info->extents->getDirty(),
+                                                       objPath);
+                    else
+                        hashes = repo->addFile(info->path, objPath);
 
                     // Copy hashes back to info stgructure
                     info->hash = hashes.first;
@@ -951,7 +1418,22 @@ OriPriv::commit(const Commit &cTemplate, bool temporary)
 
     repo->sync();
 
-    journal("snapshot", commitHash.hex());
+    // Everything journaled before is covered by the snapshot
+    journal(Journal::Snapshot, commitHash.hex());
+
+    // Small files still open stay in memory, their writes start over
+    if (OriFileInfo::getDataBytes() != 0) {
+        for (map<string, OriFileInfo *>::iterator it = paths.begin();
+             it != paths.end();
+             it++) {
+            const string *data = it->second->data;
+
+            if (data != NULL && !data->empty())
+                journal(Journal::Write, it->first,
+                        OriPrivWriteRecord(0, data->data(), data->size()));
+        }
+    }
+    journalLog.sync();
 
     return commitHash;
 }
@@ -1243,10 +1725,9 @@ OriPriv::merge(ObjectHash hash)
         tc = repo->getTree(cc.getTree());
     }
 
-    // Load flattened trees
+    // Load flattened trees, the other branch is diffed structurally
     TreeDiff td1, td2;
     Tree::Flat t1Flat = t1.flattened(repo);
-    Tree::Flat t2Flat = t2.flattened(repo);
     Tree::Flat tcFlat = tc.flattened(repo);
 
     // Apply current changes to t1Flat
@@ -1312,7 +1793,7 @@ OriPriv::merge(ObjectHash hash)
     td1.diffTwoTrees(t1Flat, tcFlat);
     LOG("Diff from %s to %s", lca.hex().c_str(), p1.hex().c_str());
     td1.dump();
-    td2.diffTwoTrees(t2Flat, tcFlat);
+    td2.diffTwoTrees(t2, tc, repo);
     LOG("Diff from %s to %s", lca.hex().c_str(), p2.hex().c_str());
     td2.dump();
 
@@ -1391,7 +1872,10 @@ OriPriv::merge(ObjectHash hash)
                             info->path.c_str(), Util_SystemError(status).c_str());
                 }
                 info->path = "";
+                delete info->extents;
+                info->extents = NULL;
             }
+            info->freeData();
 
             info->hash = e.hashes.first;
             info->largeHash = e.hashes.second;
@@ -1513,29 +1997,21 @@ OriPriv::merge(ObjectHash hash)
 }
 
 void
-OriPriv::setJournalMode(OriJournalMode::JournalMode mode)
+OriPriv::setJournalMode(OriJournalMode::JournalMode mode,
+                        unsigned int syncMsecs)
 {
     journalMode = mode;
+    journalMsecs = syncMsecs;
 }
 
 void
-OriPriv::journal(const string &event, const string &arg)
+OriPriv::journal(Journal::Event ev, const string &arg1, const string &arg2)
 {
-    int len;
-    string buf;
-
     if (journalMode == OriJournalMode::NoJournal)
         return;
 
-    buf = event + ":" + arg + "\n";
-    len = write(journalFd, buf.c_str(), buf.size());
-    if (len < 0 || len != (int)buf.size())
-        throw SystemException();
-
-    if (journalMode == OriJournalMode::SyncJournal)
-        fsync(journalFd);
-
-    return;
+    journalLog.append(ev, arg1, arg2,
+                      journalMode == OriJournalMode::SyncJournal);
 }
 
 /*
@@ -18,6 +18,8 @@
 #define __ORIPRIV_H__
 
 #include <oriutil/orifile.h>
+#include <oriutil/mutex.h>
+#include <ori/journal.h>
 
 typedef enum OriFileType
 {
@@ -29,6 +31,41 @@ typedef enum OriFileType
 #define ORIPRIVID_INVALID 0
 typedef uint64_t OriPrivId;
 
+// Files created no larger than this are held in memory until a snapshot
+#define ORIFS_SMALLFILE_MAX     (64*1024)
+// Bytes of small files held in memory before new files use temporary files
+#define ORIFS_SMALLFILE_MEMORY  (64*1024*1024)
+
+class LargeBlob;
+class OriHydrator;
+
+/*
+ * Tracks the ranges of a large file written since it was opened from a
+ * committed LargeBlob.  The temporary file has the same size as the file
+ * but only holds the written ranges, everything else is read from the
+ * chunks of the original.  This avoids copying the whole file on open and
+ * lets the next snapshot chunk again only the parts around the writes.
+ */
+class OriFileExtents
+{
+public:
+    OriFileExtents(LargeBlob *lb);
+    ~OriFileExtents();
+    void write(uint64_t off, uint64_t len);
+    void truncate(uint64_t length);
+    ssize_t read(int fd, char *buf, size_t size, off_t offset);
+    /// Returns the written ranges (start to end offset)
+    std::map<uint64_t, uint64_t> getDirty();
+
+    LargeBlob *base;
+private:
+    void add(uint64_t start, uint64_t end);
+    Mutex lock;
+    // Written ranges, the end of the original file is included as a range
+    // that extends to UINT64_MAX
+    std::map<uint64_t, uint64_t> dirty;
+};
+
 class OriFileInfo
 {
 public:
@@ -41,11 +78,16 @@ public:
         refCount = 1;
         openCount = 0;
         dirLoaded = false;
+        extents = NULL;
+        data = NULL;
     }
     ~OriFileInfo() {
         ASSERT(refCount == 0);
         ASSERT(openCount == 0);
 
+        delete extents;
+        freeData();
+
         // Delete temporary file
         if (path != "")
             OriFile_Delete(path);
@@ -81,6 +123,11 @@ public:
     bool isReg() const { return (statInfo.st_mode & S_IFREG) == S_IFREG; }
     void loadAttr(const AttrMap &attr);
     void storeAttr(AttrMap *attr) const;
+    /// Resizes the contents held in memory, allocating them if needed
+    void resizeData(size_t len);
+    void freeData();
+    /// Bytes held in memory by all files
+    static uint64_t getDataBytes();
     struct stat statInfo;
     ObjectHash hash;
     ObjectHash largeHash;
@@ -88,6 +135,8 @@ public:
     OriPrivId id;
     std::string path; // temporary file
     std::string link; // link target
+    OriFileExtents *extents; // set if path only holds the written ranges
+    std::string *data; // contents of a small file held in memory
     int fd;
     int refCount;
     int openCount;
@@ -168,6 +217,13 @@ public:
     std::pair<OriFileInfo*, uint64_t> openFile(const std::string &path,
                                                bool writing, bool trunc);
     size_t readFile(OriFileInfo *info, char *buf, size_t size, off_t offset);
+    // Small files held in memory, these return -1 and set errno on failure
+    ssize_t readData(OriFileInfo *info, char *buf, size_t size, off_t offset);
+    ssize_t writeData(const std::string &path, OriFileInfo *info,
+                      const char *buf, size_t size, off_t offset);
+    int truncateData(const std::string &path, OriFileInfo *info,
+                     off_t length);
+    void syncData();
     void unlink(const std::string &path);
     void rename(const std::string &fromPath, const std::string &toPath);
     OriFileInfo* addDir(const std::string &path);
@@ -179,6 +235,9 @@ public:
     Tree getTree(const Commit &c, const std::string &path);
     ObjectHash getTip();
 private:
+    bool useData();
+    int spillData(const std::string &path, OriFileInfo *info);
+    void recoverJournal();
     ObjectHash commitTreeHelper(const std::string &path);
     void getDiffHelper(const std::string &path,
                     std::map<std::string, OriFileState::StateType> *diff);
@@ -190,14 +249,17 @@ public:
     std::map<std::string, OriFileState::StateType> getDiff();
     std::string checkout(ObjectHash hash, bool force);
     std::string merge(ObjectHash hash);
-    void setJournalMode(OriJournalMode::JournalMode mode);
-    void journal(const std::string &event, const std::string &arg);
+    void setJournalMode(OriJournalMode::JournalMode mode,
+                        unsigned int syncMsecs = JOURNAL_SYNC_MSECS);
+    void journal(Journal::Event ev, const std::string &arg1,
+                 const std::string &arg2 = "");
     // Debugging
     void fsck();
 
     // Locks
     RWLock ioLock; // File I/O lock to allow atomic commits
     RWLock nsLock; // Namespace lock
+    Mutex dataLock; // Small files written under a namespace read lock
 
     LocalRepo *getRepo();
 private:
@@ -209,8 +271,10 @@ private:
 
     // Journal
     OriJournalMode::JournalMode journalMode;
+    unsigned int journalMsecs;
     std::string journalFile;
     int journalFd;
+    Journal journalLog;
 
     // Repository State
     LocalRepo *repo;
@@ -218,6 +282,9 @@ private:
     Commit headCommit;
     std::string tmpDir;
 
+    // Background fetch of an instaclone, NULL if not enabled
+    OriHydrator *hydrator;
+
     friend class OriCommand;
 };
 
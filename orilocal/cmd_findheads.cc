@@ -17,9 +17,12 @@
 #include <stdint.h>
 
 #include <string>
+#include <vector>
+#include <set>
 #include <iostream>
 
 #include <ori/localrepo.h>
+#include <ori/historywalk.h>
 
 using namespace std;
 
@@ -31,26 +34,41 @@ extern LocalRepo repository;
 int
 cmd_findheads(int argc, char * const argv[])
 {
-    RefcountMap refs = repository.recomputeRefCounts();
+    set<ObjectInfo> objs = repository.listObjects();
+    vector<ObjectHash> commitIds;
 
-    for (RefcountMap::iterator it = refs.begin();
-            it != refs.end();
-            it++) {
-        if ((*it).first == EMPTY_COMMIT)
+    for (set<ObjectInfo>::iterator it = objs.begin(); it != objs.end(); it++) {
+        if ((*it).type == ObjectInfo::Commit)
+            commitIds.push_back((*it).hash);
+    }
+
+    // Every commit is a starting point, so parents need not be followed
+    HistoryWalk walk(&repository);
+    vector<pair<ObjectHash, Commit> > commits;
+    set<ObjectHash> referenced;
+    ObjectHash hash;
+    Commit c;
+
+    walk.push(commitIds);
+    while (walk.next(&hash, &c)) {
+        referenced.insert(c.getParents().first);
+        referenced.insert(c.getParents().second);
+        commits.push_back(make_pair(hash, c));
+        walk.prune();
+    }
+
+    for (size_t i = 0; i < commits.size(); i++) {
+        if (referenced.count(commits[i].first) != 0)
             continue;
 
-        if ((*it).second == 0
-            && repository.getObjectType((*it).first)) {
-            Commit c = repository.getCommit((*it).first);
+        const Commit &head = commits[i].second;
 
-            // XXX: Check for existing branch names
+        // XXX: Check for existing branch names
 
-            cout << "commit:  " << (*it).first.hex() << endl;
-            cout << "parents: " << c.getParents().first.hex() << endl;
-            cout << c.getMessage() << endl;
-        }
+        cout << "commit:  " << commits[i].first.hex() << endl;
+        cout << "parents: " << head.getParents().first.hex() << endl;
+        cout << head.getMessage() << endl;
     }
 
     return 0;
 }
-
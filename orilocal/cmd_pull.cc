@@ -75,8 +75,7 @@ cmd_pull(int argc, char * const argv[])
 
     // TODO: more efficient backref tracking
     printf("Rebuilding references\n");
-    RefcountMap refs = repository.recomputeRefCounts();
-    if (!repository.rewriteRefCounts(refs))
+    if (!repository.rebuildRefCounts())
         return 1;
 
     return 0;
@@ -97,8 +97,7 @@ cmd_snapshot(int argc, char * const argv[])
         cout << "Note: nothing to commit" << endl;
     }
 
-    Tree new_tree = diff.applyTo(tip_tree.flattened(&repository),
-            &repository);
+    Tree new_tree = diff.applyTo(tip_tree, &repository);
 
     Commit newCommit;
 
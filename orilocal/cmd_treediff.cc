@@ -42,7 +42,7 @@ cmd_treediff(int argc, char * const argv[])
     Tree t1 = repository.getTree(c1.getTree());
     Tree t2 = repository.getTree(c2.getTree());
 
-    td.diffTwoTrees(t1.flattened(&repository), t2.flattened(&repository));
+    td.diffTwoTrees(t1, t2, &repository);
 
     for (size_t i = 0; i < td.entries.size(); i++) {
         printf("%c   %s\n",
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __DURABILITY_H__
+#define __DURABILITY_H__
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include <string>
+
+#include <oriutil/mutex.h>
+
+enum DurabilityMode {
+    /// Every packfile and metadata transaction is synced before it returns
+    DURABILITY_STRICT,
+    /// Writes are synced together when a group ends
+    DURABILITY_BATCHED,
+    /// Writes are flushed when a group ends but never synced
+    DURABILITY_RELAXED,
+};
+
+enum DurabilityFile {
+    DURABILITY_PACKFILE,
+    DURABILITY_INDEX,
+    DURABILITY_METADATA,
+    DURABILITY_FILES,
+};
+
+// Sync latencies are counted in power of two buckets of microseconds
+#define DURABILITY_HIST_BUCKETS 20
+
+struct DurabilityStats {
+    /// Groups ended and the write calls and bytes of all files
+    uint64_t groups;
+    uint64_t writes;
+    uint64_t bytes;
+    /// Syncs of each kind of file, their total time and latencies, where
+    /// bucket i counts syncs that took from 2^i to 2^(i+1) - 1 usecs
+    uint64_t syncs[DURABILITY_FILES];
+    uint64_t syncUsec[DURABILITY_FILES];
+    uint64_t hist[DURABILITY_FILES][DURABILITY_HIST_BUCKETS];
+};
+
+/*
+ * Group commit for the repository's append only files, with the mode read
+ * from .ori/durability.  Packfile data, index entries and metadata records
+ * are buffered and written with as few calls as possible, and a group ends
+ * when the open packfile is full or the repository is synced.  At the end
+ * of a group the files are synced in order, packfiles first, then the
+ * index and the metadata log, so the index never refers to data that could
+ * be lost in a crash.
+ */
+class Durability
+{
+public:
+    Durability();
+    ~Durability();
+    /// Shared by files that were not given one
+    static Durability *getDefault();
+    static const char *modeName(DurabilityMode mode);
+    static bool parseMode(const std::string &name, DurabilityMode *mode);
+
+    void setMode(DurabilityMode mode);
+    DurabilityMode getMode() const;
+    bool isStrict() const { return mode == DURABILITY_STRICT; }
+
+    /// Writes all of iov, returns false and sets errno on failure
+    bool write(int fd, const struct iovec *iov, int iovcnt);
+    bool write(int fd, const void *buf, size_t len);
+    /// Syncs the file unless the mode is relaxed
+    void barrier(int fd, DurabilityFile file);
+    void endGroup();
+
+    DurabilityStats getStats();
+private:
+    DurabilityMode mode;
+    // Protects stats
+    Mutex lock;
+    DurabilityStats stats;
+};
+
+#endif /* __DURABILITY_H__ */
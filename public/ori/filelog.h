@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __FILELOG_H__
+#define __FILELOG_H__
+
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+
+#include <oriutil/objecthash.h>
+#include <oriutil/stream.h>
+#include "commit.h"
+
+#define FILELOG_EXT "FILELOG"
+
+class Repo;
+class LocalRepo;
+
+/*
+ * Computes the history of a path: every commit reachable from a head, merge
+ * parents included, in which the object at the path differs from all of its
+ * parents.  Path lookups are memoized by (tree hash, remaining path) so a
+ * directory that did not change between commits is only read once.
+ *
+ * Results are written as a sequence of records, newest first, each one
+ * (UInt8 1, commit hash, object hash, LPStr commit blob), terminated by a
+ * UInt8 0.  An empty object hash means the path was deleted.
+ */
+class FileLog
+{
+public:
+    FileLog(Repo *r);
+    ~FileLog();
+    void run(const ObjectHash &head, const std::string &path,
+             bytewstream *out);
+    /// Returns false at the end of the results
+    static bool readEntry(bytestream *in, ObjectHash *commitId,
+                          ObjectHash *objId, Commit *c);
+    size_t getTreesLoaded() const { return treesLoaded; }
+private:
+    struct Pending {
+        ObjectHash hash;
+        Commit commit;
+    };
+    ObjectHash resolve(const ObjectHash &tree, size_t ix);
+    bool isResolved(const ObjectHash &commitId) const;
+    void flush(bytewstream *out);
+
+    Repo *repo;
+    std::vector<std::string> components;
+    // (tree, index of the first remaining path component) -> object
+    std::map<std::pair<ObjectHash, size_t>, ObjectHash> memo;
+    std::map<ObjectHash, ObjectHash> commitObjs;
+    std::deque<Pending> pending;
+    size_t treesLoaded;
+};
+
+/// UDSServer stream extension, takes (head hash, PStr path)
+void FileLog_UDSExt(LocalRepo *repo, const std::string &data,
+                    bytewstream *out);
+
+#endif /* __FILELOG_H__ */
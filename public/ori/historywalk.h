@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __HISTORYWALK_H__
+#define __HISTORYWALK_H__
+
+#include <time.h>
+
+#include <vector>
+#include <queue>
+
+#include <oriutil/objecthash.h>
+#include <oriutil/objecthashmap.h>
+#include "commit.h"
+
+class Repo;
+
+/*
+ * Visits every commit reachable from the starting points exactly once,
+ * newest first.  Commits carry no generation number, so the commit time is
+ * used as the ordering key.  Parents are queued when next() is called
+ * again, which lets the caller prune a branch or stop at any point, and are
+ * loaded together through Repo::getCommits.
+ *
+ *     HistoryWalk walk(repo);
+ *     walk.push(repo->getHead());
+ *     while (walk.next(&hash, &c)) { ... }
+ */
+class HistoryWalk
+{
+public:
+    HistoryWalk(Repo *r);
+    ~HistoryWalk();
+    void push(const ObjectHash &commitId);
+    void push(const std::vector<ObjectHash> &commitIds);
+    /// Returns false once all reachable commits were visited
+    bool next(ObjectHash *commitId, Commit *c);
+    /// Don't follow the parents of the commit last returned by next
+    void prune();
+    size_t getVisited() const { return visited; }
+private:
+    struct Entry {
+        time_t time;
+        ObjectHash hash;
+        Commit commit;
+        bool operator<(const Entry &e) const {
+            if (time != e.time)
+                return time < e.time;
+            return hash < e.hash;
+        }
+    };
+    void load();
+
+    Repo *repo;
+    std::priority_queue<Entry> queue;
+    ObjectHashSet seen;
+    std::vector<ObjectHash> pending;
+    Commit last;
+    bool hasLast;
+    size_t visited;
+};
+
+#endif /* __HISTORYWALK_H__ */
@@ -19,8 +19,8 @@
 
 #include <string>
 #include <vector>
-#include <boost/tr1/unordered_set.hpp>
 
+#include <oriutil/objecthashmap.h>
 #include "repo.h"
 
 class HttpObject;
@@ -47,6 +47,9 @@ public:
             const std::string &payload);
     std::vector<Commit> listCommits();
 
+    std::set<std::string> listExt();
+    std::string callExt(const std::string &ext, const std::string &data);
+
 private:
     HttpClient *client;
     
@@ -56,7 +59,7 @@ private:
 
     std::map<ObjectHash, std::string> payloads;
 
-    std::tr1::unordered_set<ObjectHash> *containedObjs;
+    ObjectHashSet *containedObjs;
 };
 
 class HttpObject : public Object
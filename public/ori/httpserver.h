@@ -44,6 +44,7 @@ private:
     void contains(struct evhttp_request *req);
     void getObjs(struct evhttp_request *req);
     void getObjInfo(struct evhttp_request *req);
+    void fileLog(struct evhttp_request *req);
     LocalRepo &repo;
     uint16_t port;
     struct evhttp *httpd;
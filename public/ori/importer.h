@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __IMPORTER_H__
+#define __IMPORTER_H__
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+
+#include <oriutil/mutex.h>
+#include <oriutil/objecthash.h>
+#include <oriutil/objecthashmap.h>
+#include "tree.h"
+
+class LocalRepo;
+
+enum ImportStage {
+    IMPORT_SCAN,
+    IMPORT_CHUNK,
+    IMPORT_HASH,
+    IMPORT_COMPRESS,
+    IMPORT_PACK,
+    IMPORT_STAGES
+};
+
+struct ImportStageStats {
+    /// Worker threads running the stage
+    uint64_t threads;
+    /// Items and payload bytes that went through the stage
+    uint64_t items;
+    uint64_t bytes;
+    /// Time summed over the workers spent working, waiting for input and
+    /// waiting for room in the next queue
+    uint64_t busyUsec;
+    uint64_t inputUsec;
+    uint64_t outputUsec;
+};
+
+struct ImportStats {
+    ImportStageStats stages[IMPORT_STAGES];
+    /// Files (including symlinks), directories and file bytes read
+    uint64_t files;
+    uint64_t dirs;
+    uint64_t bytes;
+    /// Objects written and their size as stored
+    uint64_t objects;
+    uint64_t storedBytes;
+    /// Wall clock time of the import
+    uint64_t usec;
+};
+
+struct ImportFile;
+struct ImportPiece;
+struct ImportCounters;
+template <class T> class ImportQueue;
+
+/*
+ * Adds the contents of a directory to a repository through a pipeline.  The
+ * scan stage walks the directory, the chunk stage reads the files and splits
+ * the large ones into parts, the hash stage names the parts, the compress
+ * stage compresses the parts that are not stored yet and the pack stage
+ * appends them to the packfiles and builds the trees.  Stages are connected
+ * by queues bounded in items and bytes, and all but scan and pack run on
+ * pools of worker threads.
+ *
+ * Objects reach the packfiles in whatever order the workers finish, but the
+ * trees only depend on the directory contents and are written once all files
+ * are in, so the root tree hash is the same for any number of threads.
+ */
+class Importer
+{
+public:
+    Importer(LocalRepo *repo);
+    ~Importer();
+    /// Workers in each of the chunk, hash and compress pools
+    void setThreads(int n) { threads = n; }
+    /**
+     * Imports the directory and returns the hash of its tree.  Throws
+     * std::runtime_error if the directory cannot be read.
+     */
+    ObjectHash run(const std::string &dir);
+    ImportStats getStats();
+    static const char *stageName(ImportStage stage);
+
+    // Called by the workers
+    void runStage(ImportStage stage);
+private:
+    void scanDir(const std::string &relPath, ImportCounters *c);
+    void chunkFile(ImportFile *f, ImportCounters *c);
+    void hashPiece(ImportPiece *p, ImportCounters *c);
+    void compressPiece(ImportPiece *p, ImportCounters *c);
+    void packPiece(ImportPiece *p, ImportCounters *c);
+    void finishFile(ImportFile *f);
+    void fail(const std::string &msg);
+
+    LocalRepo *repo;
+    int threads;
+    std::string root;
+    // Entries of the files packed so far, only used by the pack stage
+    std::map<std::string, TreeEntry> entries;
+
+    ImportQueue<ImportFile> *scanQ;
+    ImportQueue<ImportPiece> *chunkQ;
+    ImportQueue<ImportPiece> *hashQ;
+    ImportQueue<ImportPiece> *compressQ;
+
+    // Held around calls into the repository
+    Mutex repoLock;
+    // Objects a compress worker took on, so each is only stored once
+    ObjectHashSet claimed;
+    // Protects stats, error and the workers left in each stage
+    Mutex lock;
+    ImportStats stats;
+    int running[IMPORT_STAGES];
+    std::string error;
+};
+
+#endif /* __IMPORTER_H__ */
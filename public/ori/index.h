@@ -21,32 +21,47 @@
 
 #include <string>
 #include <set>
-#include <boost/tr1/unordered_map.hpp>
 
+#include <oriutil/objecthashmap.h>
 #include "object.h"
 #include "packfile.h"
+#include "durability.h"
 
+/*
+ * New entries are kept in memory and appended together by sync(), so they
+ * reach the file only after the packfile data they point to.
+ */
 class Index
 {
 public:
     Index();
     ~Index();
+    void setDurability(Durability *durability);
     void open(const std::string &indexFile);
     void close();
+    /// Writes the new entries and syncs them as the durability mode asks
     void sync();
     void rewrite();
     void dump();
-    void updateEntry(const ObjectHash &objId, const IndexEntry &entry);
-    const IndexEntry &getEntry(const ObjectHash &objId) const;
-    const ObjectInfo &getInfo(const ObjectHash &objId) const;
+    /// Moving an object to another packfile replaces its entry silently
+    void updateEntry(const ObjectHash &objId, const IndexEntry &entry,
+                     bool move = false);
+    /// By value, since an insert may move the entries
+    IndexEntry getEntry(const ObjectHash &objId) const;
+    ObjectInfo getInfo(const ObjectHash &objId) const;
     bool hasObject(const ObjectHash &objId) const;
     std::set<ObjectInfo> getList();
 private:
     int fd;
     std::string fileName;
-    std::tr1::unordered_map<ObjectHash, IndexEntry> index;
+    ObjectHashMap<IndexEntry> index;
+    Durability *durability;
+    // Entries not yet written and whether the file needs a sync
+    std::string pending;
+    bool dirty;
 
     void _writeEntry(const IndexEntry &e);
+    void _flush();
 };
 
 #endif /* __INDEX_H__ */
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <stdint.h>
+
+#include <string>
+
+#include <oriutil/thread.h>
+
+// Size of the in-memory ring, a power of two
+#define JOURNAL_RING_SIZE       (1024*1024)
+// Bytes queued before the writer is woken ahead of its interval
+#define JOURNAL_BATCH_BYTES     (64*1024)
+// Default time between group syncs
+#define JOURNAL_SYNC_MSECS      100
+
+struct JournalStats {
+    /// Events appended and the bytes they took in the file
+    uint64_t events;
+    uint64_t bytes;
+    /// Write calls, syncs and their total time
+    uint64_t writes;
+    uint64_t syncs;
+    uint64_t syncUsec;
+    /// Appends that waited for room in the ring
+    uint64_t stalls;
+};
+
+/*
+ * Recovery journal of the namespace operations on an orifs mount, kept in
+ * .ori/tmp/fuse/journal until it is cleanly unmounted.
+ *
+ * Events are appended to a ring in memory without taking a lock, each
+ * thread reserving its space with an atomic compare and swap, and a writer
+ * thread moves them to the file in the order their space was reserved.
+ * The writer syncs the file every few milliseconds, or sooner once
+ * JOURNAL_BATCH_BYTES are queued or an append is waiting for its event to
+ * be durable.  All waiting appends share one sync.
+ *
+ * The file holds a header followed by records of a type byte and two
+ * length prefixed strings.  A torn record at the end is ignored on replay.
+ * Write events carry the data written, so files that orifs holds in memory
+ * instead of a temporary file can be recovered from the journal alone.
+ */
+class Journal : public Thread
+{
+public:
+    enum Event {
+        Pad = 0,
+        Create,
+        Unlink,
+        Rename,
+        Mkdir,
+        Rmdir,
+        Snapshot,
+        // Writes to a small file held in memory, see OriPriv::writeData
+        Write,
+        Truncate,
+    };
+    typedef void (*ReplayCb)(Event ev, const std::string &arg1,
+                             const std::string &arg2, void *arg);
+
+    Journal();
+    ~Journal();
+    /// Takes over fd, the writer thread starts appending at its end
+    void open(int fd, unsigned int syncMsecs = JOURNAL_SYNC_MSECS);
+    /// Writes out every event and stops the writer thread
+    void close();
+    void run();
+
+    /// Queues an event, returns once it is durable if sync is true
+    void append(Event ev, const std::string &arg1,
+                const std::string &arg2 = "", bool sync = false);
+    /// Returns once every event appended so far is durable
+    void sync();
+    JournalStats getStats();
+
+    static const char *eventName(Event ev);
+    /// Calls cb for each event in the file, returns the number of events
+    /// or -1 if the file is not a journal
+    static int64_t replay(const std::string &path, ReplayCb cb, void *arg);
+private:
+    struct RingHeader;
+    uint64_t reserve(size_t len, uint64_t *end);
+    void kick();
+    void waitDurable(uint64_t pos);
+    bool drain(std::string *out);
+
+    int fd;
+    unsigned int syncMsecs;
+    int wakeFds[2];
+    uint8_t *ring;
+
+    // Bytes of the ring reserved, published to the writer, and freed
+    volatile uint64_t head;
+    volatile uint64_t tail;
+    // Ring position up to which events are durable
+    volatile uint64_t durable;
+    // Set while a wakeup is pending
+    volatile uint32_t kicked;
+    volatile uint32_t stopping;
+
+    // Counted atomically by appends, the rest only by the writer
+    JournalStats stats;
+};
+
+#endif /* __JOURNAL_H__ */
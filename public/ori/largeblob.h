@@ -42,12 +42,31 @@ public:
     LargeBlob(Repo *r);
     ~LargeBlob();
     void chunkFile(const std::string &path);
+    typedef void (*ChunkCB)(const uint8_t *buf, uint32_t len, void *arg);
+    /*
+     * Splits a file into the same parts as chunkFile without storing them,
+     * cb is called with each part in order.  Returns 0 or -errno.
+     */
+    static int splitFile(const std::string &path, ChunkCB cb, void *arg);
+    /*
+     * Chunks a modified copy of base that is size bytes long.  The ranges in
+     * dirty (start to end offset) are read from fd at the same offsets and
+     * everything else from base.  Only the parts around the dirty ranges are
+     * chunked again, the others are reused as is.
+     */
+    void chunkModified(const LargeBlob &base, int fd,
+                       const std::map<uint64_t, uint64_t> &dirty,
+                       uint64_t size);
     void extractFile(const std::string &path);
     /// May read less than s bytes
     ssize_t read(uint8_t *buf, size_t s, off_t off) const;
+    /// Same as read but for a copy modified as described in chunkModified
+    ssize_t readModified(uint8_t *buf, size_t s, off_t off, int fd,
+                         const std::map<uint64_t, uint64_t> &dirty) const;
     // XXX: Stream read/write operations
     const std::string getBlob();
     void fromBlob(const std::string &blob);
+    void fromBlob(const uint8_t *blob, size_t len);
     size_t totalSize() const;
     /*
      * A map of the file parts contains the file offset as the key and the large 
@@ -32,8 +32,12 @@
 #include "largeblob.h"
 #include "remoterepo.h"
 #include "packfile.h"
+#include "prefetcher.h"
 #include "mergestate.h"
 #include "varlink.h"
+#include "zippolicy.h"
+#include "zipadvisor.h"
+#include "durability.h"
 
 #define ORI_PATH_DIR "/.ori"
 #define ORI_PATH_VERSION "/version"
@@ -55,6 +59,11 @@
 #define ORI_PATH_LOCK "/lock"
 #define ORI_PATH_UDSSOCK "/uds"
 #define ORI_PATH_BACKUP_CONF "/backup.conf"
+#define ORI_PATH_ZIPPOLICY "/zippolicy"
+#define ORI_PATH_ZIPADVICE "/zipadvice"
+#define ORI_PATH_VERIFIED "/verified"
+#define ORI_PATH_HYDRATE "/hydrate"
+#define ORI_PATH_DURABILITY "/durability"
 
 int LocalRepo_Init(const std::string &path, bool barerepo,
                    const std::string &uuid = "");
@@ -103,6 +112,25 @@ public:
      * Check if a remote repository is set.
      */
     bool hasRemote();
+    /**
+     * Prefetch hints, these do nothing unless a remote repository is set.
+     * Called before reading from a large blob and when a tree is loaded.
+     */
+    void readahead(const ObjectHash &lbHash, const LargeBlob &lb,
+                   uint64_t off, size_t len);
+    void prefetchTree(const Tree &t);
+    /**
+     * Returns false if no remote repository is set.
+     */
+    bool getPrefetchStats(PrefetchStats *stats);
+    /**
+     * Stores the objects that are only on the remote repository, reading
+     * no faster than rate bytes per second.  The transfer is done without
+     * storeLock, which is write locked only while the objects are written.
+     * Returns the bytes received.
+     */
+    uint64_t hydrate(const ObjectHashVec &objs, uint64_t rate = 0,
+                     RWLock *storeLock = NULL);
 
     // Repo implementation
     int distance() { return 0; }
@@ -114,6 +142,10 @@ public:
     std::set<ObjectInfo> listObjects();
     int addObject(ObjectType type, const ObjectHash &hash,
             const std::string &payload);
+    /// Adds a payload compressed with PfTransaction::compress
+    int addStoredObject(const ObjectInfo &info, const std::string &stored);
+    void beginFile(const std::string &name);
+    void endFile();
 
     void sync(); /// sync all changes to disk
 
@@ -125,6 +157,9 @@ public:
     LocalObject::sp getLocalObject(const ObjectHash &objId);
     
     std::vector<Commit> listCommits();
+    std::vector<Commit> getCommits(const ObjectHashVec &commitIds);
+    Tree getTree(const ObjectHash &treeId);
+    LargeBlob getLargeBlob(const ObjectHash &objId);
     std::map<std::string, ObjectHash> listSnapshots();
     ObjectHash lookupSnapshot(const std::string &name);
 
@@ -134,6 +169,10 @@ public:
     size_t getObjectLength(const ObjectHash &objId);
     ObjectType getObjectType(const ObjectHash &objId);
     std::string getPayload(const ObjectHash &objId);
+    ssize_t readPayload(const ObjectHash &objId, uint8_t *buf, size_t n,
+                        off_t off);
+    /// @returns false unless the payload can be read in place
+    bool getPayloadView(const ObjectHash &objId, PayloadView *view);
     std::string verifyObject(const ObjectHash &objId);
     size_t sendObject(const char *objId);
 
@@ -142,6 +181,7 @@ public:
 
     // Clone/pull operations
     void pull(Repo *r);
+    int cloneTo(const std::string &oriPath);
     void multiPull(RemoteRepo::sp defaultRemote);
     void transmit(bytewstream *bs, const std::vector<ObjectHash> &objs);
     void receive(bytestream *bs);
@@ -165,8 +205,17 @@ public:
 
     // Reference Counting Operations
     MetadataLog &getMetadata();
+    const ZipPolicy &getZipPolicy() const { return zipPolicy; }
+    const ZipStats &getZipStats() const { return zipAdvisor.getStats(); }
+    /// Open packfile handles and mapped bytes kept, for an open repository
+    void setPackfileLimits(size_t maxHandles, size_t maxMappedBytes);
+    PackfilePoolStats getPackfileStats();
+    /// Overrides the mode read from .ori/durability until the next open
+    void setDurability(DurabilityMode mode);
+    DurabilityStats getDurabilityStats();
     RefcountMap recomputeRefCounts();
     bool rewriteRefCounts(const RefcountMap &refs);
+    bool rebuildRefCounts();
     
     // Purging Operations
     bool purgeObject(const ObjectHash &objId);
@@ -185,6 +234,7 @@ public:
 
     // Working Directory Operations
     std::set<std::string> listBranches();
+    std::vector<ObjectHash> listHeads();
     std::string getBranch();
     void setBranch(const std::string &name);
     ObjectHash getHead();
@@ -223,6 +273,8 @@ public:
 private:
     // Helper Functions
     void createObjDirs(const ObjectHash &objId);
+    void beginTransaction();
+    void upgradeVersion();
 public: // Hack to enable rebuild operations
     std::string objIdToPath(const ObjectHash &objId);
 private:
@@ -231,6 +283,8 @@ private:
     std::string rootPath;
     std::string id;
     std::string version;
+    // Used by the files below, so destroyed after them
+    Durability durability;
     Index index;
     SnapshotIndex snapshots;
     std::map<std::string, Peer> peers;
@@ -240,10 +294,16 @@ private:
     Packfile::sp currPackfile;
     PfTransaction::sp currTransaction;
     PackfileManager::sp packfiles;
+    ZipPolicy zipPolicy;
+    ZipAdvisor zipAdvisor;
+    void endGroup();
 
     // Purging
     std::set<ObjectHash> purged;
 
+    bool getStoredPayload(const ObjectHash &objId, PayloadView *view,
+                          std::vector<uint8_t> *buf);
+
     // Repo lock
     LocalRepoLock::sp repoProcessLock;
 
@@ -252,9 +312,14 @@ private:
     bool cacheRemoteObjects;
     Repo *remoteRepo;
     RemoteRepo resumeRepo;
+    Prefetcher::sp prefetcher;
+    Prefetcher::sp getPrefetcher();
 
     // Friends
     friend int LocalRepo_PeerHelper(LocalRepo *l, const std::string &path);
+    friend class Verifier;
+    friend class RefcountBuilder;
+    friend class Repacker;
 };
 
 #endif
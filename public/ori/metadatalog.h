@@ -17,12 +17,16 @@
 #ifndef __METADATALOG_H__
 #define __METADATALOG_H__
 
+#include <vector>
+
 #include <oriutil/objecthash.h>
+#include <oriutil/objecthashmap.h>
+#include "durability.h"
 
 typedef int32_t refcount_t;
-typedef std::tr1::unordered_map<ObjectHash, refcount_t> RefcountMap;
+typedef ObjectHashMap<refcount_t> RefcountMap;
 typedef std::tr1::unordered_map<std::string, std::string> ObjMetadata;
-typedef std::tr1::unordered_map<ObjectHash, ObjMetadata> MetadataMap;
+typedef ObjectHashMap<ObjMetadata> MetadataMap;
 
 class MetadataLog;
 class MdTransaction
@@ -43,16 +47,49 @@ private:
     MetadataMap metadata;
 };
 
+class MetadataBase;
+class MetadataBaseWriter;
+class MetadataCompactor;
+
+// Checkpoint of the log, stored next to it
+#define METADATA_BASE_SUFFIX ".base"
+
+/*
+ * Reference counts and metadata are kept in a sorted checkpoint (the base),
+ * which is mapped and searched on lookup, and in a log of the transactions
+ * committed since.  Only the log is replayed on open.  Once the log grows
+ * past METADATA_TAIL_MAX it is moved aside and merged into a new base by a
+ * background thread while new transactions go to a fresh log.
+ *
+ * Log records hold the final values rather than deltas, so replaying a log
+ * over a base that already includes it is harmless.  This is what makes
+ * each step of a compaction safe to interrupt.
+ */
 class MetadataLog
 {
 public:
     MetadataLog();
     ~MetadataLog();
 
+    void setDurability(Durability *durability);
+    /// Whether the log may be compacted into a checkpoint, which binaries
+    /// older than ORI1.3 can't read
+    void setCheckpoints(bool enable);
     void open(const std::string &filename);
+    void close();
+    /// Writes the records committed so far and syncs them as the durability
+    /// mode asks, records are otherwise written once enough are buffered
     void sync();
     /// rewrites the log file, optionally with new counts
     void rewrite(const RefcountMap *refs = NULL, const MetadataMap *data = NULL);
+    /// rewrites the log with counts supplied in pieces, keeping metadata
+    void beginRewrite();
+    /// counts must be passed in increasing hash order
+    void rewriteCounts(
+            const std::vector<std::pair<ObjectHash, refcount_t> > &counts);
+    void endRewrite();
+    /// blocks until a background compaction, if any, is done
+    void waitCompaction();
 
     void addRef(const ObjectHash &hash, MdTransaction::sp trs =
             MdTransaction::sp());
@@ -67,10 +104,31 @@ public:
 
 private:
     friend class MdTransaction;
+    void replay(const std::string &path);
+    void appendRecord(const RefcountMap &counts, const MetadataMap &data);
+    void flush();
+    void installBase(bool truncateLog);
+    void startCompaction();
+    void finishCompaction();
+    void pollCompaction();
+
     int fd;
     std::string filename;
+    size_t tailBytes;
+    MetadataBase *base;
+    MetadataBaseWriter *writer;
+    // Transactions committed since the base was written
     RefcountMap refcounts;
     MetadataMap metadata;
+    // Log being merged into the next base by the compactor
+    MetadataCompactor *compactor;
+    RefcountMap frozenCounts;
+    MetadataMap frozenMeta;
+    Durability *durability;
+    // Records not yet written and whether the log needs a sync
+    std::string pending;
+    bool dirty;
+    bool checkpoints;
 };
 
 #endif
@@ -18,14 +18,19 @@
 #define __PACKFILE_H__
 
 #include <set>
+#include <map>
+#include <list>
 #include <deque>
+#include <string>
+#include <vector>
 #include <boost/tr1/memory.hpp>
-#include <boost/tr1/unordered_map.hpp>
 
 #include <oriutil/objecthash.h>
+#include <oriutil/objecthashmap.h>
 #include <oriutil/stream.h>
-#include <oriutil/lrucache.h>
+#include <oriutil/mutex.h>
 #include "object.h"
+#include "durability.h"
 
 typedef uint32_t offset_t;
 typedef uint32_t packid_t;
@@ -44,6 +49,7 @@ struct IndexEntry
 
 class Packfile;
 class Index;
+class ZipAdvisor;
 class PfTransaction
 {
 public:
@@ -53,7 +59,12 @@ public:
     ~PfTransaction();
 
     bool full() const;
-    void addPayload(ObjectInfo info, const std::string &payload);
+    void addPayload(ObjectInfo info, const std::string &payload,
+                    ObjectInfo::ZipAlgo algo, ZipAdvisor *advisor = NULL);
+    void addStored(const ObjectInfo &info, const std::string &stored);
+    static bool compress(ObjectInfo *info, const std::string &payload,
+                         ObjectInfo::ZipAlgo algo, ZipAdvisor *advisor,
+                         std::string *stored);
     bool has(const ObjectHash &hash) const;
     void commit();
 
@@ -61,30 +72,78 @@ public:
     std::vector<std::string> payloads;
     size_t totalSize;
     bool committed;
+    /// Set when the objects are being moved from another packfile
+    bool moving;
 
-    std::tr1::unordered_map<ObjectHash, size_t> hashToIx;
+    ObjectHashMap<size_t> hashToIx;
 
 private:
     Packfile *pf;
     Index *idx;
-    float _checkCompressionRatio(const std::string &payload);
 };
 
+/*
+ * Read-only mapping of the start of a packfile.  Views hold a reference so
+ * they stay valid after the packfile is closed, purged or mapped again.
+ */
+class PackfileMap
+{
+public:
+    typedef std::tr1::shared_ptr<PackfileMap> sp;
+
+    /// Returns an empty pointer if the file cannot be mapped
+    static sp map(int fd, size_t len);
+    ~PackfileMap();
+
+    const uint8_t *data() const { return base; }
+    size_t size() const { return len; }
+private:
+    PackfileMap(const uint8_t *base, size_t len);
+
+    const uint8_t *base;
+    size_t len;
+};
+
+/// Uncompressed payload read in place from a packfile mapping
+struct PayloadView
+{
+    const uint8_t *data;
+    size_t len;
+    PackfileMap::sp map;
+};
+
+/*
+ * Handles may be shared between threads.  Reads use pread or the mapping,
+ * but only one thread may write through a handle.
+ */
 class Packfile
 {
 public:
     typedef std::tr1::shared_ptr<Packfile> sp;
 
-    Packfile(const std::string &filename, packid_t id);
+    /// Sealed packfiles are opened read-only and must exist
+    Packfile(const std::string &filename, packid_t id, bool writable = true,
+             Durability *durability = NULL);
     ~Packfile();
 
     packid_t getPackfileID() const;
+    bool isWritable() const;
+    size_t getMappedSize();
+    /// Syncs what was written since the last sync
+    void sync();
 
     bool full() const;
     PfTransaction::sp begin(Index *idx);
     void commit(PfTransaction *t, Index *idx);
     //void addPayload(ObjectInfo info, const std::string &payload, Index *idx);
     bytestream *getPayload(const IndexEntry &entry);
+    /// Read n bytes at off of the uncompressed payload
+    ssize_t readPayload(const IndexEntry &entry, uint8_t *buf, size_t n,
+                        off_t off);
+    /// @returns false unless the payload is stored uncompressed in the map
+    bool getPayloadView(const IndexEntry &entry, PayloadView *view);
+    /// Compressed payloads are returned compressed, for copying elsewhere
+    std::string getStoredPayload(const IndexEntry &entry);
     /// @returns true when the packfile is empty
     bool purge(const std::set<ObjectHash> &hset, Index *idx);
 
@@ -97,16 +156,143 @@ public:
     bool receive(bytestream *bs, Index *idx);
 
 private:
+    const uint8_t *getStored(offset_t off, size_t len, PackfileMap::sp *map);
+    void unmap();
+
     int fd;
     std::string filename;
     packid_t packid;
+    bool writable;
     size_t numObjects;
     size_t fileSize;
+    Durability *durability;
+    bool dirty;
+
+    /*
+     * Packfiles are append only, so what was written before the file was
+     * first read never changes.  That part is mapped once, unless this
+     * handle has written to the file, and objects past it are read from the
+     * fd.
+     */
+    Mutex mapLock;
+    PackfileMap::sp pfMap;
+    bool mapTried;
+};
+
+/// An object found by a PackfileScanner
+struct PackfileScanItem
+{
+    ObjectInfo info;
+    offset_t offset;
+    uint32_t storedSize;
+    /// Where the stored payload is in the batch buffer
+    size_t bufOff;
+};
+
+/// Whole transactions read from one packfile
+struct PackfileScanBatch
+{
+    packid_t packfile;
+    uint64_t ino;
+    /// Packfile offsets of the first and past the last transaction
+    offset_t start;
+    offset_t end;
+    std::string buf;
+    std::vector<PackfileScanItem> items;
+
+    std::string getStored(const PackfileScanItem &item) const {
+        return buf.substr(item.bufOff, item.storedSize);
+    }
+};
+
+class PackfileScanWorker;
+
+/*
+ * Reads packfiles sequentially in batches of whole transactions and hands
+ * each batch to a pool of worker threads, reading the next batch while they
+ * process the current one.  Subclasses choose the objects whose payloads are
+ * read and what is done with them.  Only one batch is processed at a time,
+ * so per-batch results can be kept in the subclass.
+ */
+class PackfileScanner
+{
+public:
+    PackfileScanner(size_t batchSize);
+    virtual ~PackfileScanner();
+    void setThreads(int n) { threads = n; }
+    /**
+     * Scans a packfile from off to its end.  The whole packfile is scanned
+     * if ino is given and the file was replaced since.
+     */
+    void addPackfile(packid_t id, const std::string &path, offset_t off = 0,
+                     uint64_t ino = 0);
+    void scan();
+protected:
+    /// Called by the scanning thread, objects not wanted are left out
+    virtual bool wantPayload(packid_t id, const PackfileScanItem &item);
+    /// Called by the scanning thread before the workers get the batch
+    virtual void startBatch(PackfileScanBatch *b);
+    /// Called by each worker with its share of the items
+    virtual void processBatch(PackfileScanBatch *b, size_t first,
+                              size_t step) = 0;
+    /// Called by the scanning thread once the workers are done, in order
+    virtual void finishBatch(PackfileScanBatch *b) = 0;
+    /// Called by the scanning thread when the rest of a packfile is skipped
+    virtual void scanError(packid_t id, const std::string &what) = 0;
+
+    int threads;
+private:
+    friend class PackfileScanWorker;
+    struct Scan {
+        packid_t id;
+        std::string path;
+        int fd;
+        uint64_t ino;
+        offset_t off;
+        offset_t end;
+    };
+    bool openScan(Scan *s);
+    bool readBatch(Scan *s, PackfileScanBatch *b);
+    PackfileScanBatch *nextBatch(size_t *cur);
+    PackfileScanBatch *takeBatch(uint64_t *seen);
+    void doneBatch();
+
+    size_t batchSize;
+    std::vector<Scan> scans;
+
+    // Protects the batch handed to the workers
+    Mutex poolLock;
+    // Signalled when a batch is handed out or the workers are to stop
+    CondVar poolReady;
+    // Signalled when the last worker is done with the batch
+    CondVar poolIdle;
+    PackfileScanBatch *poolBatch;
+    uint64_t poolGen;
+    size_t poolBusy;
+    bool poolStop;
 };
 
 
 #define PFMGR_FREELIST ".freelist"
 
+struct PackfilePoolStats {
+    /// getPackfile calls and those answered by an open handle
+    uint64_t lookups;
+    uint64_t hits;
+    /// Packfiles opened and handles closed to stay within the limits
+    uint64_t opens;
+    uint64_t evictions;
+    /// Handles in the pool and the bytes they have mapped
+    uint64_t handles;
+    uint64_t mappedBytes;
+};
+
+/*
+ * Packfile handles are kept in a pool shared by all threads, up to a
+ * number of open handles and of mapped bytes.  The least recently used
+ * handles that nobody else holds are closed first, so handles in use can
+ * take the pool over its limits until they are released.
+ */
 class PackfileManager
 {
 public:
@@ -118,7 +304,15 @@ public:
     Packfile::sp getPackfile(packid_t id);
     Packfile::sp newPackfile();
     bool hasPackfile(packid_t id);
+    void removePackfile(packid_t id);
     std::vector<packid_t> getPackfileList();
+    std::string getPackfilePath(packid_t id) { return _getPackfileName(id); }
+
+    void setLimits(size_t maxHandles, size_t maxMappedBytes);
+    PackfilePoolStats getStats();
+    void setDurability(Durability *durability);
+    /// Syncs the packfiles written since the last call
+    void sync();
 
 private:
     std::string rootPath;
@@ -128,7 +322,21 @@ private:
     bool _loadFreeList();
     void _writeFreeList();
 
-    LRUCache<uint32_t, Packfile::sp, 96> _packfileCache;
+    struct PoolEntry {
+        Packfile::sp pf;
+        std::list<packid_t>::iterator lru;
+    };
+    void _poolInsert(packid_t id, Packfile::sp pf);
+    void _poolEvict();
+
+    // Protects the pool and the stats
+    Mutex poolLock;
+    std::map<packid_t, PoolEntry> pool;
+    std::list<packid_t> poolLru;
+    size_t maxHandles;
+    size_t maxMappedBytes;
+    PackfilePoolStats stats;
+    Durability *durability;
 
     std::string _getPackfileName(packid_t id);
 };
@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __PREFETCHER_H__
+#define __PREFETCHER_H__
+
+#include <stdint.h>
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/tr1/memory.hpp>
+
+#include <oriutil/objecthash.h>
+#include <oriutil/objecthashmap.h>
+#include <oriutil/mutex.h>
+#include "object.h"
+#include "repo.h"
+
+class LocalRepo;
+class LargeBlob;
+class RWLock;
+class Tree;
+
+struct PrefetchStats {
+    /// Objects requested that were not stored locally
+    uint64_t requests;
+    /// Requests served from the cache without a round trip
+    uint64_t hits;
+    /// Requests that waited for a batch already on its way
+    uint64_t waits;
+    /// Requests that paid for a round trip, alone or in a readahead batch
+    uint64_t misses;
+    /// Objects fetched ahead of being requested
+    uint64_t prefetched;
+    /// Prefetched objects dropped from the cache without being requested
+    uint64_t wasted;
+    /// getObjects calls and the objects and bytes they returned
+    uint64_t batches;
+    uint64_t objects;
+    uint64_t bytes;
+};
+
+/*
+ * Fetches objects from the remote repository of an instaclone.  Requests are
+ * sent in batches with getObjects and the objects that come back are kept in
+ * a small cache, and when caching locally also written to the packfiles as
+ * received.  Sequential reads of a large blob fetch the parts ahead of the
+ * reader, in a window that starts at PREFETCH_WINDOW_MIN parts and doubles
+ * each time the reader catches up with it.  Loading a tree fetches its
+ * subtrees and symlinks.
+ *
+ * Only one request is on the connection at a time, but the cache is checked
+ * without waiting on it and a request for an object that is part of a batch
+ * in progress waits for that batch instead of asking again.
+ */
+class Prefetcher
+{
+public:
+    typedef std::tr1::shared_ptr<Prefetcher> sp;
+
+    Prefetcher(Repo *remote, LocalRepo *store, bool storeLocally);
+    ~Prefetcher();
+    void setStoreLocally(bool val);
+
+    /// Returns the object if it was prefetched, without a round trip
+    Object::sp getCached(const ObjectHash &hash);
+    /// Returns the object, fetching it if it is not cached or on its way
+    Object::sp getObject(const ObjectHash &hash);
+    bool hasObject(const ObjectHash &hash);
+    ObjectInfo getObjectInfo(const ObjectHash &hash);
+
+    /// Fetches the objects that are not stored or cached in one batch
+    void prefetch(const ObjectHashVec &hashes);
+    /// Called before reading len bytes at off from a large blob
+    void readahead(const ObjectHash &lbHash, const LargeBlob &lb,
+                   uint64_t off, size_t len);
+    /// Called when a tree is loaded to fetch its subtrees and symlinks
+    void prefetchTree(const Tree &t);
+    /**
+     * Stores the objects that are not present locally, reading no faster
+     * than rate bytes per second (zero for no limit).  The batch is read
+     * into memory and storeLock, if given, is write locked only while the
+     * packfile data is stored as sent.  Returns the number of bytes received.
+     */
+    uint64_t pull(const ObjectHashVec &hashes, uint64_t rate,
+                  RWLock *storeLock = NULL);
+
+    PrefetchStats getStats();
+private:
+    struct Batch {
+        Mutex done;
+        // Objects that requests are waiting for
+        ObjectHashSet waiting;
+    };
+    typedef std::tr1::shared_ptr<Batch> BatchRef;
+    struct Entry {
+        Object::sp obj;
+        // Requested since it was fetched
+        bool used;
+        // Fetched for a read in progress, which counts as a miss
+        bool demand;
+    };
+    struct Stream {
+        // Start of the last read and end of the parts fetched for it
+        uint64_t lastOff;
+        uint64_t aheadOff;
+        size_t window;
+        uint64_t lastUse;
+    };
+
+    bool isPresent(const ObjectHash &hash);
+    Stream *getStream(const ObjectHash &lbHash);
+    BatchRef startBatch(const ObjectHashVec &hashes);
+    void finishBatch(BatchRef b, const ObjectHashVec &hashes);
+    Object::sp fetch(BatchRef b, const ObjectHashVec &hashes,
+                     size_t numDemand, const ObjectHash &wanted);
+    void insert(Object::sp obj, bool used, bool demand);
+
+    Repo *remote;
+    LocalRepo *store;
+    bool storeLocally;
+
+    // Held while a request is on the remote connection
+    Mutex remoteLock;
+    // Protects everything below
+    Mutex lock;
+    ObjectHashMap<Entry> cache;
+    std::deque<ObjectHash> cacheOrder;
+    size_t cacheBytes;
+    ObjectHashMap<BatchRef> inflight;
+    std::map<ObjectHash, Stream> streams;
+    uint64_t streamClock;
+    PrefetchStats stats;
+};
+
+#endif /* __PREFETCHER_H__ */
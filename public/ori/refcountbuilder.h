@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __REFCOUNTBUILDER_H__
+#define __REFCOUNTBUILDER_H__
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <oriutil/objecthash.h>
+#include <oriutil/objecthashmap.h>
+#include <oriutil/mutex.h>
+#include "packfile.h"
+#include "metadatalog.h"
+
+class LocalRepo;
+struct RefcountSource;
+
+/*
+ * Counts the references to every object by reading the commits, trees and
+ * large blobs of each packfile in offset order.  Payloads are read by the
+ * calling thread while worker threads decode the previous batch (see
+ * PackfileScanner) and add the references they find to tables sharded by
+ * hash prefix.  When the tables
+ * hold more than a given number of entries they are written out as a sorted
+ * run in .ori/tmp, and the runs are merged when the counts are read back.
+ *
+ *     RefcountBuilder b(repo);
+ *     b.run();
+ *     while (b.next(&counts)) { ... }
+ */
+class RefcountBuilder : public PackfileScanner
+{
+public:
+    typedef std::vector<std::pair<ObjectHash, refcount_t> > Chunk;
+
+    RefcountBuilder(LocalRepo *r);
+    ~RefcountBuilder();
+    void setMemoryLimit(size_t entries) { maxEntries = entries; }
+    /// Returns false if some objects could not be read
+    bool run();
+    /// Returns the counts in hash order, false once all were returned
+    bool next(Chunk *chunk);
+
+    size_t getObjectsRead() const { return objectsRead; }
+    size_t getRuns() const { return runs.size(); }
+    /// Adds one reference to each hash, called by the worker threads
+    void addRefs(std::vector<ObjectHash> &refs);
+private:
+    struct Shard {
+        Mutex lock;
+        RefcountMap counts;
+    };
+    struct Run {
+        int fd;
+        size_t entries;
+    };
+    bool wantPayload(packid_t id, const PackfileScanItem &item);
+    void startBatch(PackfileScanBatch *b);
+    void processBatch(PackfileScanBatch *b, size_t first, size_t step);
+    void finishBatch(PackfileScanBatch *b);
+    void scanError(packid_t id, const std::string &what);
+    size_t countEntries();
+    void sortShard(Shard *s,
+                   std::vector<std::pair<ObjectHash, refcount_t> > *out);
+    void spill();
+    void startMerge();
+
+    LocalRepo *repo;
+    size_t maxEntries;
+    size_t objectsRead;
+    bool ok;
+    // Objects of the current batch that could not be decoded
+    std::vector<uint8_t> failed;
+    // Shard i holds the hashes whose first byte is in [256*i/n, 256*(i+1)/n)
+    std::vector<Shard *> shards;
+    std::vector<Run> runs;
+    bool merging;
+    std::vector<RefcountSource *> sources;
+};
+
+#endif /* __REFCOUNTBUILDER_H__ */
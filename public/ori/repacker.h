@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __REPACKER_H__
+#define __REPACKER_H__
+
+#include <stdint.h>
+
+#include <vector>
+
+#include <oriutil/objecthash.h>
+#include <oriutil/objecthashmap.h>
+
+class LocalRepo;
+
+/*
+ * Pulls measured on the packfile layout, each one being the objects
+ * Packfile::transmit would send for it.
+ */
+enum RepackPull {
+    /// Everything reachable from HEAD, as checked out or instacloned
+    REPACK_PULL_CHECKOUT,
+    /// The objects each of the last few commits added over its parent
+    REPACK_PULL_RECENT,
+    /// Everything reachable from the history of HEAD
+    REPACK_PULL_CLONE,
+    REPACK_PULLS
+};
+
+struct RepackLayout {
+    size_t objects;
+    /// Packfiles touched and contiguous runs read from them
+    size_t packs;
+    size_t blocks;
+};
+
+struct RepackStats {
+    RepackStats();
+    size_t packsBefore;
+    size_t packsAfter;
+    /// Objects reachable from HEAD, from older commits only, and the rest
+    size_t hotObjects;
+    size_t coldObjects;
+    size_t otherObjects;
+    /// Stored bytes copied
+    uint64_t bytes;
+    RepackLayout before[REPACK_PULLS];
+    RepackLayout after[REPACK_PULLS];
+    /// Microseconds
+    uint64_t time;
+};
+
+/*
+ * Rewrites the packfiles of a repository so that objects read together are
+ * stored together.  The objects reachable from HEAD go first in packfiles
+ * of their own, followed by those only older commits reach, and then
+ * everything else in its old order.  Within the first two sections objects
+ * are grouped by the commit that added them, newest first, so a checkout
+ * or clone reads one run and a pull of a commit one run from each section.
+ * In a group the commit object and its trees come first, then the files one
+ * directory at a time, each large blob followed by its new parts in file
+ * order.  Payloads are copied as stored, so nothing is compressed again.
+ *
+ * The new packfiles are written and synced before the old ones are deleted,
+ * so a crash part way leaves every object in at least one of them.  The
+ * repository lock is held throughout, so it fails if another process has
+ * the repository.
+ */
+class Repacker
+{
+public:
+    Repacker(LocalRepo *r);
+    ~Repacker();
+    /// Only measure the current layout
+    void setDryRun(bool dry) { dryRun = dry; }
+    void run();
+    const RepackStats &getStats() const { return stats; }
+    static const char *pullName(RepackPull pull);
+private:
+    std::vector<ObjectHash> getHistory();
+    void collectCommit(const ObjectHash &commit, ObjectHashSet *seen,
+                       std::vector<ObjectHash> *out);
+    void collectTree(const ObjectHash &tree, ObjectHashSet *seen,
+                     std::vector<ObjectHash> *trees,
+                     std::vector<ObjectHash> *files);
+    void addLayout(const std::vector<ObjectHash> &objs, RepackLayout *l);
+    void measure(const std::vector<ObjectHash> &history,
+                 RepackLayout layout[REPACK_PULLS]);
+    void writeSection(const std::vector<ObjectHash> &objs);
+
+    LocalRepo *repo;
+    bool dryRun;
+    RepackStats stats;
+};
+
+#endif /* __REPACKER_H__ */
@@ -21,6 +21,7 @@
 
 #include <string>
 #include <set>
+#include <map>
 #include <deque>
 
 #include <oriutil/dag.h>
@@ -75,13 +76,26 @@ public:
     bytestream *getObjects(const std::deque<ObjectHash> &objs);
 
     ObjectHash addSmallFile(const std::string &path);
+    ObjectHash addFileContents(const std::string &blob,
+                               const std::string &name);
     std::pair<ObjectHash, ObjectHash>
         addLargeFile(const std::string &path);
     std::pair<ObjectHash, ObjectHash>
-        addFile(const std::string &path);
-
+        addFile(const std::string &path, const std::string &name = "");
+    std::pair<ObjectHash, ObjectHash>
+        addModifiedFile(const std::string &path, const LargeBlob &base,
+                        const std::map<uint64_t, uint64_t> &dirty,
+                        const std::string &name = "");
+    /// Hints that the following blobs are the contents of the named file
+    virtual void beginFile(const std::string &name) { }
+    virtual void endFile() { }
+
+    /// Read n bytes at off of an object's payload
+    virtual ssize_t readPayload(const ObjectHash &id, uint8_t *buf, size_t n,
+                                off_t off);
     virtual Tree getTree(const ObjectHash &treeId);
     virtual Commit getCommit(const ObjectHash &commitId);
+    virtual std::vector<Commit> getCommits(const ObjectHashVec &commitIds);
     virtual LargeBlob getLargeBlob(const ObjectHash &objId);
 
     // Lookup
@@ -90,6 +104,8 @@ public:
     // Transport
     virtual void transmit(bytewstream *bs, const ObjectHashVec &objs);
     virtual void receive(bytestream *bs);
+    void transmitFor(bytewstream *bs, const ObjectHashVec &objs,
+                     uint32_t zipAlgos);
 
     // Extensions
     virtual std::set<std::string> listExt();
@@ -40,10 +40,13 @@ public:
     bool respIsOK();
 
 private:
+    int announceZipAlgos();
+
     std::string remoteHost, remoteRepo;
 
     int fdFromChild, fdToChild;
     bytewstream::ap streamToChild;
+    bytestream::ap streamFromChild;
     int childPid;
 };
 
@@ -21,6 +21,7 @@
 #include <vector>
 #include <deque>
 
+#include <oriutil/objecthashmap.h>
 #include "repo.h"
 #include "sshclient.h"
 
@@ -54,7 +55,7 @@ private:
 
     std::map<ObjectHash, std::string> payloads;
 
-    std::tr1::unordered_set<ObjectHash> *containedObjs;
+    ObjectHashSet *containedObjs;
 };
 
 class SshObject : public Object
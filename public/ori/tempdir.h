@@ -21,8 +21,8 @@
 #include <vector>
 #include <string>
 #include <boost/tr1/memory.hpp>
-#include <boost/tr1/unordered_map.hpp>
 
+#include <oriutil/objecthashmap.h>
 #include "repo.h"
 #include "commit.h"
 #include "index.h"
@@ -60,7 +60,7 @@ public:
 private:
     Index index;
     int objects_fd;
-    std::tr1::unordered_map<ObjectHash, off_t> offsets;
+    ObjectHashMap<off_t> offsets;
 };
 
 class TempObject : public Object
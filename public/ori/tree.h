@@ -122,6 +122,7 @@ public:
     ~Tree();
     const std::string getBlob() const;
     void fromBlob(const std::string &blob);
+    void fromBlob(const uint8_t *blob, size_t len);
     ObjectHash hash() const; // TODO: cache this
 
     typedef std::map<std::string, TreeEntry> Flat;
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __TREEBUILDER_H__
+#define __TREEBUILDER_H__
+
+#include <string>
+#include <map>
+
+#include "tree.h"
+
+class Repo;
+
+/*
+ * Edits a committed tree in place of flattening it.  Only the trees on the
+ * paths from modified entries to the root are loaded, and commit() writes
+ * just those trees back; untouched subtrees keep their existing hashes.
+ * Paths are relative to the root with a leading '/', as in Tree::Flat.
+ */
+class TreeBuilder
+{
+public:
+    TreeBuilder(Repo *r, const Tree &root);
+    ~TreeBuilder();
+    /// Returns false if the path does not exist
+    bool get(const std::string &path, TreeEntry *te);
+    /// Adds an entry if the path does not exist, like Tree::Flat::insert
+    bool insert(const std::string &path, const TreeEntry &te);
+    void set(const std::string &path, const TreeEntry &te);
+    /// Removes a file or a directory and everything under it
+    void erase(const std::string &path);
+    /// Writes the modified trees to the repository and returns the root
+    Tree commit();
+
+    /// Number of trees loaded and written so far
+    size_t getLoaded() const { return loaded; }
+    size_t getWritten() const { return written; }
+private:
+    struct Node {
+        Node() : tree(), children(), dirty(false) { }
+        Tree tree;
+        std::map<std::string, Node *> children;
+        bool dirty;
+    };
+    Node *lookupDir(const std::string &path, bool modify);
+    Node *getChild(Node *n, const std::string &name, bool modify);
+    ObjectHash commitNode(Node *n);
+    void freeNode(Node *n);
+    static void splitPath(const std::string &path, std::string *dir,
+                          std::string *name);
+
+    Repo *repo;
+    Node *root;
+    size_t loaded;
+    size_t written;
+};
+
+#endif /* __TREEBUILDER_H__ */
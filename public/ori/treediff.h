@@ -61,6 +61,7 @@ class TreeDiff
 public:
     TreeDiff();
     void diffTwoTrees(const Tree::Flat &t1, const Tree::Flat &t2);
+    void diffTwoTrees(const Tree &t1, const Tree &t2, Repo *r);
     void diffToDir(Commit from, const std::string &dir, Repo *r);
     TreeDiffEntry *getLatestEntry(const std::string &path);
     const TreeDiffEntry *getLatestEntry(const std::string &path) const;
@@ -75,7 +76,7 @@ public:
     void mergeChanges(const TreeDiff &d1, const TreeDiff &diff);
 
     void applyTo(Tree::Flat *flat) const;
-    Tree applyTo(Tree::Flat flat, Repo *dest_repo);
+    Tree applyTo(const Tree &tree, Repo *dest_repo);
     void dump() const;
 
     std::vector<TreeDiffEntry> entries;
@@ -85,4 +86,7 @@ private:
     void _resetLatestEntry(const std::string &filepath);
 };
 
+int TreeDiff_Walk(const Tree &t1, const Tree &t2, Repo *r,
+                  void *arg, int (*f)(void *, const TreeDiffEntry &));
+
 #endif
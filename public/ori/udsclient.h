@@ -21,6 +21,7 @@
 
 #include <oriutil/stream.h>
 #include "object.h"
+#include "udsframe.h"
 
 class UDSClient
 {
@@ -33,18 +34,48 @@ public:
     void disconnect();
     bool connected();
 
-    // At the moment the protocol is synchronous
+    /*
+     * Synchronous interface: sendCommand, optionally sendData, then
+     * respIsOK and getStream to read the reply.  When the server supports
+     * framing this is carried over the framed protocol.
+     */
     void sendCommand(const std::string &command);
     void sendData(const std::string &data);
     bytestream *getStream();
 
     bool respIsOK();
 
+    /*
+     * Pipelined interface (framed connections only): queue any number of
+     * requests and then collect the replies in the same order.  Callers
+     * should bound the number of outstanding requests so that neither side
+     * blocks writing while the other is not reading.
+     */
+    bool isFramed();
+    uint32_t queueRequest(const std::string &command,
+                          const std::string &data = "");
+    /// Returns NULL if the server replied with an error
+    bytestream *getResponse(uint32_t reqId);
+
 private:
+    int enableFraming();
+    int announceZipAlgos();
+    bool readStatus(std::string *errStr);
+    bool readResponse(uint32_t reqId);
+
     std::string udsPath, remoteRepo;
 
     int fd;
     bytewstream::ap streamToChild;
+    bytestream::ap streamFromChild;
+
+    // Framed protocol state
+    std::auto_ptr<UDSFrameReader> frameReader;
+    std::auto_ptr<UDSFrameWriter> frameWriter;
+    std::auto_ptr<udsframestream> response;
+    std::string pendingReq;
+    bool havePendingReq;
+    uint32_t nextReqId;
 };
 
 
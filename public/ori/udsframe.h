@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __UDSFRAME_H__
+#define __UDSFRAME_H__
+
+#include <stdint.h>
+
+#include <string>
+
+#include <oriutil/stream.h>
+
+/*
+ * Framed UDS protocol
+ *
+ * Once a client sends the "framed" command both directions switch to
+ * length-prefixed frames:
+ *
+ *   uint32 payload length | uint32 request id | uint8 flags | payload
+ *
+ * A request frame holds a PStr command followed by its arguments.  A
+ * response frame holds the usual OK/ERROR byte followed by the reply.  Long
+ * replies are split into several frames, all but the last carrying
+ * UDSFRAME_MORE.  The server answers in request order, which lets clients
+ * queue many requests before reading any response.
+ */
+#define UDSFRAME_HDRSIZE        9
+#define UDSFRAME_MAXPAYLOAD     (256 * 1024)
+#define UDSFRAME_MAXREQUEST     (64 * 1024 * 1024)
+#define UDSFRAME_READBUF        (64 * 1024)
+
+#define UDSFRAME_MORE           0x01
+
+class UDSFrameReader
+{
+public:
+    UDSFrameReader(int fd);
+    ~UDSFrameReader();
+    /// Returns false on EOF or error
+    bool readFrame(uint32_t *reqId, uint8_t *flags, std::string *payload);
+    /// True if a complete frame is already buffered
+    bool pending() const;
+    uint64_t getReadCalls() const { return readCalls; }
+private:
+    bool fill();
+    int fd;
+    std::string buf;
+    size_t off;
+    uint64_t readCalls;
+};
+
+class UDSFrameWriter
+{
+public:
+    UDSFrameWriter(int fd);
+    ~UDSFrameWriter();
+    /// Append a frame to the output buffer, flushing if it grows too large
+    int queue(uint32_t reqId, uint8_t flags, const void *payload, size_t len);
+    /// Write all buffered frames
+    int flush();
+    size_t buffered() const { return buf.size(); }
+    uint64_t getWriteCalls() const { return writeCalls; }
+private:
+    int fd;
+    std::string buf;
+    uint64_t writeCalls;
+};
+
+/*
+ * Writes the reply to a single request as one or more frames.
+ */
+class udsframewstream : public bytewstream
+{
+public:
+    udsframewstream(UDSFrameWriter *out, uint32_t reqId);
+    ssize_t write(const void *, size_t);
+    /// Queue the final frame of the reply
+    int finish();
+private:
+    UDSFrameWriter *out;
+    uint32_t reqId;
+    std::string buf;
+    bool finished;
+};
+
+/*
+ * Reads the reply to a single request, following UDSFRAME_MORE frames.
+ */
+class udsframestream : public bytestream
+{
+public:
+    udsframestream(UDSFrameReader *in, uint32_t reqId,
+                   uint8_t flags, const std::string &payload);
+    bool ended();
+    size_t read(uint8_t *, size_t);
+    size_t sizeHint() const;
+    /// Consume any frames of this reply that have not been read
+    void drain();
+private:
+    UDSFrameReader *in;
+    uint32_t reqId;
+    uint8_t flags;
+    std::string buf;
+    size_t off;
+};
+
+#endif /* __UDSFRAME_H__ */
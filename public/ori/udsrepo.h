@@ -21,6 +21,7 @@
 #include <vector>
 #include <deque>
 
+#include <oriutil/objecthashmap.h>
 #include "repo.h"
 #include "udsclient.h"
 
@@ -40,6 +41,7 @@ public:
 
     Object::sp getObject(const ObjectHash &id);
     ObjectInfo getObjectInfo(const ObjectHash &id);
+    std::vector<ObjectInfo> getObjectInfos(const ObjectHashVec &objs);
     bool hasObject(const ObjectHash &id);
     bytestream *getObjects(const ObjectHashVec &objs);
     std::set<ObjectInfo> listObjects();
@@ -54,6 +56,8 @@ public:
     virtual std::set<std::string> listExt();
     virtual std::string callExt(const std::string &ext,
                                 const std::string &data);
+    /// Returns the reply as it arrives, or NULL on error
+    bytestream *streamExt(const std::string &ext, const std::string &data);
 private:
     UDSClient *client;
     
@@ -63,7 +67,7 @@ private:
 
     std::map<ObjectHash, std::string> payloads;
 
-    std::tr1::unordered_set<ObjectHash> *containedObjs;
+    ObjectHashSet *containedObjs;
 };
 
 class UDSObject : public Object
@@ -19,11 +19,14 @@
 
 #include <oriutil/mutex.h>
 
-#define ORI_UDS_PROTO_VERSION "1.0"
+#define ORI_UDS_PROTO_VERSION "1.1"
 
 class UDSSession;
 
 typedef std::string (*UDSExtCB)(LocalRepo *repo, const std::string &data);
+/// Extensions that write their reply to out as it is produced
+typedef void (*UDSStreamExtCB)(LocalRepo *repo, const std::string &data,
+                               bytewstream *out);
 
 class UDSServer : public Thread
 {
@@ -39,12 +42,17 @@ public:
     bool hasExt(const std::string &ext);
     std::string callExt(const std::string &ext, const std::string &data);
     void registerExt(const std::string &ext, UDSExtCB cb);
+    bool hasStreamExt(const std::string &ext);
+    void callStreamExt(const std::string &ext, const std::string &data,
+                       bytewstream *out);
+    void registerStreamExt(const std::string &ext, UDSStreamExtCB cb);
 private:
     int listenFd;
     LocalRepo *repo;
     std::set<UDSSession *> sessions;
     Mutex sessionLock;
     std::map<std::string, UDSExtCB> extensions;
+    std::map<std::string, UDSStreamExtCB> streamExtensions;
 };
 
 class UDSSession : public Thread
@@ -57,21 +65,30 @@ public:
     void forceExit();
     void serve();
     
-    void printError(const std::string &what);
-    void cmd_hello();
-    void cmd_listObjs();
-    void cmd_listCommits();
-    void cmd_readObjs();
-    void cmd_getObjInfo();
-    void cmd_getHead();
-    void cmd_getFSID();
-    void cmd_getVersion();
-    void cmd_listExt();
-    void cmd_callExt();
+    void serveFramed();
+    bool dispatch(const std::string &command,
+                  bytestream *in, bytewstream *out);
+
+    void printError(bytewstream *out, const std::string &what);
+    void cmd_hello(bytestream *in, bytewstream *out);
+    void cmd_zipAlgos(bytestream *in, bytewstream *out);
+    void cmd_listObjs(bytestream *in, bytewstream *out);
+    void cmd_listCommits(bytestream *in, bytewstream *out);
+    void cmd_readObjs(bytestream *in, bytewstream *out);
+    void cmd_getObjInfo(bytestream *in, bytewstream *out);
+    void cmd_getObjInfos(bytestream *in, bytewstream *out);
+    void cmd_getHead(bytestream *in, bytewstream *out);
+    void cmd_getFSID(bytestream *in, bytewstream *out);
+    void cmd_getVersion(bytestream *in, bytewstream *out);
+    void cmd_listExt(bytestream *in, bytewstream *out);
+    void cmd_callExt(bytestream *in, bytewstream *out);
+    void cmd_streamExt(bytestream *in, bytewstream *out);
 private:
     UDSServer *uds;
     int fd;
     LocalRepo *repo;
+    // Payload algorithms the client can decode (see ZIPCODEC_BIT)
+    uint32_t zipAlgos;
 };
 
 #endif
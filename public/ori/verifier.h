@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __VERIFIER_H__
+#define __VERIFIER_H__
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include <oriutil/objecthash.h>
+#include <oriutil/objectinfo.h>
+#include <oriutil/objecthashmap.h>
+#include "packfile.h"
+
+class LocalRepo;
+
+struct VerifyError
+{
+    ObjectHash hash;
+    /// Short description shared by all errors of the same kind
+    std::string kind;
+    std::string detail;
+};
+
+/// An object referenced by another one, with the type it must have
+struct VerifyRef
+{
+    ObjectHash hash;
+    ObjectInfo::Type type;
+    /// Payload size the object must have, or -1
+    uint32_t size;
+};
+
+struct VerifyStats
+{
+    VerifyStats();
+    size_t packsScanned;
+    size_t packsSkipped;
+    size_t objects;
+    uint64_t storedBytes;
+    uint64_t payloadBytes;
+    size_t largeBlobs;
+    /// Objects read that heads and snapshots reach, on full runs only
+    size_t reachable;
+    size_t unreachable;
+    /// Microseconds
+    uint64_t time;
+};
+
+/*
+ * Checks every object stored in a repository's packfiles.  Packfiles are read
+ * sequentially, a batch at a time, while a pool of threads decompresses and
+ * hashes the previous batch (see PackfileScanner).  References between objects are checked once
+ * the scan is done, and so is the whole-file hash of large blobs.
+ *
+ * The offset up to which each packfile was verified without errors is saved
+ * in .ori/verified, and an incremental run only reads what was written since.
+ * Packfiles only grow or get replaced by purge, so this is enough to cover
+ * all objects.  A checkpoint holds the inode and a hash of the start of the
+ * packfile, since a removed packfile's id and inode may both be reused.
+ * Likewise, references are only checked for newly read objects, which is
+ * sufficient since objects are only removed once they are no longer
+ * referenced.  Full runs also walk the references from the heads and
+ * snapshots to count the objects nothing reaches.
+ */
+class Verifier : public PackfileScanner
+{
+public:
+    Verifier(LocalRepo *r);
+    ~Verifier();
+    void setIncremental(bool inc) { incremental = inc; }
+    /// Returns the number of errors found
+    size_t run();
+    const std::vector<VerifyError> &getErrors() const { return errors; }
+    const VerifyStats &getStats() const { return stats; }
+
+    /// Checks one object, returns an empty string if it is valid
+    static std::string checkObject(const ObjectInfo &info,
+                                   const std::string &payload,
+                                   std::vector<VerifyRef> *refs);
+    static std::string checkLargeBlob(LocalRepo *r,
+                                      const std::string &payload);
+private:
+    struct Checkpoint {
+        uint64_t ino;
+        offset_t offset;
+        /// Hash of the first VERIFY_HEAD_SIZE bytes or up to offset
+        ObjectHash head;
+    };
+    struct PendingRef {
+        ObjectHash from;
+        packid_t packfile;
+        VerifyRef ref;
+    };
+    struct PendingBlob {
+        ObjectHash hash;
+        packid_t packfile;
+        std::string payload;
+    };
+    /// What the workers found about an object of the current batch
+    struct Result {
+        std::string error;
+        std::vector<VerifyRef> refs;
+        std::string largeBlob;
+    };
+    void loadCheckpoints();
+    void saveCheckpoints();
+    void startBatch(PackfileScanBatch *b);
+    void processBatch(PackfileScanBatch *b, size_t first, size_t step);
+    void finishBatch(PackfileScanBatch *b);
+    void scanError(packid_t id, const std::string &what);
+    void checkReachable();
+    void checkRefs();
+    void checkRoots();
+    void addError(const ObjectHash &hash, const std::string &kind,
+                  const std::string &detail = "");
+
+    LocalRepo *repo;
+    bool incremental;
+    std::map<packid_t, Checkpoint> checkpoints;
+    // Checkpoints reached by this run
+    std::map<packid_t, Checkpoint> done;
+    std::vector<VerifyError> errors;
+    VerifyStats stats;
+    std::vector<Result> results;
+    // Objects read in this run, their references and large blobs
+    std::vector<PendingRef> refs;
+    std::vector<PendingBlob> largeBlobs;
+    // Where the references of each object read are in refs, on full runs
+    ObjectHashMap<std::pair<size_t, size_t> > edges;
+    // Packfiles with errors in this run
+    std::map<packid_t, size_t> packErrors;
+};
+
+#endif /* __VERIFIER_H__ */
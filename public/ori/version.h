@@ -26,8 +26,15 @@
 #define ORI_VERSION_STR \
     "Version " STR(ORI_MAJOR_VERSION) "." STR(ORI_MINOR_VERSION) "." STR(ORI_PATCH_VERSION)
 
+/*
+ * Minor versions add formats that older binaries can't read.  Older
+ * repositories with the same major version are opened as they are, and
+ * upgraded by the first write that may use a newer format.
+ *   1.2  Block framed payloads (ZIPALGO_FASTLZBLK and the other codecs)
+ *   1.3  Metadata checkpoint in metadata.base with a truncated log
+ */
 #define ORI_FS_MAJOR_VERSION    1
-#define ORI_FS_MINOR_VERSION    1
+#define ORI_FS_MINOR_VERSION    3
 
 #define ORI_FS_VERSION_STR \
     "ORI" STR(ORI_FS_MAJOR_VERSION) "." STR(ORI_FS_MINOR_VERSION)
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __ZIPADVISOR_H__
+#define __ZIPADVISOR_H__
+
+#include <stdint.h>
+
+#include <string>
+#include <map>
+
+#include <oriutil/objectinfo.h>
+
+struct ZipStats
+{
+    ZipStats();
+    std::string toString() const;
+    void fromString(const std::string &str);
+    /// Estimated time saved by skipping, at the measured compression rate
+    uint64_t savedUsec() const;
+
+    uint64_t objects;           ///< Payloads eligible for compression
+    uint64_t compressed;        ///< Stored compressed
+    uint64_t rejected;          ///< Compressed but stored raw
+    uint64_t skipEntropy;       ///< Skipped on the entropy estimate
+    uint64_t skipFile;          ///< Skipped, earlier chunks didn't compress
+    uint64_t skipExt;           ///< Skipped, the extension doesn't compress
+    uint64_t triedBytes;        ///< Bytes fed to a codec
+    uint64_t skippedBytes;      ///< Bytes never fed to a codec
+    uint64_t savedBytes;        ///< Bytes saved by compression
+    uint64_t compressUsec;      ///< Time spent compressing
+    uint64_t wastedUsec;        ///< Time spent on rejected attempts
+};
+
+/*
+ * Decides whether a payload is worth compressing.  Besides a byte entropy
+ * estimate it remembers which file extensions turned out incompressible,
+ * and stops compressing the remaining chunks of a large file once its first
+ * chunks fail to compress.  Learned state and cumulative statistics are kept
+ * in .ori/zipadvice.
+ */
+class ZipAdvisor
+{
+public:
+    enum Advice {
+        ZIPADV_TRY,
+        ZIPADV_SKIP_ENTROPY,
+        ZIPADV_SKIP_FILE,
+        ZIPADV_SKIP_EXT
+    };
+    ZipAdvisor();
+    ~ZipAdvisor();
+    void open(const std::string &path);
+    void save();
+    /// Payloads until endFile belong to the named file
+    void beginFile(const std::string &name);
+    void endFile();
+    Advice advise(ObjectInfo::Type type, const std::string &payload);
+    /// Report the outcome of a compression attempt
+    void record(ObjectInfo::Type type, size_t rawSize, size_t storedSize,
+                bool kept, uint64_t usec);
+    const ZipStats &getStats() const;
+private:
+    struct ExtStats {
+        uint64_t samples;
+        uint64_t incompressible;
+        uint64_t skipped;
+    };
+    void learn(ObjectInfo::Type type, bool compressible);
+    bool isIncompressible(const ExtStats &e) const;
+    std::string path;
+    bool inFile;
+    std::string fileExt;
+    int strikes;
+    std::map<std::string, ExtStats> exts;
+    ZipStats stats;
+};
+
+#endif /* __ZIPADVISOR_H__ */
@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __ZIPPOLICY_H__
+#define __ZIPPOLICY_H__
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <oriutil/objectinfo.h>
+
+/*
+ * Per-repository choice of compression codec for new objects, read from
+ * .ori/zippolicy.  Each line holds a rule:
+ *
+ *   TYPE MINSIZE CODEC
+ *
+ * TYPE is commit, tree, blob, largeblob or '*', and CODEC is any name known
+ * to ZipCodec_Lookup.  An object uses the rule for its type (or '*') with
+ * the largest MINSIZE not exceeding its size.  For example, a fast codec
+ * for metadata and hot blobs and a dense one for big, rarely read blobs:
+ *
+ *   tree    0        snappy
+ *   blob    0        lz4
+ *   blob    1048576  zstd
+ */
+class ZipPolicy
+{
+public:
+    ZipPolicy();
+    ~ZipPolicy();
+    /// Codec used when no rule matches
+    void setDefault(ObjectInfo::ZipAlgo algo);
+    /// Replace the rules, returns false if any line was rejected
+    bool fromString(const std::string &policy);
+    std::string toString() const;
+    ObjectInfo::ZipAlgo select(ObjectInfo::Type type, size_t size) const;
+private:
+    struct Rule {
+        bool anyType;
+        ObjectInfo::Type type;
+        size_t minSize;
+        ObjectInfo::ZipAlgo algo;
+    };
+    ObjectInfo::ZipAlgo defaultAlgo;
+    std::vector<Rule> rules;
+};
+
+#endif /* __ZIPPOLICY_H__ */
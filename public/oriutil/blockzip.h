@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __BLOCKZIP_H__
+#define __BLOCKZIP_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <vector>
+
+#include "stream.h"
+#include "objectinfo.h"
+
+/*
+ * Block-framed compressed payloads
+ *
+ *   block*     uint32 length (| BLOCKZIP_STORED if kept raw), data
+ *   uint32 0   end of blocks
+ *   table      uint32 offset of each block from the start of the payload
+ *   trailer    uint32 numBlocks, blockSize, rawSize, BLOCKZIP_MAGIC
+ *
+ * Every block holds BLOCKZIP_BLOCKSIZE bytes of input (the last may hold
+ * less) and is compressed independently with the object's codec (see
+ * zipcodec.h).  Sequential readers only need the
+ * length prefixes, so both directions stream with one block in memory.
+ * Readers with random access use the table to decompress only the blocks a
+ * read touches.
+ */
+#define BLOCKZIP_BLOCKSIZE      (64 * 1024)
+#define BLOCKZIP_MAXFRAME       (4 + BLOCKZIP_BLOCKSIZE)
+#define BLOCKZIP_STORED         0x80000000U
+#define BLOCKZIP_MAGIC          0x4F5A4231U
+#define BLOCKZIP_TRAILERSIZE    16
+
+class ZipCodec;
+
+
+class blockzipstream : public bytestream
+{
+public:
+    /// Takes ownership of source. size_hint is total number of bytes output
+    blockzipstream(bytestream *source, bool compress, size_t size_hint = 0,
+                   ObjectInfo::ZipAlgo algo = ObjectInfo::ZIPALGO_FASTLZBLK);
+    ~blockzipstream();
+    bool ended();
+    size_t read(uint8_t *, size_t);
+    size_t sizeHint() const;
+    /// Number of input bytes consumed so far
+    size_t inputConsumed() const;
+
+private:
+    bool fillCompress();
+    bool fillDecompress();
+    size_t readSource(uint8_t *buf, size_t n);
+
+    bytestream *source;
+    const ZipCodec *codec;
+    bool compress;
+    size_t size_hint;
+    size_t consumed;
+    size_t produced;
+
+    std::vector<uint8_t> inBuf;
+    std::vector<uint8_t> outBuf;
+    size_t outOff;
+    size_t outLen;
+    bool outputEnded;
+
+    // Compression state
+    std::vector<uint32_t> table;
+    uint32_t rawSize;
+};
+
+/// Random access read from a block-framed payload stored in fd at
+/// [base, base + len).  Returns bytes read or a negative errno.
+ssize_t BlockZip_PRead(int fd, off_t base, size_t len, ObjectInfo::ZipAlgo algo,
+                       uint8_t *buf, size_t n, off_t off);
+/// Same as BlockZip_PRead for a payload already in memory
+ssize_t BlockZip_Read(const uint8_t *stored, size_t len,
+                      ObjectInfo::ZipAlgo algo, uint8_t *buf, size_t n,
+                      off_t off);
+
+#endif /* __BLOCKZIP_H__ */
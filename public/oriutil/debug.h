@@ -37,6 +37,19 @@ int ori_open_log(const std::string &logPath);
 #define LEVEL_DBG       5 /* Debug */
 #define LEVEL_VRB       6 /* Verbose */
 
+/*
+ * Most verbose level that will be written somewhere.  The logging macros
+ * test it before evaluating their arguments, so a disabled message costs a
+ * compare even if its arguments format hashes or build strings.
+ */
+extern int ori_log_level;
+#define ORI_LOG_ENABLED(_level) ((_level) <= ori_log_level)
+#define ORI_LOG_LEVEL(_level, fmt, ...) \
+    do { \
+        if (ORI_LOG_ENABLED(_level)) \
+            ori_log(_level, fmt "\n", ##__VA_ARGS__); \
+    } while (0)
+
 /*
  * Remove all logging in PERF builds
  */
@@ -47,16 +60,16 @@ int ori_open_log(const std::string &logPath);
 #define LOG(fmt, ...)
 #else
 #define SYSERROR(fmt, ...) ori_log(LEVEL_ERR, fmt "\n", ##__VA_ARGS__)
-#define WARNING(fmt, ...) ori_log(LEVEL_WRN, fmt "\n", ##__VA_ARGS__)
-#define MSG(fmt, ...) ori_log(LEVEL_MSG, fmt "\n", ##__VA_ARGS__)
-#define LOG(fmt, ...) ori_log(LEVEL_LOG, fmt "\n", ##__VA_ARGS__)
+#define WARNING(fmt, ...) ORI_LOG_LEVEL(LEVEL_WRN, fmt, ##__VA_ARGS__)
+#define MSG(fmt, ...) ORI_LOG_LEVEL(LEVEL_MSG, fmt, ##__VA_ARGS__)
+#define LOG(fmt, ...) ORI_LOG_LEVEL(LEVEL_LOG, fmt, ##__VA_ARGS__)
 #endif
 
 /*
  * Only DEBUG builds compile in DLOG messages
  */
 #ifdef DEBUG
-#define DLOG(fmt, ...) ori_log(LEVEL_DBG, fmt "\n", ##__VA_ARGS__)
+#define DLOG(fmt, ...) ORI_LOG_LEVEL(LEVEL_DBG, fmt, ##__VA_ARGS__)
 #else
 #define DLOG(fmt, ...)
 #endif
@@ -41,6 +41,7 @@ public:
     bool tryLock();
     // bool Locked();
 private:
+    friend class CondVar;
 #if defined(__APPLE__) || defined(__linux__) || defined(__FreeBSD__) \
     || defined(__NetBSD__)
     pthread_mutex_t lockHandle;
@@ -51,5 +52,29 @@ private:
 #endif
 };
 
+/*
+ * Condition variable used with a Mutex.  wait is called with the mutex held,
+ * releases it while blocked and holds it again when it returns, which may
+ * happen without a signal, so the condition is checked in a loop.
+ */
+class CondVar
+{
+public:
+    CondVar();
+    virtual ~CondVar();
+    void wait(Mutex &m);
+    void signal();
+    void broadcast();
+private:
+#if defined(__APPLE__) || defined(__linux__) || defined(__FreeBSD__) \
+    || defined(__NetBSD__)
+    pthread_cond_t condHandle;
+#elif defined(_WIN32)
+    CONDITION_VARIABLE condHandle;
+#else
+#error "UNSUPPORTED OS"
+#endif
+};
+
 #endif /* __MUTEX_H__ */
 
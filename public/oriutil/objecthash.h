@@ -26,6 +26,8 @@ struct ObjectHash {
 
     ObjectHash();
     static ObjectHash fromHex(std::string hex);
+    /// Parses STR_SIZE hex digits, returns false if any digit is invalid
+    static bool fromHex(const char *hex, ObjectHash *out);
 
     bool operator <(const ObjectHash &other) const {
         return memcmp(hash, other.hash, SIZE) < 0;
@@ -42,6 +44,8 @@ struct ObjectHash {
     bool isEmpty() const;
     /// Returns the hash as a hex string (size 2*SIZE)
     std::string hex() const;
+    /// Writes the hex string and a NUL to buf (size STR_SIZE + 1)
+    const char *hex(char *buf) const;
     /// Copies the binary hash to a string (length SIZE)
     std::string bin() const;
 
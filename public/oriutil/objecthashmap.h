@@ -0,0 +1,441 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __OBJECTHASHMAP_H__
+#define __OBJECTHASHMAP_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <new>
+#include <iterator>
+#include <utility>
+#include <algorithm>
+
+#include "objecthash.h"
+
+/*
+ * Open addressing hash tables keyed by ObjectHash.  Entries live in a single
+ * array, next to an array with one control byte per slot, so inserting does
+ * not allocate unless the table grows and a lookup usually touches two cache
+ * lines.  Object hashes are uniformly distributed so their first eight bytes
+ * are used as is: the low bits pick the first slot to probe and the top seven
+ * bits are kept in the control byte, which avoids most key comparisons.
+ *
+ * The interface follows unordered_map and unordered_set except that an
+ * insert may move entries, invalidating references and iterators, so return
+ * values by value from anything that a later insert could outlive.  Erasing
+ * leaves other entries in place.  Growing moves the mapped values with swap
+ * rather than copying them.
+ */
+template <class Value, class KeyOf>
+class ObjectHashTable
+{
+public:
+    typedef ObjectHash key_type;
+    typedef Value value_type;
+    typedef size_t size_type;
+
+    template <class Ref, class Ptr>
+    class basic_iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef Value value_type;
+        typedef ptrdiff_t difference_type;
+        typedef Ptr pointer;
+        typedef Ref reference;
+
+        basic_iterator() : t(NULL), ix(0) { }
+        basic_iterator(const ObjectHashTable *t, size_t ix) : t(t), ix(ix) { }
+        template <class R, class P>
+        basic_iterator(const basic_iterator<R, P> &other)
+            : t(other.t), ix(other.ix) { }
+
+        Ref operator*() const { return t->slots[ix]; }
+        Ptr operator->() const { return &t->slots[ix]; }
+        basic_iterator &operator++()
+        {
+            ix = t->nextUsed(ix + 1);
+            return *this;
+        }
+        basic_iterator operator++(int)
+        {
+            basic_iterator rval = *this;
+            ++*this;
+            return rval;
+        }
+        template <class R, class P>
+        bool operator==(const basic_iterator<R, P> &other) const
+        {
+            return ix == other.ix;
+        }
+        template <class R, class P>
+        bool operator!=(const basic_iterator<R, P> &other) const
+        {
+            return ix != other.ix;
+        }
+
+        const ObjectHashTable *t;
+        size_t ix;
+    };
+    typedef basic_iterator<Value &, Value *> iterator;
+    typedef basic_iterator<const Value &, const Value *> const_iterator;
+
+    ObjectHashTable()
+        : ctrl(NULL), slots(NULL), capacity(0), numUsed(0), numFilled(0)
+    {
+    }
+    ObjectHashTable(const ObjectHashTable &other)
+        : ctrl(NULL), slots(NULL), capacity(0), numUsed(0), numFilled(0)
+    {
+        copyFrom(other);
+    }
+    ~ObjectHashTable()
+    {
+        release();
+    }
+    ObjectHashTable &operator=(const ObjectHashTable &other)
+    {
+        if (this != &other) {
+            ObjectHashTable tmp(other);
+            swap(tmp);
+        }
+        return *this;
+    }
+
+    iterator begin() { return iterator(this, nextUsed(0)); }
+    iterator end() { return iterator(this, capacity); }
+    const_iterator begin() const { return const_iterator(this, nextUsed(0)); }
+    const_iterator end() const { return const_iterator(this, capacity); }
+
+    size_t size() const { return numUsed; }
+    bool empty() const { return numUsed == 0; }
+    /// Bytes allocated for the table
+    size_t memoryUsage() const { return capacity * (sizeof(Value) + 1); }
+
+    iterator find(const ObjectHash &key)
+    {
+        return iterator(this, lookup(key));
+    }
+    const_iterator find(const ObjectHash &key) const
+    {
+        return const_iterator(this, lookup(key));
+    }
+    size_t count(const ObjectHash &key) const
+    {
+        return lookup(key) != capacity ? 1 : 0;
+    }
+
+    size_t erase(const ObjectHash &key)
+    {
+        size_t ix = lookup(key);
+        if (ix == capacity)
+            return 0;
+        eraseAt(ix);
+        return 1;
+    }
+    void erase(iterator it)
+    {
+        eraseAt(it.ix);
+    }
+    void clear()
+    {
+        for (size_t i = 0; i < capacity; i++) {
+            if (isUsed(ctrl[i]))
+                slots[i].~Value();
+        }
+        if (capacity)
+            memset(ctrl, CTRL_EMPTY, capacity);
+        numUsed = 0;
+        numFilled = 0;
+    }
+    void swap(ObjectHashTable &other)
+    {
+        std::swap(ctrl, other.ctrl);
+        std::swap(slots, other.slots);
+        std::swap(capacity, other.capacity);
+        std::swap(numUsed, other.numUsed);
+        std::swap(numFilled, other.numFilled);
+    }
+    /// Make room for n entries without growing
+    void reserve(size_t n)
+    {
+        size_t cap = MIN_CAPACITY;
+
+        while (cap - cap / 8 < n + 1)
+            cap *= 2;
+        if (cap > capacity)
+            rehash(cap);
+    }
+
+protected:
+    static const uint8_t CTRL_EMPTY = 0x80;
+    static const uint8_t CTRL_DELETED = 0xFE;
+    static const size_t MIN_CAPACITY = 16;
+
+    static uint64_t hashOf(const ObjectHash &key)
+    {
+        uint64_t h;
+        memcpy(&h, key.hash, sizeof(h));
+        return h;
+    }
+    static uint8_t tagOf(uint64_t h)
+    {
+        return (uint8_t)(h >> 57);
+    }
+    static bool isUsed(uint8_t c)
+    {
+        return (c & 0x80) == 0;
+    }
+
+    size_t nextUsed(size_t ix) const
+    {
+        while (ix < capacity && !isUsed(ctrl[ix]))
+            ix++;
+        return ix;
+    }
+    size_t lookup(const ObjectHash &key) const
+    {
+        if (capacity == 0)
+            return capacity;
+
+        uint64_t h = hashOf(key);
+        uint8_t tag = tagOf(h);
+        size_t mask = capacity - 1;
+
+        for (size_t ix = h & mask; ; ix = (ix + 1) & mask) {
+            uint8_t c = ctrl[ix];
+
+            if (c == tag && KeyOf::get(slots[ix]) == key)
+                return ix;
+            if (c == CTRL_EMPTY)
+                return capacity;
+        }
+    }
+    /*
+     * Returns the slot holding key, or the one it should be inserted in when
+     * *found is false.  The table always keeps a free slot for the insert.
+     */
+    size_t prepare(const ObjectHash &key, bool *found)
+    {
+        if (numFilled + 1 > capacity - capacity / 8) {
+            // Drop tombstones, growing only if the table is half full
+            if (capacity == 0)
+                rehash(MIN_CAPACITY);
+            else if (numUsed + 1 > capacity / 2)
+                rehash(capacity * 2);
+            else
+                rehash(capacity);
+        }
+
+        uint64_t h = hashOf(key);
+        uint8_t tag = tagOf(h);
+        size_t mask = capacity - 1;
+        size_t tombstone = capacity;
+
+        for (size_t ix = h & mask; ; ix = (ix + 1) & mask) {
+            uint8_t c = ctrl[ix];
+
+            if (c == tag && KeyOf::get(slots[ix]) == key) {
+                *found = true;
+                return ix;
+            }
+            if (c == CTRL_DELETED && tombstone == capacity)
+                tombstone = ix;
+            if (c == CTRL_EMPTY) {
+                *found = false;
+                return tombstone != capacity ? tombstone : ix;
+            }
+        }
+    }
+    void construct(size_t ix, const Value &v)
+    {
+        new (&slots[ix]) Value(v);
+        if (ctrl[ix] == CTRL_EMPTY)
+            numFilled++;
+        ctrl[ix] = tagOf(hashOf(KeyOf::get(v)));
+        numUsed++;
+    }
+    void eraseAt(size_t ix)
+    {
+        slots[ix].~Value();
+        numUsed--;
+        // Probes stop at the next slot if it is empty, so this one can be too
+        if (ctrl[(ix + 1) & (capacity - 1)] == CTRL_EMPTY) {
+            ctrl[ix] = CTRL_EMPTY;
+            numFilled--;
+        } else {
+            ctrl[ix] = CTRL_DELETED;
+        }
+    }
+
+    uint8_t *ctrl;
+    Value *slots;
+
+private:
+    void rehash(size_t newCapacity)
+    {
+        uint8_t *oldCtrl = ctrl;
+        Value *oldSlots = slots;
+        size_t oldCapacity = capacity;
+
+        ctrl = new uint8_t[newCapacity];
+        slots = static_cast<Value *>(
+                ::operator new(newCapacity * sizeof(Value)));
+        capacity = newCapacity;
+        memset(ctrl, CTRL_EMPTY, capacity);
+
+        size_t mask = capacity - 1;
+        for (size_t i = 0; i < oldCapacity; i++) {
+            if (!isUsed(oldCtrl[i]))
+                continue;
+
+            size_t ix = hashOf(KeyOf::get(oldSlots[i])) & mask;
+            while (ctrl[ix] != CTRL_EMPTY)
+                ix = (ix + 1) & mask;
+            KeyOf::move(&slots[ix], oldSlots[i]);
+            ctrl[ix] = oldCtrl[i];
+            oldSlots[i].~Value();
+        }
+        numFilled = numUsed;
+
+        delete[] oldCtrl;
+        ::operator delete(oldSlots);
+    }
+    void copyFrom(const ObjectHashTable &other)
+    {
+        if (other.capacity == 0)
+            return;
+
+        ctrl = new uint8_t[other.capacity];
+        slots = static_cast<Value *>(
+                ::operator new(other.capacity * sizeof(Value)));
+        capacity = other.capacity;
+        memcpy(ctrl, other.ctrl, capacity);
+        for (size_t i = 0; i < capacity; i++) {
+            if (isUsed(ctrl[i]))
+                new (&slots[i]) Value(other.slots[i]);
+        }
+        numUsed = other.numUsed;
+        numFilled = other.numFilled;
+    }
+    void release()
+    {
+        clear();
+        delete[] ctrl;
+        ::operator delete(slots);
+        ctrl = NULL;
+        slots = NULL;
+        capacity = 0;
+    }
+
+    size_t capacity;
+    // Entries, and entries plus tombstones
+    size_t numUsed;
+    size_t numFilled;
+};
+
+template <class V>
+struct ObjectHashMapKey
+{
+    static const ObjectHash &get(const std::pair<const ObjectHash, V> &v)
+    {
+        return v.first;
+    }
+    /// Constructs dst from src, leaving src to be destroyed
+    static void move(std::pair<const ObjectHash, V> *dst,
+                     std::pair<const ObjectHash, V> &src)
+    {
+        using std::swap;
+
+        new (dst) std::pair<const ObjectHash, V>(src.first, V());
+        swap(dst->second, src.second);
+    }
+};
+
+template <class V>
+class ObjectHashMap
+    : public ObjectHashTable<std::pair<const ObjectHash, V>,
+                             ObjectHashMapKey<V> >
+{
+    typedef ObjectHashTable<std::pair<const ObjectHash, V>,
+                            ObjectHashMapKey<V> > Table;
+public:
+    typedef V mapped_type;
+    typedef typename Table::value_type value_type;
+    typedef typename Table::iterator iterator;
+    typedef typename Table::const_iterator const_iterator;
+
+    V &operator[](const ObjectHash &key)
+    {
+        bool found;
+        size_t ix = Table::prepare(key, &found);
+        if (!found)
+            Table::construct(ix, value_type(key, V()));
+        return Table::slots[ix].second;
+    }
+    std::pair<iterator, bool> insert(const value_type &v)
+    {
+        bool found;
+        size_t ix = Table::prepare(v.first, &found);
+        if (!found)
+            Table::construct(ix, v);
+        return std::make_pair(iterator(this, ix), !found);
+    }
+    template <class InputIterator>
+    void insert(InputIterator first, InputIterator last)
+    {
+        for (; first != last; ++first)
+            insert(value_type(first->first, first->second));
+    }
+};
+
+struct ObjectHashSetKey
+{
+    static const ObjectHash &get(const ObjectHash &v)
+    {
+        return v;
+    }
+    static void move(ObjectHash *dst, ObjectHash &src)
+    {
+        new (dst) ObjectHash(src);
+    }
+};
+
+/// Entries must not be modified through iterators
+class ObjectHashSet : public ObjectHashTable<ObjectHash, ObjectHashSetKey>
+{
+    typedef ObjectHashTable<ObjectHash, ObjectHashSetKey> Table;
+public:
+    std::pair<iterator, bool> insert(const ObjectHash &key)
+    {
+        bool found;
+        size_t ix = Table::prepare(key, &found);
+        if (!found)
+            Table::construct(ix, key);
+        return std::make_pair(iterator(this, ix), !found);
+    }
+    template <class InputIterator>
+    void insert(InputIterator first, InputIterator last)
+    {
+        for (; first != last; ++first)
+            insert(*first);
+    }
+};
+
+#endif /* __OBJECTHASHMAP_H__ */
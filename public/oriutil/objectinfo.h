@@ -31,13 +31,19 @@
 #define ORI_FLAG_UNCOMPRESSED   0x0000
 #define ORI_FLAG_FASTLZ         0x0001
 #define ORI_FLAG_LZMA           0x0002
+#define ORI_FLAG_FASTLZBLK      0x0003
+#define ORI_FLAG_SNAPPY         0x0004
+#define ORI_FLAG_LZ4            0x0005
+#define ORI_FLAG_ZSTD           0x0006
 #define ORI_FLAG_ZIPMASK        0x000F
 
 #define ORI_FLAG_DEFAULT        0x0000
 
 struct ObjectInfo {
     enum Type { Null, Commit, Tree, Blob, LargeBlob, Purged };
-    enum ZipAlgo { ZIPALGO_UNKNOWN, ZIPALGO_NONE, ZIPALGO_FASTLZ, ZIPALGO_LZMA };
+    enum ZipAlgo { ZIPALGO_UNKNOWN, ZIPALGO_NONE, ZIPALGO_FASTLZ, ZIPALGO_LZMA,
+                   ZIPALGO_FASTLZBLK, ZIPALGO_SNAPPY, ZIPALGO_LZ4,
+                   ZIPALGO_ZSTD };
 
     ObjectInfo();
     ObjectInfo(const ObjectHash &hash);
@@ -23,6 +23,13 @@ std::string OriCrypt_MD5String(const std::string &str);
 ObjectHash OriCrypt_HashString(const std::string &str);
 ObjectHash OriCrypt_HashBlob(const uint8_t *data, size_t len);
 ObjectHash OriCrypt_HashFile(const std::string &path);
+
+// Incremental hashing of data that is not in one buffer
+struct OriCrypt_HashCtx;
+OriCrypt_HashCtx *OriCrypt_HashBegin();
+void OriCrypt_HashUpdate(OriCrypt_HashCtx *ctx, const uint8_t *data,
+                         size_t len);
+ObjectHash OriCrypt_HashEnd(OriCrypt_HashCtx *ctx);
 std::string
 OriCrypt_Encrypt(const std::string &plaintext, const std::string &key);
 std::string
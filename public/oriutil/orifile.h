@@ -33,6 +33,7 @@ bool OriFile_WriteFile(const char *blob, size_t len, const std::string &path);
 bool OriFile_Append(const std::string &blob, const std::string &path);
 bool OriFile_Append(const char *blob, size_t len, const std::string &path);
 int OriFile_Copy(const std::string &origPath, const std::string &newPath);
+int OriFile_Clone(const std::string &origPath, const std::string &newPath);
 int OriFile_Move(const std::string &origPath, const std::string &newPath);
 int OriFile_Delete(const std::string &path);
 int OriFile_Rename(const std::string &from, const std::string &to);
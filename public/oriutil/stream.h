@@ -109,10 +109,27 @@ private:
     size_t len;
 };
 
+/*
+ * Reads from a buffer owned by someone else, such as a mapped file, that
+ * must outlive the stream.
+ */
+class memstream : public bytestream
+{
+public:
+    memstream(const uint8_t *buf, size_t len);
+    bool ended();
+    size_t read(uint8_t *, size_t);
+    size_t sizeHint() const;
+private:
+    const uint8_t *buf;
+    size_t off;
+    size_t len;
+};
+
 class fdstream : public bytestream
 {
 public:
-    /// @param offset can be -1 to disable seeking
+    /// @param offset can be -1 to read from the current position
     fdstream(int fd, off_t offset, size_t length=(size_t)-1);
     bool ended();
     size_t read(uint8_t *, size_t);
@@ -125,6 +142,64 @@ private:
     size_t left;
 };
 
+/*
+ * Buffered stream for pipes and sockets.  Reads ahead, so a single instance
+ * must be used for the lifetime of the connection.  Large reads bypass the
+ * buffer.
+ */
+class fdbufstream : public bytestream
+{
+public:
+    fdbufstream(int fd);
+    bool ended();
+    size_t read(uint8_t *, size_t);
+    size_t sizeHint() const;
+
+private:
+    int fd;
+    std::vector<uint8_t> buf;
+    size_t off;
+    size_t len;
+    bool eof;
+};
+
+/*
+ * Non-owning view of another stream, used to hand out a connection's
+ * buffered stream to callers that expect to own what they are given.
+ */
+class refstream : public bytestream
+{
+public:
+    refstream(bytestream *source);
+    bool ended();
+    size_t read(uint8_t *, size_t);
+    size_t sizeHint() const;
+
+private:
+    bytestream *source;
+};
+
+/*
+ * Reads no faster than rate bytes per second from another stream, which
+ * it does not own, by sleeping before reads that would go over.  Used to
+ * cap the bandwidth of background transfers.  A rate of zero is unlimited.
+ */
+class ratestream : public bytestream
+{
+public:
+    ratestream(bytestream *source, uint64_t rate);
+    bool ended();
+    size_t read(uint8_t *, size_t);
+    size_t sizeHint() const;
+    uint64_t bytesRead() const { return total; }
+
+private:
+    bytestream *source;
+    uint64_t rate;
+    uint64_t total;
+    uint64_t startTime;
+};
+
 class diskstream : public bytestream
 {
 public:
@@ -169,8 +244,12 @@ private:
 
 #endif /* ORI_USE_LZMA */
 
-#ifdef ORI_USE_FASTLZ
+#ifndef ORI_USE_LZMA
 
+/*
+ * Whole-payload FastLZ stream used by objects flagged ORI_FLAG_FASTLZ.  New
+ * objects use the block-framed format (see blockzip.h).
+ */
 class zipstream : public bytestream
 {
 public:
@@ -195,7 +274,7 @@ private:
     bool output_ended;
 };
 
-#endif /* ORI_USE_FASTLZ */
+#endif /* !ORI_USE_LZMA */
 
 ////////////////////////////////
 // Writable streams
@@ -209,6 +288,8 @@ public:
     virtual ~bytewstream() {}
 
     virtual ssize_t write(const void *, size_t) = 0;
+    /// Write out any buffered data
+    virtual int flush() { return 0; }
 
     /// Enable typed stream
     void enableTypes();
@@ -261,5 +342,25 @@ private:
     int fd;
 };
 
+/*
+ * Buffered fdwstream.  Small writes are coalesced until flush() or until the
+ * buffer fills; writes larger than the buffer are passed straight to the
+ * kernel along with any pending data in a single writev.  The destructor
+ * flushes.
+ */
+class fdbufwstream : public bytewstream
+{
+public:
+    fdbufwstream(int fd);
+    ~fdbufwstream();
+    ssize_t write(const void *, size_t);
+    int flush();
+private:
+    int writev(const void *extra, size_t extraLen);
+    int fd;
+    std::vector<uint8_t> buf;
+    size_t len;
+};
+
 #endif
 
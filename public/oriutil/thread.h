@@ -75,6 +75,7 @@ public:
     std::string getName();
     void setName(const std::string &name);
     ThreadPriority getPriority();
+    /// Takes effect when the thread is started
     void setPriority(ThreadPriority p);
     void start();
     virtual void run() = 0;
@@ -93,6 +94,7 @@ protected:
 private:
     bool interrupted;
     ThreadState cstate;
+    ThreadPriority prio;
     std::string tname;
 #if defined(__APPLE__) || defined(__linux__) || defined(__FreeBSD__) \
     || defined(__NetBSD__)
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __ZIPCODEC_H__
+#define __ZIPCODEC_H__
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "stream.h"
+#include "objectinfo.h"
+
+/*
+ * Block compressors used by the block-framed payload format.  Each codec
+ * is identified by the ObjectInfo::ZipAlgo recorded in the object flags.
+ */
+class ZipCodec
+{
+public:
+    virtual ~ZipCodec() {}
+    virtual ObjectInfo::ZipAlgo getAlgo() const = 0;
+    virtual const char *getName() const = 0;
+    /// Output buffer size needed to compress len bytes
+    virtual size_t maxCompressedSize(size_t len) const = 0;
+    /// Returns the compressed length or 0 on failure
+    virtual size_t compress(const uint8_t *in, size_t len,
+                            uint8_t *out, size_t outLen) const = 0;
+    /// Returns the decompressed length or 0 on failure
+    virtual size_t decompress(const uint8_t *in, size_t len,
+                              uint8_t *out, size_t outLen) const = 0;
+};
+
+/// Returns NULL if algo is not a block codec built into this binary
+const ZipCodec *ZipCodec_Get(ObjectInfo::ZipAlgo algo);
+/// All block codecs built into this binary
+std::vector<const ZipCodec *> ZipCodec_List();
+/// Map a codec name ("none", "fastlz", "snappy", ...) to its algorithm
+ObjectInfo::ZipAlgo ZipCodec_Lookup(const std::string &name);
+const char *ZipCodec_Name(ObjectInfo::ZipAlgo algo);
+
+/// Estimate Shannon entropy in bits per byte from a sample of buf
+float ZipCodec_Entropy(const uint8_t *buf, size_t len);
+
+/*
+ * Sets of ZipAlgo values, so the ZipAlgo numbering is part of the wire
+ * protocol.  Peers announce the set they can decode, and peers that don't
+ * are older binaries that only decode ZIPCODEC_LEGACY.
+ */
+#define ZIPCODEC_BIT(algo) (1u << (algo))
+#define ZIPCODEC_LEGACY (ZIPCODEC_BIT(ObjectInfo::ZIPALGO_NONE) | \
+                         ZIPCODEC_BIT(ObjectInfo::ZIPALGO_FASTLZ) | \
+                         ZIPCODEC_BIT(ObjectInfo::ZIPALGO_LZMA))
+/// The algorithms ZipCodec_Decompress supports in this binary
+uint32_t ZipCodec_Supported();
+
+/// Wrap a stored payload in a stream producing the uncompressed payload.
+/// Takes ownership of stored.  Returns NULL for unsupported algorithms.
+bytestream *ZipCodec_Decompress(bytestream *stored, const ObjectInfo &info);
+
+#endif /* __ZIPCODEC_H__ */